@@ -4,12 +4,15 @@ from .version import __version__
 from . import shock
 from . import cocoon
 from . import jet
-from .flux import fluxDensity, intensity
+from . import emulator
+from .flux import fluxDensity, fluxDensityGrid, intensity
+from .emulator import buildEmulator, verifyEmulator
 from .cocoon import (Hz2eV, Msun, c, cgs2mJy, day2sec, eV2Hz, ee, h, hbar,
                      mJy2cgs, me, mp, parsec, sec2day, sigmaT)
 
 __all__ = ['__version__',
-           'shock', 'cocoon', 'jet', 'fluxDensity', 'intensity',
+           'shock', 'cocoon', 'jet', 'emulator', 'fluxDensity',
+           'fluxDensityGrid', 'intensity', 'buildEmulator', 'verifyEmulator',
            'Hz2eV', 'Msun', 'c', 'cgs2mJy', 'day2sec', 'eV2Hz', 'ee', 'h',
            'hbar', 'mJy2cgs',
            'me', 'mp', 'parsec', 'sec2day', 'sigmaT']
@@ -1,7 +1,5 @@
 import math
 import numpy as np
-import scipy.integrate as integrate
-from . import shock
 from . import jet
 
 c = 2.99792458e10
@@ -25,6 +23,10 @@ eV2Hz = 1.0/Hz2eV
 
 
 def dP(theta, amu, ate, au, ar, nu, n0, p, epsE, epsB, ksiN, specType):
+    """
+    The theta integrand of the original Python cocoon model, on the
+    tabulated shock amu, ate, au, ar.  fluxDensity() no longer uses it.
+    """
 
     mu = math.cos(theta)
     ib = np.searchsorted(amu, mu)
@@ -53,46 +55,16 @@ def dP(theta, amu, ate, au, ar, nu, n0, p, epsE, epsB, ksiN, specType):
 
 def fluxDensity(t, nu, jetType, specType, umax, umin, Ei, k, Mej_solar, L0, q,
                 ts, n0, p, epsE, epsB, ksiN, dL, tRes=1000, latRes=0,
-                rtol=1.0e-3):
-
-    t = np.array(t)
-
-    rho0 = mp * n0
-    Mej = Mej_solar * Msun
-    u0 = umax
-    g0 = math.sqrt(1+u0*u0)
-    bes0 = 4*u0*g0 / (4*u0*u0+3)
-    Rd = math.pow(9*g0*g0*Mej / (4*np.pi*(g0+1)*(4*u0*u0+3)*rho0), 1./3.)
-    td = Rd / (bes0 * c)
-
-    t0 = min(1.0e-2*td, 5.0e-1 * g0*g0*t.min(), 5.0e-1 * t.min()/(1+bes0))
-    t1 = 2. * g0*g0*t.max()
-
-    NT = int(tRes * math.log10(t1/t0))
-    # print("{0:.3e} {1:.3e} {2:.3e} {3:d}".format(t0, t1, t1/t0, NT))
-
-    r0 = bes0*c*t0
-
-    # Vej0 = 4.0/3.0*np.pi*r0*r0*r0
-
-    ate = np.logspace(math.log10(t0), math.log10(t1), num=NT, base=10.0)
-
-    ar, au = shock.shockEvolRK4(ate, r0, umax,
-                                Mej_solar*Msun, rho0, Ei, k, umin, L0, q, ts)
-
-    P = np.zeros(t.shape)
-
-    wopts = None
-
-    for i in range(len(t)):
-        amu = c * (ate - t[i]) / ar
-
-        args = (amu, ate, au, ar, nu[i], n0, p, epsE, epsB, ksiN, specType)
-
-        res = integrate.quad(dP, 0.0, np.pi, args, full_output=1, wopts=wopts,
-                             epsrel=rtol)
-        P[i] = res[0]
-
-    Fnu = cgs2mJy * P / (4*np.pi*dL*dL)
-
-    return Fnu
+                rtol=1.0e-3, z=0.0, out=None, moments=None):
+    """
+    Flux density of a cocoon at each (t, nu), computed by jet.fluxDensity().
+    The shock is evolved once for all times, and the frequencies at each
+    time share the integration over the equal arrival time surface.
+    moments, if given, receives the image moments as for jet.fluxDensity().
+    """
+
+    return jet.fluxDensity(np.asarray(t, dtype=float).reshape(-1),
+                           np.asarray(nu, dtype=float).reshape(-1), 3,
+                           specType, umax, umin, Ei, k, Mej_solar, L0, q, ts,
+                           n0, p, epsE, epsB, ksiN, dL, tRes=tRes, rtol=rtol,
+                           z=z, out=out, moments=moments)
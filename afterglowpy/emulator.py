@@ -0,0 +1,290 @@
+import struct
+import numpy as np
+from . import flux
+from . import jet
+
+# Parameters sampled in log10 by default.  The rest (angles, b, q, p) are
+# sampled linearly.
+logPars = [1, 5, 7, 8, 10, 11, 12, 13]
+
+magic = b"AGPYEMU\0"
+version = 1
+
+
+def chebNodes(n):
+    """Chebyshev-Lobatto nodes on [-1, 1], in descending order."""
+    return np.cos(np.pi * np.arange(n) / (n-1))
+
+
+def chebCoeffs(f, axis):
+    """
+    Chebyshev coefficients of the samples f at chebNodes() along axis.
+    """
+    n = f.shape[axis]
+    j = np.arange(n)
+    M = np.cos(np.pi * np.outer(j, j) / (n-1)) * 2.0 / (n-1)
+    M[:, 0] *= 0.5
+    M[:, -1] *= 0.5
+    M[0, :] *= 0.5
+    M[-1, :] *= 0.5
+    return np.moveaxis(np.tensordot(M, f, axes=([1], [axis])), 0, axis)
+
+
+def chebEval(c, x):
+    """
+    Evaluate the tensor Chebyshev series c at the points x, shape
+    (npoints, c.ndim), in [-1, 1].
+    """
+    out = np.empty(x.shape[0])
+    for i in range(x.shape[0]):
+        a = c
+        for d in range(c.ndim):
+            T = np.polynomial.chebyshev.chebvander(x[i, d], c.shape[d]-1)
+            a = np.tensordot(T[0], a, axes=([0], [0]))
+        out[i] = a
+    return out
+
+
+def buildEmulator(filename, jetType, specType, pars, box, tRange, nuRange,
+                  order=5, tOrder=9, nuOrder=9, maxOrder=33, tol=1.0e-2,
+                  Fmin=1.0e-12, nTest=64, maxEvals=20000, seed=0,
+                  verbose=False, **kwargs):
+    """
+    Build an emulator of fluxDensity() over a box in parameter space and
+    write it to filename, for use with afterglowpy.jet.Emulator.
+
+    log10 F_nu is sampled on a tensor grid of Chebyshev-Lobatto nodes in
+    the chosen parameters, log t, and log nu.  The grid is refined one
+    axis at a time, choosing the axis whose highest-order Chebyshev
+    coefficients are largest, until the error against the full model at
+    nTest random points is below tol.  Nodes are nested (2^k+1 per axis)
+    so no evaluation is repeated.
+
+    Parameters
+    ----------
+    filename: str
+        Output file.
+    jetType: int
+        Jet type, as for fluxDensity().  Must be a jet-like model.
+    specType: int
+        Spectrum type, as for fluxDensity().
+    pars: array_like
+        The 14 jet parameters (optionally followed by g0, E0Global,
+        thetaCoreGlobal).  Parameters not in box are held at these values.
+    box: dict
+        {index: (lo, hi)} for each varied parameter, indexed as in pars.
+        E0, L0, ts, n0, epsilon_e, epsilon_B, xi_N, and d_L are sampled in
+        log10, others linearly.
+    tRange, nuRange: tuple
+        (lo, hi) time and frequency ranges, sampled in log10.
+    order, tOrder, nuOrder: int, optional
+        Initial number of nodes per parameter, time, and frequency axis.
+        Rounded up to 2^k+1.
+    maxOrder: int, optional
+        Largest number of nodes along any axis.
+    tol: float, optional
+        Target maximum relative error.
+    Fmin: float, optional
+        Fluxes below Fmin (mJy) are emulated as Fmin.
+    nTest: int, optional
+        Number of random parameter vectors to check the emulator at, each
+        with 8 random times and frequencies.
+    maxEvals: int, optional
+        Maximum number of fluxDensityGrid() calls.
+    seed: int, optional
+        Seed for the test points.
+    verbose: bool, optional
+        Print progress.
+    **kwargs:
+        Passed on to fluxDensityGrid(), eg. z, spread, latRes, rtol.
+
+    Returns
+    -------
+    maxErr, rmsErr: float
+        Relative error of the emulator at the test points.
+    """
+
+    pars = np.array(pars, dtype=float)
+    parIdx = sorted(box.keys())
+    for i in parIdx:
+        if i < 0 or i > 13:
+            raise ValueError("box indices must be jet parameters, 0 to 13.")
+
+    # Axes: the varied parameters, then log t, then log nu.
+    dims = [(i, i in logPars, box[i][0], box[i][1]) for i in parIdx]
+    dims.append((-1, True, tRange[0], tRange[1]))
+    dims.append((-2, True, nuRange[0], nuRange[1]))
+    for d in dims:
+        if not d[2] < d[3] or (d[1] and not d[2] > 0.0):
+            raise ValueError("Ranges must be increasing, and positive if "
+                             "sampled in log.")
+    lo = np.array([np.log10(d[2]) if d[1] else d[2] for d in dims])
+    hi = np.array([np.log10(d[3]) if d[1] else d[3] for d in dims])
+
+    def nested(n):
+        k = int(np.ceil(np.log2(max(n, 3)-1)))
+        return 2**k + 1
+
+    maxOrder = nested(maxOrder)
+    n = [nested(order)] * len(parIdx) + [nested(tOrder), nested(nuOrder)]
+    n = [min(m, maxOrder) for m in n]
+    nd = len(dims)
+    nPar = len(parIdx)
+    logFmin = np.log10(Fmin)
+
+    def toValue(u, d):
+        u = lo[d] + 0.5*(hi[d]-lo[d])*(u+1)
+        return 10.0**u if dims[d][1] else u
+
+    def model(Y, t, nu):
+        args = tuple(Y)
+        F = flux.fluxDensityGrid(t, nu, jetType, specType, *args, **kwargs)
+        return np.log10(np.maximum(F, Fmin))
+
+    # Test points, in [-1, 1]
+    rng = np.random.default_rng(seed)
+    xTest = rng.uniform(-1.0, 1.0, (nTest, 8, nd))
+    xTest[:, :, :nPar] = xTest[:, :1, :nPar]
+    fTest = np.empty((nTest, 8))
+    for k in range(nTest):
+        Y = pars.copy()
+        for d in range(nPar):
+            Y[parIdx[d]] = toValue(xTest[k, 0, d], d)
+        for m in range(8):
+            t = toValue(xTest[k, m, nd-2], nd-2)
+            nu = toValue(xTest[k, m, nd-1], nd-1)
+            fTest[k, m] = model(Y, np.array([t]), np.array([nu]))[0, 0]
+    xTest = xTest.reshape(-1, nd)
+    fTest = fTest.reshape(-1)
+    cTest = fTest > logFmin
+
+    cache = {}
+    cacheN = None
+    evals = 0
+
+    while True:
+        # Sample on the current grid, reusing nodes from coarser ones.
+        if cacheN != (n[-2], n[-1]):
+            cache = {}
+            cacheN = (n[-2], n[-1])
+        t = toValue(chebNodes(n[-2]), nd-2)
+        nu = toValue(chebNodes(n[-1]), nd-1)
+        f = np.empty(n)
+        for idx in np.ndindex(*n[:nPar]):
+            key = tuple(j * (maxOrder-1) // (n[d]-1)
+                        for d, j in enumerate(idx))
+            if key not in cache:
+                Y = pars.copy()
+                for d in range(nPar):
+                    Y[parIdx[d]] = toValue(chebNodes(n[d])[idx[d]], d)
+                cache[key] = model(Y, t, nu)
+                evals += 1
+            f[idx] = cache[key]
+
+        c = f
+        for d in range(nd):
+            c = chebCoeffs(c, d)
+
+        fEmu = chebEval(c, xTest)
+        err = np.abs(fEmu - fTest)
+        # Points where both are below Fmin agree.
+        err[~cTest & (fEmu <= logFmin)] = 0.0
+        err = 10.0**err - 1.0
+        maxErr = err.max()
+        rmsErr = np.sqrt((err*err).mean())
+        if verbose:
+            print("nodes {0:s}: {1:d} evaluations, max err {2:.3e},"
+                  " rms err {3:.3e}".format(str(n), evals, maxErr, rmsErr))
+
+        if maxErr <= tol:
+            break
+
+        # Refine the axis with the largest tail.
+        tail = np.array([np.abs(np.take(c, [-2, -1], axis=d)).max()
+                         for d in range(nd)])
+        tail[np.array(n) >= maxOrder] = -1.0
+        d = int(np.argmax(tail))
+        if tail[d] < 0.0:
+            break
+        newEvals = np.prod(n[:nPar])
+        if d < nPar:
+            newEvals = newEvals // n[d] * (n[d]-1)
+        if evals + newEvals > maxEvals:
+            break
+        n[d] = 2*n[d]-1
+
+    writeEmulator(filename, jetType, specType, pars, dims, lo, hi, c,
+                  maxErr, rmsErr, logFmin)
+
+    return maxErr, rmsErr
+
+
+def writeEmulator(filename, jetType, specType, pars, dims, lo, hi, c,
+                  maxErr, rmsErr, logFmin):
+    """
+    Write an emulator file.  All fields are native-endian and 8-byte
+    aligned so the coefficients can be used in place once mapped.
+    """
+    Y = np.zeros(17)
+    Y[14] = -1.0
+    Y[:len(pars)] = pars
+    with open(filename, "wb") as f:
+        f.write(magic)
+        f.write(struct.pack("=iiii", version, len(dims), jetType, specType))
+        f.write(struct.pack("=dddd", maxErr, rmsErr, logFmin, 0.0))
+        f.write(Y.astype(float).tobytes())
+        for d, dim in enumerate(dims):
+            f.write(struct.pack("=iiiidd", dim[0], c.shape[d], int(dim[1]),
+                                0, lo[d], hi[d]))
+        f.write(np.ascontiguousarray(c, dtype=float).tobytes())
+
+
+def verifyEmulator(filename, nTest=64, seed=1, **kwargs):
+    """
+    Check the emulator in filename against the full model at nTest random
+    parameter vectors, each with 8 random times and frequencies.
+
+    Parameters
+    ----------
+    filename: str
+        Emulator file.
+    nTest: int, optional
+        Number of random parameter vectors.
+    seed: int, optional
+        Seed for the test points.
+    **kwargs:
+        Passed on to fluxDensity(), these should match those given to
+        buildEmulator().
+
+    Returns
+    -------
+    maxErr, rmsErr: float
+        Relative error of the emulator, ignoring points where both
+        it and the model are below the Fmin the emulator was built with.
+    """
+
+    emu = jet.Emulator(filename)
+    rng = np.random.default_rng(seed)
+    lo = np.array(emu.lo)
+    hi = np.array(emu.hi)
+    nPar = len(emu.parIndex)
+    Fmin = 10.0**emu.logFmin
+
+    errs = []
+    for k in range(nTest):
+        u = rng.uniform(lo, hi)
+        v = np.where(emu.logScale, 10.0**u, u)
+        Y = np.array(emu.pars)
+        Y[list(emu.parIndex)] = v[:nPar]
+        uTN = rng.uniform(lo[nPar:], hi[nPar:], (8, 2))
+        t = 10.0**uTN[:, 0]
+        nu = 10.0**uTN[:, 1]
+        F = flux.fluxDensity(t, nu, emu.jetType, emu.specType, *tuple(Y),
+                             **kwargs)
+        Fe = emu.flux(t, nu, v[:nPar])
+        F = np.maximum(F, Fmin)
+        Fe = np.maximum(Fe, Fmin)
+        errs.append(np.maximum(F/Fe, Fe/F) - 1.0)
+    errs = np.concatenate(errs)
+
+    return errs.max(), np.sqrt((errs*errs).mean())
@@ -93,6 +93,18 @@ def fluxDensity(t, nu, jetType, specType, *args, **kwargs):
         Relative tolerance of flux integration, defaults to 1.0e-4.
     spread: {'True', 'False'}
         Whether to include jet spreading. Defaults to True.
+    counterjet: {'True', 'False'}
+        Whether to include emission from the counter-jet. Defaults to False.
+    adaptiveCones: {'True', 'False'}
+        Whether to place the conical sections of a structured jet
+        adaptively, closer together where the energy changes quickly and
+        near the line of sight.  Defaults to False.
+    moments: array, optional
+        A float64 array of shape (3, t.size) which receives the flux-weighted
+        centroid of the image along the projected jet axis, and the rms
+        widths of the image along and across that axis, all in cm.  They are
+        integrated along with the flux at little extra cost.  LR, LO, and
+        LX are not included.
 
     Returns
     -------
@@ -103,7 +115,8 @@ def fluxDensity(t, nu, jetType, specType, *args, **kwargs):
     ------
 
     ValueError
-        If t, nu are the wrong shape or arguments take illegal values.
+        If t, nu are the wrong shape or not finite, or arguments take
+        illegal values.
     """
     
     # Check Arguments, will raise ValueError if args are bad
@@ -120,9 +133,6 @@ def fluxDensity(t, nu, jetType, specType, *args, **kwargs):
     else:
         z = 0.0
 
-    tz = t / (1+z)
-    nuz = nu * (1+z)
-
     # Default spreading method
     if 'spread' in kwargs:
         if kwargs['spread'] == True:
@@ -154,22 +164,26 @@ def fluxDensity(t, nu, jetType, specType, *args, **kwargs):
 
     # timeA = time.time()
 
-    Fnu = np.empty(tz.shape)
+    Fnu = np.empty(t.shape)
 
     if jetType == 3:
-        Fnu.flat[:] = cocoon.fluxDensity(tz.flat, nuz.flat, jetType, specType,
-                                         *args, **kwargs)
+        cocoon.fluxDensity(t.reshape(-1), nu.reshape(-1), jetType, specType,
+                           *args, z=z, out=Fnu.reshape(-1), **kwargs)
     else:
-        Fnu.flat[:] = jet.fluxDensity(tz.flat, nuz.flat, jetType, specType,
-                                      *args, **kwargs)
+        # The redshift and K-correction are applied within the C call, which
+        # writes directly into Fnu.
+        jet.fluxDensity(t.reshape(-1), nu.reshape(-1), jetType, specType,
+                        *args, z=z, out=Fnu.reshape(-1), **kwargs)
     # timeB = time.time()
     # print("Eval took: {0:f} s".format(timeB - timeA))
 
     
-    # Adding background luminosities.
-    dL = args[13]
-    L_to_flux = cocoon.cgs2mJy / (4*np.pi*dL*dL)
-
+    # Adding background luminosities, K-corrected.
+    if LR > 0.0 or LO > 0.0 or LX > 0.0:
+        dL = args[13]
+        L_to_flux = (1+z) * cocoon.cgs2mJy / (4*np.pi*dL*dL)
+        tz = t / (1+z)
+        nuz = nu * (1+z)
 
     if LR > 0.0:
         rad = (nuz < 3.0e11) & (tz > tAdd)  # radio < 300 GHz
@@ -185,12 +199,70 @@ def fluxDensity(t, nu, jetType, specType, *args, **kwargs):
         Lnu = LX / (9.7e3 * cocoon.eV2Hz)  # 9.7 keV bandwidth
         Fnu[xry] += Lnu*L_to_flux
 
-    # K-correct the flux
-    Fnu *= 1+z
-
     return Fnu
 
 
+def fluxDensityGrid(t, nu, jetType, specType, *args, **kwargs):
+    """
+    Compute the flux density F_nu of a GRB afterglow on a grid of times and
+    frequencies.
+
+    Equivalent to fluxDensity() evaluated on every pair of t and nu, but
+    without building the full (len(t), len(nu)) input arrays.  For jet-like
+    afterglows the blast wave geometry at each time is computed once and
+    shared by all frequencies.
+
+    Parameters
+    ----------
+    t: array_like or scalar
+        1-D array of times since burst in observer frame, in seconds.
+    nu: array_like or scalar
+        1-D array of frequencies in observer frame, in Hz.
+    jetType, specType, *args, **kwargs:
+        As for fluxDensity().
+
+    Returns
+    -------
+
+    The flux density F_nu in the observer frame, shape (len(t), len(nu)).
+
+    Raises
+    ------
+
+    ValueError
+        If t, nu are not 1-D or arguments take illegal values.
+    """
+
+    t = np.atleast_1d(t)
+    nu = np.atleast_1d(nu)
+    if t.ndim != 1 or nu.ndim != 1:
+        raise ValueError("t and nu must be 1-D or scalars")
+
+    # Cocoons and background luminosities are handled pointwise.
+    if (jetType == 3 or len(args) >= 19 or 'LR' in kwargs or 'LO' in kwargs
+            or 'LX' in kwargs or 'tAdd' in kwargs):
+        T, NU = np.broadcast_arrays(t[:, None], nu[None, :])
+        return fluxDensity(T, NU, jetType, specType, *args, **kwargs)
+
+    checkJetArgs(jetType, specType, *args, **kwargs)
+
+    if 'z' in kwargs.keys():
+        z = kwargs.pop('z')
+    else:
+        z = 0.0
+
+    # Default spreading method
+    if 'spread' in kwargs:
+        if kwargs['spread'] == True:
+            if jetType == -2 and 'thetaCoreGlobal' in kwargs:
+                kwargs['spread'] = 8
+            else:
+                kwargs['spread'] = 7
+
+    return jet.fluxDensityGrid(t, nu, jetType, specType, *args, z=z,
+                               **kwargs)
+
+
 def intensity(theta, phi, t, nu, jetType, specType, *args, **kwargs):
     """
     Compute the specific intensity I_nu of a GRB afterglow.
@@ -303,9 +375,6 @@ def intensity(theta, phi, t, nu, jetType, specType, *args, **kwargs):
     else:
         z = 0.0
 
-    tz = t / (1+z)
-    nuz = nu * (1+z)
-
     # Default spreading method
     if 'spread' in kwargs:
         if kwargs['spread'] is True:
@@ -314,15 +383,14 @@ def intensity(theta, phi, t, nu, jetType, specType, *args, **kwargs):
             else:
                 kwargs['spread'] = 7
 
-    Inu = np.empty(theta.shape)
-    Inu.flat[:] = jet.intensity(theta.flat, phi.flat, tz.flat, nuz.flat,
-                                jetType, specType, *args, **kwargs)
-
-    # K-correct the intensity
+    # The redshift and K-correction are applied within the C call.
     # I'm only using the flux correction here, which leaves the angular
     # part of the intensity uncorrected.  Best be careful.
 
-    Inu *= 1+z
+    Inu = np.empty(theta.shape)
+    jet.intensity(theta.reshape(-1), phi.reshape(-1), t.reshape(-1),
+                  nu.reshape(-1), jetType, specType, *args, z=z,
+                  out=Inu.reshape(-1), **kwargs)
 
     return Inu
 
@@ -1,8 +1,7 @@
+#include <stdlib.h>
 #include <math.h>
 #include "integrate.h"
 
-#define KMAX 10
-
 double trap(double (*f)(double, void *), double xa, double xb, int N, void *args)
 {
     double dx = (xb - xa)/N;
@@ -115,3 +114,142 @@ double romb(double (*f)(double, void *), double xa, double xb, int N, double ato
 
     return R[0];
 }
+
+void romb_vec(void (*f)(double, double *, void *), double *I, int Nv,
+                int Nchk, double xa, double xb, int N, double *atol,
+                double rtol, void *args, double *work)
+{
+    // Romberg integration of the vector valued f.  Refinement continues
+    // until each of the first Nchk components satisfies its tolerance, the
+    // rest are integrated on the same points.  With Nv == 1 this performs
+    // exactly the same operations as romb().  work is (KMAX+2)*Nv doubles
+    // of scratch, or NULL to allocate them here.
+
+    double *R = work;
+    if(work == NULL)
+        R = (double *)malloc((KMAX+2) * Nv * sizeof(double));
+    double *fa = R + KMAX*Nv;
+    double *Rp = R + (KMAX+1)*Nv;
+
+    int m, k, k0, fpm, Nk, j, done;
+    double hk, err, tol;
+
+    hk = xb - xa;
+    Nk = 1;
+    f(xa, fa, args);
+    f(xb, Rp, args);
+    for(j=0; j<Nv; j++)
+    {
+        R[(KMAX-1)*Nv+j] = 0.5*(xb-xa)*(fa[j] + Rp[j]);
+        R[j] = R[(KMAX-1)*Nv+j];
+    }
+
+    for(k=1; k<KMAX; k++)
+    {
+        k0 = KMAX-k-1;
+        hk *= 0.5;
+        Nk *= 2;
+
+        for(j=0; j<Nv; j++)
+            Rp[j] = 0.0;
+        for(m=1; m<Nk; m+=2)
+        {
+            f(xa + m*hk, fa, args);
+            for(j=0; j<Nv; j++)
+                Rp[j] += fa[j];
+        }
+        for(j=0; j<Nv; j++)
+            R[k0*Nv+j] = 0.5*R[(k0+1)*Nv+j] + hk*Rp[j];
+
+        fpm = 1;
+        for(m=1; m<=k; m++)
+        {
+            fpm *= 4;
+            for(j=0; j<Nv; j++)
+                R[(k0+m)*Nv+j] = (fpm*R[(k0+m-1)*Nv+j] - R[(k0+m)*Nv+j])
+                                    / (fpm - 1);
+        }
+
+        done = 1;
+        for(j=0; j<Nv; j++)
+        {
+            err = (R[(KMAX-1)*Nv+j] - R[j]) / (fpm - 1);
+            R[j] = R[(KMAX-1)*Nv+j];
+            if(j >= Nchk)
+                continue;
+            tol = atol == NULL ? 0.0 : atol[j];
+            if(!(fabs(err) < tol + rtol*fabs(R[j])))
+                done = 0;
+        }
+
+        if(done)
+            break;
+
+        if(N > 1 && Nk >= N)
+            break;
+    }
+
+    for(j=0; j<Nv; j++)
+        I[j] = R[j];
+
+    if(work == NULL)
+        free(R);
+}
+
+void gauss_vec(void (*f)(double, double *, void *), double *I, int Nv,
+                double xa, double xb, int n, void *args, double *work)
+{
+    // n point Gauss-Legendre quadrature of the vector valued f, exact for
+    // polynomials of degree 2n-1.  For smooth integrands that need few
+    // points.  The nodes are roots of P_n found by Newton's method.  work
+    // is Nv doubles of scratch, or NULL to allocate them here.
+
+    double *fa = work;
+    if(work == NULL)
+        fa = (double *)malloc(Nv * sizeof(double));
+    double xm = 0.5*(xb + xa);
+    double xr = 0.5*(xb - xa);
+    int i, j, k;
+
+    for(j=0; j<Nv; j++)
+        I[j] = 0.0;
+
+    for(i=0; i<(n+1)/2; i++)
+    {
+        double x = cos(M_PI * (i + 0.75) / (n + 0.5));
+        double dp = 1.0;
+        for(k=0; k<100; k++)
+        {
+            double p0 = 1.0;
+            double p1 = x;
+            int m;
+            for(m=2; m<=n; m++)
+            {
+                double p2 = ((2*m-1)*x*p1 - (m-1)*p0) / m;
+                p0 = p1;
+                p1 = p2;
+            }
+            dp = n * (x*p1 - p0) / (x*x - 1.0);
+            double dx = p1 / dp;
+            x -= dx;
+            if(fabs(dx) < 1.0e-15)
+                break;
+        }
+        double w = 2.0 / ((1.0 - x*x) * dp*dp);
+
+        f(xm - xr*x, fa, args);
+        for(j=0; j<Nv; j++)
+            I[j] += w * fa[j];
+        if(2*i+1 == n)
+            continue;
+        f(xm + xr*x, fa, args);
+        for(j=0; j<Nv; j++)
+            I[j] += w * fa[j];
+    }
+
+    for(j=0; j<Nv; j++)
+        I[j] *= xr;
+
+    if(work == NULL)
+        free(fa);
+}
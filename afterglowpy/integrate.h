@@ -1,6 +1,9 @@
 #ifndef GRBPY_INTEGRATE
 #define GRBPY_INTEGRATE
 
+// Romberg levels.  romb_vec() needs (KMAX+2)*Nv doubles of scratch.
+#define KMAX 10
+
 double trap(double (*f)(double, void *), double xa, double xb, int N, void *args);
 double simp(double (*f)(double, void *), double xa, double xb, int N, void *args);
 double romb(double (*f)(double, void *), double xa, double xb, int N, double atol, 
@@ -8,5 +11,10 @@ double romb(double (*f)(double, void *), double xa, double xb, int N, double ato
 void simp_v2(void (*f)(double, double *, double *, double *, int, void *),
                         double *I, double *t1, double *t2, int Nt, double xa, 
                         double xb, int N, void *args);
+void romb_vec(void (*f)(double, double *, void *), double *I, int Nv,
+                int Nchk, double xa, double xb, int N, double *atol,
+                double rtol, void *args, double *work);
+void gauss_vec(void (*f)(double, double *, void *), double *I, int Nv,
+                double xa, double xb, int n, void *args, double *work);
 
 #endif
@@ -1,7 +1,15 @@
 #include <Python.h>
+#include <structmember.h>
 #define NPY_NO_DEPRECATED_API NPY_1_11_API_VERSION
 #include <numpy/arrayobject.h>
+#include <numpy/ufuncobject.h>
 #include <time.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "offaxis_struct.h"
 
 #define PROFILE
@@ -12,11 +20,34 @@
 static char jet_docstring[] = 
     "This module calculates emission from a semi-analytic GRB afterglow model.";
 static char fluxDensity_docstring[] = 
-    "Calculate the flux density at several times and frequencies";
+    "Calculate the flux density at several times and frequencies.\n"
+    "t and nu may be any 1-D float64 arrays, strided or redshifted ones\n"
+    "are staged once into a single scratch buffer. Optional z (default 0)\n"
+    "redshifts t and nu and K-corrects the result, optional out is a\n"
+    "float64 array the result is written to. Non-finite t or nu raise\n"
+    "ValueError. Fluxes from a blast wave that fails to integrate are NaN,\n"
+    "with a RuntimeWarning.\n"
+    "counterjet=True adds the emission of the counter-jet.\n"
+    "adaptiveCones=True places the cones of a structured jet adaptively.\n"
+    "Optional moments is a float64 array of shape (3, len(t)) which\n"
+    "receives the flux-weighted centroid of the image along the projected\n"
+    "jet axis and its rms widths along and across the axis (cm), integrated\n"
+    "along with the flux.";
+static char fluxDensityGrid_docstring[] = 
+    "Calculate the flux density on the grid of times t and frequencies nu.\n"
+    "t and nu are 1-D, the result has shape (len(t), len(nu)). Arguments\n"
+    "are the same as fluxDensity(), the blast wave geometry at each time is\n"
+    "shared by all frequencies.";
 static char emissivity_docstring[] = 
-    "Calculate the instantaneous emissivity of a sector of a blastwave.";
+    "emissivity(nu, R, sinTheta, mu, te, u, us, n0, p, epse, epsB, ksiN,\n"
+    "specType=0): the instantaneous emissivity of a sector of a blastwave.\n"
+    "Arguments broadcast against each other, as for emissivity_ufunc.";
+static char emissivity_ufunc_docstring[] = 
+    "emissivity_ufunc(nu, R, sinTheta, mu, te, u, us, n0, p, epse, epsB,\n"
+    "ksiN, specType): emissivity() as a ufunc, specType is required.";
 static char intensity_docstring[] = 
-    "Calculate the position dependent intensity of a blastwave.";
+    "Calculate the position dependent intensity of a blastwave.\n"
+    "Accepts the same z and out keywords as fluxDensity().";
 static char shockVals_docstring[] = 
     "Calculate the shock values of the blastwave.";
 static char shock_docstring[] = 
@@ -25,11 +56,89 @@ static char shockObs_docstring[] =
     "Calculate the evolution of a tophat shock with reference to observer time.";
 static char find_jet_edge_docstring[] = 
     "Find jet edge at given observer time, phi, viewing angle.";
+static char buildDynamicsLibrary_docstring[] = 
+    "buildDynamicsLibrary(filename, jetType, pars, tMin, tMax, tRes=1000,\n"
+    "latRes=5, spread=7, gammaType=0): compute the blast wave solution of\n"
+    "every cone of every parameter vector in the 2-D array pars (ordered as\n"
+    "for ObservationSet) for observer times tMin to tMax, and write them to\n"
+    "filename for useDynamicsLibrary(). Returns the number of solutions.\n"
+    "Raises RuntimeError, writing nothing, if any solution failed.";
+static char useDynamicsLibrary_docstring[] = 
+    "useDynamicsLibrary(filename, verify=True): memory map a library written\n"
+    "by buildDynamicsLibrary() and take blast wave solutions from it\n"
+    "wherever it has one, rescaled in E0/n0 if there is no energy\n"
+    "injection, instead of integrating them. With verify the checksum is\n"
+    "checked first. filename None stops using the library.";
+static char Model_docstring[] = 
+    "A jet with fixed parameters. The blast wave solution of every cone is\n"
+    "computed once and reused by subsequent calls to flux(), intensity(),\n"
+    "image(), and shockVals(). Arguments are the same as fluxDensity()\n"
+    "without t and nu, plus optional tMin and tMax giving the range of\n"
+    "observer times to prepare for. Times outside the prepared range\n"
+    "trigger a rebuild.";
+static char Model_flux_docstring[] = 
+    "Calculate the flux density at several times and frequencies";
+static char Model_intensity_docstring[] = 
+    "Calculate the position dependent intensity of the blastwave.";
+static char Model_image_docstring[] = 
+    "Render the image of the blastwave at a single time and frequency: the\n"
+    "flux density (mJy) in each pixel of the sky-plane grid with increasing\n"
+    "edges x and y (cm), an array of shape (len(y)-1, len(x)-1).  x is along\n"
+    "the projected jet axis.";
+static char Model_shockVals_docstring[] = 
+    "Calculate the shock values of the blastwave.";
+static char ObservationSet_docstring[] = 
+    "A fixed set of observations for repeated model evaluation, eg. in a\n"
+    "fit. ObservationSet(t, nu, jetType, specType, Fnu=None, Ferr=None,\n"
+    "ul=None, z=0, tRes, latRes, rtol, spread, gammaType, counterjet,\n"
+    "adaptiveCones)\n"
+    "validates, redshifts, sorts and groups the observer frame t and nu\n"
+    "once. Points with nonzero ul are upper limits Fnu, which only count\n"
+    "when exceeded.\n"
+    "Jet parameters are then passed as a vector, in the order of\n"
+    "fluxDensity()'s positional arguments from thetaObs to dL, optionally\n"
+    "followed by g0, E0Global and thetaCoreGlobal. They must be finite and\n"
+    "in the ranges flux.fluxDensity() accepts.";
+static char ObservationSet_flux_docstring[] = 
+    "flux(pars, out=None): the observer frame flux density at each\n"
+    "observation, in the original order. Raises ValueError if pars are out\n"
+    "of range.";
+static char ObservationSet_chi2_docstring[] = 
+    "chi2(pars, chi2Max=inf): chi^2 of Fnu given Ferr. pars may be a 2-D\n"
+    "array of parameter vectors, giving an array of results. Evaluation\n"
+    "stops as soon as chi^2 is known to exceed chi2Max, returning a partial\n"
+    "value which is still larger than chi2Max. Returns inf if pars are out\n"
+    "of range or the flux is NaN.";
+static char ObservationSet_logLike_docstring[] = 
+    "logLike(pars, logLikeMin=-inf): the Gaussian log-likelihood -chi^2/2,\n"
+    "as chi2(pars, chi2Max=-2*logLikeMin). Returns -inf if pars are out of\n"
+    "range.";
+static char ObservationSet_fluxGrad_docstring[] = 
+    "fluxGrad(pars, dynamic=True): the flux, as flux(pars), and its\n"
+    "derivatives with respect to the 14 jet parameters, an array of shape\n"
+    "(14, N). Derivatives with respect to p, epsilon_e, epsilon_B, xi_N and\n"
+    "d_L are computed along with the flux. Those of the blast wave\n"
+    "parameters are central differences at 100x tighter rtol (n0 follows\n"
+    "from E0 by scaling), and left at 0 if not dynamic or if the parameter\n"
+    "does not enter the model.";
+static char ObservationSet_logLikeGrad_docstring[] = 
+    "logLikeGrad(pars, dynamic=True): logLike(pars) and its gradient with\n"
+    "respect to the 14 jet parameters, from fluxGrad().";
+static char Emulator_docstring[] = 
+    "Emulator(filename): a Chebyshev emulator of the flux density written\n"
+    "by afterglowpy.emulator.buildEmulator(). The file is memory mapped,\n"
+    "not read, so many processes can share one copy.";
+static char Emulator_flux_docstring[] = 
+    "flux(t, nu, pars, out=None): the emulated flux density at each\n"
+    "(t, nu) for the emulated parameters pars, in the order of parIndex.\n"
+    "pars may be a 2-D array of parameter vectors, giving a result of\n"
+    "shape (len(pars), len(t)). Points outside the emulated box are nan.";
 
 static PyObject *error_out(PyObject *m);
 static PyObject *jet_fluxDensity(PyObject *self, PyObject *args, 
                                     PyObject *kwargs);
-static PyObject *jet_emissivity(PyObject *self, PyObject *args);
+static PyObject *jet_fluxDensityGrid(PyObject *self, PyObject *args, 
+                                        PyObject *kwargs);
 static PyObject *jet_intensity(PyObject *self, PyObject *args, 
                                     PyObject *kwargs);
 static PyObject *jet_shockVals(PyObject *self, PyObject *args, 
@@ -37,6 +146,28 @@ static PyObject *jet_shockVals(PyObject *self, PyObject *args,
 static PyObject *jet_shock(PyObject *self, PyObject *args);
 static PyObject *jet_shockObs(PyObject *self, PyObject *args);
 static PyObject *jet_find_jet_edge(PyObject *self, PyObject *args);
+static PyObject *jet_buildDynamicsLibrary(PyObject *self, PyObject *args,
+                                            PyObject *kwargs);
+static PyObject *jet_useDynamicsLibrary(PyObject *self, PyObject *args,
+                                            PyObject *kwargs);
+
+static PyObject *jet_emissivity(PyObject *self, PyObject *args);
+static void jet_emissivity_loop(char **args, npy_intp const *dimensions,
+                                npy_intp const *steps, void *data);
+
+static PyUFuncGenericFunction jet_emissivity_funcs[1] = {
+                                                    &jet_emissivity_loop};
+static void *jet_emissivity_data[1] = {NULL};
+static PyObject *jet_emissivity_ufunc = NULL;
+static char jet_emissivity_types[14] = {NPY_DOUBLE, NPY_DOUBLE, NPY_DOUBLE,
+                                        NPY_DOUBLE, NPY_DOUBLE, NPY_DOUBLE,
+                                        NPY_DOUBLE, NPY_DOUBLE, NPY_DOUBLE,
+                                        NPY_DOUBLE, NPY_DOUBLE, NPY_DOUBLE,
+                                        NPY_LONG, NPY_DOUBLE};
+
+static PyTypeObject ModelType;
+static PyTypeObject ObservationSetType;
+static PyTypeObject EmulatorType;
 
 struct module_state
 {
@@ -52,6 +183,8 @@ static struct module_state _state;
 static PyMethodDef jetMethods[] = {
     {"fluxDensity", (PyCFunction)jet_fluxDensity, METH_VARARGS|METH_KEYWORDS,
         fluxDensity_docstring},
+    {"fluxDensityGrid", (PyCFunction)jet_fluxDensityGrid,
+        METH_VARARGS|METH_KEYWORDS, fluxDensityGrid_docstring},
     {"emissivity", jet_emissivity, METH_VARARGS, emissivity_docstring},
     {"intensity", (PyCFunction)jet_intensity, METH_VARARGS|METH_KEYWORDS,
         intensity_docstring},
@@ -61,6 +194,10 @@ static PyMethodDef jetMethods[] = {
     {"shockObs", jet_shockObs, METH_VARARGS, shockObs_docstring},
     {"find_jet_edge", jet_find_jet_edge, METH_VARARGS, 
         find_jet_edge_docstring},
+    {"buildDynamicsLibrary", (PyCFunction)jet_buildDynamicsLibrary,
+        METH_VARARGS|METH_KEYWORDS, buildDynamicsLibrary_docstring},
+    {"useDynamicsLibrary", (PyCFunction)jet_useDynamicsLibrary,
+        METH_VARARGS|METH_KEYWORDS, useDynamicsLibrary_docstring},
     {"error_out", (PyCFunction)error_out, METH_NOARGS, NULL},
     {NULL, NULL, 0, NULL}};
 
@@ -115,6 +252,45 @@ void initjet(void)
 
     //Load numpy stuff!
     import_array();
+    import_umath();
+
+    jet_emissivity_ufunc = PyUFunc_FromFuncAndData(jet_emissivity_funcs,
+                                    jet_emissivity_data, jet_emissivity_types,
+                                    1, 13, 1, PyUFunc_None, "emissivity_ufunc",
+                                    emissivity_ufunc_docstring, 0);
+    if(jet_emissivity_ufunc == NULL)
+    {
+        Py_DECREF(module);
+        INITERROR;
+    }
+    Py_INCREF(jet_emissivity_ufunc);
+    PyModule_AddObject(module, "emissivity_ufunc", jet_emissivity_ufunc);
+
+    if(PyType_Ready(&ModelType) < 0)
+    {
+        Py_DECREF(module);
+        INITERROR;
+    }
+    Py_INCREF(&ModelType);
+    PyModule_AddObject(module, "Model", (PyObject *) &ModelType);
+
+    if(PyType_Ready(&ObservationSetType) < 0)
+    {
+        Py_DECREF(module);
+        INITERROR;
+    }
+    Py_INCREF(&ObservationSetType);
+    PyModule_AddObject(module, "ObservationSet",
+                        (PyObject *) &ObservationSetType);
+
+    if(PyType_Ready(&EmulatorType) < 0)
+    {
+        Py_DECREF(module);
+        INITERROR;
+    }
+    Py_INCREF(&EmulatorType);
+    PyModule_AddObject(module, "Emulator", (PyObject *) &EmulatorType);
+
 #if PY_MAJOR_VERSION >= 3
     return module;
 #endif
@@ -127,12 +303,194 @@ static PyObject *error_out(PyObject *m)
     return NULL;
 }
 
+static PyArrayObject *readArray(PyObject *obj)
+{
+    // A 1-D double view of obj.  Only copies if the type or alignment
+    // of obj requires it, strided (or broadcast) arrays are kept as views
+    // and later gathered by stageArray().
+    PyArrayObject *arr = (PyArrayObject *) PyArray_FROM_OTF(obj, NPY_DOUBLE,
+                                                        NPY_ARRAY_ALIGNED);
+    if(arr == NULL)
+        return NULL;
+    if(PyArray_NDIM(arr) != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Arrays must be 1-D.");
+        Py_DECREF(arr);
+        return NULL;
+    }
+    return arr;
+}
+
+static PyArrayObject *readOutArray(PyObject *obj, int ndim, npy_intp *dims)
+{
+    // The user supplied output array, which must be written in place.
+    if(!PyArray_Check(obj))
+    {
+        PyErr_SetString(PyExc_TypeError, "out must be a numpy array.");
+        return NULL;
+    }
+    PyArrayObject *arr = (PyArrayObject *) obj;
+    if(PyArray_TYPE(arr) != NPY_DOUBLE || !PyArray_ISALIGNED(arr)
+            || !PyArray_ISWRITEABLE(arr) || !PyArray_ISNOTSWAPPED(arr))
+    {
+        PyErr_SetString(PyExc_TypeError,
+                        "out must be an aligned, writeable float64 array.");
+        return NULL;
+    }
+    int i;
+    int good = PyArray_NDIM(arr) == ndim;
+    for(i=0; good && i<ndim; i++)
+        if(PyArray_DIM(arr, i) != dims[i])
+            good = 0;
+    if(!good)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "out must have the same shape as the result.");
+        return NULL;
+    }
+    Py_INCREF(arr);
+    return arr;
+}
+
+static void arraySpan(PyArrayObject *a, char **lo, char **hi)
+{
+    // The bytes [lo, hi) spanned by the elements of a, in any dimension.
+    int d;
+    *lo = PyArray_BYTES(a);
+    *hi = *lo + sizeof(double);
+    for(d=0; d<PyArray_NDIM(a); d++)
+    {
+        npy_intp n = PyArray_DIM(a, d);
+        npy_intp ext = n > 0 ? (n-1) * PyArray_STRIDE(a, d) : 0;
+        if(ext < 0)
+            *lo += ext;
+        else
+            *hi += ext;
+    }
+}
+
+static int arraysOverlap(PyArrayObject *a, PyArrayObject *b)
+{
+    // Conservative check whether the memory spanned by a and b overlaps.
+    char *a0, *a1, *b0, *b1;
+    arraySpan(a, &a0, &a1);
+    arraySpan(b, &b0, &b1);
+
+    return a0 < b1 && b0 < a1;
+}
+
+static int needsStaging(PyArrayObject *arr, double mul, double div)
+{
+    // Whether stageArray() has to copy arr.
+    return !(mul == 1.0 && div == 1.0 && PyArray_IS_C_CONTIGUOUS(arr));
+}
+
+static double *stageArray(PyArrayObject *arr, double mul, double div,
+                            double *buf)
+{
+    // Contiguous values of mul*arr/div.  Returns arr's own data if nothing
+    // needs to be done, otherwise fills and returns buf.
+    if(!needsStaging(arr, mul, div))
+        return (double *)PyArray_DATA(arr);
+
+    npy_intp i;
+    npy_intp N = PyArray_DIM(arr, 0);
+    npy_intp s = PyArray_STRIDE(arr, 0);
+    char *x = PyArray_BYTES(arr);
+    for(i=0; i<N; i++)
+        buf[i] = *((double *)(x + i*s)) * mul / div;
+
+    return buf;
+}
+
+static int allFinite(double *x, int N)
+{
+    // Observation points are sorted and grouped before integrating, which
+    // a NaN or infinite t or nu would break, so they are refused up front.
+    int i;
+    for(i=0; i<N; i++)
+        if(!isfinite(x[i]))
+            return 0;
+    return 1;
+}
+
+static void writeOutArray(double *F, PyArrayObject *out, double fac)
+{
+    // Copy F (C-ordered, 1-D or 2-D) into out, applying the
+    // K-correction fac.
+    npy_intp i, j;
+    int ndim = PyArray_NDIM(out);
+    npy_intp N = PyArray_DIM(out, 0);
+    npy_intp M = ndim > 1 ? PyArray_DIM(out, 1) : 1;
+    npy_intp s = PyArray_STRIDE(out, 0);
+    npy_intp s2 = ndim > 1 ? PyArray_STRIDE(out, 1) : 0;
+    char *x = PyArray_BYTES(out);
+
+    if(F == (double *)x)
+    {
+        if(fac != 1.0)
+            for(i=0; i<N*M; i++)
+                F[i] *= fac;
+    }
+    else
+    {
+        for(i=0; i<N; i++)
+            for(j=0; j<M; j++)
+                *((double *)(x + i*s + j*s2)) = F[i*M+j] * fac;
+    }
+}
+
+static void mergeDiag(struct fluxDiag *diag, struct fluxDiag *from)
+{
+    // Add the problems in from to diag, for calls that make several
+    // evaluations.
+    int i;
+    diag->errors += from->errors;
+    diag->warnings += from->warnings;
+    for(i=0; i<from->n_msg && diag->n_msg < DIAG_MSGS; i++)
+    {
+        diag->msg_error[diag->n_msg] = from->msg_error[i];
+        memcpy(diag->msg[diag->n_msg], from->msg[i], DIAG_LEN);
+        diag->n_msg++;
+    }
+}
+
+static int reportDiag(struct fluxDiag *diag)
+{
+    // Surface the problems recorded by the C engine: errors raise a
+    // RuntimeError, warnings a RuntimeWarning.  Returns -1 if an exception
+    // is set.
+    if(diag->errors == 0 && diag->warnings == 0)
+        return 0;
+
+    char text[DIAG_MSGS*(DIAG_LEN+16) + 128];
+    int len = snprintf(text, sizeof(text), "%ld error(s), %ld warning(s)",
+                        diag->errors, diag->warnings);
+    int i;
+    for(i=0; i<diag->n_msg; i++)
+        len += snprintf(text + len, sizeof(text) - len, "\n  %s%s",
+                        diag->msg_error[i] ? "error: " : "", diag->msg[i]);
+    long shown = diag->n_msg;
+    if(diag->errors + diag->warnings > shown)
+        snprintf(text + len, sizeof(text) - len, "\n  (%ld more)",
+                    diag->errors + diag->warnings - shown);
+
+    if(diag->errors > 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, text);
+        return -1;
+    }
+    return PyErr_WarnEx(PyExc_RuntimeWarning, text, 1);
+}
+
 static PyObject *jet_fluxDensity(PyObject *self, PyObject *args, 
                                     PyObject *kwargs)
 {
     PyObject *t_obj = NULL;
     PyObject *nu_obj = NULL;
     PyObject *mask_obj = NULL;
+    PyObject *out_obj = NULL;
+    PyObject *mom_obj = NULL;
 
 #ifdef PROFILE
     clock_t profClock1A, profClock1B, profClock2A, profClock2B;
@@ -155,6 +513,9 @@ static PyObject *jet_fluxDensity(PyObject *self, PyObject *args,
     double g0 = -1.0;
     double E_core_global = 0.0;
     double theta_h_core_global = 0.0;
+    double z = 0.0;
+    int counterjet = 0;
+    int adaptive = 0;
     static char *kwlist[] = {"t", "nu", "jetType", "specType", "thetaObs", 
                                 "E0", "thetaCore", "thetaWing", "b",
                                 "L0", "q", "ts",
@@ -162,19 +523,21 @@ static PyObject *jet_fluxDensity(PyObject *self, PyObject *args,
                                 "epsilon_e", "epsilon_B", "ksiN", "dL",
                                 "g0", "E0Global", "thetaCoreGlobal",
                                 "tRes", "latRes", "rtol", "mask", "spread",
-                                "gammaType",
+                                "gammaType", "z", "out", "counterjet",
+                                "adaptiveCones", "moments",
                                 NULL};
 
     //Parse Arguments
     if(!PyArg_ParseTupleAndKeywords(args, kwargs,
-                "OOiidddddddddddddd|dddiidOii",
+                "OOiidddddddddddddd|dddiidOiidOiiO",
                 kwlist,
                 &t_obj, &nu_obj, &jet_type, &spec_type, &theta_obs, &E_iso_core,
                 &theta_h_core, &theta_h_wing, &b, &L0, &q, &ts,
                 &n_0, &p, &epsilon_E, &epsilon_B, 
                 &ksi_N, &d_L,
                 &g0, &E_core_global, &theta_h_core_global,
-                &tRes, &latRes, &rtol, &mask_obj, &spread, &gamma_type))
+                &tRes, &latRes, &rtol, &mask_obj, &spread, &gamma_type,
+                &z, &out_obj, &counterjet, &adaptive, &mom_obj))
     {
         //PyErr_SetString(PyExc_RuntimeError, "Could not parse arguments.");
         return NULL;
@@ -184,11 +547,11 @@ static PyObject *jet_fluxDensity(PyObject *self, PyObject *args,
     PyArrayObject *t_arr;
     PyArrayObject *nu_arr;
     PyArrayObject *mask_arr = NULL;
+    PyArrayObject *out_arr = NULL;
+    PyArrayObject *mom_arr = NULL;
 
-    t_arr = (PyArrayObject *) PyArray_FROM_OTF(t_obj, NPY_DOUBLE,
-                                                NPY_ARRAY_IN_ARRAY);
-    nu_arr = (PyArrayObject *) PyArray_FROM_OTF(nu_obj, NPY_DOUBLE,
-                                                NPY_ARRAY_IN_ARRAY);
+    t_arr = readArray(t_obj);
+    nu_arr = readArray(nu_obj);
     if(mask_obj != NULL)
         mask_arr = (PyArrayObject *) PyArray_FROM_OTF(mask_obj, NPY_DOUBLE,
                                                 NPY_ARRAY_IN_ARRAY);
@@ -196,26 +559,25 @@ static PyObject *jet_fluxDensity(PyObject *self, PyObject *args,
     if(t_arr == NULL || nu_arr == NULL || (mask_obj != NULL
                                             && mask_arr == NULL))
     {
-        PyErr_SetString(PyExc_RuntimeError, "Could not read input arrays.");
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, 
+                            "Could not read input arrays.");
         Py_XDECREF(t_arr);
         Py_XDECREF(nu_arr);
         Py_XDECREF(mask_arr);
         return NULL;
     }
 
-    int t_ndim = (int) PyArray_NDIM(t_arr);
-    int nu_ndim = (int) PyArray_NDIM(nu_arr);
     int mask_ndim = 0;
     if(mask_obj != NULL)
         mask_ndim = (int) PyArray_NDIM(mask_arr);
 
-    if(t_ndim != 1 || nu_ndim != 1 || (mask_obj != NULL && mask_ndim != 1))
+    if(mask_obj != NULL && mask_ndim != 1)
     {
         PyErr_SetString(PyExc_RuntimeError, "Arrays must be 1-D.");
         Py_DECREF(t_arr);
         Py_DECREF(nu_arr);
-        if(mask_obj != NULL)
-            Py_DECREF(mask_arr);
+        Py_DECREF(mask_arr);
         return NULL;
     }
 
@@ -244,26 +606,99 @@ static PyObject *jet_fluxDensity(PyObject *self, PyObject *args,
         return NULL;
     }
 
-    double *t = (double *)PyArray_DATA(t_arr);
-    double *nu = (double *)PyArray_DATA(nu_arr);
-    double *mask = NULL;
-    if(mask_obj != NULL)
-        mask = (double *)PyArray_DATA(mask_arr);
-    int masklen = Nmask/9;
+    //Grab (or allocate) output array
+    npy_intp dims[1] = {N};
+    if(out_obj != NULL && out_obj != Py_None)
+        out_arr = readOutArray(out_obj, 1, dims);
+    else
+        out_arr = (PyArrayObject *) PyArray_SimpleNew(1, dims, NPY_DOUBLE);
 
-    //Allocate output array
+    if(out_arr == NULL)
+    {
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Could not make flux array.");
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_XDECREF(mask_arr);
+        return NULL;
+    }
 
-    npy_intp dims[1] = {N};
-    PyObject *Fnu_obj = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    npy_intp mom_dims[2] = {3, N};
+    if(mom_obj != NULL && mom_obj != Py_None)
+    {
+        mom_arr = readOutArray(mom_obj, 2, mom_dims);
+        if(mom_arr == NULL)
+        {
+            PyErr_SetString(PyExc_ValueError, "moments must be an aligned,"
+                            " writeable float64 array of shape (3, len(t)).");
+            Py_DECREF(t_arr);
+            Py_DECREF(nu_arr);
+            Py_XDECREF(mask_arr);
+            Py_DECREF(out_arr);
+            return NULL;
+        }
+    }
 
-    if(Fnu_obj == NULL)
+    // Redshift the inputs and gather strided data.  Only the arrays that
+    // need it are staged, in a single scratch buffer sized for them.
+    int stage_t = needsStaging(t_arr, 1.0, 1.0+z);
+    int stage_nu = needsStaging(nu_arr, 1.0+z, 1.0);
+    int writeDirect = PyArray_IS_C_CONTIGUOUS(out_arr)
+                        && !arraysOverlap(out_arr, t_arr)
+                        && !arraysOverlap(out_arr, nu_arr);
+    int momDirect = mom_arr != NULL && PyArray_IS_C_CONTIGUOUS(mom_arr)
+                        && !arraysOverlap(mom_arr, t_arr)
+                        && !arraysOverlap(mom_arr, nu_arr)
+                        && !arraysOverlap(mom_arr, out_arr);
+    int nwork = stage_t + stage_nu + !writeDirect
+                    + (mom_arr != NULL && !momDirect ? 3 : 0);
+    double *work = NULL;
+    if(nwork > 0 && N > 0)
+        work = (double *)malloc(nwork * N * sizeof(double));
+    if(work == NULL && nwork > 0 && N > 0)
     {
-        PyErr_SetString(PyExc_RuntimeError, "Could not make flux array.");
+        PyErr_NoMemory();
         Py_DECREF(t_arr);
         Py_DECREF(nu_arr);
+        Py_XDECREF(mask_arr);
+        Py_DECREF(out_arr);
+        Py_XDECREF(mom_arr);
         return NULL;
     }
-    double *Fnu = PyArray_DATA((PyArrayObject *) Fnu_obj);
+    double *buf = work;
+    double *t = stageArray(t_arr, 1.0, 1.0+z, buf);
+    buf += stage_t * N;
+    double *nu = stageArray(nu_arr, 1.0+z, 1.0, buf);
+    buf += stage_nu * N;
+    if(!allFinite(t, N) || !allFinite(nu, N))
+    {
+        PyErr_SetString(PyExc_ValueError, "t and nu must be finite.");
+        free(work);
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_XDECREF(mask_arr);
+        Py_DECREF(out_arr);
+        Py_XDECREF(mom_arr);
+        return NULL;
+    }
+    double *mask = NULL;
+    if(mask_obj != NULL)
+        mask = (double *)PyArray_DATA(mask_arr);
+    int masklen = Nmask/9;
+
+    double *Fnu;
+    if(writeDirect)
+        Fnu = (double *)PyArray_DATA(out_arr);
+    else
+    {
+        Fnu = buf;
+        buf += N;
+    }
+    double *mom = NULL;
+    if(momDirect)
+        mom = (double *)PyArray_DATA(mom_arr);
+    else if(mom_arr != NULL)
+        mom = buf;
 
 #ifdef PROFILE2
     //Profile 2
@@ -271,25 +706,44 @@ static PyObject *jet_fluxDensity(PyObject *self, PyObject *args,
 #endif
 
     // Calculate the flux!
-    calc_flux_density(jet_type, spec_type, t, nu, Fnu, N, theta_obs, 
+    struct fluxDiag diag;
+    diag_clear(&diag);
+    if(N > 0)
+        calc_flux_density(jet_type, spec_type, t, nu, Fnu, N, theta_obs, 
                         E_iso_core, theta_h_core, theta_h_wing, b, L0, q, ts,
                         n_0, p, epsilon_E, epsilon_B, ksi_N, d_L, 
                         g0, E_core_global, theta_h_core_global,
-                        tRes, latRes, rtol, mask, masklen, spread, gamma_type);
+                        tRes, latRes, rtol, mask, masklen, spread, gamma_type,
+                        counterjet, adaptive, mom, &diag);
 #ifdef PROFILE2
     //Profile 2
     profClock2B = clock();
 #endif
 
+    // K-correct the flux into the output.
+    writeOutArray(Fnu, out_arr, 1.0+z);
+    if(mom_arr != NULL)
+    {
+        if(N > 0)
+            writeOutArray(mom, mom_arr, 1.0);
+        Py_DECREF(mom_arr);
+    }
 
     // Clean up!
+    free(work);
     Py_DECREF(t_arr);
     Py_DECREF(nu_arr);
     if(mask_obj != NULL)
         Py_DECREF(mask_arr);
 
+    if(reportDiag(&diag) < 0)
+    {
+        Py_DECREF(out_arr);
+        return NULL;
+    }
+
     //Build output
-    PyObject *ret = Py_BuildValue("N", Fnu_obj);
+    PyObject *ret = Py_BuildValue("N", out_arr);
     
 #ifdef PROFILE1
     //Profile 1 and output
@@ -310,37 +764,13 @@ static PyObject *jet_fluxDensity(PyObject *self, PyObject *args,
     return ret;
 }
 
-static PyObject *jet_emissivity(PyObject *self, PyObject *args)
-{
-    int spec_type = 0;
-    double nu, R, sinTheta, mu, te, u, us, n0, p, epse, epsB, ksiN;
-
-
-    //Parse Arguments
-    if(!PyArg_ParseTuple(args, "dddddddddddd|i", &nu, &R, &sinTheta, &mu, &te,
-                            &u, &us, &n0, &p, &epse, &epsB, &ksiN, &spec_type))
-    {
-        //PyErr_SetString(PyExc_RuntimeError, "Could not parse arguments.");
-        return NULL;
-    }
-
-    // Calculate it!
-    double em = emissivity(nu, R, sinTheta, mu, te, u, us, n0, p, epse, epsB, 
-                            ksiN, spec_type);
-
-    //Build output
-    PyObject *ret = Py_BuildValue("d", em);
-    
-    return ret;
-}
-
-static PyObject *jet_intensity(PyObject *self, PyObject *args, PyObject *kwargs)
+static PyObject *jet_fluxDensityGrid(PyObject *self, PyObject *args,
+                                        PyObject *kwargs)
 {
-    PyObject *theta_obj = NULL;
-    PyObject *phi_obj = NULL;
     PyObject *t_obj = NULL;
     PyObject *nu_obj = NULL;
     PyObject *mask_obj = NULL;
+    PyObject *out_obj = NULL;
 
     int jet_type, spec_type;
     double theta_obs, E_iso_core, theta_h_core, theta_h_wing, b, L0, q, ts,
@@ -354,157 +784,459 @@ static PyObject *jet_intensity(PyObject *self, PyObject *args, PyObject *kwargs)
     double g0 = -1.0;
     double E_core_global = 0.0;
     double theta_h_core_global = 0.0;
-    static char *kwlist[] = {"theta", "phi", "t", "nu", "jetType", "specType",
-                                "thetaObs", 
+    double z = 0.0;
+    int counterjet = 0;
+    int adaptive = 0;
+    static char *kwlist[] = {"t", "nu", "jetType", "specType", "thetaObs",
                                 "E0", "thetaCore", "thetaWing", "b",
                                 "L0", "q", "ts",
                                 "n0", "p",
                                 "epsilon_e", "epsilon_B", "ksiN", "dL",
                                 "g0", "E0Global", "thetaCoreGlobal",
                                 "tRes", "latRes", "rtol", "mask", "spread",
-                                "gammaType",
+                                "gammaType", "z", "out", "counterjet",
+                                "adaptiveCones",
                                 NULL};
 
     //Parse Arguments
     if(!PyArg_ParseTupleAndKeywords(args, kwargs,
-                                    "OOOOiidddddddddddddd|dddiidOii",
+                "OOiidddddddddddddd|dddiidOiidOii",
                 kwlist,
-                &theta_obj, &phi_obj, &t_obj, &nu_obj, &jet_type, &spec_type,
-                &theta_obs, &E_iso_core,
+                &t_obj, &nu_obj, &jet_type, &spec_type, &theta_obs, &E_iso_core,
                 &theta_h_core, &theta_h_wing, &b, &L0, &q, &ts,
-                &n_0, &p, &epsilon_E, &epsilon_B, &ksi_N, &d_L,
+                &n_0, &p, &epsilon_E, &epsilon_B,
+                &ksi_N, &d_L,
                 &g0, &E_core_global, &theta_h_core_global,
-                &tRes, &latRes, &rtol, &mask_obj, &spread, &gamma_type))
+                &tRes, &latRes, &rtol, &mask_obj, &spread, &gamma_type,
+                &z, &out_obj, &counterjet, &adaptive))
     {
         //PyErr_SetString(PyExc_RuntimeError, "Could not parse arguments.");
         return NULL;
     }
 
     //Grab NUMPY arrays
-    PyArrayObject *theta_arr;
-    PyArrayObject *phi_arr;
     PyArrayObject *t_arr;
     PyArrayObject *nu_arr;
     PyArrayObject *mask_arr = NULL;
+    PyArrayObject *out_arr = NULL;
 
-    theta_arr = (PyArrayObject *) PyArray_FROM_OTF(theta_obj, NPY_DOUBLE,
-                                                NPY_ARRAY_IN_ARRAY);
-    phi_arr = (PyArrayObject *) PyArray_FROM_OTF(phi_obj, NPY_DOUBLE,
-                                                NPY_ARRAY_IN_ARRAY);
-    t_arr = (PyArrayObject *) PyArray_FROM_OTF(t_obj, NPY_DOUBLE,
-                                                NPY_ARRAY_IN_ARRAY);
-    nu_arr = (PyArrayObject *) PyArray_FROM_OTF(nu_obj, NPY_DOUBLE,
-                                                NPY_ARRAY_IN_ARRAY);
+    t_arr = readArray(t_obj);
+    nu_arr = readArray(nu_obj);
     if(mask_obj != NULL)
         mask_arr = (PyArrayObject *) PyArray_FROM_OTF(mask_obj, NPY_DOUBLE,
                                                 NPY_ARRAY_IN_ARRAY);
 
-    if(theta_arr == NULL || phi_arr == NULL || t_arr == NULL || nu_arr == NULL
-            || (mask_obj != NULL && mask_arr == NULL))
+    if(t_arr == NULL || nu_arr == NULL || (mask_obj != NULL
+                                            && mask_arr == NULL))
     {
-        PyErr_SetString(PyExc_RuntimeError, "Could not read input arrays.");
-        Py_XDECREF(theta_arr);
-        Py_XDECREF(phi_arr);
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError,
+                            "Could not read input arrays.");
         Py_XDECREF(t_arr);
         Py_XDECREF(nu_arr);
         Py_XDECREF(mask_arr);
         return NULL;
     }
 
-    int theta_ndim = (int) PyArray_NDIM(theta_arr);
-    int phi_ndim = (int) PyArray_NDIM(phi_arr);
-    int t_ndim = (int) PyArray_NDIM(t_arr);
-    int nu_ndim = (int) PyArray_NDIM(nu_arr);
     int mask_ndim = 0;
     if(mask_obj != NULL)
         mask_ndim = (int) PyArray_NDIM(mask_arr);
 
-    if(theta_ndim != 1 || phi_ndim != 1 || t_ndim != 1 || nu_ndim != 1
-            || (mask_obj != NULL && mask_ndim != 1))
+    if(mask_obj != NULL && mask_ndim != 1)
     {
         PyErr_SetString(PyExc_RuntimeError, "Arrays must be 1-D.");
-        Py_DECREF(theta_arr);
-        Py_DECREF(phi_arr);
         Py_DECREF(t_arr);
         Py_DECREF(nu_arr);
-        if(mask_obj != NULL)
-            Py_DECREF(mask_arr);
+        Py_DECREF(mask_arr);
         return NULL;
     }
 
-    int N = (int)PyArray_DIM(theta_arr, 0);
-    int Np = (int)PyArray_DIM(phi_arr, 0);
     int Nt = (int)PyArray_DIM(t_arr, 0);
     int Nnu = (int)PyArray_DIM(nu_arr, 0);
     int Nmask = 0;
     if(mask_obj != NULL)
         Nmask = (int)PyArray_DIM(mask_arr, 0);
 
-    if(N!=Np || N!=Nt || N!=Nnu || Np!=Nt || Np!=Nnu || Nt!=Nnu)
-    {
-        PyErr_SetString(PyExc_RuntimeError, "Arrays must be same size.");
-        Py_DECREF(theta_arr);
-        Py_DECREF(phi_arr);
-        Py_DECREF(t_arr);
-        Py_DECREF(nu_arr);
-        if(mask_obj != NULL)
-            Py_DECREF(mask_arr);
-        return NULL;
-    }
     if(mask_obj != NULL && Nmask%9 != 0)
     {
-        PyErr_SetString(PyExc_RuntimeError, 
+        PyErr_SetString(PyExc_RuntimeError,
                             "Mask length must be multiple of 9.");
-        Py_DECREF(theta_arr);
-        Py_DECREF(phi_arr);
         Py_DECREF(t_arr);
         Py_DECREF(nu_arr);
         Py_DECREF(mask_arr);
         return NULL;
     }
 
-    double *theta = (double *)PyArray_DATA(theta_arr);
-    double *phi = (double *)PyArray_DATA(phi_arr);
-    double *t = (double *)PyArray_DATA(t_arr);
-    double *nu = (double *)PyArray_DATA(nu_arr);
-    double *mask = NULL;
-    if(mask_obj != NULL)
-        mask = (double *)PyArray_DATA(mask_arr);
-    int masklen = Nmask/9;
+    //Grab (or allocate) output array
+    npy_intp dims[2] = {Nt, Nnu};
+    if(out_obj != NULL && out_obj != Py_None)
+        out_arr = readOutArray(out_obj, 2, dims);
+    else
+        out_arr = (PyArrayObject *) PyArray_SimpleNew(2, dims, NPY_DOUBLE);
 
-    //Allocate output array
+    if(out_arr == NULL)
+    {
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "Could not make flux array.");
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_XDECREF(mask_arr);
+        return NULL;
+    }
 
-    npy_intp dims[1] = {N};
-    PyObject *Inu_obj = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    // Redshift the axes, only Nt + Nnu values need staging.
+    int stage_t = needsStaging(t_arr, 1.0, 1.0+z);
+    int stage_nu = needsStaging(nu_arr, 1.0+z, 1.0);
+    int writeDirect = PyArray_IS_C_CONTIGUOUS(out_arr)
+                        && !arraysOverlap(out_arr, t_arr)
+                        && !arraysOverlap(out_arr, nu_arr);
+    int nwork = stage_t*Nt + stage_nu*Nnu + (writeDirect ? 0 : Nt*Nnu);
+    double *work = NULL;
+    if(nwork > 0)
+        work = (double *)malloc(nwork * sizeof(double));
+    if(work == NULL && nwork > 0)
+    {
+        PyErr_NoMemory();
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_XDECREF(mask_arr);
+        Py_DECREF(out_arr);
+        return NULL;
+    }
 
-    if(Inu_obj == NULL)
+    double *buf = work;
+    double *t = stageArray(t_arr, 1.0, 1.0+z, buf);
+    buf += stage_t * Nt;
+    double *nu = stageArray(nu_arr, 1.0+z, 1.0, buf);
+    buf += stage_nu * Nnu;
+    if(!allFinite(t, Nt) || !allFinite(nu, Nnu))
     {
-        PyErr_SetString(PyExc_RuntimeError, "Could not make intensity array.");
-        Py_DECREF(theta_arr);
-        Py_DECREF(phi_arr);
+        PyErr_SetString(PyExc_ValueError, "t and nu must be finite.");
+        free(work);
         Py_DECREF(t_arr);
         Py_DECREF(nu_arr);
+        Py_XDECREF(mask_arr);
+        Py_DECREF(out_arr);
         return NULL;
     }
-    double *Inu = PyArray_DATA((PyArrayObject *) Inu_obj);
+    double *mask = NULL;
+    if(mask_obj != NULL)
+        mask = (double *)PyArray_DATA(mask_arr);
+    int masklen = Nmask/9;
 
-    // Calculate the intensity!
-    calc_intensity(jet_type, spec_type, theta, phi, t, nu, Inu, N, theta_obs, 
+    double *Fnu;
+    if(writeDirect)
+        Fnu = (double *)PyArray_DATA(out_arr);
+    else
+        Fnu = buf;
+
+    // Calculate the flux!
+    struct fluxDiag diag;
+    diag_clear(&diag);
+    if(Nt > 0 && Nnu > 0)
+        calc_flux_density_grid(jet_type, spec_type, t, Nt, nu, Nnu, Fnu,
+                        theta_obs,
                         E_iso_core, theta_h_core, theta_h_wing, b, L0, q, ts,
                         n_0, p, epsilon_E, epsilon_B, ksi_N, d_L,
                         g0, E_core_global, theta_h_core_global,
-                        tRes, latRes, rtol, mask, masklen, spread, gamma_type);
+                        tRes, latRes, rtol, mask, masklen, spread, gamma_type,
+                        counterjet, adaptive, &diag);
+
+    // K-correct the flux into the output.
+    writeOutArray(Fnu, out_arr, 1.0+z);
 
     // Clean up!
-    Py_DECREF(theta_arr);
-    Py_DECREF(phi_arr);
+    free(work);
     Py_DECREF(t_arr);
     Py_DECREF(nu_arr);
     if(mask_obj != NULL)
         Py_DECREF(mask_arr);
 
+    if(reportDiag(&diag) < 0)
+    {
+        Py_DECREF(out_arr);
+        return NULL;
+    }
+
     //Build output
-    PyObject *ret = Py_BuildValue("N", Inu_obj);
+    PyObject *ret = Py_BuildValue("N", out_arr);
+
+    return ret;
+}
+
+static PyObject *jet_emissivity(PyObject *self, PyObject *args)
+{
+    // emissivity_ufunc with specType optional, defaulting to 0, as
+    // emissivity() has always taken it.
+    Py_ssize_t n = PyTuple_GET_SIZE(args);
+    if(n == 13)
+        return PyObject_CallObject(jet_emissivity_ufunc, args);
+    if(n != 12)
+    {
+        PyErr_Format(PyExc_TypeError, "emissivity() takes 12 or 13"
+                        " positional arguments but %zd were given", n);
+        return NULL;
+    }
+
+    PyObject *args13 = PyTuple_New(13);
+    if(args13 == NULL)
+        return NULL;
+    Py_ssize_t i;
+    for(i=0; i<12; i++)
+    {
+        PyObject *x = PyTuple_GET_ITEM(args, i);
+        Py_INCREF(x);
+        PyTuple_SET_ITEM(args13, i, x);
+    }
+    PyTuple_SET_ITEM(args13, 12, PyLong_FromLong(0));
+
+    PyObject *ret = PyObject_CallObject(jet_emissivity_ufunc, args13);
+    Py_DECREF(args13);
+    return ret;
+}
+
+static void jet_emissivity_loop(char **args, npy_intp const *dimensions,
+                                npy_intp const *steps, void *data)
+{
+    // Inner loop of the emissivity ufunc: twelve double inputs and the
+    // integer specType in, one double out.
+    npy_intp i, k;
+    npy_intp n = dimensions[0];
+    double x[12];
+
+    for(i=0; i<n; i++)
+    {
+        for(k=0; k<12; k++)
+            x[k] = *(double *)(args[k] + i*steps[k]);
+        int spec_type = (int) *(long *)(args[12] + i*steps[12]);
+        *(double *)(args[13] + i*steps[13]) = emissivity(x[0], x[1], x[2],
+                            x[3], x[4], x[5], x[6], x[7], x[8], x[9], x[10],
+                            x[11], spec_type);
+    }
+}
+
+static PyObject *jet_intensity(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *theta_obj = NULL;
+    PyObject *phi_obj = NULL;
+    PyObject *t_obj = NULL;
+    PyObject *nu_obj = NULL;
+    PyObject *mask_obj = NULL;
+    PyObject *out_obj = NULL;
+
+    int jet_type, spec_type;
+    double theta_obs, E_iso_core, theta_h_core, theta_h_wing, b, L0, q, ts,
+           n_0, p, epsilon_E, epsilon_B, ksi_N, d_L;
+
+    int latRes = 5;
+    double rtol = 1.0e-4;
+    int tRes = 1000;
+    int spread = 7;
+    int gamma_type = 0;
+    double g0 = -1.0;
+    double E_core_global = 0.0;
+    double theta_h_core_global = 0.0;
+    double z = 0.0;
+    static char *kwlist[] = {"theta", "phi", "t", "nu", "jetType", "specType",
+                                "thetaObs", 
+                                "E0", "thetaCore", "thetaWing", "b",
+                                "L0", "q", "ts",
+                                "n0", "p",
+                                "epsilon_e", "epsilon_B", "ksiN", "dL",
+                                "g0", "E0Global", "thetaCoreGlobal",
+                                "tRes", "latRes", "rtol", "mask", "spread",
+                                "gammaType", "z", "out",
+                                NULL};
+
+    //Parse Arguments
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs,
+                                    "OOOOiidddddddddddddd|dddiidOiidO",
+                kwlist,
+                &theta_obj, &phi_obj, &t_obj, &nu_obj, &jet_type, &spec_type,
+                &theta_obs, &E_iso_core,
+                &theta_h_core, &theta_h_wing, &b, &L0, &q, &ts,
+                &n_0, &p, &epsilon_E, &epsilon_B, &ksi_N, &d_L,
+                &g0, &E_core_global, &theta_h_core_global,
+                &tRes, &latRes, &rtol, &mask_obj, &spread, &gamma_type,
+                &z, &out_obj))
+    {
+        //PyErr_SetString(PyExc_RuntimeError, "Could not parse arguments.");
+        return NULL;
+    }
+
+    //Grab NUMPY arrays
+    PyArrayObject *theta_arr;
+    PyArrayObject *phi_arr;
+    PyArrayObject *t_arr;
+    PyArrayObject *nu_arr;
+    PyArrayObject *mask_arr = NULL;
+    PyArrayObject *out_arr = NULL;
+
+    theta_arr = readArray(theta_obj);
+    phi_arr = readArray(phi_obj);
+    t_arr = readArray(t_obj);
+    nu_arr = readArray(nu_obj);
+    if(mask_obj != NULL)
+        mask_arr = (PyArrayObject *) PyArray_FROM_OTF(mask_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+
+    if(theta_arr == NULL || phi_arr == NULL || t_arr == NULL || nu_arr == NULL
+            || (mask_obj != NULL && mask_arr == NULL))
+    {
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError,
+                            "Could not read input arrays.");
+        Py_XDECREF(theta_arr);
+        Py_XDECREF(phi_arr);
+        Py_XDECREF(t_arr);
+        Py_XDECREF(nu_arr);
+        Py_XDECREF(mask_arr);
+        return NULL;
+    }
+
+    int mask_ndim = 0;
+    if(mask_obj != NULL)
+        mask_ndim = (int) PyArray_NDIM(mask_arr);
+
+    if(mask_obj != NULL && mask_ndim != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Arrays must be 1-D.");
+        Py_DECREF(theta_arr);
+        Py_DECREF(phi_arr);
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_DECREF(mask_arr);
+        return NULL;
+    }
+
+    int N = (int)PyArray_DIM(theta_arr, 0);
+    int Np = (int)PyArray_DIM(phi_arr, 0);
+    int Nt = (int)PyArray_DIM(t_arr, 0);
+    int Nnu = (int)PyArray_DIM(nu_arr, 0);
+    int Nmask = 0;
+    if(mask_obj != NULL)
+        Nmask = (int)PyArray_DIM(mask_arr, 0);
+
+    if(N!=Np || N!=Nt || N!=Nnu || Np!=Nt || Np!=Nnu || Nt!=Nnu)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Arrays must be same size.");
+        Py_DECREF(theta_arr);
+        Py_DECREF(phi_arr);
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        if(mask_obj != NULL)
+            Py_DECREF(mask_arr);
+        return NULL;
+    }
+    if(mask_obj != NULL && Nmask%9 != 0)
+    {
+        PyErr_SetString(PyExc_RuntimeError, 
+                            "Mask length must be multiple of 9.");
+        Py_DECREF(theta_arr);
+        Py_DECREF(phi_arr);
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_DECREF(mask_arr);
+        return NULL;
+    }
+
+    //Grab (or allocate) output array
+    npy_intp dims[1] = {N};
+    if(out_obj != NULL && out_obj != Py_None)
+        out_arr = readOutArray(out_obj, 1, dims);
+    else
+        out_arr = (PyArrayObject *) PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+
+    if(out_arr == NULL)
+    {
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError,
+                            "Could not make intensity array.");
+        Py_DECREF(theta_arr);
+        Py_DECREF(phi_arr);
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_XDECREF(mask_arr);
+        return NULL;
+    }
+
+    int stage_theta = needsStaging(theta_arr, 1.0, 1.0);
+    int stage_phi = needsStaging(phi_arr, 1.0, 1.0);
+    int stage_t = needsStaging(t_arr, 1.0, 1.0+z);
+    int stage_nu = needsStaging(nu_arr, 1.0+z, 1.0);
+    int writeDirect = PyArray_IS_C_CONTIGUOUS(out_arr)
+                        && !arraysOverlap(out_arr, theta_arr)
+                        && !arraysOverlap(out_arr, phi_arr)
+                        && !arraysOverlap(out_arr, t_arr)
+                        && !arraysOverlap(out_arr, nu_arr);
+    int nwork = stage_theta + stage_phi + stage_t + stage_nu + !writeDirect;
+    double *work = NULL;
+    if(nwork > 0 && N > 0)
+        work = (double *)malloc(nwork * N * sizeof(double));
+    if(work == NULL && nwork > 0 && N > 0)
+    {
+        PyErr_NoMemory();
+        Py_DECREF(theta_arr);
+        Py_DECREF(phi_arr);
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_XDECREF(mask_arr);
+        Py_DECREF(out_arr);
+        return NULL;
+    }
+
+    double *buf = work;
+    double *theta = stageArray(theta_arr, 1.0, 1.0, buf);
+    buf += stage_theta * N;
+    double *phi = stageArray(phi_arr, 1.0, 1.0, buf);
+    buf += stage_phi * N;
+    double *t = stageArray(t_arr, 1.0, 1.0+z, buf);
+    buf += stage_t * N;
+    double *nu = stageArray(nu_arr, 1.0+z, 1.0, buf);
+    buf += stage_nu * N;
+    double *mask = NULL;
+    if(mask_obj != NULL)
+        mask = (double *)PyArray_DATA(mask_arr);
+    int masklen = Nmask/9;
+
+    double *Inu;
+    if(writeDirect)
+        Inu = (double *)PyArray_DATA(out_arr);
+    else
+        Inu = buf;
+
+    // Calculate the intensity!
+    struct fluxDiag diag;
+    diag_clear(&diag);
+    if(N > 0)
+        calc_intensity(jet_type, spec_type, theta, phi, t, nu, Inu, N,
+                        theta_obs, 
+                        E_iso_core, theta_h_core, theta_h_wing, b, L0, q, ts,
+                        n_0, p, epsilon_E, epsilon_B, ksi_N, d_L,
+                        g0, E_core_global, theta_h_core_global,
+                        tRes, latRes, rtol, mask, masklen, spread, gamma_type,
+                        &diag);
+
+    // K-correct the intensity into the output.
+    writeOutArray(Inu, out_arr, 1.0+z);
+
+    // Clean up!
+    free(work);
+    Py_DECREF(theta_arr);
+    Py_DECREF(phi_arr);
+    Py_DECREF(t_arr);
+    Py_DECREF(nu_arr);
+    if(mask_obj != NULL)
+        Py_DECREF(mask_arr);
+
+    if(reportDiag(&diag) < 0)
+    {
+        Py_DECREF(out_arr);
+        return NULL;
+    }
+
+    //Build output
+    PyObject *ret = Py_BuildValue("N", out_arr);
     
     return ret;
 }
@@ -660,12 +1392,15 @@ static PyObject *jet_shockVals(PyObject *self, PyObject *args, PyObject *kwargs)
     double *u = PyArray_DATA((PyArrayObject *) u_obj);
     double *thj = PyArray_DATA((PyArrayObject *) thj_obj);
 
-    // Calculate the intensity!
+    // Calculate the shock state!
+    struct fluxDiag diag;
+    diag_clear(&diag);
     calc_shockVals(jet_type, theta, phi, tobs, t, R, u, thj, N, theta_obs, 
                     E_iso_core, theta_h_core, theta_h_wing, b, L0, q, ts,
                     n_0, p, epsilon_E, epsilon_B, ksi_N, d_L,
                     g0, E_core_global, theta_h_core_global,
-                    tRes, latRes, rtol, mask, masklen, spread, gamma_type);
+                    tRes, latRes, rtol, mask, masklen, spread, gamma_type,
+                    &diag);
 
     // Clean up!
     Py_DECREF(theta_arr);
@@ -674,6 +1409,15 @@ static PyObject *jet_shockVals(PyObject *self, PyObject *args, PyObject *kwargs)
     if(mask_obj != NULL)
         Py_DECREF(mask_arr);
 
+    if(reportDiag(&diag) < 0)
+    {
+        Py_DECREF(t_obj);
+        Py_DECREF(R_obj);
+        Py_DECREF(u_obj);
+        Py_DECREF(thj_obj);
+        return NULL;
+    }
+
     //Build output
     PyObject *ret = Py_BuildValue("NNNN", t_obj, R_obj, u_obj, thj_obj);
     
@@ -712,6 +1456,12 @@ static PyObject *jet_shock(PyObject *self, PyObject *args)
     pars.th_table = NULL;
     pars.mu_table = NULL;
     pars.spread = spread;
+    pars.cache = NULL;
+    pars.nmask = 0;
+    memset(&(pars.mask_idx), 0, sizeof(struct maskIndex));
+    work_init(&(pars.work));
+    pars.mu_breaks = NULL;
+    diag_clear(&(pars.diag));
 
     set_jet_params(&pars, E0, thetah);
     pars.Rt0 = Rt0;
@@ -808,6 +1558,12 @@ static PyObject *jet_shockObs(PyObject *self, PyObject *args)
     pars.mu_table_inner = NULL;
     pars.table_entries_inner = 0;
     pars.spread = spread;
+    pars.cache = NULL;
+    pars.nmask = 0;
+    memset(&(pars.mask_idx), 0, sizeof(struct maskIndex));
+    work_init(&(pars.work));
+    pars.mu_breaks = NULL;
+    diag_clear(&(pars.diag));
 
     printf("set_jet_params\n");
     set_jet_params(&pars, E0, thetah);
@@ -946,3 +1702,1990 @@ static PyObject *jet_find_jet_edge(PyObject *self, PyObject *args)
     
     return ret;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// Libraries of precomputed blast wave solutions.
+
+static struct dynLibrary jet_dynLibrary = {NULL, 0, 0, NULL};
+
+static PyObject *jet_buildDynamicsLibrary(PyObject *self, PyObject *args,
+                                            PyObject *kwargs)
+{
+    const char *filename;
+    PyObject *pars_obj = NULL;
+    int jet_type;
+    double tMin, tMax;
+    int tRes = 1000;
+    int latRes = 5;
+    int spread = 7;
+    int gamma_type = 0;
+    static char *kwlist[] = {"filename", "jetType", "pars", "tMin", "tMax",
+                                "tRes", "latRes", "spread", "gammaType",
+                                NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "siOdd|iiii", kwlist,
+                &filename, &jet_type, &pars_obj, &tMin, &tMax, &tRes,
+                &latRes, &spread, &gamma_type))
+        return NULL;
+
+    if(!(tMin > 0.0 && tMax > tMin))
+    {
+        PyErr_SetString(PyExc_ValueError, "Need 0 < tMin < tMax.");
+        return NULL;
+    }
+
+    PyArrayObject *pars_arr = (PyArrayObject *) PyArray_FROM_OTF(pars_obj,
+                                        NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+    if(pars_arr == NULL)
+        return NULL;
+    int Npar = PyArray_NDIM(pars_arr) == 2 ? (int)PyArray_DIM(pars_arr, 1)
+                                            : 0;
+    if(Npar < 14 || Npar > 17)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                    "pars must be a 2-D array of 14 to 17 parameter vectors.");
+        Py_DECREF(pars_arr);
+        return NULL;
+    }
+    int Nrow = (int)PyArray_DIM(pars_arr, 0);
+    double *pars = (double *)PyArray_DATA(pars_arr);
+
+    // No observations, lc_plan() just visits the cones.
+    struct obsPlan plan;
+    make_obsPlan(&plan, NULL, NULL, 0);
+
+    struct tableCache cache;
+    tableCache_init(&cache);
+
+    struct fluxDiag diag;
+    diag_clear(&diag);
+
+    int i, j;
+    int ok = 1;
+    for(i=0; i<Nrow && ok; i++)
+    {
+        double Y[17] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+                        0.0, 0.0, 0.0, -1.0, 0.0, 0.0};
+        for(j=0; j<Npar; j++)
+            Y[j] = pars[i*Npar + j];
+
+        struct fluxParams fp;
+        setup_fluxParams(&fp, Y[13], Y[0], Y[1], Y[2], Y[3], Y[4], Y[5], Y[6],
+                            Y[7], Y[8], Y[9], Y[10], Y[11], Y[12], Y[14],
+                            Y[15], Y[16], tMin, tMax, tRes, 0, 1.0e-4, NULL,
+                            0, spread, gamma_type);
+        // Always integrate, never copy from a library in use.
+        fp.lib = NULL;
+        fp.cache = &cache;
+        ok = lc_plan(jet_type, &plan, NULL, latRes, &fp);
+        mergeDiag(&diag, &(fp.diag));
+        free_fluxParams(&fp);
+    }
+    Py_DECREF(pars_arr);
+    free_obsPlan(&plan);
+
+    // Never write solutions that failed to integrate.  make_R_table()
+    // only warns about them, here they are an error.
+    int n = cache.n;
+    for(i=0; i<n; i++)
+        if(cache.tables[i].R_table[0] != cache.tables[i].R_table[0])
+            diag_error(&diag, "Blast wave %d failed to integrate.", i);
+    int err = ok && diag.errors == 0 ? dynLibrary_write(filename, &cache) : 0;
+    tableCache_free(&cache);
+
+    if(!ok)
+    {
+        PyErr_SetString(PyExc_ValueError, "jetType must be a jet-like model.");
+        return NULL;
+    }
+    if(reportDiag(&diag) < 0)
+        return NULL;
+    if(err)
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+        return NULL;
+    }
+
+    return PyLong_FromLong(n);
+}
+
+static PyObject *jet_useDynamicsLibrary(PyObject *self, PyObject *args,
+                                            PyObject *kwargs)
+{
+    PyObject *filename_obj = NULL;
+    int verify = 1;
+    static char *kwlist[] = {"filename", "verify", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", kwlist,
+                &filename_obj, &verify))
+        return NULL;
+
+    set_default_dynLibrary(NULL);
+    dynLibrary_close(&jet_dynLibrary);
+
+    if(filename_obj == Py_None)
+        Py_RETURN_NONE;
+
+    PyObject *bytes = NULL;
+    if(!PyUnicode_FSConverter(filename_obj, &bytes))
+        return NULL;
+    const char *filename = PyBytes_AS_STRING(bytes);
+
+    int err = dynLibrary_open(&jet_dynLibrary, filename, verify);
+    if(err == 1)
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+    else if(err == 2)
+        PyErr_SetString(PyExc_ValueError, "Not a dynamics library file.");
+    else if(err == 3)
+        PyErr_SetString(PyExc_ValueError,
+                        "Dynamics library checksum does not match.");
+    Py_DECREF(bytes);
+    if(err)
+        return NULL;
+
+    set_default_dynLibrary(&jet_dynLibrary);
+
+    Py_RETURN_NONE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Model: a jet with fixed parameters that keeps its blast wave solutions.
+
+typedef struct
+{
+    PyObject_HEAD
+    int jet_type;
+    int latRes;
+    int ready;
+    PyArrayObject *mask_arr;
+    struct fluxParams fp;
+    struct tableCache cache;
+    struct fluxStats stats;
+} ModelObject;
+
+static void Model_dealloc(ModelObject *self)
+{
+    free_fluxParams(&(self->fp));
+    tableCache_free(&(self->cache));
+    Py_XDECREF(self->mask_arr);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *Model_new(PyTypeObject *type, PyObject *args,
+                            PyObject *kwargs)
+{
+    ModelObject *self = (ModelObject *) type->tp_alloc(type, 0);
+    if(self == NULL)
+        return NULL;
+
+    self->ready = 0;
+    self->mask_arr = NULL;
+    setup_fluxParams(&(self->fp), 1.0, 0.0, 1.0, 0.1, 0.1, 0.0, 0.0, 0.0, 0.0,
+                     1.0, 2.2, 0.1, 0.01, 1.0, -1.0, 0.0, 0.0, 0.0, 0.0,
+                     1000, 0, 1.0e-4, NULL, 0, 7, 0);
+    tableCache_init(&(self->cache));
+    self->fp.cache = &(self->cache);
+    self->stats.cones_integrated = 0;
+    self->stats.cones_gauss = 0;
+    self->stats.cones_pruned = 0;
+    self->fp.stats = &(self->stats);
+
+    return (PyObject *) self;
+}
+
+static int Model_init(ModelObject *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *mask_obj = NULL;
+
+    int jet_type, spec_type;
+    double theta_obs, E_iso_core, theta_h_core, theta_h_wing, b, L0, q, ts, 
+           n_0, p, epsilon_E, epsilon_B, ksi_N, d_L;
+
+    int latRes = 5;
+    double rtol = 1.0e-4;
+    int tRes = 1000;
+    int spread = 7;
+    int gamma_type = 0;
+    double g0 = -1.0;
+    double E_core_global = 0.0;
+    double theta_h_core_global = 0.0;
+    double tMin = 0.0;
+    double tMax = 0.0;
+    int counterjet = 0;
+    int adaptive = 0;
+    static char *kwlist[] = {"jetType", "specType", "thetaObs", 
+                                "E0", "thetaCore", "thetaWing", "b",
+                                "L0", "q", "ts",
+                                "n0", "p",
+                                "epsilon_e", "epsilon_B", "ksiN", "dL",
+                                "g0", "E0Global", "thetaCoreGlobal",
+                                "tRes", "latRes", "rtol", "mask", "spread",
+                                "gammaType", "tMin", "tMax", "counterjet",
+                                "adaptiveCones",
+                                NULL};
+
+    //Parse Arguments
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs,
+                "iidddddddddddddd|dddiidOiiddii",
+                kwlist,
+                &jet_type, &spec_type, &theta_obs, &E_iso_core,
+                &theta_h_core, &theta_h_wing, &b, &L0, &q, &ts,
+                &n_0, &p, &epsilon_E, &epsilon_B, 
+                &ksi_N, &d_L,
+                &g0, &E_core_global, &theta_h_core_global,
+                &tRes, &latRes, &rtol, &mask_obj, &spread, &gamma_type,
+                &tMin, &tMax, &counterjet, &adaptive))
+    {
+        return -1;
+    }
+
+    PyArrayObject *mask_arr = NULL;
+    double *mask = NULL;
+    int masklen = 0;
+    if(mask_obj != NULL)
+    {
+        mask_arr = (PyArrayObject *) PyArray_FROM_OTF(mask_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+        if(mask_arr == NULL)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "Could not read mask array.");
+            return -1;
+        }
+        if(PyArray_NDIM(mask_arr) != 1 || PyArray_DIM(mask_arr, 0)%9 != 0)
+        {
+            PyErr_SetString(PyExc_RuntimeError, 
+                                "Mask must be 1-D, length a multiple of 9.");
+            Py_DECREF(mask_arr);
+            return -1;
+        }
+        mask = (double *)PyArray_DATA(mask_arr);
+        masklen = (int)PyArray_DIM(mask_arr, 0) / 9;
+    }
+
+    // Drop any previous state, in case __init__ is called twice.
+    free_fluxParams(&(self->fp));
+    tableCache_clear(&(self->cache));
+    Py_XDECREF(self->mask_arr);
+    self->mask_arr = mask_arr;
+
+    self->jet_type = jet_type;
+    self->latRes = latRes;
+    self->ready = 0;
+
+    setup_fluxParams(&(self->fp), d_L, theta_obs, E_iso_core, theta_h_core,
+                        theta_h_wing, b, L0, q, ts,
+                        n_0, p, epsilon_E, epsilon_B, ksi_N, g0, 
+                        E_core_global, theta_h_core_global, tMin, tMax, tRes,
+                        spec_type, rtol, mask, masklen, spread, gamma_type);
+    self->fp.cache = &(self->cache);
+    self->fp.stats = &(self->stats);
+    self->fp.counter_jet = counterjet;
+    self->fp.cone_adapt = adaptive;
+
+    if(tMin > 0.0 && tMax >= tMin)
+        self->ready = 1;
+
+    return 0;
+}
+
+static void Model_prepare(ModelObject *self, double *t, int N)
+{
+    // Make sure the stored blast wave solutions cover the times t, and
+    // reset the working tables so each evaluation starts from scratch.
+
+    double ta = t[0];
+    double tb = t[0];
+    int i;
+    for(i=0; i<N; i++)
+    {
+        if(t[i] < ta)
+            ta = t[i];
+        else if(t[i] > tb)
+            tb = t[i];
+    }
+
+    if(!self->ready)
+    {
+        self->fp.ta = ta;
+        self->fp.tb = tb;
+        self->ready = 1;
+    }
+    else if(ta < self->fp.ta || tb > self->fp.tb)
+    {
+        if(ta < self->fp.ta)
+            self->fp.ta = ta;
+        if(tb > self->fp.tb)
+            self->fp.tb = tb;
+        tableCache_clear(&(self->cache));
+    }
+
+    free_fluxParams(&(self->fp));
+}
+
+static PyObject *Model_flux(ModelObject *self, PyObject *args,
+                            PyObject *kwargs)
+{
+    PyObject *t_obj = NULL;
+    PyObject *nu_obj = NULL;
+    static char *kwlist[] = {"t", "nu", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OO", kwlist,
+                                    &t_obj, &nu_obj))
+        return NULL;
+
+    PyArrayObject *t_arr;
+    PyArrayObject *nu_arr;
+    t_arr = (PyArrayObject *) PyArray_FROM_OTF(t_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    nu_arr = (PyArrayObject *) PyArray_FROM_OTF(nu_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    if(t_arr == NULL || nu_arr == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Could not read input arrays.");
+        Py_XDECREF(t_arr);
+        Py_XDECREF(nu_arr);
+        return NULL;
+    }
+    if(PyArray_NDIM(t_arr) != 1 || PyArray_NDIM(nu_arr) != 1)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Arrays must be 1-D.");
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        return NULL;
+    }
+    int N = (int)PyArray_DIM(t_arr, 0);
+    if(N != (int)PyArray_DIM(nu_arr, 0))
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Arrays must be same size.");
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        return NULL;
+    }
+
+    npy_intp dims[1] = {N};
+    PyObject *Fnu_obj = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    if(Fnu_obj == NULL)
+    {
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        return NULL;
+    }
+
+    double *t = (double *)PyArray_DATA(t_arr);
+    double *nu = (double *)PyArray_DATA(nu_arr);
+    double *Fnu = PyArray_DATA((PyArrayObject *) Fnu_obj);
+
+    if(!allFinite(t, N) || !allFinite(nu, N))
+    {
+        PyErr_SetString(PyExc_ValueError, "t and nu must be finite.");
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_DECREF(Fnu_obj);
+        return NULL;
+    }
+
+    diag_clear(&(self->fp.diag));
+    if(N > 0)
+    {
+        Model_prepare(self, t, N);
+        lc_jet(self->jet_type, t, nu, Fnu, N, self->latRes, &(self->fp));
+    }
+
+    Py_DECREF(t_arr);
+    Py_DECREF(nu_arr);
+
+    if(reportDiag(&(self->fp.diag)) < 0)
+    {
+        Py_DECREF(Fnu_obj);
+        return NULL;
+    }
+
+    return Fnu_obj;
+}
+
+static PyObject *Model_intensity(ModelObject *self, PyObject *args,
+                                 PyObject *kwargs)
+{
+    PyObject *theta_obj = NULL;
+    PyObject *phi_obj = NULL;
+    PyObject *t_obj = NULL;
+    PyObject *nu_obj = NULL;
+    static char *kwlist[] = {"theta", "phi", "t", "nu", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOO", kwlist,
+                                    &theta_obj, &phi_obj, &t_obj, &nu_obj))
+        return NULL;
+
+    PyArrayObject *theta_arr;
+    PyArrayObject *phi_arr;
+    PyArrayObject *t_arr;
+    PyArrayObject *nu_arr;
+    theta_arr = (PyArrayObject *) PyArray_FROM_OTF(theta_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    phi_arr = (PyArrayObject *) PyArray_FROM_OTF(phi_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    t_arr = (PyArrayObject *) PyArray_FROM_OTF(t_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    nu_arr = (PyArrayObject *) PyArray_FROM_OTF(nu_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    if(theta_arr == NULL || phi_arr == NULL || t_arr == NULL || nu_arr == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Could not read input arrays.");
+        Py_XDECREF(theta_arr);
+        Py_XDECREF(phi_arr);
+        Py_XDECREF(t_arr);
+        Py_XDECREF(nu_arr);
+        return NULL;
+    }
+    int N = (int)PyArray_SIZE(theta_arr);
+    if(PyArray_NDIM(theta_arr) != 1 || PyArray_NDIM(phi_arr) != 1
+            || PyArray_NDIM(t_arr) != 1 || PyArray_NDIM(nu_arr) != 1
+            || N != (int)PyArray_SIZE(phi_arr) 
+            || N != (int)PyArray_SIZE(t_arr)
+            || N != (int)PyArray_SIZE(nu_arr))
+    {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Arrays must be 1-D and the same size.");
+        Py_DECREF(theta_arr);
+        Py_DECREF(phi_arr);
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        return NULL;
+    }
+
+    npy_intp dims[1] = {N};
+    PyObject *Inu_obj = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    if(Inu_obj == NULL)
+    {
+        Py_DECREF(theta_arr);
+        Py_DECREF(phi_arr);
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        return NULL;
+    }
+
+    double *theta = (double *)PyArray_DATA(theta_arr);
+    double *phi = (double *)PyArray_DATA(phi_arr);
+    double *t = (double *)PyArray_DATA(t_arr);
+    double *nu = (double *)PyArray_DATA(nu_arr);
+    double *Inu = PyArray_DATA((PyArrayObject *) Inu_obj);
+
+    diag_clear(&(self->fp.diag));
+    if(N > 0)
+    {
+        Model_prepare(self, t, N);
+        intensity_jet(self->jet_type, theta, phi, t, nu, Inu, N, self->latRes,
+                      &(self->fp));
+    }
+
+    Py_DECREF(theta_arr);
+    Py_DECREF(phi_arr);
+    Py_DECREF(t_arr);
+    Py_DECREF(nu_arr);
+
+    if(reportDiag(&(self->fp.diag)) < 0)
+    {
+        Py_DECREF(Inu_obj);
+        return NULL;
+    }
+
+    return Inu_obj;
+}
+
+static PyObject *Model_image(ModelObject *self, PyObject *args,
+                             PyObject *kwargs)
+{
+    PyObject *x_obj = NULL;
+    PyObject *y_obj = NULL;
+    double t, nu;
+    static char *kwlist[] = {"x", "y", "t", "nu", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OOdd", kwlist,
+                                    &x_obj, &y_obj, &t, &nu))
+        return NULL;
+
+    PyArrayObject *x_arr;
+    PyArrayObject *y_arr;
+    x_arr = (PyArrayObject *) PyArray_FROM_OTF(x_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    y_arr = (PyArrayObject *) PyArray_FROM_OTF(y_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    if(x_arr == NULL || y_arr == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Could not read input arrays.");
+        Py_XDECREF(x_arr);
+        Py_XDECREF(y_arr);
+        return NULL;
+    }
+
+    double *x = (double *)PyArray_DATA(x_arr);
+    double *y = (double *)PyArray_DATA(y_arr);
+    int Nx = (int)PyArray_SIZE(x_arr) - 1;
+    int Ny = (int)PyArray_SIZE(y_arr) - 1;
+    int i;
+    int ok = PyArray_NDIM(x_arr) == 1 && PyArray_NDIM(y_arr) == 1
+                && Nx > 0 && Ny > 0 && t > 0.0 && nu > 0.0;
+    for(i=0; ok && i<Nx; i++)
+        ok = x[i+1] > x[i];
+    for(i=0; ok && i<Ny; i++)
+        ok = y[i+1] > y[i];
+    if(!ok)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "x and y must be 1-D and increasing with at least "
+                        "two edges, t and nu positive.");
+        Py_DECREF(x_arr);
+        Py_DECREF(y_arr);
+        return NULL;
+    }
+
+    npy_intp dims[2] = {Ny, Nx};
+    PyObject *img_obj = PyArray_SimpleNew(2, dims, NPY_DOUBLE);
+    if(img_obj == NULL)
+    {
+        Py_DECREF(x_arr);
+        Py_DECREF(y_arr);
+        return NULL;
+    }
+    double *img = PyArray_DATA((PyArrayObject *) img_obj);
+
+    diag_clear(&(self->fp.diag));
+    Model_prepare(self, &t, 1);
+    ok = image_jet(self->jet_type, x, Nx, y, Ny, t, nu, img, self->latRes,
+                    &(self->fp));
+
+    Py_DECREF(x_arr);
+    Py_DECREF(y_arr);
+
+    if(!ok)
+    {
+        PyErr_SetString(PyExc_ValueError, "Images need a jet-like jetType.");
+        Py_DECREF(img_obj);
+        return NULL;
+    }
+    if(reportDiag(&(self->fp.diag)) < 0)
+    {
+        Py_DECREF(img_obj);
+        return NULL;
+    }
+
+    return img_obj;
+}
+
+static PyObject *Model_shockVals(ModelObject *self, PyObject *args,
+                                 PyObject *kwargs)
+{
+    PyObject *theta_obj = NULL;
+    PyObject *phi_obj = NULL;
+    PyObject *tobs_obj = NULL;
+    static char *kwlist[] = {"theta", "phi", "tobs", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO", kwlist,
+                                    &theta_obj, &phi_obj, &tobs_obj))
+        return NULL;
+
+    PyArrayObject *theta_arr;
+    PyArrayObject *phi_arr;
+    PyArrayObject *tobs_arr;
+    theta_arr = (PyArrayObject *) PyArray_FROM_OTF(theta_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    phi_arr = (PyArrayObject *) PyArray_FROM_OTF(phi_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    tobs_arr = (PyArrayObject *) PyArray_FROM_OTF(tobs_obj, NPY_DOUBLE,
+                                                NPY_ARRAY_IN_ARRAY);
+    if(theta_arr == NULL || phi_arr == NULL || tobs_arr == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Could not read input arrays.");
+        Py_XDECREF(theta_arr);
+        Py_XDECREF(phi_arr);
+        Py_XDECREF(tobs_arr);
+        return NULL;
+    }
+    int N = (int)PyArray_SIZE(theta_arr);
+    if(PyArray_NDIM(theta_arr) != 1 || PyArray_NDIM(phi_arr) != 1
+            || PyArray_NDIM(tobs_arr) != 1
+            || N != (int)PyArray_SIZE(phi_arr) 
+            || N != (int)PyArray_SIZE(tobs_arr))
+    {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Arrays must be 1-D and the same size.");
+        Py_DECREF(theta_arr);
+        Py_DECREF(phi_arr);
+        Py_DECREF(tobs_arr);
+        return NULL;
+    }
+
+    npy_intp dims[1] = {N};
+    PyObject *t_obj = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    PyObject *R_obj = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    PyObject *u_obj = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    PyObject *thj_obj = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    if(t_obj == NULL || R_obj == NULL || u_obj == NULL || thj_obj == NULL)
+    {
+        Py_XDECREF(t_obj);
+        Py_XDECREF(R_obj);
+        Py_XDECREF(u_obj);
+        Py_XDECREF(thj_obj);
+        Py_DECREF(theta_arr);
+        Py_DECREF(phi_arr);
+        Py_DECREF(tobs_arr);
+        return NULL;
+    }
+
+    double *theta = (double *)PyArray_DATA(theta_arr);
+    double *phi = (double *)PyArray_DATA(phi_arr);
+    double *tobs = (double *)PyArray_DATA(tobs_arr);
+    double *t = PyArray_DATA((PyArrayObject *) t_obj);
+    double *R = PyArray_DATA((PyArrayObject *) R_obj);
+    double *u = PyArray_DATA((PyArrayObject *) u_obj);
+    double *thj = PyArray_DATA((PyArrayObject *) thj_obj);
+
+    diag_clear(&(self->fp.diag));
+    if(N > 0)
+    {
+        Model_prepare(self, tobs, N);
+        shockVals_jet(self->jet_type, theta, phi, tobs, t, R, u, thj, N,
+                      self->latRes, &(self->fp));
+    }
+
+    Py_DECREF(theta_arr);
+    Py_DECREF(phi_arr);
+    Py_DECREF(tobs_arr);
+
+    if(reportDiag(&(self->fp.diag)) < 0)
+    {
+        Py_DECREF(t_obj);
+        Py_DECREF(R_obj);
+        Py_DECREF(u_obj);
+        Py_DECREF(thj_obj);
+        return NULL;
+    }
+
+    return Py_BuildValue("NNNN", t_obj, R_obj, u_obj, thj_obj);
+}
+
+static PyMethodDef Model_methods[] = {
+    {"flux", (PyCFunction)Model_flux, METH_VARARGS|METH_KEYWORDS,
+        Model_flux_docstring},
+    {"intensity", (PyCFunction)Model_intensity, METH_VARARGS|METH_KEYWORDS,
+        Model_intensity_docstring},
+    {"image", (PyCFunction)Model_image, METH_VARARGS|METH_KEYWORDS,
+        Model_image_docstring},
+    {"shockVals", (PyCFunction)Model_shockVals, METH_VARARGS|METH_KEYWORDS,
+        Model_shockVals_docstring},
+    {NULL, NULL, 0, NULL}};
+
+static PyMemberDef Model_members[] = {
+    {"conesIntegrated", T_LONG, offsetof(ModelObject, stats.cones_integrated),
+        READONLY, "Number of (cone, time) flux integrations done."},
+    {"conesLowOrder", T_LONG, offsetof(ModelObject, stats.cones_gauss),
+        READONLY, "Number of (cone, time) pairs done with a low order rule."},
+    {"conesPruned", T_LONG, offsetof(ModelObject, stats.cones_pruned),
+        READONLY, "Number of (cone, time) pairs skipped as negligible."},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyTypeObject ModelType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "afterglowpy.jet.Model",
+    .tp_doc = Model_docstring,
+    .tp_basicsize = sizeof(ModelObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = Model_new,
+    .tp_init = (initproc) Model_init,
+    .tp_dealloc = (destructor) Model_dealloc,
+    .tp_methods = Model_methods,
+    .tp_members = Model_members,
+};
+
+typedef struct
+{
+    PyObject_HEAD
+    int jet_type;
+    int spec_type;
+    int tRes;
+    int latRes;
+    double rtol;
+    int spread;
+    int gamma_type;
+    int counterjet;
+    int adaptive;
+    double z;
+    int N;
+    double *t;
+    double *nu;
+    double *Fobs;
+    double *Ferr;
+    int *ul;
+    struct obsPlan plan;
+    struct chi2Data cd;
+    struct fluxStats stats;
+} ObservationSetObject;
+
+static void ObservationSet_dealloc(ObservationSetObject *self)
+{
+    free(self->t);
+    free(self->ul);
+    free_obsPlan(&(self->plan));
+    free_chi2Data(&(self->cd));
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *ObservationSet_new(PyTypeObject *type, PyObject *args,
+                                    PyObject *kwargs)
+{
+    ObservationSetObject *self = (ObservationSetObject *)
+                                        type->tp_alloc(type, 0);
+    if(self == NULL)
+        return NULL;
+
+    self->N = 0;
+    self->t = NULL;
+    self->nu = NULL;
+    self->Fobs = NULL;
+    self->Ferr = NULL;
+    self->ul = NULL;
+    self->plan.index = NULL;
+    self->plan.nu = NULL;
+    self->plan.t = NULL;
+    self->plan.start = NULL;
+    self->plan.N = 0;
+    self->plan.Nu = 0;
+    self->plan.Ng = 0;
+    self->plan.Nnu = 0;
+    self->cd.contrib = NULL;
+    self->cd.obs_start = NULL;
+    self->cd.obs = NULL;
+    self->stats.cones_integrated = 0;
+    self->stats.cones_gauss = 0;
+    self->stats.cones_pruned = 0;
+
+    return (PyObject *) self;
+}
+
+static int ObservationSet_init(ObservationSetObject *self, PyObject *args,
+                                PyObject *kwargs)
+{
+    PyObject *t_obj = NULL;
+    PyObject *nu_obj = NULL;
+    PyObject *Fobs_obj = NULL;
+    PyObject *Ferr_obj = NULL;
+    PyObject *ul_obj = NULL;
+
+    int jet_type, spec_type;
+    int latRes = 5;
+    double rtol = 1.0e-4;
+    int tRes = 1000;
+    int spread = 7;
+    int gamma_type = 0;
+    int counterjet = 0;
+    int adaptive = 0;
+    double z = 0.0;
+    static char *kwlist[] = {"t", "nu", "jetType", "specType", "Fnu",
+                                "Ferr", "ul", "z", "tRes", "latRes", "rtol",
+                                "spread", "gammaType", "counterjet",
+                                "adaptiveCones", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OOii|OOOdiidiiii", kwlist,
+                &t_obj, &nu_obj, &jet_type, &spec_type, &Fobs_obj, &Ferr_obj,
+                &ul_obj, &z, &tRes, &latRes, &rtol, &spread, &gamma_type,
+                &counterjet, &adaptive))
+        return -1;
+
+    if(Fobs_obj == Py_None)
+        Fobs_obj = NULL;
+    if(Ferr_obj == Py_None)
+        Ferr_obj = NULL;
+    if(ul_obj == Py_None)
+        ul_obj = NULL;
+    if((Fobs_obj == NULL) != (Ferr_obj == NULL)
+            || (ul_obj != NULL && Fobs_obj == NULL))
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "Fnu and Ferr must be given together, and with ul.");
+        return -1;
+    }
+
+    // t, nu, Fnu, Ferr, and ul (as doubles, nonzero for upper limits).
+    PyObject *objs[5] = {t_obj, nu_obj, Fobs_obj, Ferr_obj, ul_obj};
+    PyArrayObject *arrs[5] = {NULL, NULL, NULL, NULL, NULL};
+    int narr = Fobs_obj == NULL ? 2 : (ul_obj == NULL ? 4 : 5);
+    int i, j;
+    int good = 1;
+
+    for(j=0; j<narr; j++)
+    {
+        arrs[j] = (PyArrayObject *) PyArray_FROM_OTF(objs[j], NPY_DOUBLE,
+                                                    NPY_ARRAY_IN_ARRAY);
+        if(arrs[j] == NULL || PyArray_NDIM(arrs[j]) != 1
+                || PyArray_DIM(arrs[j], 0) != PyArray_DIM(arrs[0], 0))
+            good = 0;
+    }
+    if(!good)
+    {
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError,
+                            "Arrays must be 1-D and the same size.");
+        for(j=0; j<narr; j++)
+            Py_XDECREF(arrs[j]);
+        return -1;
+    }
+
+    int N = (int)PyArray_DIM(arrs[0], 0);
+    double *data[5];
+    for(j=0; j<narr; j++)
+        data[j] = (double *)PyArray_DATA(arrs[j]);
+
+    for(i=0; i<N; i++)
+    {
+        if(!(data[0][i] > 0.0) || !(data[1][i] > 0.0)
+                || (narr >= 4 && !(data[3][i] > 0.0)))
+            good = 0;
+        for(j=0; j<narr; j++)
+            if(!isfinite(data[j][i]))
+                good = 0;
+    }
+    if(N == 0 || !good || !(z > -1.0))
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "Need at least one point, t, nu and Ferr must be "
+                        "positive and finite, z > -1.");
+        for(j=0; j<narr; j++)
+            Py_DECREF(arrs[j]);
+        return -1;
+    }
+
+    // Drop any previous state, in case __init__ is called twice.
+    free(self->t);
+    free(self->ul);
+    free_obsPlan(&(self->plan));
+    free_chi2Data(&(self->cd));
+    self->ul = NULL;
+
+    // All data lives in one block: source frame t and nu, then Fnu, Ferr.
+    int ndata = narr < 4 ? narr : 4;
+    self->t = (double *)malloc(ndata * N * sizeof(double));
+    self->nu = self->t + N;
+    self->Fobs = narr >= 4 ? self->t + 2*N : NULL;
+    self->Ferr = narr >= 4 ? self->t + 3*N : NULL;
+    for(i=0; i<N; i++)
+    {
+        self->t[i] = data[0][i] / (1.0+z);
+        self->nu[i] = data[1][i] * (1.0+z);
+    }
+    if(narr >= 4)
+    {
+        memcpy(self->Fobs, data[2], N * sizeof(double));
+        memcpy(self->Ferr, data[3], N * sizeof(double));
+    }
+    if(narr == 5)
+    {
+        self->ul = (int *)malloc(N * sizeof(int));
+        for(i=0; i<N; i++)
+            self->ul[i] = data[4][i] != 0.0;
+    }
+    for(j=0; j<narr; j++)
+        Py_DECREF(arrs[j]);
+
+    make_obsPlan(&(self->plan), self->t, self->nu, N);
+    if(narr >= 4)
+        setup_chi2Data(&(self->cd), &(self->plan), self->Fobs, self->Ferr,
+                        self->ul, 1.0+z, INFINITY);
+
+    self->N = N;
+    self->jet_type = jet_type;
+    self->spec_type = spec_type;
+    self->tRes = tRes;
+    self->latRes = latRes;
+    self->rtol = rtol;
+    self->spread = spread;
+    self->gamma_type = gamma_type;
+    self->counterjet = counterjet;
+    self->adaptive = adaptive;
+    self->z = z;
+
+    return 0;
+}
+
+static PyArrayObject *ObservationSet_readPars(PyObject *pars_obj, int batch)
+{
+    // The parameter vector (or, if batch, a 2-D array of vectors).
+    PyArrayObject *pars_arr = (PyArrayObject *) PyArray_FROM_OTF(pars_obj,
+                                        NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+    if(pars_arr == NULL)
+        return NULL;
+
+    int ndim = PyArray_NDIM(pars_arr);
+    int Npar = ndim > 0 ? (int)PyArray_DIM(pars_arr, ndim-1) : 0;
+    if((ndim != 1 && !(batch && ndim == 2)) || Npar < 14 || Npar > 17)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "pars must be a vector of 14 to 17 parameters.");
+        Py_DECREF(pars_arr);
+        return NULL;
+    }
+    return pars_arr;
+}
+
+static const char *ObservationSet_check(ObservationSetObject *self,
+                                        double *pars, int Npar)
+{
+    // What is wrong with the parameter vector pars, or NULL if nothing.
+    // The bounds are those of flux.checkJetArgs() and
+    // flux.checkCocoonArgs(), checked once per evaluation.
+    int i;
+    for(i=0; i<Npar; i++)
+        if(!isfinite(pars[i]))
+            return "All parameters must be finite.";
+
+    int jet_type = self->jet_type;
+    int spec_type = self->spec_type;
+
+    if(jet_type == _cocoon)
+    {
+        if(pars[0] <= 0.0)
+            return "u_max must be positive.";
+        if(pars[1] <= 0.0)
+            return "u_min must be positive.";
+        if(pars[2] <= 0.0)
+            return "Ei must be positive.";
+        if(pars[4] <= 0.0)
+            return "Mej_solar must be positive.";
+    }
+    else
+    {
+        if(pars[0] < 0.0 || pars[0] > 0.5*PI)
+            return "theta_obs must be in [0.0, pi/2].";
+        if(pars[1] <= 0.0)
+            return "E0 must be positive.";
+        if(pars[2] <= 0.0 || pars[2] > 0.5*PI)
+            return "theta_c must be in (0.0, pi/2].";
+        if(jet_type != _tophat && (pars[3] <= 0.0 || pars[3] > 0.5*PI))
+            return "theta_w must be in (0.0, pi/2].";
+        if(jet_type == _powerlaw && pars[4] <= 0.0)
+            return "b must be positive.";
+        if(jet_type == _cone && pars[2] > pars[3])
+            return "theta_w must be larger than theta_c for cone model.";
+    }
+
+    if(pars[5] < 0.0)
+        return "L0 must be non-negative.";
+    if(pars[7] < 0.0)
+        return "t_s must be non-negative.";
+    if(pars[8] <= 0.0)
+        return "n0 must be positive.";
+    if(spec_type != 2 && pars[9] <= 2.0)
+        return "p must be in (2, inf).";
+    if(spec_type == 2 && pars[9] <= 1.0)
+        return "p must be in (1, inf).";
+    if(pars[10] <= 0.0 || pars[10] > 1.0)
+        return "epsilon_e must be in (0, 1].";
+    if(pars[11] <= 0.0 || pars[11] > 1.0)
+        return "epsilon_B must be in (0, 1].";
+    if(pars[12] <= 0.0 || pars[12] > 1.0)
+        return "xi_N must be in (0, 1].";
+    if(pars[13] <= 0.0)
+        return "dL must be positive.";
+    return NULL;
+}
+
+static void ObservationSet_setup(ObservationSetObject *self, double *pars,
+                                int Npar, struct fluxParams *fp)
+{
+    // Set up fp for the finite parameter vector pars.
+
+    double Y[17] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+                    0.0, 0.0, 0.0, -1.0, 0.0, 0.0};
+    int i;
+    for(i=0; i<Npar; i++)
+        Y[i] = pars[i];
+
+    // Observations are sorted, so the time range is known.
+    double ta = self->plan.t[0];
+    double tb = self->plan.t[self->plan.Ng-1];
+
+    setup_fluxParams(fp, Y[13], Y[0], Y[1], Y[2], Y[3], Y[4], Y[5], Y[6],
+                        Y[7], Y[8], Y[9], Y[10], Y[11], Y[12], Y[14], Y[15],
+                        Y[16], ta, tb, self->tRes, self->spec_type,
+                        self->rtol, NULL, 0, self->spread, self->gamma_type);
+    fp->stats = &(self->stats);
+    fp->counter_jet = self->counterjet;
+    fp->cone_adapt = self->adaptive;
+}
+
+static PyObject *ObservationSet_flux(ObservationSetObject *self,
+                                        PyObject *args, PyObject *kwargs)
+{
+    PyObject *pars_obj = NULL;
+    PyObject *out_obj = NULL;
+    static char *kwlist[] = {"pars", "out", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist,
+                                    &pars_obj, &out_obj))
+        return NULL;
+
+    PyArrayObject *pars_arr = ObservationSet_readPars(pars_obj, 0);
+    if(pars_arr == NULL)
+        return NULL;
+
+    const char *bad = ObservationSet_check(self,
+                                        (double *)PyArray_DATA(pars_arr),
+                                        (int)PyArray_DIM(pars_arr, 0));
+    if(bad != NULL)
+    {
+        PyErr_SetString(PyExc_ValueError, bad);
+        Py_DECREF(pars_arr);
+        return NULL;
+    }
+    struct fluxParams fp;
+    ObservationSet_setup(self, (double *)PyArray_DATA(pars_arr),
+                            (int)PyArray_DIM(pars_arr, 0), &fp);
+    Py_DECREF(pars_arr);
+
+    PyArrayObject *out_arr;
+    npy_intp dims[1] = {self->N};
+    if(out_obj != NULL && out_obj != Py_None)
+        out_arr = readOutArray(out_obj, 1, dims);
+    else
+        out_arr = (PyArrayObject *) PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    if(out_arr == NULL)
+        return NULL;
+
+    double *Fnu;
+    if(PyArray_IS_C_CONTIGUOUS(out_arr))
+        Fnu = (double *)PyArray_DATA(out_arr);
+    else
+        Fnu = (double *)malloc(self->N * sizeof(double));
+
+    lc_jet_plan(self->jet_type, &(self->plan), self->t, self->nu, Fnu,
+                    self->latRes, &fp);
+    struct fluxDiag diag = fp.diag;
+    free_fluxParams(&fp);
+
+    // K-correct the flux into the output.
+    writeOutArray(Fnu, out_arr, 1.0+self->z);
+
+    if(Fnu != (double *)PyArray_DATA(out_arr))
+        free(Fnu);
+
+    if(reportDiag(&diag) < 0)
+    {
+        Py_DECREF(out_arr);
+        return NULL;
+    }
+
+    return (PyObject *) out_arr;
+}
+
+static PyObject *ObservationSet_chi2Batch(ObservationSetObject *self,
+                                            PyObject *pars_obj,
+                                            double chi2_max, double scale)
+{
+    // scale * chi^2 for one parameter vector (returns a float) or each
+    // row of a 2-D array of them (returns an array).  Parameters
+    // ObservationSet_check() rejects give scale * inf.  Evaluations stop
+    // early once chi^2 passes chi2_max, returning the partial value.  So
+    // a sampler can carry on, an evaluation with errors or a NaN flux
+    // also gives scale * inf, and its errors are reported as warnings.
+
+    if(self->Fobs == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "ObservationSet was created without Fnu and Ferr.");
+        return NULL;
+    }
+
+    PyArrayObject *pars_arr = ObservationSet_readPars(pars_obj, 1);
+    if(pars_arr == NULL)
+        return NULL;
+
+    int batch = PyArray_NDIM(pars_arr) == 2;
+    int B = batch ? (int)PyArray_DIM(pars_arr, 0) : 1;
+    int Npar = (int)PyArray_DIM(pars_arr, batch ? 1 : 0);
+    double *pars = (double *)PyArray_DATA(pars_arr);
+
+    npy_intp dims[1] = {B};
+    PyObject *res_obj = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+    if(res_obj == NULL)
+    {
+        Py_DECREF(pars_arr);
+        return NULL;
+    }
+    double *res = (double *)PyArray_DATA((PyArrayObject *) res_obj);
+
+    double *Fnu = (double *)malloc(self->N * sizeof(double));
+    self->cd.chi2_max = chi2_max;
+
+    struct fluxDiag diag;
+    diag_clear(&diag);
+
+    int b;
+    for(b=0; b<B; b++)
+    {
+        struct fluxParams fp;
+        if(ObservationSet_check(self, pars + b*Npar, Npar) != NULL)
+        {
+            res[b] = scale * INFINITY;
+            continue;
+        }
+        ObservationSet_setup(self, pars + b*Npar, Npar, &fp);
+        double chi2 = lc_jet_chi2(self->jet_type, &(self->plan), self->t,
+                                    self->nu, Fnu, &(self->cd), self->latRes,
+                                    &fp);
+        if(fp.diag.errors > 0 || chi2 != chi2)
+        {
+            chi2 = INFINITY;
+            fp.diag.warnings += fp.diag.errors;
+            fp.diag.errors = 0;
+        }
+        mergeDiag(&diag, &(fp.diag));
+        free_fluxParams(&fp);
+        res[b] = scale * chi2;
+    }
+
+    free(Fnu);
+    Py_DECREF(pars_arr);
+
+    if(reportDiag(&diag) < 0)
+    {
+        Py_DECREF(res_obj);
+        return NULL;
+    }
+
+    if(batch)
+        return res_obj;
+
+    PyObject *ret = PyFloat_FromDouble(res[0]);
+    Py_DECREF(res_obj);
+    return ret;
+}
+
+static PyObject *ObservationSet_chi2(ObservationSetObject *self,
+                                        PyObject *args, PyObject *kwargs)
+{
+    PyObject *pars_obj = NULL;
+    double chi2_max = INFINITY;
+    static char *kwlist[] = {"pars", "chi2Max", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|d", kwlist, &pars_obj,
+                                    &chi2_max))
+        return NULL;
+
+    return ObservationSet_chi2Batch(self, pars_obj, chi2_max, 1.0);
+}
+
+static PyObject *ObservationSet_logLike(ObservationSetObject *self,
+                                        PyObject *args, PyObject *kwargs)
+{
+    PyObject *pars_obj = NULL;
+    double logLike_min = -INFINITY;
+    static char *kwlist[] = {"pars", "logLikeMin", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|d", kwlist, &pars_obj,
+                                    &logLike_min))
+        return NULL;
+
+    return ObservationSet_chi2Batch(self, pars_obj, -2.0*logLike_min, -0.5);
+}
+
+static int ObservationSet_usesPar(int jet_type, double *pars, int k)
+{
+    // Whether blast wave parameter k enters the model at all.
+    if(jet_type == _cocoon)
+        return k < 5 || pars[5] > 0.0;
+    if(k == 3 && jet_type == _tophat)
+        return 0;
+    if(k == 4 && (jet_type == _tophat || jet_type == _cone
+                    || jet_type == _Gaussian || jet_type == _Gaussian_core))
+        return 0;
+    if(k >= 5 && k <= 7 && !(pars[5] > 0.0))
+        return 0;
+    return 1;
+}
+
+static int ObservationSet_grad(ObservationSetObject *self, double *pars,
+                                int Npar, int dynamic, double *Fnu,
+                                double *dFnu, struct fluxDiag *diag)
+{
+    // Source frame flux and its derivatives dFnu[k*N + i] with respect to
+    // the 14 jet parameters.  Returns 0 if ObservationSet_check() rejects
+    // pars, -1 if jet_type has no planned version.  Problems met are
+    // added to diag.
+
+    int N = self->N;
+    int i, k;
+    struct fluxParams fp;
+
+    if(ObservationSet_check(self, pars, Npar) != NULL)
+        return 0;
+    ObservationSet_setup(self, pars, Npar, &fp);
+    int res_cones = (int) (self->latRes * fp.theta_wing / fp.theta_core);
+    int planned = lc_jet_grad(self->jet_type, &(self->plan), Fnu,
+                                dFnu + 9*N, self->latRes, &fp);
+    mergeDiag(diag, &(fp.diag));
+    free_fluxParams(&fp);
+    if(!planned)
+        return -1;
+
+    for(i=0; i<N; i++)
+        dFnu[13*N+i] = -2.0 * Fnu[i] / pars[13];
+    for(i=0; i<9*N; i++)
+        dFnu[i] = 0.0;
+
+    if(!dynamic)
+        return 1;
+
+    // The blast wave parameters change the dynamics, difference them.
+    // The cone count is held fixed so thetaCore and thetaWing do not
+    // step across a change in the jet's discretization.  n0 is left for
+    // last.
+    double Y[17];
+    double *Fa = (double *)malloc(2 * N * sizeof(double));
+    double *Fb = Fa + N;
+    memcpy(Y, pars, Npar * sizeof(double));
+
+    for(k=0; k<8; k++)
+    {
+        if(!ObservationSet_usesPar(self->jet_type, pars, k))
+            continue;
+
+        double x = pars[k];
+        double h = 1.0e-3 * fabs(x);
+        if(self->jet_type != _cocoon)
+        {
+            if(k == 0)
+                h = 1.0e-3 * (fabs(x) > pars[2] ? fabs(x) : pars[2]);
+            else if(k == 4 || k == 6)
+                h = 1.0e-3 * (fabs(x) > 1.0 ? fabs(x) : 1.0);
+        }
+
+        double *Fab[2] = {Fa, Fb};
+        int j;
+        for(j=0; j<2; j++)
+        {
+            // The flux is even in thetaObs.
+            Y[k] = j == 0 ? x + h : x - h;
+            if(k == 0 && self->jet_type != _cocoon)
+                Y[k] = fabs(Y[k]);
+            ObservationSet_setup(self, Y, Npar, &fp);
+            fp.flux_rtol *= 1.0e-2;
+            fp.res_cones = res_cones;
+            lc_jet_plan(self->jet_type, &(self->plan), self->t, self->nu,
+                            Fab[j], self->latRes, &fp);
+            mergeDiag(diag, &(fp.diag));
+            free_fluxParams(&fp);
+        }
+        Y[k] = x;
+
+        for(i=0; i<N; i++)
+            dFnu[k*N+i] = (Fa[i] - Fb[i]) / (2*h);
+    }
+
+    // The dynamics only depend on E0/n0 and L0/n0, and the emissivity
+    // on n0 and epsilon_B * n0, so
+    // n0 dF/dn0 = F + epsilon_B dF/depsilon_B - E0 dF/dE0 - L0 dF/dL0.
+    // A cocoon's dynamics depend on Ei/n0 and Mej/n0 instead.
+    if(self->jet_type == _cocoon)
+        for(i=0; i<N; i++)
+            dFnu[8*N+i] = (Fnu[i] + pars[11]*dFnu[11*N+i]
+                            - pars[2]*dFnu[2*N+i] - pars[4]*dFnu[4*N+i]
+                            - pars[5]*dFnu[5*N+i]) / pars[8];
+    else
+        for(i=0; i<N; i++)
+            dFnu[8*N+i] = (Fnu[i] + pars[11]*dFnu[11*N+i]
+                            - pars[1]*dFnu[N+i] - pars[5]*dFnu[5*N+i])
+                            / pars[8];
+
+    free(Fa);
+    return 1;
+}
+
+static PyObject *ObservationSet_fluxGrad(ObservationSetObject *self,
+                                            PyObject *args, PyObject *kwargs)
+{
+    PyObject *pars_obj = NULL;
+    int dynamic = 1;
+    static char *kwlist[] = {"pars", "dynamic", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", kwlist,
+                                    &pars_obj, &dynamic))
+        return NULL;
+
+    PyArrayObject *pars_arr = ObservationSet_readPars(pars_obj, 0);
+    if(pars_arr == NULL)
+        return NULL;
+
+    int N = self->N;
+    npy_intp dims[2] = {14, N};
+    PyArrayObject *F_arr = (PyArrayObject *) PyArray_SimpleNew(1, dims+1,
+                                                                NPY_DOUBLE);
+    PyArrayObject *dF_arr = (PyArrayObject *) PyArray_SimpleNew(2, dims,
+                                                                NPY_DOUBLE);
+    if(F_arr == NULL || dF_arr == NULL)
+    {
+        Py_DECREF(pars_arr);
+        Py_XDECREF(F_arr);
+        Py_XDECREF(dF_arr);
+        return NULL;
+    }
+    double *Fnu = (double *)PyArray_DATA(F_arr);
+    double *dFnu = (double *)PyArray_DATA(dF_arr);
+
+    struct fluxDiag diag;
+    diag_clear(&diag);
+    double *pars = (double *)PyArray_DATA(pars_arr);
+    int Npar = (int)PyArray_DIM(pars_arr, 0);
+    int res = ObservationSet_grad(self, pars, Npar, dynamic, Fnu, dFnu,
+                                    &diag);
+    const char *bad = res == 0 ? ObservationSet_check(self, pars, Npar)
+                                : NULL;
+    Py_DECREF(pars_arr);
+    if(res <= 0)
+    {
+        if(res == 0)
+            PyErr_SetString(PyExc_ValueError, bad);
+        else
+            PyErr_SetString(PyExc_ValueError,
+                            "Gradients are not available for this jetType.");
+        Py_DECREF(F_arr);
+        Py_DECREF(dF_arr);
+        return NULL;
+    }
+    if(reportDiag(&diag) < 0)
+    {
+        Py_DECREF(F_arr);
+        Py_DECREF(dF_arr);
+        return NULL;
+    }
+
+    // K-correct.
+    int i;
+    for(i=0; i<N; i++)
+        Fnu[i] *= 1.0+self->z;
+    for(i=0; i<14*N; i++)
+        dFnu[i] *= 1.0+self->z;
+
+    return Py_BuildValue("NN", F_arr, dF_arr);
+}
+
+static PyObject *ObservationSet_logLikeGrad(ObservationSetObject *self,
+                                            PyObject *args, PyObject *kwargs)
+{
+    PyObject *pars_obj = NULL;
+    int dynamic = 1;
+    static char *kwlist[] = {"pars", "dynamic", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|p", kwlist,
+                                    &pars_obj, &dynamic))
+        return NULL;
+
+    if(self->Fobs == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "ObservationSet was created without Fnu and Ferr.");
+        return NULL;
+    }
+
+    PyArrayObject *pars_arr = ObservationSet_readPars(pars_obj, 0);
+    if(pars_arr == NULL)
+        return NULL;
+
+    int N = self->N;
+    npy_intp dims[1] = {14};
+    PyArrayObject *g_arr = (PyArrayObject *) PyArray_ZEROS(1, dims,
+                                                            NPY_DOUBLE, 0);
+    double *Fnu = (double *)malloc(15 * N * sizeof(double));
+    double *dFnu = Fnu + N;
+    if(g_arr == NULL || Fnu == NULL)
+    {
+        Py_DECREF(pars_arr);
+        Py_XDECREF(g_arr);
+        free(Fnu);
+        return PyErr_NoMemory();
+    }
+
+    struct fluxDiag diag;
+    diag_clear(&diag);
+    int res = ObservationSet_grad(self, (double *)PyArray_DATA(pars_arr),
+                                    (int)PyArray_DIM(pars_arr, 0), dynamic,
+                                    Fnu, dFnu, &diag);
+    Py_DECREF(pars_arr);
+    if(res < 0)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "Gradients are not available for this jetType.");
+        Py_DECREF(g_arr);
+        free(Fnu);
+        return NULL;
+    }
+    // As for logLike(), errors give -inf and are reported as warnings.
+    int failed = diag.errors > 0;
+    diag.warnings += diag.errors;
+    diag.errors = 0;
+    if(reportDiag(&diag) < 0)
+    {
+        Py_DECREF(g_arr);
+        free(Fnu);
+        return NULL;
+    }
+    if(res == 0 || failed)
+    {
+        free(Fnu);
+        return Py_BuildValue("dN", -INFINITY, g_arr);
+    }
+
+    double *grad = (double *)PyArray_DATA(g_arr);
+    double fac = 1.0 + self->z;
+    double chi2 = 0.0;
+    int i, k;
+    for(i=0; i<N; i++)
+    {
+        int ul = self->ul != NULL && self->ul[i];
+        double F = fac * Fnu[i];
+        chi2 += chi2_point(F, self->Fobs[i], self->Ferr[i], ul);
+        if(ul && F <= self->Fobs[i])
+            continue;
+        double w = (F - self->Fobs[i]) / (self->Ferr[i]*self->Ferr[i]);
+        for(k=0; k<14; k++)
+            grad[k] -= w * fac * dFnu[k*N+i];
+    }
+    free(Fnu);
+    if(chi2 != chi2)
+        chi2 = INFINITY;
+
+    return Py_BuildValue("dN", -0.5*chi2, g_arr);
+}
+
+static PyObject *ObservationSet_len(ObservationSetObject *self,
+                                    void *closure)
+{
+    return PyLong_FromLong(self->N);
+}
+
+static PyMethodDef ObservationSet_methods[] = {
+    {"flux", (PyCFunction)ObservationSet_flux, METH_VARARGS|METH_KEYWORDS,
+        ObservationSet_flux_docstring},
+    {"chi2", (PyCFunction)ObservationSet_chi2, METH_VARARGS|METH_KEYWORDS,
+        ObservationSet_chi2_docstring},
+    {"logLike", (PyCFunction)ObservationSet_logLike,
+        METH_VARARGS|METH_KEYWORDS, ObservationSet_logLike_docstring},
+    {"fluxGrad", (PyCFunction)ObservationSet_fluxGrad,
+        METH_VARARGS|METH_KEYWORDS, ObservationSet_fluxGrad_docstring},
+    {"logLikeGrad", (PyCFunction)ObservationSet_logLikeGrad,
+        METH_VARARGS|METH_KEYWORDS, ObservationSet_logLikeGrad_docstring},
+    {NULL, NULL, 0, NULL}};
+
+static PyGetSetDef ObservationSet_getset[] = {
+    {"N", (getter)ObservationSet_len, NULL, "Number of observations.", NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyMemberDef ObservationSet_members[] = {
+    {"conesIntegrated", T_LONG,
+        offsetof(ObservationSetObject, stats.cones_integrated), READONLY,
+        "Number of (cone, time) flux integrations done."},
+    {"conesLowOrder", T_LONG,
+        offsetof(ObservationSetObject, stats.cones_gauss), READONLY,
+        "Number of (cone, time) pairs done with a low order rule."},
+    {"conesPruned", T_LONG,
+        offsetof(ObservationSetObject, stats.cones_pruned), READONLY,
+        "Number of (cone, time) pairs skipped as negligible."},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyTypeObject ObservationSetType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "afterglowpy.jet.ObservationSet",
+    .tp_doc = ObservationSet_docstring,
+    .tp_basicsize = sizeof(ObservationSetObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = ObservationSet_new,
+    .tp_init = (initproc) ObservationSet_init,
+    .tp_dealloc = (destructor) ObservationSet_dealloc,
+    .tp_methods = ObservationSet_methods,
+    .tp_members = ObservationSet_members,
+    .tp_getset = ObservationSet_getset,
+};
+
+// Emulator files, written by afterglowpy.emulator.writeEmulator().  A 192
+// byte header, a 32 byte record per axis, then the coefficients.
+#define EMU_HEADER 192
+#define EMU_DIM 32
+#define EMU_VERSION 1
+
+typedef struct
+{
+    PyObject_HEAD
+    char *map;
+    size_t size;
+    int ndim;
+    int npar;
+    int jet_type;
+    int spec_type;
+    double maxErr;
+    double rmsErr;
+    double logFmin;
+    double pars[17];
+    int *index;
+    int *n;
+    int *logScale;
+    double *lo;
+    double *hi;
+    const double *coef;
+} EmulatorObject;
+
+static void Emulator_unmap(EmulatorObject *self)
+{
+    if(self->map != NULL)
+    {
+#ifndef _WIN32
+        munmap(self->map, self->size);
+#else
+        free(self->map);
+#endif
+    }
+    free(self->index);
+    self->map = NULL;
+    self->size = 0;
+    self->index = NULL;
+    self->n = NULL;
+    self->logScale = NULL;
+    self->lo = NULL;
+    self->hi = NULL;
+    self->coef = NULL;
+    self->ndim = 0;
+    self->npar = 0;
+}
+
+static void Emulator_dealloc(EmulatorObject *self)
+{
+    Emulator_unmap(self);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *Emulator_new(PyTypeObject *type, PyObject *args,
+                                PyObject *kwargs)
+{
+    EmulatorObject *self = (EmulatorObject *) type->tp_alloc(type, 0);
+    if(self == NULL)
+        return NULL;
+
+    self->map = NULL;
+    self->size = 0;
+    self->index = NULL;
+    Emulator_unmap(self);
+
+    return (PyObject *) self;
+}
+
+static int Emulator_map(EmulatorObject *self, const char *filename)
+{
+    // Map filename read-only, the coefficients are used in place.
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < EMU_HEADER)
+    {
+        close(fd);
+        PyErr_SetString(PyExc_ValueError, "Not an emulator file.");
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd,
+                        0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+        return -1;
+    }
+    self->map = (char *) map;
+    self->size = (size_t) st.st_size;
+#else
+    FILE *f = fopen(filename, "rb");
+    if(f == NULL)
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    self->map = size >= EMU_HEADER ? (char *)malloc(size) : NULL;
+    if(self->map == NULL || fread(self->map, 1, size, f) != (size_t) size)
+    {
+        fclose(f);
+        free(self->map);
+        self->map = NULL;
+        PyErr_SetString(PyExc_ValueError, "Not an emulator file.");
+        return -1;
+    }
+    fclose(f);
+    self->size = (size_t) size;
+#endif
+    return 0;
+}
+
+static int Emulator_init(EmulatorObject *self, PyObject *args,
+                            PyObject *kwargs)
+{
+    const char *filename;
+    static char *kwlist[] = {"filename", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "s", kwlist, &filename))
+        return -1;
+
+    Emulator_unmap(self);
+    if(Emulator_map(self, filename) != 0)
+        return -1;
+
+    int head[4];
+    double err[3];
+    memcpy(head, self->map + 8, sizeof(head));
+    memcpy(err, self->map + 24, sizeof(err));
+    memcpy(self->pars, self->map + 56, sizeof(self->pars));
+    int ndim = head[1];
+
+    if(memcmp(self->map, "AGPYEMU", 8) != 0 || head[0] != EMU_VERSION
+            || ndim < 2 || self->size < EMU_HEADER + (size_t)ndim*EMU_DIM)
+    {
+        Emulator_unmap(self);
+        PyErr_SetString(PyExc_ValueError, "Not an emulator file.");
+        return -1;
+    }
+
+    self->index = (int *)malloc(3 * ndim * sizeof(int)
+                                + 2 * ndim * sizeof(double));
+    if(self->index == NULL)
+    {
+        Emulator_unmap(self);
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->n = self->index + ndim;
+    self->logScale = self->n + ndim;
+    self->lo = (double *)(self->logScale + ndim);
+    self->hi = self->lo + ndim;
+
+    int d;
+    int good = 1;
+    size_t ncoef = 1;
+    for(d=0; d<ndim; d++)
+    {
+        char *rec = self->map + EMU_HEADER + d*EMU_DIM;
+        int di[4];
+        memcpy(di, rec, sizeof(di));
+        memcpy(self->lo + d, rec + 16, sizeof(double));
+        memcpy(self->hi + d, rec + 24, sizeof(double));
+        self->index[d] = di[0];
+        self->n[d] = di[1];
+        self->logScale[d] = di[2];
+
+        if(di[1] < 1 || !(self->lo[d] < self->hi[d]))
+            good = 0;
+        else
+            ncoef *= di[1];
+        if(d < ndim-2 && (di[0] < 0 || di[0] > 13))
+            good = 0;
+    }
+    if(self->index[ndim-2] != -1 || self->index[ndim-1] != -2)
+        good = 0;
+
+    size_t offset = EMU_HEADER + (size_t)ndim*EMU_DIM;
+    if(!good || self->size != offset + ncoef*sizeof(double))
+    {
+        Emulator_unmap(self);
+        PyErr_SetString(PyExc_ValueError, "Not an emulator file.");
+        return -1;
+    }
+
+    self->ndim = ndim;
+    self->npar = ndim-2;
+    self->jet_type = head[2];
+    self->spec_type = head[3];
+    self->maxErr = err[0];
+    self->rmsErr = err[1];
+    self->logFmin = err[2];
+    self->coef = (const double *)(self->map + offset);
+
+    return 0;
+}
+
+static double Emulator_x(EmulatorObject *self, int d, double v)
+{
+    // v mapped to [-1, 1] along axis d, or nan if out of range.
+    double u = self->logScale[d] ? log10(v) : v;
+    double x = (2*u - (self->lo[d] + self->hi[d]))
+                / (self->hi[d] - self->lo[d]);
+    if(!(fabs(x) <= 1.0 + 1.0e-12))
+        return NAN;
+    return x;
+}
+
+static void chebT(double x, int n, double *T)
+{
+    int k;
+    T[0] = 1.0;
+    if(n > 1)
+        T[1] = x;
+    for(k=2; k<n; k++)
+        T[k] = 2*x*T[k-1] - T[k-2];
+}
+
+static void Emulator_eval(EmulatorObject *self, double *par, double *t,
+                            double *nu, int N, double *F, double *work)
+{
+    // F at the N points (t, nu) for the parameters par.  The parameter
+    // axes are summed first, leaving a small series in log t and log nu.
+    // work must hold maxn + n[nu] + 2*(size of coef)/n[0] doubles, maxn
+    // the largest n[d], see Emulator_flux().  The first maxn + n[nu]
+    // hold the T_k(x) of one axis, or of both t and nu at the end.
+    int i, j, k, d;
+    int npar = self->npar;
+    int nt = self->n[npar];
+    int nnu = self->n[npar+1];
+    double *T = work;
+    double *buf[2];
+    int maxn = 0;
+    size_t M = 1;
+    for(d=0; d<self->ndim; d++)
+    {
+        M *= self->n[d];
+        if(self->n[d] > maxn)
+            maxn = self->n[d];
+    }
+    buf[0] = T + maxn + nnu;
+    buf[1] = buf[0] + M / self->n[0];
+
+    const double *a = self->coef;
+    for(d=0; d<npar; d++)
+    {
+        double x = Emulator_x(self, d, par[d]);
+        if(x != x)
+        {
+            for(i=0; i<N; i++)
+                F[i] = NAN;
+            return;
+        }
+        chebT(x, self->n[d], T);
+        M /= self->n[d];
+        double *b = buf[d%2];
+        size_t m;
+        for(m=0; m<M; m++)
+            b[m] = T[0] * a[m];
+        for(k=1; k<self->n[d]; k++)
+            for(m=0; m<M; m++)
+                b[m] += T[k] * a[k*M+m];
+        a = b;
+    }
+
+    double *Tnu = T + nt;
+    for(i=0; i<N; i++)
+    {
+        double xt = Emulator_x(self, npar, t[i]);
+        double xnu = Emulator_x(self, npar+1, nu[i]);
+        if(xt != xt || xnu != xnu)
+        {
+            F[i] = NAN;
+            continue;
+        }
+        chebT(xt, nt, T);
+        chebT(xnu, nnu, Tnu);
+        double logF = 0.0;
+        for(j=0; j<nt; j++)
+        {
+            double s = 0.0;
+            for(k=0; k<nnu; k++)
+                s += a[j*nnu+k] * Tnu[k];
+            logF += T[j] * s;
+        }
+        F[i] = pow(10.0, logF);
+    }
+}
+
+static PyObject *Emulator_flux(EmulatorObject *self, PyObject *args,
+                                PyObject *kwargs)
+{
+    PyObject *t_obj = NULL;
+    PyObject *nu_obj = NULL;
+    PyObject *pars_obj = NULL;
+    PyObject *out_obj = NULL;
+    static char *kwlist[] = {"t", "nu", "pars", "out", NULL};
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|O", kwlist, &t_obj,
+                                    &nu_obj, &pars_obj, &out_obj))
+        return NULL;
+
+    if(self->coef == NULL)
+    {
+        PyErr_SetString(PyExc_RuntimeError, "Emulator is not loaded.");
+        return NULL;
+    }
+
+    PyArrayObject *t_arr = readArray(t_obj);
+    PyArrayObject *nu_arr = readArray(nu_obj);
+    PyArrayObject *pars_arr = (PyArrayObject *) PyArray_FROM_OTF(pars_obj,
+                                        NPY_DOUBLE, NPY_ARRAY_IN_ARRAY);
+    if(t_arr == NULL || nu_arr == NULL || pars_arr == NULL)
+    {
+        Py_XDECREF(t_arr);
+        Py_XDECREF(nu_arr);
+        Py_XDECREF(pars_arr);
+        return NULL;
+    }
+
+    int N = (int)PyArray_DIM(t_arr, 0);
+    int pdim = PyArray_NDIM(pars_arr);
+    int batch = pdim == 2;
+    int B = batch ? (int)PyArray_DIM(pars_arr, 0) : 1;
+    if(N != (int)PyArray_DIM(nu_arr, 0) || (pdim != 1 && pdim != 2)
+            || (int)PyArray_DIM(pars_arr, pdim-1) != self->npar)
+    {
+        PyErr_Format(PyExc_ValueError, "t and nu must have the same length, "
+                        "pars must be a vector (or 2-D array of vectors) of "
+                        "the %d emulated parameters.", self->npar);
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_DECREF(pars_arr);
+        return NULL;
+    }
+
+    npy_intp dims[2] = {B, N};
+    PyArrayObject *out_arr;
+    if(out_obj != NULL && out_obj != Py_None)
+        out_arr = readOutArray(out_obj, batch ? 2 : 1, batch ? dims : dims+1);
+    else
+        out_arr = (PyArrayObject *) PyArray_SimpleNew(batch ? 2 : 1,
+                                            batch ? dims : dims+1, NPY_DOUBLE);
+    if(out_arr == NULL)
+    {
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_DECREF(pars_arr);
+        return NULL;
+    }
+
+    // Staged (contiguous) inputs, the output, and the work space.
+    int d;
+    size_t M = 1;
+    int maxn = 0;
+    for(d=0; d<self->ndim; d++)
+    {
+        M *= self->n[d];
+        if(self->n[d] > maxn)
+            maxn = self->n[d];
+    }
+    size_t nwork = 2*N + (size_t)B*N + maxn + self->n[self->ndim-1]
+                    + 2*(M / self->n[0]);
+    double *work = (double *)malloc(nwork * sizeof(double));
+    if(work == NULL)
+    {
+        Py_DECREF(t_arr);
+        Py_DECREF(nu_arr);
+        Py_DECREF(pars_arr);
+        Py_DECREF(out_arr);
+        return PyErr_NoMemory();
+    }
+    double *t = stageArray(t_arr, 1.0, 1.0, work);
+    double *nu = stageArray(nu_arr, 1.0, 1.0, work + N);
+    double *F = work + 2*N;
+    double *pars = (double *)PyArray_DATA(pars_arr);
+
+    int b;
+    for(b=0; b<B; b++)
+        Emulator_eval(self, pars + b*self->npar, t, nu, N, F + b*N,
+                        F + B*N);
+
+    writeOutArray(F, out_arr, 1.0);
+
+    free(work);
+    Py_DECREF(t_arr);
+    Py_DECREF(nu_arr);
+    Py_DECREF(pars_arr);
+
+    return (PyObject *) out_arr;
+}
+
+static PyObject *Emulator_tuple(EmulatorObject *self, void *closure)
+{
+    // The per-axis (or, for pars, per-parameter) arrays as tuples.
+    const char *which = (const char *) closure;
+    int d;
+    int n = self->ndim;
+    if(strcmp(which, "pars") == 0)
+        n = 17;
+    else if(strcmp(which, "parIndex") == 0)
+        n = self->npar;
+    PyObject *tup = PyTuple_New(n);
+    if(tup == NULL)
+        return NULL;
+    for(d=0; d<n; d++)
+    {
+        PyObject *v;
+        if(strcmp(which, "pars") == 0)
+            v = PyFloat_FromDouble(self->pars[d]);
+        else if(strcmp(which, "parIndex") == 0)
+            v = PyLong_FromLong(self->index[d]);
+        else if(strcmp(which, "shape") == 0)
+            v = PyLong_FromLong(self->n[d]);
+        else if(strcmp(which, "logScale") == 0)
+            v = PyBool_FromLong(self->logScale[d]);
+        else if(strcmp(which, "lo") == 0)
+            v = PyFloat_FromDouble(self->lo[d]);
+        else
+            v = PyFloat_FromDouble(self->hi[d]);
+        PyTuple_SET_ITEM(tup, d, v);
+    }
+    return tup;
+}
+
+static PyMethodDef Emulator_methods[] = {
+    {"flux", (PyCFunction)Emulator_flux, METH_VARARGS|METH_KEYWORDS,
+        Emulator_flux_docstring},
+    {NULL, NULL, 0, NULL}};
+
+static PyMemberDef Emulator_members[] = {
+    {"jetType", T_INT, offsetof(EmulatorObject, jet_type), READONLY,
+        "Jet type the emulator was built for."},
+    {"specType", T_INT, offsetof(EmulatorObject, spec_type), READONLY,
+        "Spectrum type the emulator was built for."},
+    {"maxErr", T_DOUBLE, offsetof(EmulatorObject, maxErr), READONLY,
+        "Maximum relative error found when building."},
+    {"rmsErr", T_DOUBLE, offsetof(EmulatorObject, rmsErr), READONLY,
+        "RMS relative error found when building."},
+    {"logFmin", T_DOUBLE, offsetof(EmulatorObject, logFmin), READONLY,
+        "log10 of the flux floor."},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyGetSetDef Emulator_getset[] = {
+    {"pars", (getter)Emulator_tuple, NULL,
+        "Jet parameters the emulator was built with.", "pars"},
+    {"parIndex", (getter)Emulator_tuple, NULL,
+        "Index in pars of each emulated parameter.", "parIndex"},
+    {"shape", (getter)Emulator_tuple, NULL,
+        "Number of Chebyshev nodes along each axis.", "shape"},
+    {"logScale", (getter)Emulator_tuple, NULL,
+        "Whether each axis is sampled in log10.", "logScale"},
+    {"lo", (getter)Emulator_tuple, NULL,
+        "Lower end of each axis (log10 if logScale).", "lo"},
+    {"hi", (getter)Emulator_tuple, NULL,
+        "Upper end of each axis (log10 if logScale).", "hi"},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyTypeObject EmulatorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "afterglowpy.jet.Emulator",
+    .tp_doc = Emulator_docstring,
+    .tp_basicsize = sizeof(EmulatorObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = Emulator_new,
+    .tp_init = (initproc) Emulator_init,
+    .tp_dealloc = (destructor) Emulator_dealloc,
+    .tp_methods = Emulator_methods,
+    .tp_members = Emulator_members,
+    .tp_getset = Emulator_getset,
+};
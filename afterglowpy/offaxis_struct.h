@@ -5,6 +5,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
 #ifdef USEGSL
 #include <gsl/gsl_errno.h>
@@ -36,6 +38,7 @@
 #define day2sec     86400           // quantity in days to seconds
 #define parsec      3.0857e18       // quantity in parsec to cm
 #define Hz2eV       4.13566553853599E-15
+#define Msun        1.98892e33      // solar mass in g
 #define eV2Hz       2.417991e+14
 
 #define _cone -2
@@ -43,6 +46,7 @@
 #define _Gaussian 0
 #define _powerlaw_core 1 //has a core as well
 #define _Gaussian_core 2 // has a core as well
+#define _cocoon 3
 #define _powerlaw 4
 #define _exponential 5
 #define _twocomponent 6
@@ -51,6 +55,215 @@
 #define R_ACC 1.0e-6
 #define THETA_ACC 1.0e-6
 #define PHI_ACC 1.0e-6
+// Cones whose nearest point is more than GAUSS_OFFBEAM beaming angles from
+// the line of sight are first tried with low order Gauss-Legendre rules.
+#define GAUSS_OFFBEAM 10.0
+#define GAUSS_NODES 4
+// The theta integrals are split at the kinks of the integrand along the
+// equal arrival time surface, found from MU_BREAK_SAMPLES samples of the
+// tables, see make_mu_breaks().  The cocoon's are also split at up to
+// THETA_BREAKS kinks of its tables, see lc_plan_cocoon().
+#define THETA_BREAKS 8
+#define MU_BREAK_SAMPLES 8
+// Images start from this many tiles in phi (over [0, pi]) and theta per
+// cone, each refined at most IMAGE_LEVELS times.
+#define IMAGE_TILES_PHI 16
+#define IMAGE_TILES_THETA 2
+#define IMAGE_LEVELS 10
+
+// Number of parameters (p, epsilon_e, epsilon_B, ksi_N) whose flux
+// derivatives can be carried along with the flux integration.
+#define N_GRAD 4
+
+// Flux-weighted sky-plane moments (x, x^2, y^2) that can be carried along
+// with the flux integration, see lc_jet_moments().
+#define N_MOM 3
+
+// Everything a blast wave solution depends on.  Without energy injection
+// the solution for E_iso and n_0 is a rescaling of the one for any other
+// E_iso/n_0, so those only need to match if L0 > 0.
+struct dynKey
+{
+    double theta_h;
+    double theta_core;
+    double theta_core_global;
+    double g_init;
+    double L0;
+    double q;
+    double ts;
+    double E_iso;
+    double n_0;
+    double tRes;
+    double spread;
+};
+
+// A blast wave solution computed by make_R_table(), kept for reuse.
+struct coneTable
+{
+    struct dynKey key;
+
+    double E_iso;
+    double theta_h;
+    double Rt0;
+    double Rt1;
+
+    double *t_table;
+    double *R_table;
+    double *u_table;
+    double *th_table;
+    int table_entries;
+};
+
+// Store of blast wave solutions for a fixed set of jet parameters.  Only
+// valid as long as n_0, L0, q, ts, g0, spread, etc. do not change.
+struct tableCache
+{
+    struct coneTable *tables;
+    int n;
+    int size;
+};
+
+// On-disk library of blast wave solutions, see dynLibrary_write().  The
+// file is a 64 byte header (magic, version, record count, checksum of
+// everything after the header, file size), the records, then the t, R, u,
+// and th tables of each record.
+#define DYNLIB_VERSION 1
+#define DYNLIB_HEADER 64
+
+struct dynRecord
+{
+    struct dynKey key;
+    double t0;
+    double t1;
+    int64_t offset;
+    int64_t N;
+};
+
+struct dynLibrary
+{
+    char *map;
+    size_t size;
+    int n;
+    const struct dynRecord *rec;
+};
+
+// Requested (t, nu) points sorted by time, with exact duplicates removed
+// and equal times grouped together.  Group i has time t[i] and frequencies
+// nu[start[i]] ... nu[start[i+1]-1].  Requested point j is nu[index[j]].
+// A grid plan, see make_obsPlan_grid(), instead has the same Nnu
+// frequencies nu[0] ... nu[Nnu-1] in every group, see obsPlan_nu().
+struct obsPlan
+{
+    int N;
+    int Nu;
+    int Ng;
+    double *t;
+    int *start;
+    double *nu;
+    int *index;
+    int Nnu;
+};
+
+// Observations to compare a model against, and the running chi^2.  The
+// observations of unique plan point j are obs[obs_start[j]] ...
+// obs[obs_start[j+1]-1].
+struct chi2Data
+{
+    int N;
+    double *Fobs;
+    double *Ferr;
+    int *ul;
+    double fac;
+    double chi2_max;
+    double chi2;
+    int stopped;
+
+    double *contrib;
+    int *obs_start;
+    int *obs;
+};
+
+// Work counters, accumulated over calls by the objects that own them.
+// A (cone, time) pair is pruned when flux_bound() shows it is below its
+// share of the tolerance, and integrated otherwise.
+struct fluxStats
+{
+    long cones_integrated;
+    long cones_gauss;
+    long cones_pruned;
+};
+
+// Problems met during a calculation, recorded here instead of printed.
+// Errors mean the result can not be trusted, warnings flag suspicious
+// values (eg. a negative flux) that were carried on with.  Only the
+// first DIAG_MSGS of them are described, the rest are just counted.
+#define DIAG_MSGS 4
+#define DIAG_LEN 256
+struct fluxDiag
+{
+    long errors;
+    long warnings;
+    int n_msg;
+    int msg_error[DIAG_MSGS];
+    char msg[DIAG_MSGS][DIAG_LEN];
+};
+
+// Scratch space for the integrators, handed out and given back in stack
+// order: work_push() returns n doubles, work_pop() gives back everything
+// pushed since the matching work_mark().  Blocks are never moved, each
+// new one is at least twice the last, and they are kept until
+// free_fluxParams(), so the integration loops stop allocating once the
+// stack has grown to the depth they need.
+#define WORK_BLOCKS 32
+#define WORK_MIN 4096
+struct workStack
+{
+    double *block[WORK_BLOCKS];
+    size_t size[WORK_BLOCKS];
+    int cur;        // block being handed out
+    size_t used;    //   and the doubles of it in use
+};
+
+struct workMark
+{
+    int cur;
+    size_t used;
+};
+
+// Index of the emission mask boxes.  They are sorted once by their lower
+// phi bound.  At each phi, those that can hold a point of the current
+// theta extent (jet and counter-jet) are bucketed by theta, latest box
+// first, so mask_factor() only tests one bucket.  See mask_select().
+#define MASK_BUCKETS 16
+struct maskIndex
+{
+    int *order;         // box indices by increasing lower phi bound
+    double *phi_lo;     //   and those bounds
+    int *cand;          // scratch, nmask entries
+    int *box;           // bucket contents
+    int cap;            //   and their capacity
+    int n_range;        // theta ranges bucketed, 0 if not selected
+    double th_lo[2];
+    double th_hi[2];
+    double inv_dth[2];
+    int start[2][MASK_BUCKETS+1];   // bucket b of range r is
+};                                  //   box[start[r][b]..start[r][b+1]-1]
+
+struct obsPoint
+{
+    double t;
+    double nu;
+    int i;
+};
+
+// One cone of an adaptive decomposition, see lc_plan_adaptive().
+struct coneSlice
+{
+    double theta_lo;
+    double theta_hi;
+    double E_iso;
+    double est;     // estimated contribution at the current time
+};
 
 struct fluxParams
 {
@@ -129,10 +342,49 @@ struct fluxParams
 
     double *mask;
     int nmask;
+    struct maskIndex mask_idx;
+
+    double *nu_grid;
+    int n_nu;
+    int n_grad;
+    int n_mom;          // moment blocks, after the derivatives
+    int res_cones;  // if > 0, overrides the cone count from latRes
+
+    int counter_jet;    // include the counter-jet
+    int theta_nodes;    // if > 0, Gauss-Legendre points per theta integral
+    int gauss_tries;    // off-beam cones tried with flux_grid_gauss()
+    int gauss_hits;     //   and the number accepted
+    int cone_adapt;     // adaptive cone decomposition, see lc_plan_adaptive()
+    double theta_jet_0; // polar extent of the jet and counter-jet along
+    double theta_jet_1; //   the current phi, for the fused integrand
+    double theta_cj_0;
+    double theta_cj_1;
+    double *cj_buf;
+    struct workStack work;  // integrator scratch, see work_push()
+    double *mu_breaks;  // kinks of the integrand in mu,
+    int n_mu_breaks;    //   or -1 if not located yet,
+    int mu_breaks_cap;  //   and the room for them
+    void (*theta_grid)(double, double *, void *);  // specialized integrands,
+    void (*theta_fused)(double, double *, void *); //   see select_integrands()
+
+    struct fluxDiag diag;
+
+    struct chi2Data *chi2;
+    struct fluxStats *stats;
+    struct tableCache *cache;
+    struct dynLibrary *lib;
 };
 
 
 double dmin(const double a, const double b);
+void diag_clear(struct fluxDiag *diag);
+void diag_error(struct fluxDiag *diag, const char *fmt, ...);
+void diag_warning(struct fluxDiag *diag, const char *fmt, ...);
+void work_init(struct workStack *ws);
+void work_free(struct workStack *ws);
+double *work_push(struct workStack *ws, size_t n);
+struct workMark work_mark(struct workStack *ws);
+void work_pop(struct workStack *ws, struct workMark mark);
 
 
 double f_E_tophat(double theta, void *params);
@@ -147,7 +399,31 @@ double f_Etot_powerlaw(void *params);
 double get_lfacbetashocksqrd(double a_t_e, double C_BMsqrd, double C_STsqrd);
 double get_lfacbetasqrd(double a_t_e, double C_BMsqrd, double C_STsqrd);
 double Rintegrand(double a_t_e, void* params);
+void shift_R_tables(struct fluxParams *pars, int table_entries);
+int R_table_entries(struct fluxParams *pars);
+void R_table_start(struct fluxParams *pars, double *t_table, int N,
+                    double *args, double *R0, double *u0);
 void make_R_table(struct fluxParams *pars);
+void make_R_tables(struct fluxParams *pars, struct coneSlice *cones, int n);
+void make_R_table_cocoon(struct fluxParams *pars);
+int load_R_table(struct fluxParams *pars, struct tableCache *cache);
+void store_R_table(struct fluxParams *pars, struct tableCache *cache);
+struct coneTable *tableCache_find(struct tableCache *cache,
+                                    struct fluxParams *pars);
+struct coneTable *tableCache_add(struct tableCache *cache,
+                                    struct fluxParams *pars, int N);
+void tableCache_init(struct tableCache *cache);
+void tableCache_clear(struct tableCache *cache);
+void tableCache_free(struct tableCache *cache);
+void dynKey_set(struct dynKey *key, struct fluxParams *pars);
+int dynKey_match(const struct dynKey *a, const struct dynKey *b, int exact);
+int dynLibrary_write(const char *filename, struct tableCache *cache);
+int dynLibrary_open(struct dynLibrary *lib, const char *filename,
+                        int verify);
+void dynLibrary_close(struct dynLibrary *lib);
+void set_default_dynLibrary(struct dynLibrary *lib);
+int find_R_library(struct fluxParams *pars, struct dynLibrary *lib, double *s);
+int load_R_library(struct fluxParams *pars, struct dynLibrary *lib);
 void make_mu_table(struct fluxParams *pars);
 double check_t_e(double t_e, double mu, double t_obs, double *mu_table, int N);
 int searchSorted(double x, double *arr, int N);
@@ -155,8 +431,24 @@ double interpolateLin(int a, int b, double x, double *X, double *Y, int N);
 double interpolateLog(int a, int b, double x, double *X, double *Y, int N);
 double find_jet_edge(double phi, double cto, double sto, double theta0,
                      double *a_mu, double *a_thj, int N);
+void shock_state(double mu, struct fluxParams *pars, double *t_e_out,
+                    double *R_out, double *u_out, double *us_out);
+void shock_geom(double a_theta, struct fluxParams *pars, double *mu_out,
+                double *t_e_out, double *R_out, double *u_out, double *us_out);
+void mask_index_build(struct fluxParams *pars);
+void mask_index_free(struct fluxParams *pars);
+void mask_select(struct fluxParams *pars, double theta_0, double theta_1,
+                    double theta_cj_0, double theta_cj_1);
+double mask_factor(double a_theta, double t_e, double R,
+                    struct fluxParams *pars);
+void phi_theta_bounds(double a_phi, double cto, struct fluxParams *pars,
+                        double *theta_0_out, double *theta_1_out);
 double theta_integrand(double a_theta, void* params); // inner integral
 double phi_integrand(double a_phi, void* params); // outer integral
+void theta_integrand_grid(double a_theta, double *dFnu, void* params);
+void phi_integrand_grid(double a_phi, double *result, void* params);
+void theta_integrand_fused(double x, double *dFnu, void* params);
+void select_integrands(struct fluxParams *pars);
 void theta_integrand_vec(double theta, double *Fnu, double *t, double *nu,
                             int Nt, void* params);
 double phi_integrand_vec(double phi, void* params);
@@ -164,11 +456,31 @@ double emissivity(double nu, double R, double sinTheta, double mu, double te,
                     double u, double us, double n0, double p, double epse,
                     double epsB, double ksiN, int specType); //emissivity of
                                                              // a zone.
+void emissivity_spec(double *nu, double *em_nu, int Nnu, double R,
+                    double sinTheta, double mu, double te, double u,
+                    double us, double n0, double p, double epse,
+                    double epsB, double ksiN, int specType, double *dem,
+                    struct fluxDiag *diag);
 double flux(struct fluxParams *pars, double atol); // determine flux for a given t_obs
+void cone_extent(struct fluxParams *pars, double cto, double *theta_lo_out,
+                    double *theta_max_out);
+double cone_offbeam(struct fluxParams *pars, double cto);
+double cone_axisym(struct fluxParams *pars, double limit);
+int flux_bound(struct fluxParams *pars, double cto, double *limit,
+                double *bound);
+int flux_grid_gauss(struct fluxParams *pars, double *atol, double *F);
+int flux_grid_axisym(struct fluxParams *pars, double *atol, double *F);
+void make_mu_breaks(struct fluxParams *pars);
+int theta_breaks(struct fluxParams *pars, double cto, double theta_0,
+                    double theta_1, double *theta);
+void flux_grid(struct fluxParams *pars, double *atol, double *F);
 
 double flux_cone(double t_obs, double nu_obs, double E_iso, double theta_h,
                     double theta_cone_low, double theta_cone_hi,
                     double atol, struct fluxParams *pars);
+void flux_cone_grid(double t_obs, double *nu_obs, int Nnu, double *F,
+                    double theta_cone_low, double theta_cone_hi, double *atol,
+                    struct fluxParams *pars);
 double intensity(double theta, double phi, double tobs, double nuobs,
                 double theta_obs, double theta_cone_hi, double theta_cone_low,
                 struct fluxParams *pars);
@@ -236,6 +548,56 @@ void lc_vec(double *t, double *nu, double *Fnu, int Nt, double E_iso_core,
             double theta_core, double theta_wing, int Ntheta, 
             double (*f_E)(double, void *), double (*f_Etot)(void *), 
             struct fluxParams *pars);
+void lc_jet(int jet_type, double *t, double *nu, double *Fnu, int N,
+            int latRes, struct fluxParams *pars);
+int obsPoint_cmp(const void *a, const void *b);
+void make_obsPlan(struct obsPlan *plan, double *t, double *nu, int N);
+void make_obsPlan_grid(struct obsPlan *plan, double *t, int Nt, double *nu,
+                        int Nnu);
+double *obsPlan_nu(struct obsPlan *plan, int g);
+void free_obsPlan(struct obsPlan *plan);
+void lc_plan_cone(struct obsPlan *plan, double *F,
+                    double theta_cone_low, double theta_cone_hi,
+                    int res_cones, struct fluxParams *pars);
+void cocoon_integrand_grid(double a_theta, double *dP, void *params);
+void lc_plan_cocoon(struct obsPlan *plan, double *F, struct fluxParams *pars);
+int make_cone_slices(struct coneSlice *cones, int max_cones, double theta_0,
+                        double theta_1, int latRes,
+                        double (*f_E)(double, void *),
+                        struct fluxParams *pars);
+void lc_plan_adaptive(struct obsPlan *plan, double *F, struct coneSlice *cones,
+                        int n_cones, struct fluxParams *pars);
+int jet_cones(int jet_type, int latRes, struct fluxParams *pars,
+                struct coneSlice **cones_out, int *n_core_out);
+int lc_plan(int jet_type, struct obsPlan *plan, double *F, int latRes,
+                struct fluxParams *pars);
+void lc_jet_plan(int jet_type, struct obsPlan *plan, double *t, double *nu,
+                    double *Fnu, int latRes, struct fluxParams *pars);
+int lc_jet_grad(int jet_type, struct obsPlan *plan, double *Fnu,
+                    double *dFnu, int latRes, struct fluxParams *pars);
+int lc_jet_moments(int jet_type, struct obsPlan *plan, double *Fnu,
+                    double *mom, int latRes, struct fluxParams *pars);
+void setup_chi2Data(struct chi2Data *cd, struct obsPlan *plan, double *Fobs,
+                    double *Ferr, int *ul, double fac, double chi2_max);
+void reset_chi2Data(struct chi2Data *cd);
+void free_chi2Data(struct chi2Data *cd);
+double chi2_point(double F, double Fobs, double Ferr, int ul);
+int chi2_update(struct chi2Data *cd, double *F, int a, int b);
+double lc_jet_chi2(int jet_type, struct obsPlan *plan, double *t, double *nu,
+                    double *Fnu, struct chi2Data *cd, int latRes,
+                    struct fluxParams *pars);
+void lc_jet_points(int jet_type, double *t, double *nu, double *Fnu, int N,
+                    int latRes, struct fluxParams *pars);
+void lc_jet_grid(int jet_type, double *t, int Nt, double *nu, int Nnu,
+                    double *Fnu, int latRes, struct fluxParams *pars);
+void intensity_jet(int jet_type, double *theta, double *phi, double *t,
+                    double *nu, double *Inu, int N, int latRes,
+                    struct fluxParams *pars);
+int image_jet(int jet_type, double *x, int Nx, double *y, int Ny, double t,
+                double nu, double *img, int latRes, struct fluxParams *pars);
+void shockVals_jet(int jet_type, double *theta, double *phi, double *tobs,
+                    double *t, double *R, double *u, double *thj, int N,
+                    int latRes, struct fluxParams *pars);
 void calc_flux_density(int jet_type, int spec_type, 
                             double *t, double *nu, double *Fnu, int N,
                             double theta_obs, double E_iso_core,
@@ -247,7 +609,23 @@ void calc_flux_density(int jet_type, int spec_type,
                             double theta_h_core_global,
                             int tRes, int latRes, double rtol,
                             double *mask, int nmask, int spread,
-                            int gamma_type);
+                            int gamma_type, int counterjet,
+                            int adaptive, double *mom,
+                            struct fluxDiag *diag);
+void calc_flux_density_grid(int jet_type, int spec_type, 
+                            double *t, int Nt, double *nu, int Nnu,
+                            double *Fnu,
+                            double theta_obs, double E_iso_core,
+                            double theta_h_core, double theta_h_wing, 
+                            double b, double L0, double q, double ts, 
+                            double n_0, double p, double epsilon_E,
+                            double epsilon_B, double ksi_N, double d_L,
+                            double g0, double E_core_global,
+                            double theta_h_core_global,
+                            int tRes, int latRes, double rtol,
+                            double *mask, int nmask, int spread,
+                            int gamma_type, int counterjet,
+                            int adaptive, struct fluxDiag *diag);
 void calc_intensity(int jet_type, int spec_type, double *theta, double *phi,
                             double *t, double *nu, double *Inu, int N,
                             double theta_obs, double E_iso_core,
@@ -258,7 +636,8 @@ void calc_intensity(int jet_type, int spec_type, double *theta, double *phi,
                             double g0, double E_core_global,
                             double theta_h_core_global,
                             int tRes, int latRes, double rtol, double *mask,
-                            int nmask, int spread, int gamma_type);
+                            int nmask, int spread, int gamma_type,
+                            struct fluxDiag *diag);
 void calc_shockVals(int jet_type, double *theta, double *phi, double *tobs,
                             double *t, double *R, double *u, double *thj, int N,
                             double theta_obs, double E_iso_core,
@@ -269,7 +648,8 @@ void calc_shockVals(int jet_type, double *theta, double *phi, double *tobs,
                             double g0, double E_core_global,
                             double theta_h_core_global,
                             int tRes, int latRes, double rtol, double *mask,
-                            int nmask, int spread, int gamma_type);
+                            int nmask, int spread, int gamma_type,
+                            struct fluxDiag *diag);
 
 void setup_fluxParams(struct fluxParams *pars,
                     double d_L,
@@ -287,6 +667,7 @@ void setup_fluxParams(struct fluxParams *pars,
                     double ta, double tb, double tRes,
                     int spec_type, double flux_rtol,
                     double *mask, int nmask, int spread, int gammaType);
+void set_jet_cone(struct fluxParams *pars, double E_iso, double theta_h);
 void set_jet_params(struct fluxParams *pars, double E_iso, double theta_h);
 void set_obs_params(struct fluxParams *pars, double t_obs, double nu_obs,
                         double theta_obs_cur, double current_theta_cone_hi, 
@@ -1,5 +1,12 @@
+#include <stdarg.h>
 #include "offaxis_struct.h"
 #include "shockEvolution.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 double dmin(const double a, const double b)
 {
@@ -8,6 +15,102 @@ double dmin(const double a, const double b)
     else
         return b;
 }
+
+static void diag_record(struct fluxDiag *diag, int error, const char *fmt,
+                        va_list ap)
+{
+    if(diag->n_msg < DIAG_MSGS)
+    {
+        diag->msg_error[diag->n_msg] = error;
+        vsnprintf(diag->msg[diag->n_msg], DIAG_LEN, fmt, ap);
+        diag->n_msg++;
+    }
+}
+
+void diag_clear(struct fluxDiag *diag)
+{
+    diag->errors = 0;
+    diag->warnings = 0;
+    diag->n_msg = 0;
+}
+
+void diag_error(struct fluxDiag *diag, const char *fmt, ...)
+{
+    if(diag == NULL)
+        return;
+    diag->errors++;
+    va_list ap;
+    va_start(ap, fmt);
+    diag_record(diag, 1, fmt, ap);
+    va_end(ap);
+}
+
+void diag_warning(struct fluxDiag *diag, const char *fmt, ...)
+{
+    if(diag == NULL)
+        return;
+    diag->warnings++;
+    va_list ap;
+    va_start(ap, fmt);
+    diag_record(diag, 0, fmt, ap);
+    va_end(ap);
+}
+
+void work_init(struct workStack *ws)
+{
+    memset(ws, 0, sizeof(struct workStack));
+}
+
+void work_free(struct workStack *ws)
+{
+    int b;
+    for(b=0; b<WORK_BLOCKS; b++)
+        free(ws->block[b]);
+    work_init(ws);
+}
+
+double *work_push(struct workStack *ws, size_t n)
+{
+    // n doubles of scratch, valid until an earlier mark is popped.  A block
+    // with nothing in use that is too small is replaced by a larger one.
+    while(1)
+    {
+        int b = ws->cur;
+        if(ws->used == 0 && ws->size[b] < n)
+        {
+            size_t size = b > 0 ? 2*ws->size[b-1] : WORK_MIN;
+            if(size < n)
+                size = n;
+            free(ws->block[b]);
+            ws->block[b] = (double *)malloc(size * sizeof(double));
+            ws->size[b] = ws->block[b] == NULL ? 0 : size;
+            if(ws->block[b] == NULL)
+                return NULL;
+        }
+        if(ws->used + n <= ws->size[b])
+            break;
+        if(b == WORK_BLOCKS-1)
+            return NULL;
+        ws->cur++;
+        ws->used = 0;
+    }
+
+    double *x = ws->block[ws->cur] + ws->used;
+    ws->used += n;
+    return x;
+}
+
+struct workMark work_mark(struct workStack *ws)
+{
+    struct workMark mark = {ws->cur, ws->used};
+    return mark;
+}
+
+void work_pop(struct workStack *ws, struct workMark mark)
+{
+    ws->cur = mark.cur;
+    ws->used = mark.used;
+}
  
 /////////////////////////////////////////////////////////////////////////
 
@@ -162,17 +265,15 @@ double get_lfacbetasqrd(double a_t_e, double C_BMsqrd, double C_STsqrd)
 
 double check_t_e(double t_e, double mu, double t_obs, double *mu_table, int N)
 {
+    // -1 if mu is outside the table, the callers report it.
     if(mu > mu_table[N-1])
     {
-        printf("mu >> 1? this should not have happened\n");
-        printf("   t_obs=%.6lg t_e=%.6lg mu=%.6lg mu_table[-1]=%.6lg\n",
-                t_obs, t_e, mu, mu_table[N-1]);
+        //mu >> 1? this should not have happened
         return -1;
     }
 
     if(mu_table[0] >= mu) // happens only if t_e very small
     {
-        printf("very small mu: mu=%.3lg, mu[0]=%.3lg\n", mu, mu_table[0]);
         //return t_obs / (1.0 - mu); // so return small t_e limit
         return -1;
     }
@@ -324,13 +425,9 @@ void make_R_tableInterp(struct fluxParams *pars)
     Rp = R; tp = t;
 
     if(R_table[0] != R_table[0])
-    {
-        printf("Rintegration Error: R[0]=%.3e  (fac0=%.3e)\n", 
-                                    R_table[0], fac0);
-        printf("    t=%.3e Rdot=%.3e t=%.3e Rdot=%.3e\n",
-                    0.0,Rintegrand(0.0,Rpar), t_table[0], 
-                    Rintegrand(t_table[0],Rpar));
-    }
+        diag_warning(&(pars->diag), "Rintegration Error: R[0]=%.3e (fac0=%.3e)"
+                    " t=%.3e Rdot=%.3e", R_table[0], fac0, t_table[0],
+                    Rintegrand(t_table[0], Rpar));
 
     // free memory for integration routine
 #ifdef USEGSL
@@ -338,12 +435,10 @@ void make_R_tableInterp(struct fluxParams *pars)
 #endif
 }
 
-void make_R_table(struct fluxParams *pars)
+void shift_R_tables(struct fluxParams *pars, int table_entries)
 {
-    int tRes = pars->tRes;
-    double Rt0 = pars->Rt0;
-    double Rt1 = pars->Rt1;
-    int table_entries = (int)(tRes * log10(Rt1/Rt0));
+    // Current tables become the inner tables, the old inner tables are
+    // recycled to hold the next solution.
     double *temp;
 
     pars->table_entries_inner = pars->table_entries;
@@ -364,22 +459,32 @@ void make_R_table(struct fluxParams *pars)
     temp = pars->mu_table_inner;
     pars->mu_table_inner = pars->mu_table;
     pars->mu_table = (double *)realloc(temp, sizeof(double) * table_entries);
+}
 
-    double *t_table = pars->t_table;
-    double *R_table = pars->R_table;
-    double *u_table = pars->u_table;
-    double *th_table = pars->th_table;
+int R_table_entries(struct fluxParams *pars)
+{
+    return (int)(pars->tRes * log10(pars->Rt1/pars->Rt0));
+}
 
-    double fac = pow(Rt1/Rt0, 1.0/(table_entries-1.0));
+void R_table_start(struct fluxParams *pars, double *t_table, int N,
+                    double *args, double *R0, double *u0)
+{
+    // Time grid, shock evolution arguments (12 entries), and initial state
+    // of the current cone's blast wave.
+
+    double Rt0 = pars->Rt0;
+    double Rt1 = pars->Rt1;
+
+    double fac = pow(Rt1/Rt0, 1.0/(N-1.0));
     t_table[0] = Rt0;
 
     int i;
-    for(i=1; i<table_entries; i++)
+    for(i=1; i<N; i++)
         t_table[i] = t_table[i-1] * fac;
 
     double Rpar[2] = {pars->C_BMsqrd, pars->C_STsqrd};
-    double R0 = romb(&Rintegrand, 0.0, Rt0, 1000, 0, R_ACC, Rpar);
-    double u0 = sqrt(get_lfacbetasqrd(Rt0, pars->C_BMsqrd, pars->C_STsqrd));
+    *R0 = romb(&Rintegrand, 0.0, Rt0, 1000, 0, R_ACC, Rpar);
+    *u0 = sqrt(get_lfacbetasqrd(Rt0, pars->C_BMsqrd, pars->C_STsqrd));
     double th0 = pars->theta_h;
     double fom = 2*sin(0.5*th0)*sin(0.5*th0); //Fraction of solid angle in jet.
 
@@ -397,27 +502,570 @@ void make_R_table(struct fluxParams *pars)
     if(thCg <= 0.0)
         thCg = thC;
 
-    double args[12] = {pars->E_iso, Mej_sph, m_p*pars->n_0, 0.0, 0.0, 0.0, 
-                        pars->L0, pars->q, pars->ts, thC, th0, thCg};
-    int spread = pars->spread;
-    //printf("t0=%.6le R0=%.6le u0=%.6le\n", Rt0, R0, u0);
-    //shockInitDecel(Rt0, &R0, &u0, args);
-    shockInitFind(Rt0, &R0, &u0, pars->tRes/10, args);
-    //printf("t0=%.6le R0=%.6le u0=%.6le\n", Rt0, R0, u0);
+    args[0] = pars->E_iso;
+    args[1] = Mej_sph;
+    args[2] = m_p*pars->n_0;
+    args[3] = 0.0;
+    args[4] = 0.0;
+    args[5] = 0.0;
+    args[6] = pars->L0;
+    args[7] = pars->q;
+    args[8] = pars->ts;
+    args[9] = thC;
+    args[10] = th0;
+    args[11] = thCg;
+    //printf("t0=%.6le R0=%.6le u0=%.6le\n", Rt0, *R0, *u0);
+    //shockInitDecel(Rt0, R0, u0, args);
+    shockInitFind(Rt0, R0, u0, pars->tRes/10, args);
+    //printf("t0=%.6le R0=%.6le u0=%.6le\n", Rt0, *R0, *u0);
 
     args[0] = pars->E_iso * fom;
     args[1] = Mej_sph * fom;
+}
+
+void make_R_table(struct fluxParams *pars)
+{
+    int table_entries = R_table_entries(pars);
+
+    shift_R_tables(pars, table_entries);
+
+    double *t_table = pars->t_table;
+    double *R_table = pars->R_table;
+    double *u_table = pars->u_table;
+    double *th_table = pars->th_table;
+
+    double args[12];
+    double R0, u0;
+    R_table_start(pars, t_table, table_entries, args, &R0, &u0);
+
     shockEvolveSpreadRK4(t_table, R_table, u_table, th_table, table_entries,
-                            R0, u0, th0, args, spread);
+                            R0, u0, args[10], args, pars->spread);
 
     if(R_table[0] != R_table[0])
     {
-        printf("Rintegration Error: R[0]=%.3e  (fac=%.3e)\n", 
-                                    R_table[0], fac);
-        printf("    t=%.3e Rdot=%.3e t=%.3e Rdot=%.3e\n",
-                    0.0,Rintegrand(0.0,Rpar), t_table[0], 
-                    Rintegrand(t_table[0],Rpar));
+        double Rpar[2] = {pars->C_BMsqrd, pars->C_STsqrd};
+        diag_warning(&(pars->diag), "Rintegration Error: R[0]=%.3e t=%.3e"
+                    " Rdot=%.3e", R_table[0], t_table[0],
+                    Rintegrand(t_table[0], Rpar));
+    }
+}
+
+void make_R_tables(struct fluxParams *pars, struct coneSlice *cones, int n)
+{
+    // Fill pars->cache with the tables of every cone that is in neither
+    // it nor the library, integrating their blast waves together with
+    // shockEvolveSpreadRK4Multi().  Each cone gets the same tables
+    // make_R_table() would give it, the current tables are left alone.
+
+    struct tableCache *cache = pars->cache;
+    int i, k;
+    int m = 0;
+
+    double **t = (double **)malloc(4 * n * sizeof(double *));
+    double **R = t + n;
+    double **u = t + 2*n;
+    double **th = t + 3*n;
+    int *N = (int *)malloc(n * sizeof(int));
+    double *buf = (double *)malloc(4 * n * sizeof(double));
+    double *R0 = buf;
+    double *u0 = buf + n;
+    double *th0 = buf + 2*n;
+    double *Mej = buf + 3*n;
+    double args[12];
+
+    for(k=0; k<n; k++)
+    {
+        set_jet_cone(pars, cones[k].E_iso, cones[k].theta_hi);
+        if(tableCache_find(cache, pars) != NULL)
+            continue;
+        if(pars->lib != NULL && find_R_library(pars, pars->lib, NULL) >= 0)
+            continue;
+
+        int Nk = R_table_entries(pars);
+        struct coneTable *c = tableCache_add(cache, pars, Nk);
+        double R0k, u0k;
+        R_table_start(pars, c->t_table, Nk, args, &R0k, &u0k);
+
+        // Insert in order of decreasing N.
+        for(i=m; i>0 && N[i-1] < Nk; i--)
+        {
+            t[i] = t[i-1];
+            R[i] = R[i-1];
+            u[i] = u[i-1];
+            th[i] = th[i-1];
+            N[i] = N[i-1];
+            R0[i] = R0[i-1];
+            u0[i] = u0[i-1];
+            th0[i] = th0[i-1];
+            Mej[i] = Mej[i-1];
+        }
+        t[i] = c->t_table;
+        R[i] = c->R_table;
+        u[i] = c->u_table;
+        th[i] = c->th_table;
+        R0[i] = R0k;
+        u0[i] = u0k;
+        th0[i] = args[10];
+        Mej[i] = args[1];
+        N[i] = Nk;
+        m++;
+    }
+
+    // Only the per-cone Mej and th0 differ between the cones' arguments.
+    if(m > 0)
+        shockEvolveSpreadRK4Multi(t, R, u, th, N, m, R0, u0, th0, Mej, args,
+                                    pars->spread);
+    for(i=0; i<m; i++)
+        if(R[i][0] != R[i][0])
+            diag_warning(&(pars->diag), "Rintegration Error: R[0]=%.3e"
+                            " t=%.3e", R[i][0], t[i][0]);
+
+    free(t);
+    free(N);
+    free(buf);
+}
+
+struct coneTable *tableCache_find(struct tableCache *cache,
+                                    struct fluxParams *pars)
+{
+    // The cached solution for the current cone, or NULL.
+
+    struct dynKey key;
+    dynKey_set(&key, pars);
+
+    int i;
+    for(i=0; i<cache->n; i++)
+    {
+        struct coneTable *c = &(cache->tables[i]);
+        if(c->E_iso == pars->E_iso && c->theta_h == pars->theta_h
+                && c->Rt0 == pars->Rt0 && c->Rt1 == pars->Rt1
+                && dynKey_match(&(c->key), &key, 1))
+            return c;
+    }
+    return NULL;
+}
+
+int load_R_table(struct fluxParams *pars, struct tableCache *cache)
+{
+    // Fill the current tables from the cache, if the solution for this
+    // cone has been computed already.  Returns 1 on success, 0 on a miss.
+
+    struct coneTable *c = tableCache_find(cache, pars);
+    if(c == NULL)
+        return 0;
+
+    int N = c->table_entries;
+
+    shift_R_tables(pars, N);
+
+    size_t sz = N * sizeof(double);
+    memcpy(pars->t_table, c->t_table, sz);
+    memcpy(pars->R_table, c->R_table, sz);
+    memcpy(pars->u_table, c->u_table, sz);
+    memcpy(pars->th_table, c->th_table, sz);
+
+    return 1;
+}
+
+struct coneTable *tableCache_add(struct tableCache *cache,
+                                    struct fluxParams *pars, int N)
+{
+    // A new entry for the current cone with room for N table entries.
+    // The pointer is only valid until the next addition.
+
+    if(cache->n == cache->size)
+    {
+        int size = cache->size > 0 ? 2*cache->size : 16;
+        cache->tables = (struct coneTable *)realloc(cache->tables,
+                                            size * sizeof(struct coneTable));
+        cache->size = size;
+    }
+
+    struct coneTable *c = &(cache->tables[cache->n]);
+
+    dynKey_set(&(c->key), pars);
+    c->E_iso = pars->E_iso;
+    c->theta_h = pars->theta_h;
+    c->Rt0 = pars->Rt0;
+    c->Rt1 = pars->Rt1;
+    c->table_entries = N;
+
+    //One block for all four tables.
+    c->t_table = (double *)malloc(4 * N * sizeof(double));
+    c->R_table = c->t_table + N;
+    c->u_table = c->t_table + 2*N;
+    c->th_table = c->t_table + 3*N;
+
+    cache->n++;
+
+    return c;
+}
+
+void store_R_table(struct fluxParams *pars, struct tableCache *cache)
+{
+    int N = pars->table_entries;
+    size_t sz = N * sizeof(double);
+    struct coneTable *c = tableCache_add(cache, pars, N);
+
+    memcpy(c->t_table, pars->t_table, sz);
+    memcpy(c->R_table, pars->R_table, sz);
+    memcpy(c->u_table, pars->u_table, sz);
+    memcpy(c->th_table, pars->th_table, sz);
+}
+
+void tableCache_init(struct tableCache *cache)
+{
+    cache->tables = NULL;
+    cache->n = 0;
+    cache->size = 0;
+}
+
+void tableCache_clear(struct tableCache *cache)
+{
+    int i;
+    for(i=0; i<cache->n; i++)
+        free(cache->tables[i].t_table);
+    cache->n = 0;
+}
+
+void tableCache_free(struct tableCache *cache)
+{
+    tableCache_clear(cache);
+    free(cache->tables);
+    cache->tables = NULL;
+    cache->size = 0;
+}
+
+void dynKey_set(struct dynKey *key, struct fluxParams *pars)
+{
+    // The parameters make_R_table() uses for the current cone, with the
+    // same defaults.
+    double thC = pars->theta_core;
+    if(thC <= 0.0)
+        thC = pars->theta_wing;
+    double thCg = pars->theta_core_global;
+    if(thCg <= 0.0)
+        thCg = thC;
+
+    key->theta_h = pars->theta_h;
+    key->theta_core = thC;
+    key->theta_core_global = thCg;
+    key->g_init = pars->g_core > 1.0 ? pars->g_init : 0.0;
+    if(pars->L0 > 0.0 && pars->ts > 0.0)
+    {
+        key->L0 = pars->L0;
+        key->q = pars->q;
+        key->ts = pars->ts;
+    }
+    else
+    {
+        key->L0 = 0.0;
+        key->q = 0.0;
+        key->ts = 0.0;
+    }
+    key->E_iso = pars->E_iso;
+    key->n_0 = pars->n_0;
+    key->tRes = pars->tRes;
+    key->spread = pars->spread;
+}
+
+int dynKey_match(const struct dynKey *a, const struct dynKey *b, int exact)
+{
+    // 1 if solutions for a and b are rescalings of each other, or with
+    // exact set (or energy injection on) the same solution.
+    if(a->theta_h != b->theta_h || a->theta_core != b->theta_core
+            || a->theta_core_global != b->theta_core_global
+            || a->g_init != b->g_init || a->L0 != b->L0 || a->q != b->q
+            || a->ts != b->ts || a->tRes != b->tRes
+            || a->spread != b->spread)
+        return 0;
+    if((exact || a->L0 > 0.0) && (a->E_iso != b->E_iso || a->n_0 != b->n_0))
+        return 0;
+    return 1;
+}
+
+static uint64_t dynLibrary_checksum(const char *buf, size_t size)
+{
+    // 64 bit FNV-1a.
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for(i=0; i<size; i++)
+    {
+        h ^= (unsigned char) buf[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+int dynLibrary_write(const char *filename, struct tableCache *cache)
+{
+    // Write the solutions in cache to filename, skipping duplicates.  All
+    // fields are native-endian and 8-byte aligned so the tables can be
+    // used in place once mapped.  Returns 0 on success.
+
+    int i, j;
+    int n = 0;
+    int *keep = (int *)malloc((cache->n+1) * sizeof(int));
+    for(i=0; i<cache->n; i++)
+    {
+        struct coneTable *c = &(cache->tables[i]);
+        for(j=0; j<n; j++)
+        {
+            struct coneTable *d = &(cache->tables[keep[j]]);
+            if(dynKey_match(&(c->key), &(d->key), 1)
+                    && c->t_table[0] == d->t_table[0]
+                    && c->table_entries == d->table_entries
+                    && c->t_table[c->table_entries-1]
+                        == d->t_table[d->table_entries-1])
+                break;
+        }
+        if(j == n)
+            keep[n++] = i;
+    }
+
+    size_t size = DYNLIB_HEADER + n * sizeof(struct dynRecord);
+    for(j=0; j<n; j++)
+        size += 4 * cache->tables[keep[j]].table_entries * sizeof(double);
+
+    char *buf = (char *)calloc(size, 1);
+    if(buf == NULL)
+    {
+        free(keep);
+        return 1;
+    }
+
+    struct dynRecord *rec = (struct dynRecord *)(buf + DYNLIB_HEADER);
+    size_t offset = DYNLIB_HEADER + n * sizeof(struct dynRecord);
+    for(j=0; j<n; j++)
+    {
+        struct coneTable *c = &(cache->tables[keep[j]]);
+        int N = c->table_entries;
+        rec[j].key = c->key;
+        rec[j].t0 = c->t_table[0];
+        rec[j].t1 = c->t_table[N-1];
+        rec[j].offset = (int64_t) offset;
+        rec[j].N = N;
+        // t, R, u, th are contiguous in the cache.
+        memcpy(buf + offset, c->t_table, 4 * N * sizeof(double));
+        offset += 4 * N * sizeof(double);
+    }
+    free(keep);
+
+    uint32_t version = DYNLIB_VERSION;
+    uint32_t count = (uint32_t) n;
+    uint64_t sum = dynLibrary_checksum(buf + DYNLIB_HEADER,
+                                        size - DYNLIB_HEADER);
+    uint64_t size64 = (uint64_t) size;
+    memcpy(buf, "AGPYDYN", 8);
+    memcpy(buf + 8, &version, 4);
+    memcpy(buf + 12, &count, 4);
+    memcpy(buf + 16, &sum, 8);
+    memcpy(buf + 24, &size64, 8);
+
+    FILE *f = fopen(filename, "wb");
+    int err = 1;
+    if(f != NULL)
+    {
+        err = fwrite(buf, 1, size, f) != size;
+        err = fclose(f) != 0 || err;
+    }
+    free(buf);
+
+    return err;
+}
+
+int dynLibrary_open(struct dynLibrary *lib, const char *filename, int verify)
+{
+    // Map filename read-only.  Returns 0 on success, 1 if the file could
+    // not be read, 2 if it is not a library of this version, and 3 if
+    // verify is set and the checksum does not match.
+
+    lib->map = NULL;
+    lib->size = 0;
+    lib->n = 0;
+    lib->rec = NULL;
+
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return 1;
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 1;
+    }
+    if(st.st_size < DYNLIB_HEADER)
+    {
+        close(fd);
+        return 2;
+    }
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd,
+                        0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return 1;
+    lib->map = (char *) map;
+    lib->size = (size_t) st.st_size;
+#else
+    FILE *f = fopen(filename, "rb");
+    if(f == NULL)
+        return 1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(size < DYNLIB_HEADER)
+    {
+        fclose(f);
+        return 2;
+    }
+    lib->map = (char *)malloc(size);
+    if(lib->map == NULL || fread(lib->map, 1, size, f) != (size_t) size)
+    {
+        fclose(f);
+        free(lib->map);
+        lib->map = NULL;
+        return 1;
+    }
+    fclose(f);
+    lib->size = (size_t) size;
+#endif
+
+    uint32_t version, count;
+    uint64_t sum, size64;
+    memcpy(&version, lib->map + 8, 4);
+    memcpy(&count, lib->map + 12, 4);
+    memcpy(&sum, lib->map + 16, 8);
+    memcpy(&size64, lib->map + 24, 8);
+
+    int err = 0;
+    if(memcmp(lib->map, "AGPYDYN", 8) != 0 || version != DYNLIB_VERSION
+            || size64 != (uint64_t) lib->size
+            || DYNLIB_HEADER + count * sizeof(struct dynRecord) > lib->size)
+        err = 2;
+    else if(verify && sum != dynLibrary_checksum(lib->map + DYNLIB_HEADER,
+                                            lib->size - DYNLIB_HEADER))
+        err = 3;
+
+    if(!err)
+    {
+        lib->n = (int) count;
+        lib->rec = (const struct dynRecord *)(lib->map + DYNLIB_HEADER);
+        int i;
+        for(i=0; i<lib->n; i++)
+            if(lib->rec[i].N < 2 || lib->rec[i].offset < 0
+                    || (uint64_t) lib->rec[i].offset
+                        + 4 * lib->rec[i].N * sizeof(double) > lib->size)
+                err = 2;
+    }
+    if(err)
+        dynLibrary_close(lib);
+
+    return err;
+}
+
+void dynLibrary_close(struct dynLibrary *lib)
+{
+    if(lib->map != NULL)
+    {
+#ifndef _WIN32
+        munmap(lib->map, lib->size);
+#else
+        free(lib->map);
+#endif
+    }
+    lib->map = NULL;
+    lib->size = 0;
+    lib->n = 0;
+    lib->rec = NULL;
+}
+
+// Library consulted by every fluxParams set up afterwards.
+static struct dynLibrary *default_dynLibrary = NULL;
+
+void set_default_dynLibrary(struct dynLibrary *lib)
+{
+    default_dynLibrary = lib;
+}
+
+int find_R_library(struct fluxParams *pars, struct dynLibrary *lib, double *s)
+{
+    // Index of a record in lib whose solution, rescaled by the factor *s
+    // (if not NULL), covers the current cone.  -1 if there is none.
+    //
+    // Without energy injection the blast wave depends on E_iso and n_0
+    // only through E_iso/n_0, and the solution for (E_iso/n_0)_B is
+    // R_B(t) = s R_A(t/s) with s = ((E_iso/n_0)_B / (E_iso/n_0)_A)^(1/3),
+    // so any record with the same angles, spreading, and resolution whose
+    // scaled times cover Rt0 to Rt1 will do.
+
+    struct dynKey key;
+    dynKey_set(&key, pars);
+
+    double Rt0 = pars->Rt0;
+    double Rt1 = pars->Rt1;
+
+    int i;
+    for(i=0; i<lib->n; i++)
+    {
+        const struct dynRecord *r = &(lib->rec[i]);
+        if(!dynKey_match(&(r->key), &key, 0))
+            continue;
+        double si = cbrt((key.E_iso * r->key.n_0) / (key.n_0 * r->key.E_iso));
+        if(si * r->t0 <= Rt0 && Rt1 <= si * r->t1)
+        {
+            if(s != NULL)
+                *s = si;
+            return i;
+        }
+    }
+    return -1;
+}
+
+int load_R_library(struct fluxParams *pars, struct dynLibrary *lib)
+{
+    // Fill the current tables from a solution in lib, see find_R_library().
+    // Returns 1 on success, 0 on a miss.
+
+    double Rt0 = pars->Rt0;
+    double Rt1 = pars->Rt1;
+    double s = 1.0;
+
+    int i = find_R_library(pars, lib, &s);
+    if(i < 0)
+        return 0;
+
+    const struct dynRecord *r = &(lib->rec[i]);
+    int M = (int) r->N;
+    double *rt = (double *)(lib->map + r->offset);
+    double *rR = rt + M;
+    double *ru = rt + 2*M;
+    double *rth = rt + 3*M;
+
+    // Same time grid make_R_table() would use.
+    int table_entries = R_table_entries(pars);
+    shift_R_tables(pars, table_entries);
+
+    double *t_table = pars->t_table;
+    double *R_table = pars->R_table;
+    double *u_table = pars->u_table;
+    double *th_table = pars->th_table;
+
+    double fac = pow(Rt1/Rt0, 1.0/(table_entries-1.0));
+    t_table[0] = Rt0;
+    for(i=1; i<table_entries; i++)
+        t_table[i] = t_table[i-1] * fac;
+
+    for(i=0; i<table_entries; i++)
+    {
+        double x = t_table[i] / s;
+        int a = searchSorted(x, rt, M);
+        R_table[i] = s * interpolateLog(a, a+1, x, rt, rR, M);
+        u_table[i] = interpolateLog(a, a+1, x, rt, ru, M);
+        th_table[i] = interpolateLin(a, a+1, x, rt, rth, M);
     }
+
+    return 1;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -426,29 +1074,26 @@ double emissivity(double nu, double R, double sinTheta, double mu, double te,
                     double u, double us, double n0, double p, double epse,
                     double epsB, double ksiN, int specType)
 {
-    if(us < 1.0e-5)
-    {
-        //shock is ~ at sound speed of warm ISM. Won't shock, approach invalid.
-        return 0.0;
-    }
-    if(sinTheta == 0.0 || R == 0.0)
-        return 0.0;
+    double em;
+    emissivity_spec(&nu, &em, 1, R, sinTheta, mu, te, u, us, n0, p, epse,
+                    epsB, ksiN, specType, NULL, NULL);
+    return em;
+}
 
-    // set remaining fluid quantities
+static inline void synch_state(double u, double te, double n0, double p,
+                    double epse, double epsB, double ksiN, int specType,
+                    double *g_out, double *nprime_out, double *B_out,
+                    double *nu_m_out, double *nu_c_out)
+{
+    // Lorentz factor, comoving density and magnetic field of the shocked
+    // fluid, and the synchrotron break frequencies of its electrons.
     double g = sqrt(1+u*u);
     double beta = u/g;
-    double betas = us / sqrt(1+us*us);
     double nprime = 4.0 * n0 * g; // comoving number density
     double e_th = u*u/(g+1) * nprime * m_p * v_light * v_light;
     double B = sqrt(epsB * 8.0 * PI * e_th);
-    double a = (1.0 - mu * beta); // beaming factor
-    double ashock = (1.0 - mu * betas); // shock velocity beaming factor
-    double DR = R / (12.0 * g*g * ashock);
-    if (DR < 0.0) DR *= -1.0; // DR is function of the absolute value of mu
-
 
-    // set local emissivity 
-    double nuprime = nu * g * a; // comoving observer frequency
+    // minimum and cooling electron Lorentz factors
     double g_m = (2.0 - p) / (1.0 - p) * epse * e_th / (
                             ksiN * nprime * m_e * v_light * v_light);
     double g_c = 6 * PI * m_e * g * v_light / (sigma_T * B * B * te);
@@ -491,54 +1136,174 @@ double emissivity(double nu, double R, double sinTheta, double mu, double te,
 
     double nu_m = 3.0 * g_m * g_m * e_e * B / (4.0 * PI * m_e * v_light);
     double nu_c = 3.0 * g_c * g_c * e_e * B / (4.0 * PI * m_e * v_light);
-    double em = 0.5*(p - 1.0)*sqrt(3.0) * e_e*e_e*e_e * ksiN * nprime * B
-                    / (m_e*v_light*v_light);
-  
-    double freq = 0.0; // frequency dependent part of emissivity
 
+    *g_out = g;
+    *nprime_out = nprime;
+    *B_out = B;
+    *nu_m_out = nu_m;
+    *nu_c_out = nu_c;
+}
 
-    // set frequency dependence
-    if (nu_c > nu_m)
-    {
-        if (nuprime < nu_m) 
-            freq = pow(nuprime / nu_m, 1.0 / 3.0 );
-        else if (nuprime < nu_c)
-            freq = pow(nuprime / nu_m, 0.5 * (1.0 - p));
-        else
-            freq = pow(nu_c / nu_m, 0.5 * (1.0 - p))
-                    * pow(nuprime / nu_c, -0.5*p);
-    }
-    else
+static inline void emissivity_kernel(double *nu, double *em_nu, int Nnu,
+                    double R, double sinTheta, double mu, double te, double u,
+                    double us, double n0, double p, double epse,
+                    double epsB, double ksiN, int specType, double *dem,
+                    struct fluxDiag *diag)
+{
+    // Body of emissivity_spec().  Inlined with a constant specType and
+    // dem (NULL or not) its branches on them compile away.
+    int j, k;
+    if(us < 1.0e-5 || sinTheta == 0.0 || R == 0.0)
     {
-        if (nuprime < nu_c)
-            freq = pow(nuprime / nu_c, 1.0/3.0);
-        else if (nuprime < nu_m)
-            freq = sqrt(nu_c / nuprime);
-        else
-            freq = sqrt(nu_c/nu_m) * pow(nuprime / nu_m, -0.5 * p);
+        //shock is ~ at sound speed of warm ISM. Won't shock, approach invalid.
+        for(j=0; j<Nnu; j++)
+            em_nu[j] = 0.0;
+        if(dem != NULL)
+            for(j=0; j<N_GRAD*Nnu; j++)
+                dem[j] = 0.0;
+        return;
     }
 
-
+    // set remaining fluid quantities
+    double g, nprime, B, nu_m, nu_c;
+    synch_state(u, te, n0, p, epse, epsB, ksiN, specType, &g, &nprime, &B,
+                &nu_m, &nu_c);
+    double beta = u/g;
+    double betas = us / sqrt(1+us*us);
+    double a = (1.0 - mu * beta); // beaming factor
+    double ashock = (1.0 - mu * betas); // shock velocity beaming factor
+    double DR = R / (12.0 * g*g * ashock);
+    if (DR < 0.0) DR *= -1.0; // DR is function of the absolute value of mu
+
+    double em = 0.5*(p - 1.0)*sqrt(3.0) * e_e*e_e*e_e * ksiN * nprime * B
+                    / (m_e*v_light*v_light);
+
     if(em != em || em < 0.0)
-        printf("bad em:%.3le te=%.3le sinTheta=%.3lf mu=%.3lf\n",
-                em, te, sinTheta, mu);
-    if(freq != freq || freq < 0.0)
-        printf("bad freq at:%.3le te=%.3le sinTheta=%.3lf mu=%.3lf\n",
-                freq, te, sinTheta, mu);
+        diag_warning(diag, "bad em:%.3le te=%.3le sinTheta=%.3lf mu=%.3lf",
+                    em, te, sinTheta, mu);
+  
+    for(j=0; j<Nnu; j++)
+    {
+        double nuprime = nu[j] * g * a; // comoving observer frequency
+        double freq = 0.0; // frequency dependent part of emissivity
+
+        // set frequency dependence
+        if (nu_c > nu_m)
+        {
+            if (nuprime < nu_m) 
+                freq = pow(nuprime / nu_m, 1.0 / 3.0 );
+            else if (nuprime < nu_c)
+                freq = pow(nuprime / nu_m, 0.5 * (1.0 - p));
+            else
+                freq = pow(nu_c / nu_m, 0.5 * (1.0 - p))
+                        * pow(nuprime / nu_c, -0.5*p);
+        }
+        else
+        {
+            if (nuprime < nu_c)
+                freq = pow(nuprime / nu_c, 1.0/3.0);
+            else if (nuprime < nu_m)
+                freq = sqrt(nu_c / nuprime);
+            else
+                freq = sqrt(nu_c/nu_m) * pow(nuprime / nu_m, -0.5 * p);
+        }
+
+        if(freq != freq || freq < 0.0)
+            diag_warning(diag, "bad freq:%.3le te=%.3le sinTheta=%.3lf"
+                        " mu=%.3lf", freq, te, sinTheta, mu);
+
+        em_nu[j] = R * R * sinTheta * DR * em * freq / (g*g * a*a);
+
+        if(dem != NULL && specType == 0)
+        {
+            // Logarithmic derivatives of freq with respect to nu_m, nu_c,
+            // and explicitly to p.
+            double dm = 0.0, dc = 0.0, dp = 0.0;
+            if (nu_c > nu_m)
+            {
+                if (nuprime < nu_m)
+                    dm = -1.0/3.0;
+                else if (nuprime < nu_c)
+                {
+                    dm = 0.5 * (p - 1.0);
+                    dp = -0.5 * log(nuprime / nu_m);
+                }
+                else
+                {
+                    dm = 0.5 * (p - 1.0);
+                    dc = 0.5;
+                    dp = -0.5 * log(nuprime / nu_m);
+                }
+            }
+            else
+            {
+                if (nuprime < nu_c)
+                    dc = -1.0/3.0;
+                else if (nuprime < nu_m)
+                    dc = 0.5;
+                else
+                {
+                    dm = 0.5 * (p - 1.0);
+                    dc = 0.5;
+                    dp = -0.5 * log(nuprime / nu_m);
+                }
+            }
+
+            // nu_m ~ ((p-2)/(p-1))^2 epse^2 epsB^1/2 ksiN^-2,
+            // nu_c ~ epsB^-3/2, and em ~ (p-1) epsB^1/2 ksiN.
+            double dlnm_p = 2.0 * (1.0/(p - 2.0) - 1.0/(p - 1.0));
+            dem[j] = em_nu[j] * (1.0/(p - 1.0) + dm*dlnm_p + dp);
+            dem[Nnu+j] = em_nu[j] * 2.0*dm / epse;
+            dem[2*Nnu+j] = em_nu[j] * (0.5 + 0.5*dm - 1.5*dc) / epsB;
+            dem[3*Nnu+j] = em_nu[j] * (1.0 - 2.0*dm) / ksiN;
+        }
+    }
 
-    return R * R * sinTheta * DR * em * freq / (g*g * a*a);
+    if(dem != NULL && specType != 0)
+    {
+        // The inverse Compton correction has no closed form, difference
+        // this zone's emissivity instead.  No integration is involved so
+        // the step can be small.
+        double *em_a = (double *)malloc(2 * Nnu * sizeof(double));
+        double *em_b = em_a + Nnu;
+        double x[N_GRAD] = {p, epse, epsB, ksiN};
+        for(k=0; k<N_GRAD; k++)
+        {
+            double y[N_GRAD] = {p, epse, epsB, ksiN};
+            double h = 1.0e-6 * x[k];
+            y[k] = x[k] + h;
+            emissivity_spec(nu, em_a, Nnu, R, sinTheta, mu, te, u, us, n0,
+                            y[0], y[1], y[2], y[3], specType, NULL, diag);
+            y[k] = x[k] - h;
+            emissivity_spec(nu, em_b, Nnu, R, sinTheta, mu, te, u, us, n0,
+                            y[0], y[1], y[2], y[3], specType, NULL, diag);
+            for(j=0; j<Nnu; j++)
+                dem[k*Nnu+j] = (em_a[j] - em_b[j]) / (2*h);
+        }
+        free(em_a);
+    }
 }
 
-double theta_integrand(double a_theta, void* params) // inner integral
+void emissivity_spec(double *nu, double *em_nu, int Nnu, double R,
+                    double sinTheta, double mu, double te, double u,
+                    double us, double n0, double p, double epse,
+                    double epsB, double ksiN, int specType, double *dem,
+                    struct fluxDiag *diag)
 {
-    struct fluxParams *pars = (struct fluxParams *) params;
-    
-    //double cp = cos(pars->phi); 
-    //double cto = cos(pars->theta_obs_cur);
-    //double sto = sin(pars->theta_obs_cur);
-    double ast = sin(a_theta);
-    double act = cos(a_theta);
-    double mu = ast * (pars->cp) * (pars->sto) + act * (pars->cto);
+    // Emissivity of a zone at each of the Nnu frequencies nu.  Everything
+    // but the spectral shape is computed once.  If dem is not NULL it
+    // receives the derivatives with respect to p, epse, epsB, and ksiN,
+    // dem[k*Nnu + j] for parameter k and frequency j.  Bad values are
+    // counted in diag, if not NULL.
+    emissivity_kernel(nu, em_nu, Nnu, R, sinTheta, mu, te, u, us, n0, p, epse,
+                        epsB, ksiN, specType, dem, diag);
+}
+
+void shock_state(double mu, struct fluxParams *pars, double *t_e_out,
+                    double *R_out, double *u_out, double *us_out)
+{
+    // State of the shock where the current equal observer time surface
+    // meets the direction mu to the line of sight.
 
     int ia = searchSorted(mu, pars->mu_table, pars->table_entries);
     int ib = ia+1;
@@ -548,18 +1313,19 @@ double theta_integrand(double a_theta, void* params) // inner integral
 
     if(t_e < 0.0)
     {
-        printf("BAD t_e: %.6lf Eiso=%.3le n0=%.3le thetah=%.3le\n",
-                t_e, pars->E_iso, pars->n_0, pars->theta_h);
-        printf("    theta_obs=%.3lf phi=%.3lf theta=%.3lf mu=%.3lf\n",
-                pars->theta_obs, pars->phi, pars->theta, mu);
-        printf("    L0=%.3le q=%.3lf ts=%.3le\n", pars->L0, pars->q, pars->ts);
-        printf("    t[0]=%.3le t[-1]=%.3le R[0]=%.3le R[-1]=%.3le\n",
-                pars->t_table[0], pars->t_table[pars->table_entries-1],
-                pars->R_table[0], pars->R_table[pars->table_entries-1]);
-        printf("    u[0]=%.3le u[-1]=%.3le th[0]=%.3le th[-1]=%.3le\n",
-                pars->u_table[0], pars->u_table[pars->table_entries-1],
-                pars->th_table[0], pars->th_table[pars->table_entries-1]);
-        abort();
+        // Off the tabulated surface, nothing sensible to interpolate.
+        // Record it and give this point a zero radius, so no emission.
+        diag_error(&(pars->diag), "BAD t_e: %.6lf Eiso=%.3le n0=%.3le"
+                    " thetah=%.3le theta_obs=%.3lf phi=%.3lf mu=%.3lf"
+                    " t[0]=%.3le t[-1]=%.3le",
+                    t_e, pars->E_iso, pars->n_0, pars->theta_h,
+                    pars->theta_obs, pars->phi, mu, pars->t_table[0],
+                    pars->t_table[pars->table_entries-1]);
+        *t_e_out = t_e;
+        *R_out = 0.0;
+        *u_out = 0.0;
+        *us_out = 0.0;
+        return;
     }
     
     double R = interpolateLog(ia, ib, t_e, pars->t_table, pars->R_table, 
@@ -579,56 +1345,345 @@ double theta_integrand(double a_theta, void* params) // inner integral
         us = sqrt(us2);
         u = sqrt(u2);
     }
-    
-    double dFnu =  emissivity(pars->nu_obs, R, ast, mu, t_e, u, us,
-                                pars->n_0, pars->p, pars->epsilon_E,
-                                pars->epsilon_B, pars->ksi_N, pars->spec_type);
 
-    if(dFnu != dFnu || dFnu < 0.0)
+    *t_e_out = t_e;
+    *R_out = R;
+    *u_out = u;
+    *us_out = us;
+}
+
+void shock_geom(double a_theta, struct fluxParams *pars, double *mu_out,
+                double *t_e_out, double *R_out, double *u_out, double *us_out)
+{
+    // Location and state of the shock at polar angle a_theta on the
+    // current equal observer time surface.
+
+    //double cp = cos(pars->phi); 
+    //double cto = cos(pars->theta_obs_cur);
+    //double sto = sin(pars->theta_obs_cur);
+    double ast = sin(a_theta);
+    double act = cos(a_theta);
+    double mu = ast * (pars->cp) * (pars->sto) + act * (pars->cto);
+
+    shock_state(mu, pars, t_e_out, R_out, u_out, us_out);
+    *mu_out = mu;
+}
+
+struct maskKey
+{
+    double x;
+    int i;
+};
+
+static int maskKey_cmp(const void *a, const void *b)
+{
+    const struct maskKey *ka = (const struct maskKey *) a;
+    const struct maskKey *kb = (const struct maskKey *) b;
+
+    if(ka->x != kb->x)
+        return ka->x < kb->x ? -1 : 1;
+    return ka->i - kb->i;
+}
+
+static int int_cmp_desc(const void *a, const void *b)
+{
+    return *(const int *)b - *(const int *)a;
+}
+
+static int int_cmp_asc(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+void mask_index_build(struct fluxParams *pars)
+{
+    // Sort the mask boxes by their lower phi bound.
+    struct maskIndex *mi = &(pars->mask_idx);
+    int n = pars->nmask;
+    int i;
+
+    mi->n_range = 0;
+    if(n <= 0)
+        return;
+
+    struct maskKey *keys = (struct maskKey *)malloc(n
+                                                * sizeof(struct maskKey));
+    for(i=0; i<n; i++)
+    {
+        keys[i].x = pars->mask[9*i+6];
+        keys[i].i = i;
+    }
+    qsort(keys, n, sizeof(struct maskKey), &maskKey_cmp);
+
+    mi->order = (int *)malloc(n * sizeof(int));
+    mi->phi_lo = (double *)malloc(n * sizeof(double));
+    mi->cand = (int *)malloc(n * sizeof(int));
+    for(i=0; i<n; i++)
+    {
+        mi->order[i] = keys[i].i;
+        mi->phi_lo[i] = keys[i].x;
+    }
+    free(keys);
+}
+
+void mask_index_free(struct fluxParams *pars)
+{
+    struct maskIndex *mi = &(pars->mask_idx);
+    free(mi->order);
+    free(mi->phi_lo);
+    free(mi->cand);
+    free(mi->box);
+    mi->order = NULL;
+    mi->phi_lo = NULL;
+    mi->cand = NULL;
+    mi->box = NULL;
+    mi->cap = 0;
+    mi->n_range = 0;
+}
+
+static inline int mask_bucket(struct maskIndex *mi, int r, double th)
+{
+    if(th <= mi->th_lo[r])
+        return 0;
+    double b = (th - mi->th_lo[r]) * mi->inv_dth[r];
+    return b < MASK_BUCKETS-1 ? (int)b : MASK_BUCKETS-1;
+}
+
+void mask_select(struct fluxParams *pars, double theta_0, double theta_1,
+                    double theta_cj_0, double theta_cj_1)
+{
+    // Bucket the mask boxes which can hold a point at the current phi with
+    // polar angle in [theta_0, theta_1], or on the counter-jet (evaluated
+    // at pi - theta) with theta in [theta_cj_0, theta_cj_1] if that is not
+    // empty.  Within a bucket boxes are in decreasing order, the last
+    // matching box in the mask is the one that applies.
+    struct maskIndex *mi = &(pars->mask_idx);
+    double phi = pars->phi;
+    int n = pars->nmask;
+    int j, b, r;
+
+    mi->n_range = 0;
+    if(n <= 0)
+        return;
+    if(mi->order == NULL)
+        mask_index_build(pars);
+
+    // Boxes starting below phi.
+    int k = 0;
+    int k1 = n;
+    while(k < k1)
+    {
+        int mid = (k + k1) / 2;
+        if(mi->phi_lo[mid] < phi)
+            k = mid+1;
+        else
+            k1 = mid;
+    }
+
+    double lo[2] = {theta_0, PI - theta_cj_1};
+    double hi[2] = {theta_1, PI - theta_cj_0};
+    int n_range = theta_cj_0 < theta_cj_1 ? 2 : 1;
+    int used = 0;
+
+    for(r=0; r<n_range; r++)
     {
-        printf("bad dFnu:%.3le nu=%.3le R=%.3le th=%.3lf mu=%.3lf\n",
-                dFnu, pars->nu_obs, R, a_theta, mu);
-        printf("               t=%.3le u=%.3le us=%.3le n0=%.3le p=%.3lf\n",
-                t_e, u, us, pars->n_0, pars->p);
-        printf("               epse=%.3le epsB=%.3le ksiN=%.3le specType=%d\n",
-                pars->epsilon_E, pars->epsilon_B, pars->ksi_N, pars->spec_type);
-        printf("               Rt0=%.3le Rt1=%.3le E_iso=%.3le L0=%.3le ts=%.3le\n",
-                pars->Rt0, pars->Rt1, pars->E_iso, pars->L0, pars->ts);
+        // A small margin, the integrands' angles are computed from these.
+        // An empty range (only the counter-jet is visible) gets no boxes
+        // and is never picked by mask_factor().
+        double th_lo = lo[r] - 1.0e-9;
+        double th_hi = hi[r] + 1.0e-9;
+        int empty = !(lo[r] < hi[r]);
+        if(empty)
+        {
+            th_lo = 0.0;
+            th_hi = -1.0;
+        }
+        mi->th_lo[r] = th_lo;
+        mi->th_hi[r] = th_hi;
+        mi->inv_dth[r] = empty ? 0.0 : MASK_BUCKETS / (th_hi - th_lo);
+
+        int nc = 0;
+        for(j=0; j<k && !empty; j++)
+        {
+            double *m = &((pars->mask)[9*mi->order[j]]);
+            if(phi < m[7] && m[4] < th_hi && th_lo < m[5])
+                mi->cand[nc++] = mi->order[j];
+        }
+        qsort(mi->cand, nc, sizeof(int), &int_cmp_desc);
+
+        // Count, then fill each bucket in candidate order.
+        int *start = mi->start[r];
+        for(b=0; b<=MASK_BUCKETS; b++)
+            start[b] = 0;
+        for(j=0; j<nc; j++)
+        {
+            double *m = &((pars->mask)[9*mi->cand[j]]);
+            int b1 = mask_bucket(mi, r, m[5]);
+            for(b=mask_bucket(mi, r, m[4]); b<=b1; b++)
+                start[b+1]++;
+        }
+        start[0] = used;
+        for(b=0; b<MASK_BUCKETS; b++)
+            start[b+1] += start[b];
+
+        if(start[MASK_BUCKETS] > mi->cap)
+        {
+            mi->cap = 2*start[MASK_BUCKETS];
+            mi->box = (int *)realloc(mi->box, mi->cap * sizeof(int));
+        }
+        int fill[MASK_BUCKETS];
+        for(b=0; b<MASK_BUCKETS; b++)
+            fill[b] = start[b];
+        for(j=0; j<nc; j++)
+        {
+            double *m = &((pars->mask)[9*mi->cand[j]]);
+            int b1 = mask_bucket(mi, r, m[5]);
+            for(b=mask_bucket(mi, r, m[4]); b<=b1; b++)
+                mi->box[fill[b]++] = mi->cand[j];
+        }
+        used = start[MASK_BUCKETS];
     }
+    mi->n_range = n_range;
+}
 
+double mask_factor(double a_theta, double t_e, double R,
+                    struct fluxParams *pars)
+{
     int i;
     double fac = 1.0;
-    for(i=0; i<pars->nmask; i++)
+    struct maskIndex *mi = &(pars->mask_idx);
+
+    if(mi->n_range == 0)
+    {
+        // No selection for this phi, test every box.
+        for(i=0; i<pars->nmask; i++)
+        {
+            double *m = &((pars->mask)[9*i]);
+            if(m[0]<t_e && t_e<m[1] && m[2]<R && R<m[3] && m[4]<a_theta
+                    && a_theta<m[5] && m[6]<pars->phi && pars->phi<m[7])
+                fac = m[8];
+        }
+    }
+    else
     {
-        double *m = &((pars->mask)[9*i]);
-        if(m[0]<t_e && t_e<m[1] && m[2]<R && R<m[3] && m[4]<a_theta
-                && a_theta<m[5] && m[6]<pars->phi && pars->phi<m[7])
-            fac = m[8];
+        int r = mi->n_range > 1 && a_theta > mi->th_hi[0] ? 1 : 0;
+        int b = mask_bucket(mi, r, a_theta);
+        int j;
+        for(j=mi->start[r][b]; j<mi->start[r][b+1]; j++)
+        {
+            double *m = &((pars->mask)[9*mi->box[j]]);
+            if(m[0]<t_e && t_e<m[1] && m[2]<R && R<m[3] && m[4]<a_theta
+                    && a_theta<m[5])
+            {
+                fac = m[8];
+                break;
+            }
+        }
     }
 
     if(fac != fac || fac < 0.0)
-        printf("bad mask fac: %.3le\n", fac);
+        diag_warning(&(pars->diag), "bad mask fac: %.3le", fac);
+
+    return fac;
+}
+
+double theta_integrand(double a_theta, void* params) // inner integral
+{
+    struct fluxParams *pars = (struct fluxParams *) params;
+
+    double mu, t_e, R, u, us;
+    shock_geom(a_theta, pars, &mu, &t_e, &R, &u, &us);
+    
+    double dFnu =  emissivity(pars->nu_obs, R, sin(a_theta), mu, t_e, u, us,
+                                pars->n_0, pars->p, pars->epsilon_E,
+                                pars->epsilon_B, pars->ksi_N, pars->spec_type);
+
+    if(dFnu != dFnu || dFnu < 0.0)
+    {
+        diag_warning(&(pars->diag), "bad dFnu:%.3le nu=%.3le R=%.3le"
+                    " th=%.3lf mu=%.3lf t=%.3le u=%.3le", dFnu, pars->nu_obs,
+                    R, a_theta, mu, t_e, u);
+    }
+
+    double fac = mask_factor(a_theta, t_e, R, pars);
 
     return fac * dFnu;
 }
 
-///////////////////////////////////////////////////////////////////////////////
+static inline int value_blocks(struct fluxParams *pars)
+{
+    // Values per frequency produced by the grid integrands: the flux,
+    // then any derivatives, then any sky-plane moments.
+    return 1 + pars->n_grad + pars->n_mom;
+}
 
-double phi_integrand(double a_phi, void* params) // outer integral
+static inline void sky_moments(double *dFnu, int Nnu, double *M, double x,
+                                double y2)
 {
-    double result;
+    // Moment blocks of the flux dFnu at sky position x (along the
+    // projected jet axis) and y^2 (across it).
+    int j;
+    for(j=0; j<Nnu; j++)
+    {
+        M[j] = dFnu[j] * x;
+        M[Nnu+j] = dFnu[j] * x*x;
+        M[2*Nnu+j] = dFnu[j] * y2;
+    }
+}
+
+static inline void theta_integrand_grid_kernel(double a_theta, double *dFnu,
+                                                struct fluxParams *pars,
+                                                int spec, int mask, int grad,
+                                                int mom)
+{
+    double mu, t_e, R, u, us;
+    shock_geom(a_theta, pars, &mu, &t_e, &R, &u, &us);
+
+    double st = sin(a_theta);
+    emissivity_kernel(pars->nu_grid, dFnu, pars->n_nu, R, st, mu,
+                        t_e, u, us, pars->n_0, pars->p, pars->epsilon_E,
+                        pars->epsilon_B, pars->ksi_N, spec,
+                        grad ? dFnu + pars->n_nu : NULL, &(pars->diag));
+
+    if(mom)
+    {
+        double x = R * (pars->sto*cos(a_theta) - pars->cto*st*pars->cp);
+        double y = R * st * sin(pars->phi);
+        sky_moments(dFnu, pars->n_nu,
+                    dFnu + (1+pars->n_grad)*pars->n_nu, x, y*y);
+    }
+
+    if(mask)
+    {
+        double fac = mask_factor(a_theta, t_e, R, pars);
+
+        int j;
+        for(j=0; j<value_blocks(pars)*pars->n_nu; j++)
+            dFnu[j] *= fac;
+    }
+}
 
+void theta_integrand_grid(double a_theta, double *dFnu, void* params)
+{
+    // theta_integrand() at all of the pars->n_nu frequencies pars->nu_grid.
     struct fluxParams *pars = (struct fluxParams *) params;
-  
-    // set up integration routine
-#ifdef USEGSL
-    gsl_integration_workspace * w = gsl_integration_workspace_alloc (1000);
-    gsl_function F; F.function = &theta_integrand; F.params = params;
-    double error;
-#endif
+    theta_integrand_grid_kernel(a_theta, dFnu, pars, pars->spec_type,
+                                pars->nmask > 0, pars->n_grad > 0,
+                                pars->n_mom > 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void phi_theta_bounds(double a_phi, double cto, struct fluxParams *pars,
+                        double *theta_0_out, double *theta_1_out)
+{
+    // Set the azimuth a_phi and find the polar extent of the current cone
+    // along it, seen from cos(theta_obs) = cto.  The counter-jet is the
+    // same cone seen from cto = -pars->cto.
 
     pars->phi = a_phi;
     pars->cp = cos(a_phi);
+    pars->mask_idx.n_range = 0;
   
   // implement sideways spreading approximation until spherical symmetry reached
     double theta_1 = pars->current_theta_cone_hi;
@@ -638,7 +1693,7 @@ double phi_integrand(double a_phi, void* params) // outer integral
     if(pars->th_table != NULL && spreadVersion==1)
     {
         double th_0, th_1;
-        th_1 = find_jet_edge(a_phi, pars->cto, pars->sto, theta_1,
+        th_1 = find_jet_edge(a_phi, cto, pars->sto, theta_1,
                              pars->mu_table, pars->th_table,
                              pars->table_entries);
 
@@ -649,7 +1704,7 @@ double phi_integrand(double a_phi, void* params) // outer integral
         }
         else
         {
-            th_0 = find_jet_edge(a_phi, pars->cto, pars->sto, theta_0,
+            th_0 = find_jet_edge(a_phi, cto, pars->sto, theta_0,
                                  pars->mu_table_inner, pars->th_table_inner,
                                  pars->table_entries_inner);
         }
@@ -669,7 +1724,7 @@ double phi_integrand(double a_phi, void* params) // outer integral
         // approx mu
         double ct = cos(0.5*(theta_0+theta_1));
         double st = sin(0.5*(theta_0+theta_1));
-        double mu = pars->cp * st * (pars->sto) + ct * (pars->cto);
+        double mu = pars->cp * st * (pars->sto) + ct * cto;
 
         int ia = searchSorted(mu, pars->mu_table, pars->table_entries);
         int ib = ia+1;
@@ -691,8 +1746,29 @@ double phi_integrand(double a_phi, void* params) // outer integral
             theta_0 = theta_1-Dtheta;
     }
 
+    *theta_0_out = theta_0;
+    *theta_1_out = theta_1;
+}
+
+double phi_integrand(double a_phi, void* params) // outer integral
+{
+    double result;
+
+    struct fluxParams *pars = (struct fluxParams *) params;
+  
+    // set up integration routine
+#ifdef USEGSL
+    gsl_integration_workspace * w = gsl_integration_workspace_alloc (1000);
+    gsl_function F; F.function = &theta_integrand; F.params = params;
+    double error;
+#endif
+
+    double theta_0, theta_1;
+    phi_theta_bounds(a_phi, pars->cto, pars, &theta_0, &theta_1);
+
     if(theta_0 >= theta_1)
         return 0.0;
+    mask_select(pars, theta_0, theta_1, 0.0, 0.0);
  
     //printf("# theta integration domain: %e - %e\n", theta_1 - Dtheta, theta_1); fflush(stdout);
  
@@ -707,62 +1783,557 @@ double phi_integrand(double a_phi, void* params) // outer integral
                         pars->theta_atol, THETA_ACC, params);
 #endif
     if(result != result || result < 0.0)
-        printf("bad result:%.3le t_obs=%.3le theta_lo=%.3lf theta_hi=%.3lf theta_log=%.3lf phi=%.3lf\n",
-              result, pars->t_obs, theta_0, theta_1, pars->theta_h + 0.1 * log( pars->t_obs / pars->t_NR), pars->phi);
+        diag_warning(&(pars->diag), "bad result:%.3le t_obs=%.3le"
+                    " theta_lo=%.3lf theta_hi=%.3lf phi=%.3lf", result,
+                    pars->t_obs, theta_0, theta_1, pars->phi);
   
     //return result
     return result;
 }
 
-double find_jet_edge(double phi, double cto, double sto, double theta0,
-                     double *a_mu, double *a_thj, int N)
+static int dbl_cmp_asc(const void *a, const void *b)
 {
-    double cp = cos(phi);
-    double mu = cos(theta0)*cto + sin(theta0)*sto*cp;
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
 
-    int ia = searchSorted(mu, a_mu, N);
-    
-    if(a_thj[ia] <= theta0 && theta0 <= a_thj[ia+1])
-        return theta0;
+static int sort_breaks(double *x, int n, double lo, double hi)
+{
+    // Sort the n points x in place and drop those within 1e-6 of the
+    // range (lo, hi) of either end or of the point before, so no piece is
+    // degenerate.  Returns the number kept.
+    int i, k = 0;
+    double eps = 1.0e-6 * (hi - lo);
+    double last = lo;
+
+    if(n > 1)
+        qsort(x, n, sizeof(double), dbl_cmp_asc);
+    for(i=0; i<n; i++)
+        if(x[i] > last + eps && x[i] < hi - eps)
+        {
+            x[k++] = x[i];
+            last = x[i];
+        }
+    return k;
+}
 
-    double tha, thb;
-    if(theta0 < a_thj[ia])
+static double mu_break_value(struct fluxParams *pars, double mu, int i,
+                                int m)
+{
+    // Functions of the shock where the current equal arrival time surface
+    // meets mu, whose zeros are kinks of the integrand: m = 0 the shock
+    // switching off (us = 1e-5 in emissivity_spec()), m = 1 nu_c = nu_m,
+    // and m = 2 + 2j, 3 + 2j nu' = nu_m, nu' = nu_c at frequency j.  With
+    // i >= 0 mu is mu_table[i] and the state is that of table entry i.
+    double t_e, R, u, us;
+    if(i >= 0)
     {
-        //The jet is spreading
-        tha = theta0;
-        thb = 0.5*M_PI;
+        mu = pars->mu_table[i];
+        t_e = pars->t_table[i];
+        u = pars->u_table[i];
+        us = shockVel(u);
     }
     else
+        shock_state(mu, pars, &t_e, &R, &u, &us);
+
+    if(m == 0)
+        return us - 1.0e-5;
+
+    double g, nprime, B, nu_m, nu_c;
+    synch_state(u, t_e, pars->n_0, pars->p, pars->epsilon_E,
+                pars->epsilon_B, pars->ksi_N, pars->spec_type, &g, &nprime,
+                &B, &nu_m, &nu_c);
+    if(m == 1)
+        return log(nu_c / nu_m);
+
+    double nup = pars->nu_grid[(m-2)/2] * (g - mu * u);
+    return log(nup / (m % 2 == 0 ? nu_m : nu_c));
+}
+
+static double mu_break_refine(struct fluxParams *pars, int m, double a,
+                                double fa, double b, double fb)
+{
+    // Zero of mu_break_value() m between table entries mu = a and b, with
+    // the integrand's own interpolation of the tables, so the pieces either
+    // side of it are smooth.  Regula falsi, with the Illinois modification.
+    int k, side = 0;
+    double c = a;
+    for(k=0; k<20; k++)
     {
-        //Guessed too far out!
-        tha = 0.0;
-        thb = theta0;
+        c = (a*fb - b*fa) / (fb - fa);
+        if(!(fabs(b - a) > 1.0e-12))
+            break;
+        double fc = mu_break_value(pars, c, -1, m);
+        if(fc == 0.0)
+            break;
+        if((fc < 0.0) == (fa < 0.0))
+        {
+            a = c;
+            fa = fc;
+            if(side == -1)
+                fb *= 0.5;
+            side = -1;
+        }
+        else
+        {
+            b = c;
+            fb = fc;
+            if(side == 1)
+                fa *= 0.5;
+            side = 1;
+        }
     }
+    return c;
+}
 
-    int i = 0;
-    while(thb-tha > 1.0e-5 && i < 100)
+static int mu_breaks_scan(struct fluxParams *pars, double mu_lo,
+                            double mu_hi)
+{
+    // Add the zeros of mu_break_value() in [mu_lo, mu_hi] to
+    // pars->mu_breaks, growing it as needed.  The tables are sampled at
+    // MU_BREAK_SAMPLES entries, sign changes are narrowed down to one table
+    // interval by bisection and the zero found within it by
+    // mu_break_refine().  Returns 0 if the room for them can't be had.
+    int N = pars->table_entries;
+    int Nf = 2 + 2*pars->n_nu;
+    double *mu = pars->mu_table;
+    int m;
+
+    int i0 = searchSorted(mu_lo, mu, N);
+    int i1 = searchSorted(mu_hi, mu, N) + 1;
+    if(i1 > N-1)
+        i1 = N-1;
+    if(i1 <= i0)
+        return 1;
+    int stride = (i1 - i0 + MU_BREAK_SAMPLES - 1) / MU_BREAK_SAMPLES;
+
+    for(m=0; m<Nf; m++)
     {
-        double th = 0.5*(tha+thb);
-        mu = cos(th)*cto + sin(th)*sto*cp;
-        ia = searchSorted(mu, a_mu, N);
-        if(th < a_thj[ia])
-            tha = th;
-        else
-            thb = th;
-        i++;
+        int ia = i0;
+        double fa = mu_break_value(pars, 0.0, ia, m);
+        while(ia < i1)
+        {
+            int ib = ia + stride < i1 ? ia + stride : i1;
+            double fb = mu_break_value(pars, 0.0, ib, m);
+            if((fa < 0.0 && fb >= 0.0) || (fa >= 0.0 && fb < 0.0))
+            {
+                int lo = ia, hi = ib;
+                double flo = fa, fhi = fb;
+                while(hi - lo > 1)
+                {
+                    int mid = (lo + hi) / 2;
+                    double fm = mu_break_value(pars, 0.0, mid, m);
+                    if((fm < 0.0) == (flo < 0.0))
+                    {
+                        lo = mid;
+                        flo = fm;
+                    }
+                    else
+                    {
+                        hi = mid;
+                        fhi = fm;
+                    }
+                }
+                if(pars->n_mu_breaks == pars->mu_breaks_cap)
+                {
+                    int cap = 2*pars->mu_breaks_cap + THETA_BREAKS;
+                    double *b = (double *)realloc(pars->mu_breaks,
+                                                    cap * sizeof(double));
+                    if(b == NULL)
+                        return 0;
+                    pars->mu_breaks = b;
+                    pars->mu_breaks_cap = cap;
+                }
+                pars->mu_breaks[pars->n_mu_breaks++]
+                    = mu_break_refine(pars, m, mu[lo], flo, mu[hi], fhi);
+            }
+            fa = fb;
+            ia = ib;
+        }
     }
+    return 1;
+}
 
-    //printf("iter: %d, th0=%.6lf, th=%.6lf\n", i, theta0, tha);
+void make_mu_breaks(struct fluxParams *pars)
+{
+    // Kinks of the integrand along the current equal arrival time surface
+    // over the extent of the current cone (and counter-jet), at which
+    // phi_integrand_grid() splits its theta integrals.  Spectral breaks
+    // cost Romberg many levels to resolve, or worse stop it early, the
+    // smooth pieces on either side converge in a few.  Every frequency's
+    // breaks are kept, however many share the time, so a point's flux
+    // does not depend on which others are computed with it.  Requires
+    // make_mu_table().
+    double theta_lo, theta_max, d_lo, d_hi;
+
+    pars->n_mu_breaks = 0;
+    if(pars->u_table == NULL || pars->table_entries < 2)
+        return;
+
+    double theta_obs = acos(pars->cto);
+    int ok;
+
+    cone_extent(pars, pars->cto, &theta_lo, &theta_max);
+    d_lo = theta_lo > theta_obs ? theta_lo - theta_obs : 0.0;
+    d_hi = theta_max + theta_obs < PI ? theta_max + theta_obs : PI;
+    ok = mu_breaks_scan(pars, cos(d_hi), cos(d_lo));
+
+    if(ok && pars->counter_jet)
+    {
+        theta_obs = PI - theta_obs;
+        cone_extent(pars, -pars->cto, &theta_lo, &theta_max);
+        d_lo = theta_lo > theta_obs ? theta_lo - theta_obs : 0.0;
+        d_hi = theta_max + theta_obs < PI ? theta_max + theta_obs : PI;
+        ok = mu_breaks_scan(pars, cos(d_hi), cos(d_lo));
+    }
 
-    return tha;
+    if(!ok)
+        pars->n_mu_breaks = 0;
 }
 
-double phi_integrand_vec(double phi, void *params)
+int theta_breaks(struct fluxParams *pars, double cto, double theta_0,
+                    double theta_1, double *theta)
 {
-    struct fluxParams *pars = (struct fluxParams *) params;
-    
-    double cp = cos(phi); 
-    double mu = cp * (pars->st) * (pars->sto) + (pars->ct) * (pars->cto);
+    // The polar angles in (theta_0, theta_1) along the current phi where
+    // mu = cto cos(theta) + sto cos(phi) sin(theta) = rho cos(theta - ths)
+    // meets one of pars->mu_breaks, in increasing order and at least 1e-6
+    // of the range apart.  theta needs room for 2*pars->n_mu_breaks
+    // entries, after make_mu_breaks().
+    int k, n = 0;
+    if(pars->n_mu_breaks < 0)
+        make_mu_breaks(pars);
+    double b = pars->cp * pars->sto;
+    double rho = sqrt(cto*cto + b*b);
+    double ths = atan2(b, cto);
+
+    for(k=0; k<pars->n_mu_breaks; k++)
+    {
+        double c = pars->mu_breaks[k] / rho;
+        if(!(fabs(c) < 1.0))
+            continue;
+        double d = acos(c);
+        theta[n++] = ths + d;
+        theta[n++] = ths - d;
+    }
+
+    return sort_breaks(theta, n, theta_0, theta_1);
+}
+
+static void romb_split(void (*f)(double, double *, void *), double *I,
+                        int Nv, int Nchk, double *x, int n, void *args)
+{
+    // romb_vec() of f over [x[0], x[n]] as the sum of its integrals over
+    // the n pieces [x[k], x[k+1]].  The pieces stop 1e-8 of the range short
+    // of the inner breaks, so each only evaluates f on its own side of
+    // them: the derivatives (and the spectrum, at nu_c = nu_m) jump there.
+    struct fluxParams *pars = (struct fluxParams *) args;
+    int j, k;
+
+    struct workMark mark = work_mark(&(pars->work));
+    double *R = work_push(&(pars->work), (KMAX+2) * Nv);
+
+    if(n == 1)
+    {
+        romb_vec(f, I, Nv, Nchk, x[0], x[1], 1000, NULL, THETA_ACC, args, R);
+        work_pop(&(pars->work), mark);
+        return;
+    }
+
+    double gap = 1.0e-8 * (x[n] - x[0]);
+    double *Ik = work_push(&(pars->work), Nv);
+    for(j=0; j<Nv; j++)
+        I[j] = 0.0;
+    for(k=0; k<n; k++)
+    {
+        double a = k > 0 ? x[k] + gap : x[k];
+        double b = k < n-1 ? x[k+1] - gap : x[k+1];
+        romb_vec(f, Ik, Nv, Nchk, a, b, 1000, NULL, THETA_ACC, args, R);
+        for(j=0; j<Nv; j++)
+            I[j] += Ik[j];
+    }
+    work_pop(&(pars->work), mark);
+}
+
+void phi_integrand_grid(double a_phi, double *result, void* params)
+{
+    // phi_integrand() at all of the pars->n_nu frequencies pars->nu_grid.
+    // The extent of the cone is found once for all frequencies.  Any
+    // derivatives and moments follow the flux and are integrated on the
+    // same points.
+    struct fluxParams *pars = (struct fluxParams *) params;
+
+    int j;
+    int Nv = value_blocks(pars) * pars->n_nu;
+    double theta_0, theta_1;
+    phi_theta_bounds(a_phi, pars->cto, pars, &theta_0, &theta_1);
+
+    if(pars->counter_jet)
+    {
+        // Both hemispheres in one integration, see theta_integrand_fused().
+        pars->theta_jet_0 = theta_0;
+        pars->theta_jet_1 = theta_1;
+        phi_theta_bounds(a_phi, -pars->cto, pars, &(pars->theta_cj_0),
+                            &(pars->theta_cj_1));
+        if(theta_0 < theta_1 || pars->theta_cj_0 < pars->theta_cj_1)
+        {
+            mask_select(pars, theta_0, theta_1, pars->theta_cj_0,
+                        pars->theta_cj_1);
+            if(pars->theta_nodes > 0)
+            {
+                struct workMark mark = work_mark(&(pars->work));
+                gauss_vec(pars->theta_fused, result, Nv, 0.0, 1.0,
+                            pars->theta_nodes, params,
+                            work_push(&(pars->work), Nv));
+                work_pop(&(pars->work), mark);
+                return;
+            }
+            // Both sets of breaks, mapped onto [0, 1].
+            if(pars->n_mu_breaks < 0)
+                make_mu_breaks(pars);
+            struct workMark mark = work_mark(&(pars->work));
+            double *x = work_push(&(pars->work), 4*pars->n_mu_breaks + 2);
+            int nb = 0;
+            double dth = theta_1 - theta_0;
+            double dth_cj = pars->theta_cj_1 - pars->theta_cj_0;
+            if(dth > 0.0)
+                nb = theta_breaks(pars, pars->cto, theta_0, theta_1, x+1);
+            for(j=0; j<nb; j++)
+                x[j+1] = (x[j+1] - theta_0) / dth;
+            if(dth_cj > 0.0)
+            {
+                int nb_cj = theta_breaks(pars, -pars->cto, pars->theta_cj_0,
+                                         pars->theta_cj_1, x+nb+1);
+                for(j=nb; j<nb+nb_cj; j++)
+                    x[j+1] = (x[j+1] - pars->theta_cj_0) / dth_cj;
+                nb = sort_breaks(x+1, nb + nb_cj, 0.0, 1.0);
+            }
+            x[0] = 0.0;
+            x[nb+1] = 1.0;
+            romb_split(pars->theta_fused, result, Nv, pars->n_nu, x, nb+1,
+                        params);
+            work_pop(&(pars->work), mark);
+            return;
+        }
+    }
+
+    if(theta_0 >= theta_1)
+    {
+        for(j=0; j<Nv; j++)
+            result[j] = 0.0;
+        return;
+    }
+
+    mask_select(pars, theta_0, theta_1, 0.0, 0.0);
+    if(pars->theta_nodes > 0)
+    {
+        struct workMark mark = work_mark(&(pars->work));
+        gauss_vec(pars->theta_grid, result, Nv, theta_0, theta_1,
+                    pars->theta_nodes, params, work_push(&(pars->work), Nv));
+        work_pop(&(pars->work), mark);
+        return;
+    }
+    if(pars->n_mu_breaks < 0)
+        make_mu_breaks(pars);
+    struct workMark mark = work_mark(&(pars->work));
+    double *th = work_push(&(pars->work), 2*pars->n_mu_breaks + 2);
+    int nb = theta_breaks(pars, pars->cto, theta_0, theta_1, th+1);
+    th[0] = theta_0;
+    th[nb+1] = theta_1;
+    romb_split(pars->theta_grid, result, Nv, pars->n_nu, th, nb+1, params);
+    work_pop(&(pars->work), mark);
+}
+
+static inline void theta_integrand_fused_kernel(double x, double *dFnu,
+                                                struct fluxParams *pars,
+                                                int spec, int mask, int grad,
+                                                int mom)
+{
+    // The theta integrands of the jet and counter-jet at the current phi,
+    // each mapped onto x in [0, 1] and summed, so both hemispheres share
+    // one set of integration points and one convergence check.  The
+    // counter-jet is the cone seen from pi - theta_obs: the same shock and
+    // mu tables with cos(theta_obs) negated.  Without spreading the two
+    // extents coincide and the angles are shared.
+    int j;
+    int Nnu = pars->n_nu;
+    int Nv = value_blocks(pars) * Nnu;
+    double *dem = grad ? pars->cj_buf + Nnu : NULL;
+    double sp = mom ? sin(pars->phi) : 0.0;
+
+    double dth = pars->theta_jet_1 - pars->theta_jet_0;
+    double dth_cj = pars->theta_cj_1 - pars->theta_cj_0;
+    double th = pars->theta_jet_0 + x*dth;
+    double th_cj = pars->theta_cj_0 + x*dth_cj;
+    double st = sin(th);
+    double ct = cos(th);
+    double a = st * pars->cp * pars->sto;
+    double b = ct * pars->cto;
+
+    double t_e, R, u, us, fac;
+
+    if(dth > 0.0)
+    {
+        shock_state(a + b, pars, &t_e, &R, &u, &us);
+        emissivity_kernel(pars->nu_grid, dFnu, Nnu, R, st, a + b, t_e, u, us,
+                        pars->n_0, pars->p, pars->epsilon_E,
+                        pars->epsilon_B, pars->ksi_N, spec,
+                        grad ? dFnu + Nnu : NULL, &(pars->diag));
+        if(mom)
+            sky_moments(dFnu, Nnu, dFnu + (1+pars->n_grad)*Nnu,
+                        R * (pars->sto*ct - pars->cto*st*pars->cp),
+                        R*R * st*st * sp*sp);
+        fac = mask ? dth * mask_factor(th, t_e, R, pars) : dth;
+        for(j=0; j<Nv; j++)
+            dFnu[j] *= fac;
+    }
+    else
+        for(j=0; j<Nv; j++)
+            dFnu[j] = 0.0;
+
+    if(dth_cj <= 0.0)
+        return;
+
+    if(th_cj != th)
+    {
+        st = sin(th_cj);
+        ct = cos(th_cj);
+        a = st * pars->cp * pars->sto;
+        b = ct * pars->cto;
+    }
+
+    shock_state(a - b, pars, &t_e, &R, &u, &us);
+    emissivity_kernel(pars->nu_grid, pars->cj_buf, Nnu, R, st, a - b, t_e, u,
+                    us, pars->n_0, pars->p, pars->epsilon_E, pars->epsilon_B,
+                    pars->ksi_N, spec, dem, &(pars->diag));
+    if(mom)
+        sky_moments(pars->cj_buf, Nnu, pars->cj_buf + (1+pars->n_grad)*Nnu,
+                    -R * (pars->sto*ct + pars->cto*st*pars->cp),
+                    R*R * st*st * sp*sp);
+    // The counter-jet lies at pi - theta from the jet axis.
+    fac = mask ? dth_cj * mask_factor(PI - th_cj, t_e, R, pars) : dth_cj;
+    for(j=0; j<Nv; j++)
+        dFnu[j] += fac * pars->cj_buf[j];
+}
+
+void theta_integrand_fused(double x, double *dFnu, void* params)
+{
+    struct fluxParams *pars = (struct fluxParams *) params;
+    theta_integrand_fused_kernel(x, dFnu, pars, pars->spec_type,
+                                    pars->nmask > 0, pars->n_grad > 0,
+                                    pars->n_mom > 0);
+}
+
+// theta_integrand_grid() and theta_integrand_fused() specialized for each
+// spectrum type (0 or 1), with and without a mask, and with and without
+// derivatives.  select_integrands() picks the pair for a fluxParams.
+// Moments always use the generic ones.
+#define THETA_INTEGRANDS(spec, mask, grad) \
+static void theta_integrand_grid_##spec##mask##grad(double a_theta, \
+                                            double *dFnu, void *params) \
+{ \
+    theta_integrand_grid_kernel(a_theta, dFnu, \
+                        (struct fluxParams *)params, spec, mask, grad, 0); \
+} \
+static void theta_integrand_fused_##spec##mask##grad(double x, \
+                                            double *dFnu, void *params) \
+{ \
+    theta_integrand_fused_kernel(x, dFnu, \
+                        (struct fluxParams *)params, spec, mask, grad, 0); \
+}
+
+THETA_INTEGRANDS(0, 0, 0)
+THETA_INTEGRANDS(0, 0, 1)
+THETA_INTEGRANDS(0, 1, 0)
+THETA_INTEGRANDS(0, 1, 1)
+THETA_INTEGRANDS(1, 0, 0)
+THETA_INTEGRANDS(1, 0, 1)
+THETA_INTEGRANDS(1, 1, 0)
+THETA_INTEGRANDS(1, 1, 1)
+
+static void (*const theta_grid_kernels[2][2][2])(double, double *, void *) = {
+    {{theta_integrand_grid_000, theta_integrand_grid_001},
+     {theta_integrand_grid_010, theta_integrand_grid_011}},
+    {{theta_integrand_grid_100, theta_integrand_grid_101},
+     {theta_integrand_grid_110, theta_integrand_grid_111}}};
+
+static void (*const theta_fused_kernels[2][2][2])(double, double *, void *) = {
+    {{theta_integrand_fused_000, theta_integrand_fused_001},
+     {theta_integrand_fused_010, theta_integrand_fused_011}},
+    {{theta_integrand_fused_100, theta_integrand_fused_101},
+     {theta_integrand_fused_110, theta_integrand_fused_111}}};
+
+void select_integrands(struct fluxParams *pars)
+{
+    // Set pars->theta_grid and pars->theta_fused for the current spectrum
+    // type, mask, and n_grad.  Other spectrum types, and moments, use the
+    // generic ones.
+
+    int spec = pars->spec_type;
+    int mask = pars->nmask > 0;
+    int grad = pars->n_grad > 0;
+
+    if((spec == 0 || spec == 1) && pars->n_mom == 0)
+    {
+        pars->theta_grid = theta_grid_kernels[spec][mask][grad];
+        pars->theta_fused = theta_fused_kernels[spec][mask][grad];
+    }
+    else
+    {
+        pars->theta_grid = &theta_integrand_grid;
+        pars->theta_fused = &theta_integrand_fused;
+    }
+}
+
+double find_jet_edge(double phi, double cto, double sto, double theta0,
+                     double *a_mu, double *a_thj, int N)
+{
+    double cp = cos(phi);
+    double mu = cos(theta0)*cto + sin(theta0)*sto*cp;
+
+    int ia = searchSorted(mu, a_mu, N);
+    
+    if(a_thj[ia] <= theta0 && theta0 <= a_thj[ia+1])
+        return theta0;
+
+    double tha, thb;
+    if(theta0 < a_thj[ia])
+    {
+        //The jet is spreading
+        tha = theta0;
+        thb = 0.5*M_PI;
+    }
+    else
+    {
+        //Guessed too far out!
+        tha = 0.0;
+        thb = theta0;
+    }
+
+    int i = 0;
+    while(thb-tha > 1.0e-5 && i < 100)
+    {
+        double th = 0.5*(tha+thb);
+        mu = cos(th)*cto + sin(th)*sto*cp;
+        ia = searchSorted(mu, a_mu, N);
+        if(th < a_thj[ia])
+            tha = th;
+        else
+            thb = th;
+        i++;
+    }
+
+    //printf("iter: %d, th0=%.6lf, th=%.6lf\n", i, theta0, tha);
+
+    return tha;
+}
+
+double phi_integrand_vec(double phi, void *params)
+{
+    struct fluxParams *pars = (struct fluxParams *) params;
+    
+    double cp = cos(phi); 
+    double mu = cp * (pars->st) * (pars->sto) + (pars->ct) * (pars->cto);
 
     int ia = searchSorted(mu, pars->mu_table, pars->table_entries);
     int ib = ia+1;
@@ -832,6 +2403,10 @@ double flux(struct fluxParams *pars, double atol) // determine flux for a given
     double error;
 #endif
 
+  // The flux of a cone whose blast wave failed to integrate is unknown.
+  if(pars->R_table[0] != pars->R_table[0])
+    return NAN;
+
   // at this stage t_obs is known, so mu_table can be made
   make_mu_table(pars); 
 
@@ -859,6 +2434,513 @@ double flux(struct fluxParams *pars, double atol) // determine flux for a given
   return result;
 }
 
+void cone_extent(struct fluxParams *pars, double cto, double *theta_lo_out,
+                    double *theta_max_out)
+{
+    // Polar range of the current cone at pars->t_obs, including its
+    // spreading, that holds for every azimuth seen from cos(theta_obs) =
+    // cto.  Requires make_mu_table().
+
+    int N = pars->table_entries;
+    double *mu_table = pars->mu_table;
+    double *th_table = pars->th_table;
+    int k;
+
+    double theta_obs = acos(cto);
+    double theta_lo = pars->current_theta_cone_low - 1.0e-5;
+    if(theta_lo < 0.0)
+        theta_lo = 0.0;
+    double theta_max = pars->current_theta_cone_hi;
+
+    // The spreading edge is th(t_e(mu)) at some mu below the largest mu
+    // the cone reaches.  th and t_e grow with mu, so iterating down from
+    // PI/2 stays above the edge.  The 1.0e-5 is find_jet_edge()'s
+    // tolerance.
+    if(th_table != NULL)
+    {
+        double th = 0.5*PI;
+        for(k=0; k<10; k++)
+        {
+            double d = theta_obs - th;
+            if(theta_lo - theta_obs > d)
+                d = theta_lo - theta_obs;
+            if(d < 0.0)
+                d = 0.0;
+            int ib = searchSorted(cos(d), mu_table, N) + 1;
+            double th_new = th_table[ib] + 1.0e-5;
+            if(th_new < theta_max)
+                th_new = theta_max;
+            if(th_new > 0.5*PI)
+                th_new = 0.5*PI;
+            if(th_new >= th)
+                break;
+            th = th_new;
+        }
+        theta_max = th;
+    }
+    *theta_lo_out = theta_lo;
+    *theta_max_out = theta_max;
+}
+
+double cone_offbeam(struct fluxParams *pars, double cto)
+{
+    // Lorentz factor times the angle between the line of sight, seen from
+    // cos(theta_obs) = cto, and the nearest point of the current cone, a
+    // lower bound over the cone as points further away emitted earlier.
+    // Zero if the line of sight passes through the cone.
+
+    double theta_obs = acos(cto);
+    double theta_lo, theta_max;
+    cone_extent(pars, cto, &theta_lo, &theta_max);
+
+    double d = theta_obs - theta_max;
+    if(theta_lo - theta_obs > d)
+        d = theta_lo - theta_obs;
+    if(d <= 0.0 || pars->u_table == NULL)
+        return 0.0;
+
+    int ib = searchSorted(cos(d), pars->mu_table, pars->table_entries) + 1;
+    double u = pars->u_table[ib];
+    return sqrt(1.0 + u*u) * d;
+}
+
+int flux_bound(struct fluxParams *pars, double cto, double *limit,
+                double *bound)
+{
+    // Upper bound on the flux of the current cone at pars->t_obs, seen from
+    // cos(theta_obs) = cto, at each of the pars->n_nu frequencies
+    // pars->nu_grid.  Requires make_mu_table().  Returns 0 if there is no
+    // bound, or if limit is not NULL and the bound is not below it at
+    // every frequency.
+    //
+    // The cone lies in theta_lo < theta < theta_max, so it meets the equal
+    // arrival time surface between mu_min and mu_max.  That stretch of the
+    // tables is cut into segments and in each every factor of
+    // emissivity_spec() is bounded by the extreme table values, which
+    // holds as the tables are interpolated monotonically between entries.
+    // The spectral shape is bounded by its peak, by its rise below the
+    // lower break and by its fall above both breaks.
+
+    int N = pars->table_entries;
+    double *mu_table = pars->mu_table;
+    double *t_table = pars->t_table;
+    double *R_table = pars->R_table;
+    double *u_table = pars->u_table;
+    int Nnu = pars->n_nu;
+    int i, j;
+
+    if(u_table == NULL || N < 2)
+        return 0;
+
+    double theta_obs = acos(cto);
+    double theta_lo, theta_max;
+    cone_extent(pars, cto, &theta_lo, &theta_max);
+
+    if(theta_max <= theta_lo)
+    {
+        for(j=0; j<Nnu; j++)
+            bound[j] = 0.0;
+        return 1;
+    }
+
+    double d = theta_obs - theta_max;
+    if(theta_lo - theta_obs > d)
+        d = theta_lo - theta_obs;
+    double mu_max = d > 0.0 ? cos(d) : 1.0;
+    double mu_min = theta_obs + theta_max < PI ? cos(theta_obs + theta_max)
+                                                : -1.0;
+    int ia = searchSorted(mu_min, mu_table, N);
+    int ib = searchSorted(mu_max, mu_table, N) + 1;
+
+    double fac_max = 1.0;
+    for(i=0; i<pars->nmask; i++)
+        if(pars->mask[9*i+8] > fac_max)
+            fac_max = pars->mask[9*i+8];
+
+    double Fcoeff = cgs2mJy / (4*PI * pars->d_L*pars->d_L);
+    double geom = 2 * Fcoeff * PI * (theta_max - theta_lo) * sin(theta_max)
+                    * fac_max;
+
+    double n0 = pars->n_0;
+    double p = pars->p;
+    double epse = pars->epsilon_E;
+    double epsB = pars->epsilon_B;
+    double ksiN = pars->ksi_N;
+    double c_eth = 4.0 * n0 * m_p * v_light * v_light;
+    double c_em = 0.5*(p - 1.0)*sqrt(3.0) * e_e*e_e*e_e * ksiN * 4.0 * n0
+                    / (m_e*v_light*v_light);
+    double c_gm = (2.0 - p) / (1.0 - p) * epse * m_p / (ksiN * m_e);
+    double c_nu = 3.0 * e_e / (4.0 * PI * m_e * v_light);
+    double c_gc = 6 * PI * m_e * v_light / sigma_T;
+
+    for(j=0; j<Nnu; j++)
+        bound[j] = 0.0;
+
+    // Segments nearest the line of sight usually dominate, so are done
+    // first.  Without energy injection R grows and u falls along the
+    // tables, and the extremes are at the ends of each segment.
+    int monotone = pars->L0 <= 0.0;
+    int Nseg = 32;
+    int step = (ib - ia + Nseg - 1) / Nseg;
+    if(step < 1)
+        step = 1;
+    int i1;
+    for(i1=ib; i1>ia; i1-=step)
+    {
+        int i0 = i1-step > ia ? i1-step : ia;
+        double R_hi = R_table[i1];
+        double u_lo = u_table[i1];
+        double u_hi = u_table[i0];
+        if(!monotone)
+        {
+            u_hi = u_lo;
+            for(i=i0; i<i1; i++)
+            {
+                if(R_table[i] > R_hi)
+                    R_hi = R_table[i];
+                if(u_table[i] < u_lo)
+                    u_lo = u_table[i];
+                else if(u_table[i] > u_hi)
+                    u_hi = u_table[i];
+            }
+        }
+        double m_lo = mu_table[i0] > mu_min ? mu_table[i0] : mu_min;
+        double m_hi = mu_table[i1] < mu_max ? mu_table[i1] : mu_max;
+        double te_lo = t_table[i0];
+        double te_hi = t_table[i1];
+
+        double g_lo = sqrt(1+u_lo*u_lo);
+        double g_hi = sqrt(1+u_hi*u_hi);
+        double b_lo = u_lo/g_lo;
+        double b_hi = u_hi/g_hi;
+        double us_lo = shockVel(u_lo);
+        double us_hi = shockVel(u_hi);
+        double bs_lo = us_lo / sqrt(1+us_lo*us_lo);
+        double bs_hi = us_hi / sqrt(1+us_hi*us_hi);
+
+        double a_lo = 1.0 - m_hi * (m_hi > 0.0 ? b_hi : b_lo);
+        double a_hi = 1.0 - m_lo * (m_lo > 0.0 ? b_lo : b_hi);
+        double as_lo = 1.0 - m_hi * (m_hi > 0.0 ? bs_hi : bs_lo);
+
+        // e_th, B, em, g_m, and nu_m all grow with u.
+        double B_lo = sqrt(epsB * 8.0 * PI * c_eth * u_lo*u_lo*g_lo/(g_lo+1));
+        double B_hi = sqrt(epsB * 8.0 * PI * c_eth * u_hi*u_hi*g_hi/(g_hi+1));
+        double em_hi = c_em * g_hi * B_hi;
+        double gm_lo = c_gm * u_lo*u_lo/(g_lo+1);
+        double gm_hi = c_gm * u_hi*u_hi/(g_hi+1);
+        double num_lo = c_nu * gm_lo*gm_lo * B_lo;
+        double num_hi = c_nu * gm_hi*gm_hi * B_hi;
+        double gc_hi = c_gc * g_hi / (B_lo*B_lo * te_lo);
+        double gc_lo = c_gc * g_lo / (B_hi*B_hi * te_hi);
+        double nuc_hi = c_nu * gc_hi*gc_hi * B_lo;
+        // Inverse Compton cooling only lowers nu_c.
+        double nuc_lo = pars->spec_type == 0 ? c_nu * gc_lo*gc_lo * B_hi
+                                             : 0.0;
+        double nupk_lo = num_lo < nuc_lo ? num_lo : nuc_lo;
+
+        double pref = geom * R_hi*R_hi*R_hi * em_hi
+                        / (12.0 * g_lo*g_lo*g_lo*g_lo * as_lo * a_lo*a_lo);
+        if(!(pref > 0.0) || us_hi < 1.0e-5)
+            continue;
+
+        for(j=0; j<Nnu; j++)
+        {
+            double nup_lo = pars->nu_grid[j] * g_lo * a_lo;
+            double nup_hi = pars->nu_grid[j] * g_hi * a_hi;
+            double freq = 1.0;
+            double f = pow(num_hi/nup_lo, 0.5*(p-1.0)) * sqrt(nuc_hi/nup_lo);
+            if(f < freq)
+                freq = f;
+            if(nupk_lo > 0.0)
+            {
+                f = cbrt(nup_hi / nupk_lo);
+                if(f < freq)
+                    freq = f;
+            }
+            if(pref*freq > bound[j])
+                bound[j] = pref*freq;
+            if(limit != NULL && !(bound[j] < limit[j]))
+                return 0;
+        }
+    }
+
+    for(j=0; j<Nnu; j++)
+        if(!(bound[j] < HUGE_VAL))
+            return 0;
+
+    return 1;
+}
+
+int flux_grid_gauss(struct fluxParams *pars, double *atol, double *F)
+{
+    // flux_grid() of a cone far outside the beaming cone of the line of
+    // sight, where the integrand is smooth in both angles.  A tensor
+    // Gauss-Legendre rule of GAUSS_NODES points per angle is compared
+    // against one of twice as many, and the latter is accepted if they
+    // differ by less than atol + rtol*F at every frequency.  Returns 0,
+    // leaving F unspecified, if the cone is not far enough off-beam or the
+    // rules disagree.
+
+    int j;
+    int Nnu = pars->n_nu;
+    int Nv = value_blocks(pars) * Nnu;
+
+    double x = cone_offbeam(pars, pars->cto);
+    if(pars->counter_jet)
+    {
+        double x_cj = cone_offbeam(pars, -pars->cto);
+        if(x_cj < x)
+            x = x_cj;
+    }
+    if(x < GAUSS_OFFBEAM)
+        return 0;
+
+    // Only keep trying while the rule is accepted often enough to pay.
+    pars->gauss_tries++;
+    if(pars->gauss_tries > 8 && 2*pars->gauss_hits < pars->gauss_tries
+            && pars->gauss_tries % 16 != 0)
+        return 0;
+
+    double Fcoeff = 2 * cgs2mJy / (4*PI * pars->d_L*pars->d_L);
+    struct workMark mark = work_mark(&(pars->work));
+    double *F1 = work_push(&(pars->work), 2*Nv);
+    double *fa = F1 + Nv;
+    if(pars->counter_jet)
+        pars->cj_buf = work_push(&(pars->work), Nv);
+
+    pars->theta_nodes = GAUSS_NODES;
+    gauss_vec(&phi_integrand_grid, F1, Nv, 0.0, PI, GAUSS_NODES, pars, fa);
+    pars->theta_nodes = 2*GAUSS_NODES;
+    gauss_vec(&phi_integrand_grid, F, Nv, 0.0, PI, 2*GAUSS_NODES, pars, fa);
+    pars->theta_nodes = 0;
+
+    int ok = 1;
+    for(j=0; j<Nv; j++)
+    {
+        F[j] *= Fcoeff;
+        F1[j] *= Fcoeff;
+        if(j < Nnu && !(fabs(F[j] - F1[j]) < atol[j]
+                                            + pars->flux_rtol*fabs(F[j])))
+            ok = 0;
+    }
+
+    pars->cj_buf = NULL;
+    work_pop(&(pars->work), mark);
+    pars->gauss_hits += ok;
+
+    return ok;
+}
+
+double cone_axisym(struct fluxParams *pars, double limit)
+{
+    // Rough relative size of the variation along phi of the current
+    // cone's integrand.  The Doppler factor at angle theta from the line of
+    // sight changes over 1 - mu ~ 1/Gamma^2 + theta^2/2, while along phi
+    // mu moves by 2 sin(theta) sin(theta_obs), giving sin(theta_obs) times
+    // min(2 Gamma, 4/theta) at most.  The counter-jet adds at most
+    // 2 sin(theta_obs).  Requires make_mu_table().  Once the value is
+    // known to be at least limit, a lower bound of it that is at least
+    // limit is returned instead, the scan of the table stops there.
+
+    int N = pars->table_entries;
+    int i;
+
+    if(pars->sto == 0.0)
+        return 0.0;
+    if(pars->u_table == NULL || N < 2)
+        return HUGE_VAL;
+
+    // min(2 Gamma, 4/theta) >= 4/pi, which rules out most cones at once.
+    double eps = pars->counter_jet ? 2.0 : 4.0/PI;
+    if(!(eps * pars->sto < limit))
+        return eps * pars->sto;
+    limit /= pars->sto;
+
+    double theta_obs = acos(pars->cto);
+    double theta_lo, theta_max;
+    cone_extent(pars, pars->cto, &theta_lo, &theta_max);
+
+    double d_lo = theta_lo - theta_obs;
+    if(d_lo < 0.0)
+        d_lo = 0.0;
+    double d_hi = theta_max + theta_obs;
+    if(d_hi > PI)
+        d_hi = PI;
+
+    int ia = searchSorted(cos(d_hi), pars->mu_table, N);
+    int ib = searchSorted(cos(d_lo), pars->mu_table, N) + 1;
+    if(ib > N-1)
+        ib = N-1;
+
+    eps = pars->counter_jet ? 2.0 : 0.0;
+    for(i=ia; i<=ib; i++)
+    {
+        double u = pars->u_table[i];
+        double e = 2.0*sqrt(1.0 + u*u);
+        double th = acos(pars->mu_table[i]);
+        if(th < d_lo)
+            th = d_lo;
+        if(th > d_hi)
+            th = d_hi;
+        if(4.0 < e*th)
+            e = 4.0/th;
+        if(e > eps)
+        {
+            eps = e;
+            if(!(eps < limit))
+                break;
+        }
+    }
+
+    return eps * pars->sto;
+}
+
+int flux_grid_axisym(struct fluxParams *pars, double *atol, double *F)
+{
+    // flux_grid() of a cone seen from on or near its axis.  The integrand
+    // only depends on phi through mu = cos(theta)cos(theta_obs)
+    // + sin(theta)sin(theta_obs)cos(phi), so on the axis a single phi (and
+    // a single jet edge) suffices, or two with moments, whose weights go
+    // as cos(phi) and sin(phi).  Near the axis the midpoint rule on
+    // phi = pi/4, 3pi/4 is used if the relative variation along phi, the
+    // larger of cone_axisym() and the relative difference of those two
+    // values, times F is below atol + rtol*F at every frequency.  Returns
+    // 0, leaving F unspecified, if the cone is not near enough the axis or
+    // has an emission mask, which need not be axisymmetric.
+
+    int j;
+    int Nnu = pars->n_nu;
+    int Nv = value_blocks(pars) * Nnu;
+
+    if(pars->nmask > 0)
+        return 0;
+
+    double eps = cone_axisym(pars, pars->flux_rtol);
+    if(!(eps < pars->flux_rtol))
+        return 0;
+
+    double Fcoeff = 2 * cgs2mJy / (4*PI * pars->d_L*pars->d_L);
+    struct workMark mark = work_mark(&(pars->work));
+    if(pars->counter_jet)
+        pars->cj_buf = work_push(&(pars->work), Nv);
+
+    int ok = 1;
+    if(eps == 0.0 && pars->n_mom == 0)
+    {
+        phi_integrand_grid(0.5*PI, F, pars);
+        for(j=0; j<Nv; j++)
+            F[j] *= PI * Fcoeff;
+    }
+    else
+    {
+        double *F1 = work_push(&(pars->work), Nv);
+        phi_integrand_grid(0.25*PI, F, pars);
+        phi_integrand_grid(0.75*PI, F1, pars);
+        for(j=0; j<Nv; j++)
+        {
+            double r = 2.0 * fabs(F[j] - F1[j])
+                            / fabs(F[j] + F1[j]);
+            F[j] = 0.5*PI * Fcoeff * (F[j] + F1[j]);
+            if(j >= Nnu || F[j] == 0.0)
+                continue;
+            if(r < eps)
+                r = eps;
+            if(!(r*fabs(F[j]) < atol[j] + pars->flux_rtol*fabs(F[j])))
+                ok = 0;
+        }
+    }
+
+    pars->cj_buf = NULL;
+    work_pop(&(pars->work), mark);
+
+    return ok;
+}
+
+void flux_grid(struct fluxParams *pars, double *atol, double *F)
+{
+    // flux() at all of the pars->n_nu frequencies pars->nu_grid.  The
+    // mu table and the extent of the jet are computed once for all of them.
+    // With pars->n_grad > 0, F[(k+1)*n_nu + j] receives the derivative with
+    // respect to radiation parameter k, followed by any sky-plane moments
+    // (pars->n_mom > 0).
+    int j;
+    int Nnu = pars->n_nu;
+    int Nv = value_blocks(pars) * Nnu;
+
+    // The flux of a cone whose blast wave failed to integrate is unknown,
+    // see make_R_table().
+    if(pars->R_table[0] != pars->R_table[0])
+    {
+        for(j=0; j<Nv; j++)
+            F[j] = NAN;
+        return;
+    }
+
+    make_mu_table(pars); 
+
+    double d_L = pars->d_L;
+
+    double Fcoeff = cgs2mJy / (4*PI * d_L*d_L);
+
+    // Skip cones whose flux is provably below their share of the
+    // tolerance.  Derivatives are not bounded, so not with n_grad > 0.
+    if(pars->n_grad == 0 && atol != NULL)
+    {
+        struct workMark mark = work_mark(&(pars->work));
+        double *bound = work_push(&(pars->work), 2*Nnu);
+        double *limit = bound + Nnu;
+        int prune = flux_bound(pars, pars->cto, atol, bound);
+        if(prune && pars->counter_jet)
+        {
+            for(j=0; j<Nnu; j++)
+                limit[j] = atol[j] - bound[j];
+            prune = flux_bound(pars, -pars->cto, limit, bound);
+        }
+        work_pop(&(pars->work), mark);
+        if(prune)
+        {
+            for(j=0; j<Nv; j++)
+                F[j] = 0.0;
+            if(pars->stats != NULL)
+                pars->stats->cones_pruned++;
+            return;
+        }
+    }
+    pars->n_mu_breaks = -1;
+
+    if(atol != NULL && flux_grid_axisym(pars, atol, F))
+    {
+        if(pars->stats != NULL)
+            pars->stats->cones_gauss++;
+        return;
+    }
+    if(atol != NULL && flux_grid_gauss(pars, atol, F))
+    {
+        if(pars->stats != NULL)
+            pars->stats->cones_gauss++;
+        return;
+    }
+    if(pars->stats != NULL)
+        pars->stats->cones_integrated++;
+
+    struct workMark mark = work_mark(&(pars->work));
+    double *phi_atol = work_push(&(pars->work), Nnu);
+    for(j=0; j<Nnu; j++)
+        phi_atol[j] = atol[j]/(2*Fcoeff);
+
+    if(pars->counter_jet)
+        pars->cj_buf = work_push(&(pars->work), Nv);
+
+    romb_vec(&phi_integrand_grid, F, Nv, Nnu, 0.0, PI, 1000, phi_atol,
+                PHI_ACC, pars, work_push(&(pars->work), (KMAX+2) * Nv));
+
+    for(j=0; j<Nv; j++)
+        F[j] = 2 * Fcoeff * F[j];
+
+    pars->cj_buf = NULL;
+    work_pop(&(pars->work), mark);
+}
+
 void lc_cone(double *t, double *nu, double *F, int Nt, double E_iso,
                 double theta_core, double theta_wing, struct fluxParams *pars)
 {
@@ -997,41 +3079,69 @@ double flux_cone(double t_obs, double nu_obs, double E_iso, double theta_h,
     if(E_iso > 0.0 && theta_h > 0.0)
         set_jet_params(pars, E_iso, theta_h);
 
+    //Jet and counter-jet, integrated together by flux_grid()
+    if(pars->counter_jet)
+    {
+        flux_cone_grid(t_obs, &nu_obs, 1, &Fboth, theta_cone_low,
+                        theta_cone_hi, &atol, pars);
+        return Fboth;
+    }
+
     //Jet 
     theta_obs_cur = theta_obs;
     set_obs_params(pars, t_obs, nu_obs, theta_obs_cur, 
                     theta_cone_hi, theta_cone_low);
     F1 = flux(pars, atol);
     
-    //Counter-jet
-    /* 
-    theta_obs_cur = 180*deg2rad - theta_obs;
-    set_obs_params(pars, t_obs, nu_obs, theta_obs_cur, 
-                    theta_cone_hi, theta_cone_low);
-    F2 = flux(pars, atol);
-    */
     F2 = 0.0;
     Fboth = F1 + F2;
 
 
     if(F1 != F1 || F1 < 0.0)
-        printf("bad F1:%.3lg t_obs=%.3le theta_lo=%.3lf theta_hi=%.3lf\n",
-                F1, t_obs, theta_cone_low, theta_cone_hi);
+        diag_warning(&(pars->diag), "bad F1:%.3lg t_obs=%.3le"
+                    " theta_lo=%.3lf theta_hi=%.3lf",
+                    F1, t_obs, theta_cone_low, theta_cone_hi);
     if(F2 != F2 || F2 < 0.0)
-        printf("bad F2:%.3lg t_obs=%.3le theta_lo=%.3lf theta_hi=%.3lf\n",
-                F2, t_obs, theta_cone_low, theta_cone_hi);
+        diag_warning(&(pars->diag), "bad F2:%.3lg t_obs=%.3le"
+                    " theta_lo=%.3lf theta_hi=%.3lf",
+                    F2, t_obs, theta_cone_low, theta_cone_hi);
 
     return Fboth;
 }
 
-double intensity(double theta, double phi, double tobs, double nuobs,
-                double theta_obs, double theta_cone_hi, double theta_cone_low,
-                struct fluxParams *pars)
+void flux_cone_grid(double t_obs, double *nu_obs, int Nnu, double *F,
+                    double theta_cone_low, double theta_cone_hi, double *atol,
+                    struct fluxParams *pars)
 {
-    double I = 0;
+    // flux_cone() at a single t_obs and Nnu frequencies nu_obs.  Assumes
+    // set_jet_params() has already been called for this cone.
+    int j;
 
-    int remakeMu = 0;
-    if(tobs != pars->t_obs)
+    set_obs_params(pars, t_obs, nu_obs[0], pars->theta_obs, 
+                    theta_cone_hi, theta_cone_low);
+    pars->nu_grid = nu_obs;
+    pars->n_nu = Nnu;
+
+    flux_grid(pars, atol, F);
+
+    pars->nu_grid = NULL;
+    pars->n_nu = 0;
+
+    for(j=0; j<Nnu; j++)
+        if(F[j] != F[j] || F[j] < 0.0)
+            diag_warning(&(pars->diag), "bad F1:%.3lg t_obs=%.3le nu=%.3le"
+                        " theta_lo=%.3lf theta_hi=%.3lf", F[j], t_obs,
+                        nu_obs[j], theta_cone_low, theta_cone_hi);
+}
+
+double intensity(double theta, double phi, double tobs, double nuobs,
+                double theta_obs, double theta_cone_hi, double theta_cone_low,
+                struct fluxParams *pars)
+{
+    double I = 0;
+
+    int remakeMu = 0;
+    if(tobs != pars->t_obs)
         remakeMu = 1;
     set_obs_params(pars, tobs, nuobs, theta_obs, theta_cone_hi, 
                     theta_cone_low);
@@ -1049,7 +3159,9 @@ double intensity(double theta, double phi, double tobs, double nuobs,
     t_e = check_t_e(t_e, mu, pars->t_obs, pars->mu_table, 
                                 pars->table_entries);
     if(t_e < 0.0)
-        printf("WTFWTF\n");
+        diag_warning(&(pars->diag), "point not on the shock surface:"
+                        " theta=%.3lf phi=%.3lf t_obs=%.3le",
+                        theta, phi, tobs);
 
     double R = interpolateLog(ia, ib, t_e, pars->t_table,
                                 pars->R_table, pars->table_entries);
@@ -1088,7 +3200,9 @@ void shockVals(double theta, double phi, double tobs,
     t_e = check_t_e(t_e, mu, pars->t_obs, pars->mu_table, 
                                 pars->table_entries);
     if(t_e < 0.0)
-        printf("WTFWTF\n");
+        diag_warning(&(pars->diag), "point not on the shock surface:"
+                        " theta=%.3lf phi=%.3lf t_obs=%.3le",
+                        theta, phi, tobs);
 
 
     *t = t_e;
@@ -1100,6 +3214,141 @@ void shockVals(double theta, double phi, double tobs,
                           pars->th_table, pars->table_entries);
 }
 
+struct thetaBuckets
+{
+    int n;          // buckets of width w from theta = 0, the last holds
+    double w;       //   points with no (comparable) theta
+    int *start;     // bucket b is idx[start[b]..end[b]), in index order
+    int *end;
+    int *idx;
+    int *cand;      // the points selected for one cone
+};
+
+static inline int theta_bucket(struct thetaBuckets *tb, double theta)
+{
+    if(!(theta >= 0.0))
+        return theta < 0.0 ? 0 : tb->n - 1;
+    if(theta >= (tb->n - 2) * tb->w)
+        return tb->n - 2;
+    return (int)(theta / tb->w);
+}
+
+static void theta_buckets_make(struct thetaBuckets *tb, double *theta, int N,
+                                double w)
+{
+    // Counting sort of the points by theta into buckets of width w.
+    int j, b;
+    double th_max = 0.0;
+    for(j=0; j<N; j++)
+        if(theta[j] > th_max && theta[j] <= PI)
+            th_max = theta[j];
+
+    tb->w = w;
+    tb->n = (int)(th_max / w) + 3;
+    tb->start = (int *)malloc((2*tb->n + 1) * sizeof(int));
+    tb->end = tb->start + tb->n + 1;
+    tb->idx = (int *)malloc(2 * N * sizeof(int));
+    tb->cand = tb->idx + N;
+
+    for(b=0; b<=tb->n; b++)
+        tb->start[b] = 0;
+    for(j=0; j<N; j++)
+        tb->start[theta_bucket(tb, theta[j]) + 1]++;
+    for(b=0; b<tb->n; b++)
+    {
+        tb->start[b+1] += tb->start[b];
+        tb->end[b] = tb->start[b];
+    }
+    for(j=0; j<N; j++)
+    {
+        b = theta_bucket(tb, theta[j]);
+        tb->idx[tb->end[b]++] = j;
+    }
+}
+
+static int theta_buckets_select(struct thetaBuckets *tb, double th_lo,
+                                double th_hi, double *done)
+{
+    // The points which may lie in [th_lo, th_hi], or have no theta, and
+    // have not been done (done[j] > 0), in index order.  Points found done
+    // are dropped from their buckets.
+    int b, k;
+    int n = 0;
+    int b0 = (int)(th_lo / tb->w) - 1;
+    int b1 = th_hi < (tb->n - 2) * tb->w ? (int)(th_hi / tb->w) + 1
+                                          : tb->n - 2;
+    if(b0 < 0)
+        b0 = 0;
+
+    int used = 0;
+    for(b=b0; b<tb->n; b++)
+    {
+        if(b > b1 && b < tb->n - 1)
+            continue;
+        int m = tb->start[b];
+        for(k=tb->start[b]; k<tb->end[b]; k++)
+        {
+            int j = tb->idx[k];
+            if(done[j] > 0.0)
+                continue;
+            tb->idx[m++] = j;
+            tb->cand[n++] = j;
+        }
+        tb->end[b] = m;
+        used += m > tb->start[b];
+    }
+    if(used > 1)
+        qsort(tb->cand, n, sizeof(int), &int_cmp_asc);
+
+    return n;
+}
+
+static void theta_buckets_free(struct thetaBuckets *tb)
+{
+    free(tb->start);
+    free(tb->idx);
+}
+
+static double jet_edge_bound(struct fluxParams *pars, double theta0,
+                                double t_obs_max)
+{
+    // An upper bound on find_jet_edge(phi, ..., theta0) for the current
+    // tables at any phi and any observer time up to t_obs_max: the edge
+    // never passes the spread th_table has reached by the last entry
+    // still on the surface.
+    double th = theta0;
+    int N = pars->table_entries;
+    int k;
+
+    if(!(t_obs_max < INFINITY))
+        return INFINITY;
+    for(k=0; k<N; k++)
+    {
+        if(pars->th_table[k] > th)
+            th = pars->th_table[k];
+        // One entry of margin past the surface, for rounding in mu_table.
+        if(k > 0 && pars->t_table[k-1] - pars->R_table[k-1]*invv_light
+                        > t_obs_max)
+            break;
+    }
+    return th;
+}
+
+static double max_time(double *t, int N)
+{
+    // Largest of t, inf if any is nan.
+    double t_max = t[0];
+    int j;
+    for(j=0; j<N; j++)
+    {
+        if(t[j] != t[j])
+            return INFINITY;
+        if(t[j] > t_max)
+            t_max = t[j];
+    }
+    return t_max;
+}
+
 void intensity_cone(double *theta, double *phi, double *t, double *nu, 
                         double *I, int N, double E_iso_core, 
                         double theta_h_core, double theta_h_wing, 
@@ -1160,7 +3409,7 @@ void intensity_struct(double *theta, double *phi, double *t, double *nu,
 {
     //Intensity of a structured jet.
     
-    int i,j;
+    int i,j,k;
     //No Core
     for(j=0; j<N; j++)
         I[j] = 0.0;
@@ -1174,6 +3423,12 @@ void intensity_struct(double *theta, double *phi, double *t, double *nu,
 
     double Fcoeff = cgs2mJy / (4*M_PI*dL*dL);
 
+    // Each cone only visits the points which may lie within its
+    // (spread) extent.
+    struct thetaBuckets tb;
+    theta_buckets_make(&tb, theta, N, Dtheta);
+    double t_max = max_time(t, N);
+
     for(i=0; i<res_cones; i++)
     {
         theta_c = (i+0.5) * Dtheta;
@@ -1188,8 +3443,11 @@ void intensity_struct(double *theta, double *phi, double *t, double *nu,
                         theta_cone_low);
         make_mu_table(pars);
 
-        for(j=0; j<N; j++)
+        double th_b_max = jet_edge_bound(pars, theta_cone_hi, t_max);
+        int n = theta_buckets_select(&tb, theta_cone_low, th_b_max, I);
+        for(k=0; k<n; k++)
         {
+            j = tb.cand[k];
             double th = theta[j];
             double ph = phi[j];
 
@@ -1215,6 +3473,8 @@ void intensity_struct(double *theta, double *phi, double *t, double *nu,
                                     theta_cone_hi, theta_cone_low, pars);
         }
     }
+
+    theta_buckets_free(&tb);
 }
 
 void intensity_structCore(double *theta, double *phi, double *t, double *nu, 
@@ -1226,7 +3486,7 @@ void intensity_structCore(double *theta, double *phi, double *t, double *nu,
 {
     //Intensity of a structured jet.
     
-    int i,j;
+    int i,j,k;
     //Core
     intensity_cone(theta, phi, t, nu, I, N, E_iso_core, 0.0, theta_h_core,
                     pars);
@@ -1240,6 +3500,12 @@ void intensity_structCore(double *theta, double *phi, double *t, double *nu,
 
     double Fcoeff = cgs2mJy / (4*M_PI*dL*dL);
 
+    // Each cone only visits the points which may lie within its
+    // (spread) extent.
+    struct thetaBuckets tb;
+    theta_buckets_make(&tb, theta, N, Dtheta);
+    double t_max = max_time(t, N);
+
     for(i=0; i<res_cones; i++)
     {
         theta_c = (i+0.5) * Dtheta;
@@ -1254,8 +3520,11 @@ void intensity_structCore(double *theta, double *phi, double *t, double *nu,
                         theta_cone_low);
         make_mu_table(pars);
         
-        for(j=0; j<N; j++)
+        double th_b_max = jet_edge_bound(pars, theta_cone_hi, t_max);
+        int n = theta_buckets_select(&tb, theta_cone_low, th_b_max, I);
+        for(k=0; k<n; k++)
         {
+            j = tb.cand[k];
             double th = theta[j];
             double ph = phi[j];
             
@@ -1281,6 +3550,8 @@ void intensity_structCore(double *theta, double *phi, double *t, double *nu,
                                     theta_cone_hi, theta_cone_low, pars);
         }
     }
+
+    theta_buckets_free(&tb);
 }
 
 void shockVals_cone(double *theta, double *phi, double *tobs,
@@ -1347,7 +3618,7 @@ void shockVals_struct(double *theta, double *phi, double *tobs,
 {
     //Intensity of a structured jet.
     
-    int i,j;
+    int i,j,k;
     //No Core
     for(j=0; j<N; j++)
     {
@@ -1363,6 +3634,12 @@ void shockVals_struct(double *theta, double *phi, double *tobs,
     Dtheta = theta_h_wing / res_cones;
     theta_obs = pars->theta_obs;
 
+    // Each cone only visits the points which may lie within its
+    // (spread) extent.
+    struct thetaBuckets tb;
+    theta_buckets_make(&tb, theta, N, Dtheta);
+    double t_max = max_time(tobs, N);
+
     for(i=0; i<res_cones; i++)
     {
         theta_c = (i+0.5) * Dtheta;
@@ -1377,8 +3654,11 @@ void shockVals_struct(double *theta, double *phi, double *tobs,
                         theta_cone_low);
         make_mu_table(pars);
 
-        for(j=0; j<N; j++)
+        double th_b_max = jet_edge_bound(pars, theta_cone_hi, t_max);
+        int n = theta_buckets_select(&tb, theta_cone_low, th_b_max, t);
+        for(k=0; k<n; k++)
         {
+            j = tb.cand[k];
             double th = theta[j];
             double ph = phi[j];
 
@@ -1397,75 +3677,1586 @@ void shockVals_struct(double *theta, double *phi, double *tobs,
                                      pars->th_table_inner,
                                      pars->table_entries_inner);
 
-            if(th < th_a || th > th_b)
-                continue;
+            if(th < th_a || th > th_b)
+                continue;
+
+            shockVals(th, ph, tobs[j], t+j, R+j, u+j, thj+j,
+                      theta_obs, theta_cone_hi, theta_cone_low, pars);
+        }
+    }
+
+    theta_buckets_free(&tb);
+}
+
+void shockVals_structCore(double *theta, double *phi, double *tobs, 
+                          double *t, double *R, double *u, double *thj, int N,
+                          double E_iso_core, 
+                          double theta_h_core, double theta_h_wing,
+                          int res_cones, double (*f_E)(double,void *),
+                          struct fluxParams *pars)
+{
+    //Intensity of a structured jet.
+    
+    int i,j,k;
+    //Core
+    shockVals_cone(theta, phi, tobs, t, R, u, thj, N, E_iso_core, 0.0,
+                    theta_h_core, pars);
+
+    double Dtheta, theta_cone_hi, theta_cone_low, theta_h, theta_c, E_iso;
+    double theta_obs;
+
+    Dtheta = theta_h_wing / res_cones;
+    theta_obs = pars->theta_obs;
+
+    // Each cone only visits the points which may lie within its
+    // (spread) extent.
+    struct thetaBuckets tb;
+    theta_buckets_make(&tb, theta, N, Dtheta);
+    double t_max = max_time(tobs, N);
+
+    for(i=0; i<res_cones; i++)
+    {
+        theta_c = (i+0.5) * Dtheta;
+        E_iso = f_E(theta_c, pars);
+
+        theta_cone_hi = (i+1) * Dtheta;
+        theta_cone_low = i * Dtheta;
+        theta_h = theta_cone_hi;
+
+        set_jet_params(pars, E_iso, theta_h);
+        set_obs_params(pars, tobs[0], 1.0, theta_obs, theta_cone_hi, 
+                        theta_cone_low);
+        make_mu_table(pars);
+        
+        double th_b_max = jet_edge_bound(pars, theta_cone_hi, t_max);
+        int n = theta_buckets_select(&tb, theta_cone_low, th_b_max, t);
+        for(k=0; k<n; k++)
+        {
+            j = tb.cand[k];
+            double th = theta[j];
+            double ph = phi[j];
+            
+            if(t[j] > 0.0 || th < theta_cone_low)
+                continue;
+
+            double th_a, th_b;
+            th_b = find_jet_edge(ph, pars->cto, pars->sto, theta_cone_hi,
+                                 pars->mu_table, pars->th_table,
+                                 pars->table_entries);
+            if(pars->table_entries_inner == 0)
+                th_a = (theta_cone_low / theta_cone_hi) * th_b;
+            else
+                th_a = find_jet_edge(ph, pars->cto, pars->sto, theta_cone_hi,
+                                     pars->mu_table_inner, 
+                                     pars->th_table_inner,
+                                     pars->table_entries_inner);
+
+            if(th < th_a || th > th_b)
+                continue;
+
+            shockVals(th, ph, tobs[j], t+j, R+j, u+j, thj+j,
+                      theta_obs, theta_cone_hi, theta_cone_low, pars);
+        }
+    }
+
+    theta_buckets_free(&tb);
+}
+
+void lc_jet_points(int jet_type, double *t, double *nu, double *Fnu, int N,
+                    int latRes, struct fluxParams *pars)
+{
+    // Flux at each (t[i], nu[i]) in turn.
+
+    double E_iso_core = pars->E_iso_core;
+    double theta_h_core = pars->theta_core;
+    double theta_h_wing = pars->theta_wing;
+
+    int res_cones = (int) (latRes*theta_h_wing / theta_h_core);
+
+    if(jet_type == _tophat)
+    {
+        lc_tophat(t, nu, Fnu, N, E_iso_core, theta_h_core, pars);
+    }
+    else if(jet_type == _cone)
+    {
+        lc_cone(t, nu, Fnu, N, E_iso_core, theta_h_core, theta_h_wing, pars);
+    }
+    else if(jet_type == _Gaussian)
+    {
+        lc_struct(t, nu, Fnu, N, E_iso_core, theta_h_core, 
+                theta_h_wing, NULL, NULL, res_cones, &f_E_Gaussian, pars);
+    }
+    else if(jet_type == _powerlaw)
+    {
+        lc_struct(t, nu, Fnu, N, E_iso_core, theta_h_core, 
+                theta_h_wing, NULL, NULL, res_cones, &f_E_powerlaw, pars);
+    }
+    else if(jet_type == _twocomponent)
+    {
+        lc_struct(t, nu, Fnu, N, E_iso_core, theta_h_core, 
+                theta_h_wing, NULL, NULL, res_cones, &f_E_twocomponent, pars);
+    }
+    else if(jet_type == _Gaussian_core)
+    {
+        lc_structCore(t, nu, Fnu, N, E_iso_core, theta_h_core, 
+                theta_h_wing, NULL, NULL, res_cones, &f_E_GaussianCore, pars);
+    }
+    else if(jet_type == _powerlaw_core)
+    {
+        lc_structCore(t, nu, Fnu, N, E_iso_core, theta_h_core, 
+                theta_h_wing, NULL, NULL, res_cones, &f_E_powerlawCore, pars);
+    }
+    else if(jet_type == _exponential)
+    {
+        lc_structCore(t, nu, Fnu, N, E_iso_core, theta_h_core, 
+                theta_h_wing, NULL, NULL, res_cones, &f_E_exponential, pars);
+    }
+    else if(jet_type == _tophat + 10)
+    {
+        lc_vec(t, nu, Fnu, N, E_iso_core, theta_h_core, theta_h_core, 
+                res_cones, &f_E_tophat, &f_Etot_tophat, pars);
+    }
+    else if(jet_type == _Gaussian + 10)
+    {
+        lc_vec(t, nu, Fnu, N, E_iso_core, theta_h_core, theta_h_wing, 
+                res_cones, &f_E_Gaussian, &f_Etot_Gaussian, pars);
+    }
+    else if(jet_type == _powerlaw + 10)
+    {
+        lc_vec(t, nu, Fnu, N, E_iso_core, theta_h_core, theta_h_wing, 
+                res_cones, &f_E_powerlaw, &f_Etot_powerlaw, pars);
+    }
+}
+
+static int nan_last_cmp(double a, double b)
+{
+    // Orders NaN after every number, so qsort sees a consistent order.
+    if(a < b)
+        return -1;
+    if(a > b)
+        return 1;
+    if(a == b)
+        return 0;
+    return isnan(a) - isnan(b);
+}
+
+int obsPoint_cmp(const void *a, const void *b)
+{
+    const struct obsPoint *pa = (const struct obsPoint *) a;
+    const struct obsPoint *pb = (const struct obsPoint *) b;
+
+    int c = nan_last_cmp(pa->t, pb->t);
+    if(c != 0)
+        return c;
+    c = nan_last_cmp(pa->nu, pb->nu);
+    if(c != 0)
+        return c;
+    return pa->i - pb->i;
+}
+
+void make_obsPlan(struct obsPlan *plan, double *t, double *nu, int N)
+{
+    // Sort the requested points by time then frequency, collapse exact
+    // duplicates, and group the remaining points by time.
+
+    int i;
+    struct obsPoint *pts = (struct obsPoint *)malloc(N
+                                                * sizeof(struct obsPoint));
+    for(i=0; i<N; i++)
+    {
+        pts[i].t = t[i];
+        pts[i].nu = nu[i];
+        pts[i].i = i;
+    }
+    qsort(pts, N, sizeof(struct obsPoint), &obsPoint_cmp);
+
+    plan->N = N;
+    plan->index = (int *)malloc(N * sizeof(int));
+    plan->nu = (double *)malloc(N * sizeof(double));
+    plan->t = (double *)malloc(N * sizeof(double));
+    plan->start = (int *)malloc((N+1) * sizeof(int));
+
+    int Nu = 0;
+    int Ng = 0;
+    for(i=0; i<N; i++)
+    {
+        if(Ng == 0 || pts[i].t != plan->t[Ng-1])
+        {
+            plan->t[Ng] = pts[i].t;
+            plan->start[Ng] = Nu;
+            Ng++;
+        }
+        else if(pts[i].nu == plan->nu[Nu-1])
+        {
+            // Duplicate of the previous point.
+            plan->index[pts[i].i] = Nu-1;
+            continue;
+        }
+        plan->nu[Nu] = pts[i].nu;
+        plan->index[pts[i].i] = Nu;
+        Nu++;
+    }
+    plan->start[Ng] = Nu;
+    plan->Nu = Nu;
+    plan->Ng = Ng;
+    plan->Nnu = 0;
+
+    free(pts);
+}
+
+void make_obsPlan_grid(struct obsPlan *plan, double *t, int Nt, double *nu,
+                        int Nnu)
+{
+    // Plan for the outer product of the axes t and nu, without forming it.
+    // Each distinct time is a group of every distinct frequency, so only
+    // the axes are sorted.  index[i] is the group of t[i], and index[Nt+j]
+    // the position of nu[j] in the shared frequencies, so requested point
+    // (i, j) is unique point index[i]*Nnu + index[Nt+j].
+
+    int i;
+    struct obsPoint *pts = (struct obsPoint *)malloc((Nt > Nnu ? Nt : Nnu)
+                                                * sizeof(struct obsPoint));
+
+    plan->N = Nt*Nnu;
+    plan->index = (int *)malloc((Nt + Nnu) * sizeof(int));
+    plan->nu = (double *)malloc(Nnu * sizeof(double));
+    plan->t = (double *)malloc(Nt * sizeof(double));
+    plan->start = (int *)malloc((Nt+1) * sizeof(int));
+
+    for(i=0; i<Nt; i++)
+    {
+        pts[i].t = t[i];
+        pts[i].nu = 0.0;
+        pts[i].i = i;
+    }
+    qsort(pts, Nt, sizeof(struct obsPoint), &obsPoint_cmp);
+    int Ng = 0;
+    for(i=0; i<Nt; i++)
+    {
+        if(Ng == 0 || pts[i].t != plan->t[Ng-1])
+            plan->t[Ng++] = pts[i].t;
+        plan->index[pts[i].i] = Ng-1;
+    }
+
+    for(i=0; i<Nnu; i++)
+    {
+        pts[i].t = nu[i];
+        pts[i].nu = 0.0;
+        pts[i].i = i;
+    }
+    qsort(pts, Nnu, sizeof(struct obsPoint), &obsPoint_cmp);
+    int Nf = 0;
+    for(i=0; i<Nnu; i++)
+    {
+        if(Nf == 0 || pts[i].t != plan->nu[Nf-1])
+            plan->nu[Nf++] = pts[i].t;
+        plan->index[Nt + pts[i].i] = Nf-1;
+    }
+
+    for(i=0; i<=Ng; i++)
+        plan->start[i] = i*Nf;
+    plan->Nu = Ng*Nf;
+    plan->Ng = Ng;
+    plan->Nnu = Nf;
+
+    free(pts);
+}
+
+double *obsPlan_nu(struct obsPlan *plan, int g)
+{
+    // The frequencies of group g.
+    if(plan->Nnu > 0)
+        return plan->nu;
+    return plan->nu + plan->start[g];
+}
+
+void free_obsPlan(struct obsPlan *plan)
+{
+    free(plan->index);
+    free(plan->nu);
+    free(plan->t);
+    free(plan->start);
+    plan->index = NULL;
+    plan->nu = NULL;
+    plan->t = NULL;
+    plan->start = NULL;
+    plan->N = 0;
+    plan->Nu = 0;
+    plan->Ng = 0;
+    plan->Nnu = 0;
+}
+
+void lc_plan_cone(struct obsPlan *plan, double *F,
+                    double theta_cone_low, double theta_cone_hi,
+                    int res_cones, struct fluxParams *pars)
+{
+    // Add the flux of the current cone to F, one time group at a time.
+    // With pars->n_grad > 0, derivative k of the flux at point j is
+    // accumulated in F[(k+1)*plan->Nu + j], and any moments after them.
+    int i, j, k;
+    int Nu = plan->Nu;
+    int ng = value_blocks(pars) - 1;
+    double *dF = (double *)malloc((2+ng) * Nu * sizeof(double));
+    double *atol = dF + (1+ng)*Nu;
+
+    for(i=0; i<plan->Ng; i++)
+    {
+        int a = plan->start[i];
+        int Nnu = plan->start[i+1] - a;
+        double *dFa = dF + (1+ng)*a;
+        for(j=a; j<a+Nnu; j++)
+            atol[j] = F[j]*pars->flux_rtol/res_cones;
+        flux_cone_grid(plan->t[i], obsPlan_nu(plan, i), Nnu, dFa,
+                        theta_cone_low, theta_cone_hi, atol + a, pars);
+        for(j=0; j<Nnu; j++)
+            F[a+j] += dFa[j];
+        for(k=1; k<=ng; k++)
+            for(j=0; j<Nnu; j++)
+                F[k*Nu+a+j] += dFa[k*Nnu+j];
+
+        if(pars->chi2 != NULL && chi2_update(pars->chi2, F, a, a+Nnu))
+            break;
+    }
+
+    free(dF);
+}
+
+double cone_density(double theta, int latRes, double (*f_E)(double, void *),
+                    struct fluxParams *pars)
+{
+    // Cones per radian at theta for the adaptive decomposition.  A floor
+    // of 0.6*latRes per theta_core, more where the energy changes quickly,
+    // and more within about a core width of the line of sight, where the
+    // cones' emission changes fastest with their position.
+
+    double thc = pars->theta_core;
+    double h = 1.0e-3*thc;
+    double tha = theta > h ? theta-h : 0.0;
+    double Ea = f_E(tha, pars);
+    double Eb = f_E(theta+h, pars);
+    double dlnE = 0.0;
+    if(Ea > 0.0 && Eb > 0.0)
+        dlnE = fabs(log(Eb/Ea)) / (theta+h - tha);
+    double x = (theta - pars->theta_obs) / thc;
+
+    return latRes/thc * (0.6 + 0.2*thc*dlnE + 0.5*exp(-0.5*x*x));
+}
+
+int make_cone_slices(struct coneSlice *cones, int max_cones, double theta_0,
+                        double theta_1, int latRes,
+                        double (*f_E)(double, void *),
+                        struct fluxParams *pars)
+{
+    // Split [theta_0, theta_1] into at most max_cones cones, with edges
+    // placed so each holds an equal share of the integral of
+    // cone_density().  Returns the number of cones.
+
+    int N = 256;
+    int i, k;
+    double cum[257];
+    double dth = (theta_1 - theta_0) / N;
+
+    double rho0 = cone_density(theta_0, latRes, f_E, pars);
+    cum[0] = 0.0;
+    for(i=1; i<=N; i++)
+    {
+        double rho1 = cone_density(theta_0 + i*dth, latRes, f_E, pars);
+        cum[i] = cum[i-1] + 0.5*(rho0+rho1)*dth;
+        rho0 = rho1;
+    }
+
+    int n = (int)ceil(cum[N]);
+    if(pars->res_cones > 0)
+        n = pars->res_cones;
+    if(n > max_cones)
+        n = max_cones;
+    if(n < 1)
+        n = 1;
+
+    double theta_lo = theta_0;
+    for(k=0; k<n; k++)
+    {
+        double theta_hi = theta_1;
+        if(k < n-1)
+        {
+            double c = cum[N] * (k+1) / n;
+            i = searchSorted(c, cum, N+1);
+            if(i >= N)
+                i = N-1;
+            double x = cum[i+1] > cum[i] ? (c-cum[i])/(cum[i+1]-cum[i]) : 0.0;
+            theta_hi = theta_0 + (i+x)*dth;
+        }
+        cones[k].theta_lo = theta_lo;
+        cones[k].theta_hi = theta_hi;
+        cones[k].E_iso = f_E(0.5*(theta_lo+theta_hi), pars);
+        cones[k].est = 0.0;
+        theta_lo = theta_hi;
+    }
+
+    return n;
+}
+
+static void view_R_tables(struct fluxParams *pars, struct coneTable *c,
+                            struct coneTable *inner)
+{
+    // Point the current and inner tables at cached solutions rather than
+    // copying them in.  The mu tables remain the parameters' own.
+    pars->t_table = c->t_table;
+    pars->R_table = c->R_table;
+    pars->u_table = c->u_table;
+    pars->th_table = c->th_table;
+    pars->table_entries = c->table_entries;
+
+    if(inner == NULL)
+    {
+        pars->table_entries_inner = 0;
+        return;
+    }
+    pars->t_table_inner = inner->t_table;
+    pars->R_table_inner = inner->R_table;
+    pars->u_table_inner = inner->u_table;
+    pars->th_table_inner = inner->th_table;
+    pars->table_entries_inner = inner->table_entries;
+}
+
+void lc_plan_adaptive(struct obsPlan *plan, double *F, struct coneSlice *cones,
+                        int n_cones, struct fluxParams *pars)
+{
+    // Add the flux of the cones to F.  Time groups are done one at a
+    // time, and within each the cones are processed in order of their
+    // estimated contribution, so the running total that sets each cone's
+    // share of the error budget, F*rtol/n_cones, is close to the final
+    // flux as early as possible.  A cone's contribution is estimated by
+    // its flux in the previous time group, and for the first by its
+    // energy, Doppler suppressed by its angular distance from the line of
+    // sight.  The cones' blast waves must be in the table cache, see
+    // make_R_tables(), and are used from there in place.
+
+    int i, j, k, g;
+    int Nu = plan->Nu;
+    int ng = value_blocks(pars) - 1;
+
+    double t0 = plan->Ng > 0 ? plan->t[0] : pars->ta;
+    for(k=0; k<n_cones; k++)
+    {
+        struct coneSlice *c = &(cones[k]);
+        set_jet_params(pars, c->E_iso, c->theta_hi);
+
+        double d = 0.0;
+        if(pars->theta_obs < c->theta_lo)
+            d = c->theta_lo - pars->theta_obs;
+        else if(pars->theta_obs > c->theta_hi)
+            d = pars->theta_obs - c->theta_hi;
+        int ia = searchSorted(t0, pars->t_table, pars->table_entries);
+        double u = pars->u_table[ia];
+        double x = 1.0 + u*u*d*d;
+        c->est = c->E_iso * (cos(c->theta_lo) - cos(c->theta_hi)) / (x*x*x);
+    }
+
+    // The loop above may have added to the cache, so its entries are only
+    // looked up now.  The parameters' own tables are set aside meanwhile.
+    struct coneTable **tab = (struct coneTable **)malloc(n_cones
+                                                * sizeof(struct coneTable *));
+    int Nmax = 0;
+    for(k=0; k<n_cones; k++)
+    {
+        set_jet_cone(pars, cones[k].E_iso, cones[k].theta_hi);
+        tab[k] = tableCache_find(pars->cache, pars);
+        if(tab[k]->table_entries > Nmax)
+            Nmax = tab[k]->table_entries;
+    }
+    pars->mu_table = (double *)realloc(pars->mu_table, Nmax * sizeof(double));
+    pars->mu_table_inner = (double *)realloc(pars->mu_table_inner,
+                                                Nmax * sizeof(double));
+    double *own[8] = {pars->t_table, pars->R_table, pars->u_table,
+                      pars->th_table, pars->t_table_inner,
+                      pars->R_table_inner, pars->u_table_inner,
+                      pars->th_table_inner};
+    int own_N = pars->table_entries;
+    int own_N_inner = pars->table_entries_inner;
+
+    int *order = (int *)malloc(n_cones * sizeof(int));
+    for(k=0; k<n_cones; k++)
+        order[k] = k;
+
+    double *dF = (double *)malloc((2+ng) * Nu * sizeof(double));
+    double *atol = dF + (1+ng)*Nu;
+
+    for(g=0; g<plan->Ng; g++)
+    {
+        int a = plan->start[g];
+        int Nnu = plan->start[g+1] - a;
+        double *dFa = dF + (1+ng)*a;
+
+        // Largest estimated contribution first.
+        for(i=1; i<n_cones; i++)
+        {
+            int o = order[i];
+            for(k=i; k>0 && cones[order[k-1]].est < cones[o].est; k--)
+                order[k] = order[k-1];
+            order[k] = o;
+        }
+
+        for(i=0; i<n_cones; i++)
+        {
+            k = order[i];
+            struct coneSlice *c = &(cones[k]);
+
+            // The inner edge of a cone follows the spreading of its
+            // inner neighbour.
+            set_jet_cone(pars, c->E_iso, c->theta_hi);
+            view_R_tables(pars, tab[k], k > 0 ? tab[k-1] : NULL);
+
+            for(j=a; j<a+Nnu; j++)
+                atol[j] = F[j]*pars->flux_rtol/n_cones;
+            flux_cone_grid(plan->t[g], obsPlan_nu(plan, g), Nnu, dFa,
+                            c->theta_lo, c->theta_hi, atol + a, pars);
+
+            c->est = 0.0;
+            for(j=0; j<Nnu; j++)
+            {
+                F[a+j] += dFa[j];
+                c->est += dFa[j];
+            }
+            for(j=1; j<=ng; j++)
+            {
+                int m;
+                for(m=0; m<Nnu; m++)
+                    F[j*Nu+a+m] += dFa[j*Nnu+m];
+            }
+        }
+
+        if(pars->chi2 != NULL && chi2_update(pars->chi2, F, a, a+Nnu))
+            break;
+    }
+
+    // Back to the parameters' own tables, which hold the last cone.
+    pars->t_table = own[0];
+    pars->R_table = own[1];
+    pars->u_table = own[2];
+    pars->th_table = own[3];
+    pars->t_table_inner = own[4];
+    pars->R_table_inner = own[5];
+    pars->u_table_inner = own[6];
+    pars->th_table_inner = own[7];
+    pars->table_entries = own_N;
+    pars->table_entries_inner = own_N_inner;
+    if(n_cones > 0)
+        set_jet_cone(pars, cones[n_cones-1].E_iso, cones[n_cones-1].theta_hi);
+
+    free(dF);
+    free(order);
+    free(tab);
+}
+
+void make_R_table_cocoon(struct fluxParams *pars)
+{
+    // Spherical shock of a cocoon, an outflow with energy distributed in
+    // velocity as E(>u) = Ei u^-k.  The cocoon parameters occupy the slots
+    // of the jet-like ones: theta_obs = umax, E_iso_core = umin,
+    // theta_core = Ei, theta_wing = k, and b = Mej in solar masses.
+
+    double umax = pars->theta_obs;
+    double umin = pars->E_iso_core;
+    double Ei = pars->theta_core;
+    double k = pars->theta_wing;
+    double Mej = pars->b * Msun;
+    double rho0 = m_p * pars->n_0;
+
+    double g0 = sqrt(1+umax*umax);
+    double bes0 = 4*umax*g0 / (4*umax*umax+3);
+    double Rd = pow(9*g0*g0*Mej / (4*PI*(g0+1)*(4*umax*umax+3)*rho0), 1./3.);
+    double td = Rd / (bes0 * v_light);
+
+    // Early enough to be coasting for every observer time.
+    double t0 = dmin(1.0e-2*td, dmin(0.5*g0*g0*pars->ta,
+                                     0.5*pars->ta/(1+bes0)));
+    double t1 = 2.0*g0*g0*pars->tb;
+    int table_entries = (int)(pars->tRes * log10(t1/t0));
+
+    shift_R_tables(pars, table_entries);
+
+    double *t_table = pars->t_table;
+
+    double fac = pow(t1/t0, 1.0/(table_entries-1.0));
+    t_table[0] = t0;
+
+    int i;
+    for(i=1; i<table_entries; i++)
+        t_table[i] = t_table[i-1] * fac;
+    for(i=0; i<table_entries; i++)
+        pars->th_table[i] = PI;
+
+    double args[9] = {umax, Mej, rho0, Ei, k, umin, pars->L0, pars->q,
+                        pars->ts};
+    shockEvolveRK4(t_table, pars->R_table, pars->u_table, table_entries,
+                    bes0*v_light*t0, umax, args);
+}
+
+void cocoon_integrand_grid(double a_theta, double *dP, void *params)
+{
+    // Emissivity of the ring at polar angle a_theta (from the line of
+    // sight) on the equal arrival time surface of pars->t_obs, at all of
+    // the pars->n_nu frequencies pars->nu_grid.
+    struct fluxParams *pars = (struct fluxParams *) params;
+
+    double mu = cos(a_theta);
+    int N = pars->table_entries;
+    int ia = searchSorted(mu, pars->mu_table, N);
+    int ib = ia + 1;
+
+    double t_e = interpolateLin(ia, ib, mu, pars->mu_table, pars->t_table, N);
+    double u = interpolateLog(ia, ib, t_e, pars->t_table, pars->u_table, N);
+    double R = interpolateLog(ia, ib, t_e, pars->t_table, pars->R_table, N);
+    double g = sqrt(u*u+1);
+    double us = 4*u*g / sqrt(8*u*u+9);
+
+    emissivity_spec(pars->nu_grid, dP, pars->n_nu, R, sin(a_theta), mu, t_e,
+                    u, us, pars->n_0, pars->p, pars->epsilon_E,
+                    pars->epsilon_B, pars->ksi_N, pars->spec_type,
+                    pars->n_grad > 0 ? dP + pars->n_nu : NULL,
+                    &(pars->diag));
+
+    // The ring projects to a circle of radius R sin(theta) on the sky,
+    // centred on the line of sight.
+    int j;
+    if(pars->n_mom > 0)
+    {
+        double *M = dP + (1+pars->n_grad)*pars->n_nu;
+        double r = R * sin(a_theta);
+        sky_moments(dP, pars->n_nu, M, 0.0, 0.5*r*r);
+        for(j=0; j<pars->n_nu; j++)
+            M[pars->n_nu+j] = M[2*pars->n_nu+j];
+    }
+    for(j=0; j<value_blocks(pars)*pars->n_nu; j++)
+        dP[j] *= 2*PI;
+}
+
+static void cocoon_piece(struct fluxParams *pars, double *I, double *I1,
+                            int Nv, int Nnu, double xa, double xb,
+                            double *atol)
+{
+    // Integral of cocoon_integrand_grid() over one smooth piece [xa, xb].
+    // Gauss-Legendre rules of 2 and 4 GAUSS_NODES points are compared and
+    // the latter accepted if they agree to atol + THETA_ACC at every
+    // frequency, otherwise the piece is integrated with romb_vec().  Two
+    // high order rules agree by chance far less often than the first
+    // levels of Romberg do on a steep integrand.  I1 is scratch of Nv.
+    int j;
+    struct workMark mark = work_mark(&(pars->work));
+    double *R = work_push(&(pars->work), (KMAX+2) * Nv);
+    gauss_vec(&cocoon_integrand_grid, I1, Nv, xa, xb, 2*GAUSS_NODES, pars,
+                R);
+    gauss_vec(&cocoon_integrand_grid, I, Nv, xa, xb, 4*GAUSS_NODES, pars,
+                R);
+    for(j=0; j<Nnu; j++)
+        if(!(fabs(I[j] - I1[j]) < atol[j] + THETA_ACC*fabs(I[j])))
+            break;
+    if(j < Nnu)
+        romb_vec(&cocoon_integrand_grid, I, Nv, Nnu, xa, xb, 0, atol,
+                    THETA_ACC, pars, R);
+    work_pop(&(pars->work), mark);
+}
+
+void lc_plan_cocoon(struct obsPlan *plan, double *F, struct fluxParams *pars)
+{
+    // Flux of a cocoon at the unique points of plan, laid out as by
+    // lc_plan().  One shock solution serves every time, and each time's
+    // frequencies share the integration over the equal arrival time
+    // surface.
+    int i, j, k;
+    int Nu = plan->Nu;
+    int ng = value_blocks(pars) - 1;
+    double Fcoeff = cgs2mJy / (4*PI * pars->d_L*pars->d_L);
+    double *P = (double *)malloc(3 * (1+ng) * Nu * sizeof(double));
+    double *dP = P + (1+ng)*Nu;
+    double *dP1 = dP + (1+ng)*Nu;
+    double *atol = (double *)malloc(Nu * sizeof(double));
+
+    make_R_table_cocoon(pars);
+    int N = pars->table_entries;
+    double *t_table = pars->t_table;
+    double *u_table = pars->u_table;
+
+    // The shock's velocity changes abruptly where u falls below umin and
+    // where energy injection ends, and, as each RK4 stage of the step
+    // crosses them, over a few rows after.  u(t) is interpolated as a
+    // power law between rows, so these are kinks of the integrand at
+    // table rows, which Romberg integration can mistake for convergence.
+    // They are found as rows where the log slope of u turns by more than
+    // 10 dlog(t), far more than it does smoothly from one row to the next.
+    int krow[THETA_BREAKS];
+    int nkrow = 0;
+    double dl = log(t_table[1] / t_table[0]);
+    for(j=1; j<N-1 && nkrow < THETA_BREAKS; j++)
+    {
+        double s0 = log(u_table[j] / u_table[j-1]);
+        double s1 = log(u_table[j+1] / u_table[j]);
+        if(fabs(s1 - s0) > 10*dl*dl)
+            krow[nkrow++] = j;
+    }
+
+    for(i=0; i<plan->Ng; i++)
+    {
+        int a = plan->start[i];
+        int Nnu = plan->start[i+1] - a;
+        int Nv = (1+ng)*Nnu;
+
+        pars->t_obs = plan->t[i];
+        make_mu_table(pars);
+        pars->nu_grid = obsPlan_nu(plan, i);
+        pars->n_nu = Nnu;
+
+        // Emission is beamed within ~1/gamma of the line of sight, so
+        // integrate over theta in pieces of half of max(w, theta), with
+        // w = 1/gamma along the line of sight.  The pieces are also split
+        // at the rows above and at the spectral breaks, located within
+        // their table interval by mu_breaks_scan(), ending 1e-8 short of
+        // each as in romb_split(), so each piece is smooth.
+        int ia = searchSorted(1.0, pars->mu_table, N);
+        double t_e = interpolateLin(ia, ia+1, 1.0, pars->mu_table,
+                                    t_table, N);
+        double u = interpolateLog(ia, ia+1, t_e, t_table, u_table, N);
+        int nth = 0;
+
+        pars->n_mu_breaks = 0;
+        if(!mu_breaks_scan(pars, -1.0, 1.0))
+            pars->n_mu_breaks = 0;
+        struct workMark mark = work_mark(&(pars->work));
+        double *th_brk = work_push(&(pars->work),
+                                    pars->n_mu_breaks + nkrow);
+        for(j=0; j<pars->n_mu_breaks; j++)
+            th_brk[nth++] = acos(pars->mu_breaks[j]);
+        for(j=0; j<nkrow; j++)
+        {
+            double mu = pars->mu_table[krow[j]];
+            if(mu > -1.0 && mu < 1.0)
+                th_brk[nth++] = acos(mu);
+        }
+        nth = sort_breaks(th_brk, nth, 0.0, PI);
+
+        double w = 1.0/sqrt(1+u*u);
+        double gap = 1.0e-8 * PI;
+        double th0 = 0.0;
+        int at_brk = 0;
+        int ib = 0;
+
+        for(j=0; j<Nv; j++)
+            P[j] = 0.0;
+        while(th0 < PI)
+        {
+            double th1 = th0 + 0.5 * (th0 > w ? th0 : w);
+            int to_brk = 0;
+            if(th1 > PI)
+                th1 = PI;
+            if(ib < nth && th_brk[ib] <= th1)
+            {
+                th1 = th_brk[ib++];
+                to_brk = 1;
+            }
+            for(j=0; j<Nnu; j++)
+                atol[j] = 0.1 * pars->flux_rtol * P[j];
+            cocoon_piece(pars, dP, dP1, Nv, Nnu, at_brk ? th0 + gap : th0,
+                            to_brk ? th1 - gap : th1, atol);
+            for(j=0; j<Nv; j++)
+                P[j] += dP[j];
+            th0 = th1;
+            at_brk = to_brk;
+        }
+        work_pop(&(pars->work), mark);
+
+        for(j=0; j<Nnu; j++)
+            F[a+j] = Fcoeff * P[j];
+        for(k=1; k<=ng; k++)
+            for(j=0; j<Nnu; j++)
+                F[k*Nu+a+j] = Fcoeff * P[k*Nnu+j];
+
+        if(pars->chi2 != NULL && chi2_update(pars->chi2, F, a, a+Nnu))
+            break;
+    }
+
+    pars->nu_grid = NULL;
+    pars->n_nu = 0;
+    free(atol);
+    free(P);
+}
+
+int jet_cones(int jet_type, int latRes, struct fluxParams *pars,
+                struct coneSlice **cones_out, int *n_core_out)
+{
+    // The conical sections a jet-like model is summed over, cores with a
+    // distinct energy first (*n_core_out of them).  The rest are split
+    // uniformly or by make_cone_slices().  Returns their number and
+    // mallocs *cones_out, or 0 if jet_type is not jet-like.
+
+    double E_iso_core = pars->E_iso_core;
+    double theta_h_core = pars->theta_core;
+    double theta_h_wing = pars->theta_wing;
+
+    int res_cones = (int) (latRes*theta_h_wing / theta_h_core);
+    if(pars->res_cones > 0)
+        res_cones = pars->res_cones;
+
+    double (*f_E)(double, void *) = NULL;
+    double theta_0 = 0.0;
+    int i;
+
+    if(jet_type == _tophat || jet_type == _cone)
+        f_E = NULL;
+    else if(jet_type == _Gaussian)
+        f_E = &f_E_Gaussian;
+    else if(jet_type == _powerlaw)
+        f_E = &f_E_powerlaw;
+    else if(jet_type == _twocomponent)
+        f_E = &f_E_twocomponent;
+    else if(jet_type == _Gaussian_core)
+        f_E = &f_E_GaussianCore;
+    else if(jet_type == _powerlaw_core)
+        f_E = &f_E_powerlawCore;
+    else if(jet_type == _exponential)
+        f_E = &f_E_exponential;
+    else
+        return 0;
+
+    int max_cones = 4*res_cones + 8;
+    struct coneSlice *cones = (struct coneSlice *)malloc((max_cones+1)
+                                            * sizeof(struct coneSlice));
+    *cones_out = cones;
+    *n_core_out = 0;
+
+    if(jet_type == _tophat || jet_type == _cone)
+    {
+        cones[0].theta_lo = jet_type == _tophat ? 0.0 : theta_h_core;
+        cones[0].theta_hi = jet_type == _tophat ? theta_h_core : theta_h_wing;
+        cones[0].E_iso = E_iso_core;
+        *n_core_out = 1;
+        return 1;
+    }
+
+    int n_core = 0;
+    if(jet_type == _Gaussian_core || jet_type == _powerlaw_core
+            || jet_type == _exponential)
+    {
+        cones[0].theta_lo = 0.0;
+        cones[0].theta_hi = theta_h_core;
+        cones[0].E_iso = E_iso_core;
+        theta_0 = theta_h_core;
+        n_core = 1;
+    }
+
+    int n = n_core;
+    if(pars->cone_adapt)
+        n += make_cone_slices(cones+n, max_cones, theta_0, theta_h_wing,
+                                latRes, f_E, pars);
+    else
+    {
+        double Dtheta = (theta_h_wing - theta_0) / res_cones;
+
+        for(i=0; i<res_cones; i++)
+        {
+            double theta_c = theta_0 + (i+0.5) * Dtheta;
+            cones[n].E_iso = f_E(theta_c, pars);
+            cones[n].theta_hi = theta_0 + (i+1) * Dtheta;
+            cones[n].theta_lo = theta_0 + i * Dtheta;
+            n++;
+        }
+    }
+
+    *n_core_out = n_core;
+    return n;
+}
+
+int lc_plan(int jet_type, struct obsPlan *plan, double *F, int latRes,
+                struct fluxParams *pars)
+{
+    // Flux at the unique points of plan, in group order, see obsPlan_nu().
+    // Returns 0 if jet_type has no planned version.
+
+    int res_cones = (int) (latRes*pars->theta_wing / pars->theta_core);
+    if(pars->res_cones > 0)
+        res_cones = pars->res_cones;
+
+    int i;
+    struct coneSlice *cones = NULL;
+    int n_core = 0;
+    int n = 0;
+
+    if(jet_type != _cocoon)
+    {
+        n = jet_cones(jet_type, latRes, pars, &cones, &n_core);
+        if(n == 0)
+            return 0;
+    }
+
+    for(i=0; i<value_blocks(pars)*plan->Nu; i++)
+        F[i] = 0.0;
+
+    if(jet_type == _cocoon)
+    {
+        lc_plan_cocoon(plan, F, pars);
+        return 1;
+    }
+
+    if(jet_type == _tophat || jet_type == _cone)
+    {
+        set_jet_params(pars, cones[0].E_iso, cones[0].theta_hi);
+        lc_plan_cone(plan, F, cones[0].theta_lo, cones[0].theta_hi, 1, pars);
+        free(cones);
+        return 1;
+    }
+
+    // All the cones' blast waves are solved together up front and kept in
+    // the table cache.
+    struct tableCache local_cache;
+    int own_cache = pars->cache == NULL;
+    if(own_cache)
+    {
+        tableCache_init(&local_cache);
+        pars->cache = &local_cache;
+    }
+
+    make_R_tables(pars, cones, n);
+
+    if(pars->cone_adapt)
+        lc_plan_adaptive(plan, F, cones, n, pars);
+    else
+    {
+        for(i=0; i<n; i++)
+        {
+            set_jet_params(pars, cones[i].E_iso, cones[i].theta_hi);
+            lc_plan_cone(plan, F, cones[i].theta_lo, cones[i].theta_hi,
+                            i < n_core ? 1 : res_cones, pars);
+            if(pars->chi2 != NULL && pars->chi2->stopped)
+                break;
+        }
+    }
+
+    free(cones);
+    if(own_cache)
+    {
+        tableCache_free(&local_cache);
+        pars->cache = NULL;
+    }
+
+    return 1;
+}
+
+void lc_jet_plan(int jet_type, struct obsPlan *plan, double *t, double *nu,
+                    double *Fnu, int latRes, struct fluxParams *pars)
+{
+    // Flux at the points (t, nu) described by plan, in the caller's order.
+    int N = plan->N;
+    double *F = (double *)malloc(plan->Nu * sizeof(double));
+
+    if(lc_plan(jet_type, plan, F, latRes, pars))
+    {
+        int i;
+        for(i=0; i<N; i++)
+            Fnu[i] = F[plan->index[i]];
+    }
+    else
+        lc_jet_points(jet_type, t, nu, Fnu, N, latRes, pars);
+
+    free(F);
+}
+
+int lc_jet_grad(int jet_type, struct obsPlan *plan, double *Fnu,
+                    double *dFnu, int latRes, struct fluxParams *pars)
+{
+    // Flux at the points described by plan, in the caller's order, and
+    // its derivatives dFnu[k*N + i] with respect to p, epsilon_E,
+    // epsilon_B, and ksi_N.  The derivatives are integrated alongside the
+    // flux, on the points chosen for the flux.  Returns 0 if jet_type has
+    // no planned version.
+    int N = plan->N;
+    int Nu = plan->Nu;
+    int i, k;
+    double *F = (double *)malloc((1+N_GRAD) * Nu * sizeof(double));
+
+    pars->n_grad = N_GRAD;
+    select_integrands(pars);
+    int planned = lc_plan(jet_type, plan, F, latRes, pars);
+    pars->n_grad = 0;
+    select_integrands(pars);
+
+    if(planned)
+    {
+        for(i=0; i<N; i++)
+            Fnu[i] = F[plan->index[i]];
+        for(k=0; k<N_GRAD; k++)
+            for(i=0; i<N; i++)
+                dFnu[k*N+i] = F[(k+1)*Nu + plan->index[i]];
+    }
+
+    free(F);
+    return planned;
+}
+
+int lc_jet_moments(int jet_type, struct obsPlan *plan, double *Fnu,
+                    double *mom, int latRes, struct fluxParams *pars)
+{
+    // Flux at the points described by plan, in the caller's order, and
+    // the flux-weighted centroid mom[i] of the image along the projected
+    // jet axis, its rms width about the centroid mom[N+i], and its rms
+    // width across the axis mom[2*N+i], in cm.  The moments are
+    // integrated alongside the flux, on the points chosen for the flux.
+    // Returns 0 if jet_type has no planned version.
+    int N = plan->N;
+    int Nu = plan->Nu;
+    int i;
+    double *F = (double *)malloc((1+N_MOM) * Nu * sizeof(double));
+
+    pars->n_mom = N_MOM;
+    select_integrands(pars);
+    int planned = lc_plan(jet_type, plan, F, latRes, pars);
+    pars->n_mom = 0;
+    select_integrands(pars);
+
+    if(planned)
+    {
+        for(i=0; i<N; i++)
+        {
+            int j = plan->index[i];
+            double Fj = F[j];
+            Fnu[i] = Fj;
+            mom[i] = 0.0;
+            mom[N+i] = 0.0;
+            mom[2*N+i] = 0.0;
+            if(Fj > 0.0)
+            {
+                double x = F[Nu+j] / Fj;
+                double x2 = F[2*Nu+j] / Fj - x*x;
+                mom[i] = x;
+                mom[N+i] = x2 > 0.0 ? sqrt(x2) : 0.0;
+                mom[2*N+i] = sqrt(F[3*Nu+j] / Fj);
+            }
+        }
+    }
+
+    free(F);
+    return planned;
+}
+
+void lc_jet(int jet_type, double *t, double *nu, double *Fnu, int N,
+            int latRes, struct fluxParams *pars)
+{
+    // Flux at each (t[i], nu[i]).  Points are evaluated in time order,
+    // each distinct time once for all of its frequencies, and scattered
+    // back to the caller's order.
+
+    struct obsPlan plan;
+    make_obsPlan(&plan, t, nu, N);
+
+    lc_jet_plan(jet_type, &plan, t, nu, Fnu, latRes, pars);
+
+    free_obsPlan(&plan);
+}
+
+void setup_chi2Data(struct chi2Data *cd, struct obsPlan *plan, double *Fobs,
+                    double *Ferr, int *ul, double fac, double chi2_max)
+{
+    // Observed fluxes Fobs with uncertainties Ferr at the points of plan.
+    // Points with ul[i] != 0 are upper limits.  Model fluxes are multiplied
+    // by fac (eg. 1+z) before comparing.
+
+    int N = plan->N;
+    int i;
+
+    cd->N = N;
+    cd->Fobs = Fobs;
+    cd->Ferr = Ferr;
+    cd->ul = ul;
+    cd->fac = fac;
+    cd->chi2_max = chi2_max;
+    cd->chi2 = 0.0;
+    cd->stopped = 0;
+    cd->contrib = (double *)malloc(N * sizeof(double));
+    cd->obs = (int *)malloc(N * sizeof(int));
+    cd->obs_start = (int *)malloc((plan->Nu+1) * sizeof(int));
+
+    // Observations belonging to each unique point, in CSR form.
+    for(i=0; i<=plan->Nu; i++)
+        cd->obs_start[i] = 0;
+    for(i=0; i<N; i++)
+        cd->obs_start[plan->index[i]+1]++;
+    for(i=0; i<plan->Nu; i++)
+        cd->obs_start[i+1] += cd->obs_start[i];
+
+    int *fill = (int *)malloc((plan->Nu+1) * sizeof(int));
+    for(i=0; i<plan->Nu; i++)
+        fill[i] = cd->obs_start[i];
+    for(i=0; i<N; i++)
+        cd->obs[fill[plan->index[i]]++] = i;
+    free(fill);
+
+    reset_chi2Data(cd);
+}
+
+void reset_chi2Data(struct chi2Data *cd)
+{
+    int i;
+    for(i=0; i<cd->N; i++)
+        cd->contrib[i] = 0.0;
+    cd->chi2 = 0.0;
+    cd->stopped = 0;
+}
+
+void free_chi2Data(struct chi2Data *cd)
+{
+    free(cd->contrib);
+    free(cd->obs);
+    free(cd->obs_start);
+    cd->contrib = NULL;
+    cd->obs = NULL;
+    cd->obs_start = NULL;
+}
+
+double chi2_point(double F, double Fobs, double Ferr, int ul)
+{
+    double x = (F - Fobs) / Ferr;
+    if(ul && F <= Fobs)
+        return 0.0;
+    return x*x;
+}
+
+int chi2_update(struct chi2Data *cd, double *F, int a, int b)
+{
+    // Update the running chi^2 bound with the partial fluxes F[a:b].
+    // Fluxes only grow as cones are added, so only points already above
+    // their observed value contribute.  Returns 1 if the bound exceeds
+    // chi2_max.
+
+    int i, j;
+    for(j=a; j<b; j++)
+    {
+        double Fj = cd->fac * F[j];
+        for(i=cd->obs_start[j]; i<cd->obs_start[j+1]; i++)
+        {
+            int k = cd->obs[i];
+            double c = 0.0;
+            if(Fj > cd->Fobs[k])
+                c = chi2_point(Fj, cd->Fobs[k], cd->Ferr[k],
+                                cd->ul == NULL ? 0 : cd->ul[k]);
+            cd->chi2 += c - cd->contrib[k];
+            cd->contrib[k] = c;
+        }
+    }
+
+    if(cd->chi2 > cd->chi2_max)
+        cd->stopped = 1;
+
+    return cd->stopped;
+}
+
+double lc_jet_chi2(int jet_type, struct obsPlan *plan, double *t, double *nu,
+                    double *Fnu, struct chi2Data *cd, int latRes,
+                    struct fluxParams *pars)
+{
+    // chi^2 of the model against the observations in cd.  If the running
+    // bound passes cd->chi2_max the evaluation stops early, cd->stopped is
+    // set, and the (larger than chi2_max) bound is returned.  Otherwise
+    // the model fluxes are left in Fnu and the exact chi^2 is returned.
+
+    int N = plan->N;
+    int i;
+    double *F = (double *)malloc(plan->Nu * sizeof(double));
+
+    reset_chi2Data(cd);
+    pars->chi2 = cd;
+    int planned = lc_plan(jet_type, plan, F, latRes, pars);
+    pars->chi2 = NULL;
+
+    if(planned && cd->stopped)
+    {
+        free(F);
+        return cd->chi2;
+    }
+
+    if(planned)
+        for(i=0; i<N; i++)
+            Fnu[i] = F[plan->index[i]];
+    else
+        lc_jet_points(jet_type, t, nu, Fnu, N, latRes, pars);
+    free(F);
+
+    double chi2 = 0.0;
+    for(i=0; i<N; i++)
+        chi2 += chi2_point(cd->fac * Fnu[i], cd->Fobs[i], cd->Ferr[i],
+                            cd->ul == NULL ? 0 : cd->ul[i]);
+    cd->chi2 = chi2;
+
+    return chi2;
+}
+
+void lc_jet_grid(int jet_type, double *t, int Nt, double *nu, int Nnu,
+                    double *Fnu, int latRes, struct fluxParams *pars)
+{
+    // Flux on the outer product of t and nu, Fnu[i*Nnu + j] = F(t[i], nu[j]).
+    // The plan groups every frequency under its time, so the geometry is
+    // done once per cone and time, and the product itself is never formed.
+
+    int i, j;
+    struct obsPlan plan;
+    make_obsPlan_grid(&plan, t, Nt, nu, Nnu);
+    double *F = (double *)malloc(plan.Nu * sizeof(double));
+
+    if(lc_plan(jet_type, &plan, F, latRes, pars))
+    {
+        for(i=0; i<Nt; i++)
+        {
+            double *Fg = F + plan.index[i] * plan.Nnu;
+            for(j=0; j<Nnu; j++)
+                Fnu[i*Nnu+j] = Fg[plan.index[Nt+j]];
+        }
+    }
+    else
+    {
+        double *tt = (double *)malloc(Nnu * sizeof(double));
+        for(i=0; i<Nt; i++)
+        {
+            for(j=0; j<Nnu; j++)
+                tt[j] = t[i];
+            lc_jet_points(jet_type, tt, nu, Fnu + i*Nnu, Nnu, latRes, pars);
+        }
+        free(tt);
+    }
+
+    free(F);
+    free_obsPlan(&plan);
+}
+
+void intensity_jet(int jet_type, double *theta, double *phi, double *t,
+                    double *nu, double *Inu, int N, int latRes,
+                    struct fluxParams *pars)
+{
+    double E_iso_core = pars->E_iso_core;
+    double theta_h_core = pars->theta_core;
+    double theta_h_wing = pars->theta_wing;
+
+    int res_cones = (int) (latRes*theta_h_wing / theta_h_core);
+
+    if(jet_type == _tophat)
+    {
+        intensity_cone(theta, phi, t, nu, Inu, N, E_iso_core, 0.0, theta_h_core,
+                            pars);
+    }
+    else if(jet_type == _cone)
+    {
+        intensity_cone(theta, phi, t, nu, Inu, N, E_iso_core, theta_h_core,
+                        theta_h_wing, pars);
+    }
+    else if(jet_type == _Gaussian)
+    {
+        intensity_struct(theta, phi, t, nu, Inu, N, E_iso_core, theta_h_core, 
+                theta_h_wing, res_cones, &f_E_Gaussian, pars);
+    }
+    else if(jet_type == _powerlaw)
+    {
+        intensity_struct(theta, phi, t, nu, Inu, N, E_iso_core, theta_h_core, 
+                theta_h_wing, res_cones, &f_E_powerlaw, pars);
+    }
+    else if(jet_type == _Gaussian_core)
+    {
+        intensity_structCore(theta, phi, t, nu, Inu, N, E_iso_core, 
+                            theta_h_core, theta_h_wing, res_cones,
+                            &f_E_GaussianCore, pars);
+    }
+    else if(jet_type == _powerlaw_core)
+    {
+        intensity_structCore(theta, phi, t, nu, Inu, N, E_iso_core, 
+                                theta_h_core, theta_h_wing, res_cones, 
+                                &f_E_powerlawCore, pars);
+    }
+}
+
+struct imageTile
+{
+    double *x;          // pixel edges, Nx+1 and Ny+1 of them
+    double *y;
+    int Nx;
+    int Ny;
+    double *img;        // flux of each pixel, img[iy*Nx + ix], or NULL
+    double dpix;        // smallest pixel width
+    double rtol;
+    double atol;        // cells with less flux are never refined
+    double Fcoeff;
+    double cto;         // cos(theta_obs), negated for the counter-jet
+    int cj;
+    double sum;         // flux of the cells visited
+};
+
+static int image_pixel(double *e, int N, double v)
+{
+    // Index of the pixel holding v along edges e[0..N], -1 if outside.
+    if(!(v >= e[0] && v < e[N]))
+        return -1;
+    int a = 0;
+    int b = N;
+    while(b - a > 1)
+    {
+        int m = (a + b) / 2;
+        if(e[m] <= v)
+            a = m;
+        else
+            b = m;
+    }
+    return a;
+}
+
+static double image_node(double phi, double x, struct imageTile *tile,
+                            struct fluxParams *pars, double *sx, double *sy)
+{
+    // dF/dphi/dx (without Fcoeff) at the point of the current cone at
+    // azimuth phi, a fraction x of the way across its polar extent, and
+    // that point's position in the sky plane.  The sky x axis is the
+    // projection of the jet axis, y is along phi = pi/2.
+    double th0, th1;
+    phi_theta_bounds(phi, tile->cto, pars, &th0, &th1);
+    *sx = 0.0;
+    *sy = 0.0;
+    if(th0 >= th1)
+        return 0.0;
+
+    double th = th0 + x * (th1 - th0);
+    double st = sin(th);
+    double ct = cos(th);
+    double mu = st * pars->cp * pars->sto + ct * tile->cto;
+
+    double t_e, R, u, us, em;
+    shock_state(mu, pars, &t_e, &R, &u, &us);
+    emissivity_kernel(&(pars->nu_obs), &em, 1, R, st, mu, t_e, u, us,
+                        pars->n_0, pars->p, pars->epsilon_E, pars->epsilon_B,
+                        pars->ksi_N, pars->spec_type, NULL, &(pars->diag));
+    if(pars->nmask > 0)
+        em *= mask_factor(tile->cj ? PI - th : th, t_e, R, pars);
+
+    // Position R n, n = (st cp, st sp, +-ct) along the jet axis.
+    double nz = tile->cj ? -ct : ct;
+    *sx = R * (pars->sto * nz - pars->cto * st * pars->cp);
+    *sy = R * st * sin(phi);
+
+    return em * (th1 - th0);
+}
+
+static void image_cell(struct imageTile *tile, struct fluxParams *pars,
+                        double pa, double pb, double xa, double xb, int level)
+{
+    // Flux of the cell [pa, pb] x [xa, xb] from a 2x2 Gauss-Legendre rule,
+    // checked against the midpoint rule.  Cells whose estimates disagree
+    // (large gradients) or whose nodes spread over more than a pixel are
+    // split in four, the rest deposit each node's flux in its pixel and
+    // its mirror image at -phi.
+    double g = 0.5 / sqrt(3.0);
+    double pm = 0.5*(pa + pb);
+    double xm = 0.5*(xa + xb);
+    double dp = pb - pa;
+    double dx = xb - xa;
+    double f[4], sx[4], sy[4];
+    double fc, sxc, syc;
+    int i;
+
+    for(i=0; i<4; i++)
+        f[i] = image_node(pm + (i&1 ? g : -g)*dp, xm + (i&2 ? g : -g)*dx,
+                            tile, pars, sx+i, sy+i);
+    fc = image_node(pm, xm, tile, pars, &sxc, &syc);
+
+    double w = 0.25 * dp * dx * tile->Fcoeff;
+    double F2 = w * (f[0] + f[1] + f[2] + f[3]);
+    double F1 = 4 * w * fc;
+    double err = fabs(F2 - F1);
 
-            shockVals(th, ph, tobs[j], t+j, R+j, u+j, thj+j,
-                      theta_obs, theta_cone_hi, theta_cone_low, pars);
+    double xlo = sxc, xhi = sxc, ylo = syc, yhi = syc;
+    for(i=0; i<4; i++)
+    {
+        xlo = sx[i] < xlo ? sx[i] : xlo;
+        xhi = sx[i] > xhi ? sx[i] : xhi;
+        ylo = sy[i] < ylo ? sy[i] : ylo;
+        yhi = sy[i] > yhi ? sy[i] : yhi;
+    }
+    double size = xhi - xlo > yhi - ylo ? xhi - xlo : yhi - ylo;
+
+    // Nothing of this cell (or its mirror) can land in the image.
+    double y0 = tile->y[0] - size;
+    double y1 = tile->y[tile->Ny] + size;
+    if(xhi + size < tile->x[0] || xlo - size > tile->x[tile->Nx]
+        || ((yhi < y0 || ylo > y1) && (-ylo < y0 || -yhi > y1)))
+    {
+        tile->sum += F2;
+        return;
+    }
+
+    if(level < IMAGE_LEVELS)
+    {
+        int refine = (err > tile->rtol * fabs(F2) && err > tile->atol)
+                        || (size > tile->dpix && F2 > tile->atol);
+        if(refine)
+        {
+            image_cell(tile, pars, pa, pm, xa, xm, level+1);
+            image_cell(tile, pars, pm, pb, xa, xm, level+1);
+            image_cell(tile, pars, pa, pm, xm, xb, level+1);
+            image_cell(tile, pars, pm, pb, xm, xb, level+1);
+            return;
         }
     }
+
+    tile->sum += F2;
+    for(i=0; i<4 && tile->img != NULL; i++)
+    {
+        int ix = image_pixel(tile->x, tile->Nx, sx[i]);
+        if(ix < 0)
+            continue;
+        int iy = image_pixel(tile->y, tile->Ny, sy[i]);
+        if(iy >= 0)
+            tile->img[iy*tile->Nx + ix] += w * f[i];
+        iy = image_pixel(tile->y, tile->Ny, -sy[i]);
+        if(iy >= 0)
+            tile->img[iy*tile->Nx + ix] += w * f[i];
+    }
 }
 
-void shockVals_structCore(double *theta, double *phi, double *tobs, 
-                          double *t, double *R, double *u, double *thj, int N,
-                          double E_iso_core, 
-                          double theta_h_core, double theta_h_wing,
-                          int res_cones, double (*f_E)(double,void *),
-                          struct fluxParams *pars)
+int image_jet(int jet_type, double *x, int Nx, double *y, int Ny, double t,
+                double nu, double *img, int latRes, struct fluxParams *pars)
 {
-    //Intensity of a structured jet.
-    
-    int i,j;
-    //Core
-    shockVals_cone(theta, phi, tobs, t, R, u, thj, N, E_iso_core, 0.0,
-                    theta_h_core, pars);
-
-    double Dtheta, theta_cone_hi, theta_cone_low, theta_h, theta_c, E_iso;
-    double theta_obs;
+    // Image of the jet (and counter-jet, if pars->counter_jet) at
+    // observer time t and frequency nu: the flux in each of the Nx by Ny
+    // pixels with edges x[0..Nx] and y[0..Ny] (increasing, in cm in the
+    // sky plane), img[iy*Nx + ix].  The equal arrival time surface of each
+    // cone is cut into tiles in phi and theta, refined independently, so
+    // nothing but the image is kept.  Returns 0 if jet_type is not
+    // jet-like.
+
+    struct coneSlice *cones;
+    int n_core;
+    int n = jet_cones(jet_type, latRes, pars, &cones, &n_core);
+    if(n == 0)
+        return 0;
 
-    Dtheta = theta_h_wing / res_cones;
-    theta_obs = pars->theta_obs;
+    int i, j, k, c;
+    for(i=0; i<Nx*Ny; i++)
+        img[i] = 0.0;
 
-    for(i=0; i<res_cones; i++)
+    struct tableCache local_cache;
+    int own_cache = pars->cache == NULL;
+    if(own_cache)
     {
-        theta_c = (i+0.5) * Dtheta;
-        E_iso = f_E(theta_c, pars);
+        tableCache_init(&local_cache);
+        pars->cache = &local_cache;
+    }
+    make_R_tables(pars, cones, n);
+
+    struct imageTile tile;
+    tile.x = x;
+    tile.y = y;
+    tile.Nx = Nx;
+    tile.Ny = Ny;
+    tile.img = img;
+    tile.dpix = x[Nx] - x[0];
+    for(i=0; i<Nx; i++)
+        if(x[i+1] - x[i] < tile.dpix)
+            tile.dpix = x[i+1] - x[i];
+    for(i=0; i<Ny; i++)
+        if(y[i+1] - y[i] < tile.dpix)
+            tile.dpix = y[i+1] - y[i];
+    tile.rtol = pars->flux_rtol;
+    tile.Fcoeff = cgs2mJy / (4*PI * pars->d_L*pars->d_L);
+
+    // A first pass over the coarsest tiles, without refining, sets the
+    // absolute tolerance: rtol of the mean flux per pixel.
+    int n_sides = pars->counter_jet ? 2 : 1;
+    double dphi = PI / IMAGE_TILES_PHI;
+    double dx = 1.0 / IMAGE_TILES_THETA;
+    int pass;
+    for(pass=0; pass<2; pass++)
+    {
+        if(pass == 0)
+        {
+            tile.atol = INFINITY;
+            tile.img = NULL;
+        }
+        tile.sum = 0.0;
+        for(c=0; c<n; c++)
+        {
+            // The inner edge of a cone follows the spreading of its
+            // inner neighbour.
+            if(c > 0)
+                set_jet_params(pars, cones[c-1].E_iso, cones[c-1].theta_hi);
+            set_jet_params(pars, cones[c].E_iso, cones[c].theta_hi);
+            if(c == 0)
+                pars->table_entries_inner = 0;
+            set_obs_params(pars, t, nu, pars->theta_obs, cones[c].theta_hi,
+                            cones[c].theta_lo);
+            make_mu_table(pars);
+
+            for(k=0; k<n_sides; k++)
+            {
+                tile.cj = k;
+                tile.cto = k ? -pars->cto : pars->cto;
+                for(i=0; i<IMAGE_TILES_PHI; i++)
+                    for(j=0; j<IMAGE_TILES_THETA; j++)
+                        image_cell(&tile, pars, i*dphi, (i+1)*dphi, j*dx,
+                                    (j+1)*dx, pass == 0 ? IMAGE_LEVELS : 0);
+            }
+        }
+        if(pass == 0)
+        {
+            tile.img = img;
+            tile.atol = tile.rtol * 2*tile.sum / (Nx*Ny);
+        }
+    }
 
-        theta_cone_hi = (i+1) * Dtheta;
-        theta_cone_low = i * Dtheta;
-        theta_h = theta_cone_hi;
+    free(cones);
+    if(own_cache)
+    {
+        tableCache_free(&local_cache);
+        pars->cache = NULL;
+    }
 
-        set_jet_params(pars, E_iso, theta_h);
-        set_obs_params(pars, tobs[0], 1.0, theta_obs, theta_cone_hi, 
-                        theta_cone_low);
-        make_mu_table(pars);
-        
-        for(j=0; j<N; j++)
-        {
-            double th = theta[j];
-            double ph = phi[j];
-            
-            if(t[j] > 0.0 || th < theta_cone_low)
-                continue;
+    return 1;
+}
 
-            double th_a, th_b;
-            th_b = find_jet_edge(ph, pars->cto, pars->sto, theta_cone_hi,
-                                 pars->mu_table, pars->th_table,
-                                 pars->table_entries);
-            if(pars->table_entries_inner == 0)
-                th_a = (theta_cone_low / theta_cone_hi) * th_b;
-            else
-                th_a = find_jet_edge(ph, pars->cto, pars->sto, theta_cone_hi,
-                                     pars->mu_table_inner, 
-                                     pars->th_table_inner,
-                                     pars->table_entries_inner);
+void shockVals_jet(int jet_type, double *theta, double *phi, double *tobs,
+                    double *t, double *R, double *u, double *thj, int N,
+                    int latRes, struct fluxParams *pars)
+{
+    double E_iso_core = pars->E_iso_core;
+    double theta_h_core = pars->theta_core;
+    double theta_h_wing = pars->theta_wing;
 
-            if(th < th_a || th > th_b)
-                continue;
+    int res_cones = (int) (latRes*theta_h_wing / theta_h_core);
 
-            shockVals(th, ph, tobs[j], t+j, R+j, u+j, thj+j,
-                      theta_obs, theta_cone_hi, theta_cone_low, pars);
-        }
+    if(jet_type == _tophat)
+    {
+        shockVals_cone(theta, phi, tobs, t, R, u, thj, N, E_iso_core, 0.0,
+                        theta_h_core, pars);
+    }
+    else if(jet_type == _cone)
+    {
+        shockVals_cone(theta, phi, tobs, t, R, u, thj, N, E_iso_core,
+                        theta_h_core, theta_h_wing, pars);
+    }
+    else if(jet_type == _Gaussian)
+    {
+        shockVals_struct(theta, phi, tobs, t, R, u, thj, N, E_iso_core,
+                         theta_h_core, theta_h_wing, res_cones, &f_E_Gaussian,
+                         pars);
+    }
+    else if(jet_type == _powerlaw)
+    {
+        shockVals_struct(theta, phi, tobs, t, R, u, thj, N, E_iso_core,
+                         theta_h_core, theta_h_wing, res_cones, &f_E_powerlaw,
+                         pars);
+    }
+    else if(jet_type == _Gaussian_core)
+    {
+        shockVals_structCore(theta, phi, tobs, t, R, u, thj, N, E_iso_core,
+                             theta_h_core, theta_h_wing, res_cones,
+                             &f_E_GaussianCore, pars);
+    }
+    else if(jet_type == _powerlaw_core)
+    {
+        shockVals_structCore(theta, phi, tobs, t, R, u, thj, N, E_iso_core,
+                             theta_h_core, theta_h_wing, res_cones,
+                             &f_E_powerlawCore, pars);
     }
 }
 
@@ -1479,8 +5270,12 @@ void calc_flux_density(int jet_type, int spec_type, double *t, double *nu,
                             double g0, double E_core_global,
                             double theta_h_core_global,
                             int tRes, int latRes, double rtol, double *mask,
-                            int nmask, int spread, int gamma_type)
+                            int nmask, int spread, int gamma_type,
+                            int counterjet, int adaptive, double *mom,
+                            struct fluxDiag *diag)
 {
+    // With mom != NULL, also the image moments of lc_jet_moments(), nan
+    // for models without them.
     double ta = t[0];
     double tb = t[0];
     int i;
@@ -1492,68 +5287,74 @@ void calc_flux_density(int jet_type, int spec_type, double *t, double *nu,
             tb = t[i];
     }
 
-    int res_cones = (int) (latRes*theta_h_wing / theta_h_core);
-
     struct fluxParams fp;
     setup_fluxParams(&fp, d_L, theta_obs, E_iso_core, theta_h_core,
                         theta_h_wing, b, L0, q, ts,
                         n_0, p, epsilon_E, epsilon_B, ksi_N, g0, 
                         E_core_global, theta_h_core_global, ta, tb, tRes,
                         spec_type, rtol, mask, nmask, spread, gamma_type);
+    fp.counter_jet = counterjet;
+    fp.cone_adapt = adaptive;
 
-    if(jet_type == _tophat)
-    {
-        lc_tophat(t, nu, Fnu, N, E_iso_core, theta_h_core, &fp);
-    }
-    else if(jet_type == _cone)
-    {
-        lc_cone(t, nu, Fnu, N, E_iso_core, theta_h_core, theta_h_wing, &fp);
-    }
-    else if(jet_type == _Gaussian)
-    {
-        lc_struct(t, nu, Fnu, N, E_iso_core, theta_h_core, 
-                theta_h_wing, NULL, NULL, res_cones, &f_E_Gaussian, &fp);
-    }
-    else if(jet_type == _powerlaw)
-    {
-        lc_struct(t, nu, Fnu, N, E_iso_core, theta_h_core, 
-                theta_h_wing, NULL, NULL, res_cones, &f_E_powerlaw, &fp);
-    }
-    else if(jet_type == _twocomponent)
+    if(mom != NULL)
     {
-        lc_struct(t, nu, Fnu, N, E_iso_core, theta_h_core, 
-                theta_h_wing, NULL, NULL, res_cones, &f_E_twocomponent, &fp);
-    }
-    else if(jet_type == _Gaussian_core)
-    {
-        lc_structCore(t, nu, Fnu, N, E_iso_core, theta_h_core, 
-                theta_h_wing, NULL, NULL, res_cones, &f_E_GaussianCore, &fp);
-    }
-    else if(jet_type == _powerlaw_core)
-    {
-        lc_structCore(t, nu, Fnu, N, E_iso_core, theta_h_core, 
-                theta_h_wing, NULL, NULL, res_cones, &f_E_powerlawCore, &fp);
-    }
-    else if(jet_type == _exponential)
-    {
-        lc_structCore(t, nu, Fnu, N, E_iso_core, theta_h_core, 
-                theta_h_wing, NULL, NULL, res_cones, &f_E_exponential, &fp);
-    }
-    else if(jet_type == _tophat + 10)
-    {
-        lc_vec(t, nu, Fnu, N, E_iso_core, theta_h_core, theta_h_core, 
-                res_cones, &f_E_tophat, &f_Etot_tophat, &fp);
-    }
-    else if(jet_type == _Gaussian + 10)
-    {
-        lc_vec(t, nu, Fnu, N, E_iso_core, theta_h_core, theta_h_wing, 
-                res_cones, &f_E_Gaussian, &f_Etot_Gaussian, &fp);
+        struct obsPlan plan;
+        make_obsPlan(&plan, t, nu, N);
+        if(!lc_jet_moments(jet_type, &plan, Fnu, mom, latRes, &fp))
+        {
+            lc_jet_points(jet_type, t, nu, Fnu, N, latRes, &fp);
+            for(i=0; i<3*N; i++)
+                mom[i] = NAN;
+        }
+        free_obsPlan(&plan);
     }
-    else if(jet_type == _powerlaw + 10)
+    else
+        lc_jet(jet_type, t, nu, Fnu, N, latRes, &fp);
+
+    if(diag != NULL)
+        *diag = fp.diag;
+    free_fluxParams(&fp);
+}
+
+void calc_flux_density_grid(int jet_type, int spec_type, 
+                            double *t, int Nt, double *nu, int Nnu,
+                            double *Fnu,
+                            double theta_obs, double E_iso_core,
+                            double theta_h_core, double theta_h_wing, 
+                            double b, double L0, double q, double ts, 
+                            double n_0, double p, double epsilon_E,
+                            double epsilon_B, double ksi_N, double d_L,
+                            double g0, double E_core_global,
+                            double theta_h_core_global,
+                            int tRes, int latRes, double rtol, double *mask,
+                            int nmask, int spread, int gamma_type,
+                            int counterjet, int adaptive,
+                            struct fluxDiag *diag)
+{
+    double ta = t[0];
+    double tb = t[0];
+    int i;
+    for(i=0; i<Nt; i++)
     {
-        lc_vec(t, nu, Fnu, N, E_iso_core, theta_h_core, theta_h_wing, 
-                res_cones, &f_E_powerlaw, &f_Etot_powerlaw, &fp);
+        if(t[i] < ta)
+            ta = t[i];
+        else if(t[i] > tb)
+            tb = t[i];
     }
+
+    struct fluxParams fp;
+    setup_fluxParams(&fp, d_L, theta_obs, E_iso_core, theta_h_core,
+                        theta_h_wing, b, L0, q, ts,
+                        n_0, p, epsilon_E, epsilon_B, ksi_N, g0, 
+                        E_core_global, theta_h_core_global, ta, tb, tRes,
+                        spec_type, rtol, mask, nmask, spread, gamma_type);
+    fp.counter_jet = counterjet;
+    fp.cone_adapt = adaptive;
+
+    lc_jet_grid(jet_type, t, Nt, nu, Nnu, Fnu, latRes, &fp);
+
+    if(diag != NULL)
+        *diag = fp.diag;
     free_fluxParams(&fp);
 }
 
@@ -1567,7 +5368,8 @@ void calc_intensity(int jet_type, int spec_type, double *theta, double *phi,
                             double g0, double E_core_global,
                             double theta_h_core_global,
                             int tRes, int latRes, double rtol, double *mask,
-                            int nmask, int spread, int gamma_type)
+                            int nmask, int spread, int gamma_type,
+                            struct fluxDiag *diag)
 {
     double ta = t[0];
     double tb = t[0];
@@ -1580,8 +5382,6 @@ void calc_intensity(int jet_type, int spec_type, double *theta, double *phi,
             tb = t[i];
     }
 
-    int res_cones = (int) (latRes*theta_h_wing / theta_h_core);
-
     struct fluxParams fp;
     setup_fluxParams(&fp, d_L, theta_obs, E_iso_core, theta_h_core,
                         theta_h_wing, b, L0, q, ts,
@@ -1589,38 +5389,10 @@ void calc_intensity(int jet_type, int spec_type, double *theta, double *phi,
                         E_core_global, theta_h_core_global, ta, tb, tRes,
                         spec_type, rtol, mask, nmask, spread, gamma_type);
 
-    if(jet_type == _tophat)
-    {
-        intensity_cone(theta, phi, t, nu, Inu, N, E_iso_core, 0.0, theta_h_core,
-                            &fp);
-    }
-    else if(jet_type == _cone)
-    {
-        intensity_cone(theta, phi, t, nu, Inu, N, E_iso_core, theta_h_core,
-                        theta_h_wing, &fp);
-    }
-    else if(jet_type == _Gaussian)
-    {
-        intensity_struct(theta, phi, t, nu, Inu, N, E_iso_core, theta_h_core, 
-                theta_h_wing, res_cones, &f_E_Gaussian, &fp);
-    }
-    else if(jet_type == _powerlaw)
-    {
-        intensity_struct(theta, phi, t, nu, Inu, N, E_iso_core, theta_h_core, 
-                theta_h_wing, res_cones, &f_E_powerlaw, &fp);
-    }
-    else if(jet_type == _Gaussian_core)
-    {
-        intensity_structCore(theta, phi, t, nu, Inu, N, E_iso_core, 
-                            theta_h_core, theta_h_wing, res_cones,
-                            &f_E_GaussianCore, &fp);
-    }
-    else if(jet_type == _powerlaw_core)
-    {
-        intensity_structCore(theta, phi, t, nu, Inu, N, E_iso_core, 
-                                theta_h_core, theta_h_wing, res_cones, 
-                                &f_E_powerlawCore, &fp);
-    }
+    intensity_jet(jet_type, theta, phi, t, nu, Inu, N, latRes, &fp);
+
+    if(diag != NULL)
+        *diag = fp.diag;
     free_fluxParams(&fp);
 
 }
@@ -1635,7 +5407,8 @@ void calc_shockVals(int jet_type, double *theta, double *phi, double *tobs,
                     double g0, double E_core_global,
                     double theta_h_core_global,
                     int tRes, int latRes, double rtol, double *mask,
-                    int nmask, int spread, int gamma_type)
+                    int nmask, int spread, int gamma_type,
+                    struct fluxDiag *diag)
 {
     double ta = tobs[0];
     double tb = tobs[0];
@@ -1648,8 +5421,6 @@ void calc_shockVals(int jet_type, double *theta, double *phi, double *tobs,
             tb = tobs[i];
     }
 
-    int res_cones = (int) (latRes*theta_h_wing / theta_h_core);
-
     struct fluxParams fp;
     setup_fluxParams(&fp, d_L, theta_obs, E_iso_core, theta_h_core,
                         theta_h_wing, b, L0, q, ts,
@@ -1657,40 +5428,10 @@ void calc_shockVals(int jet_type, double *theta, double *phi, double *tobs,
                         E_core_global, theta_h_core_global, ta, tb, tRes,
                         0, rtol, mask, nmask, spread, gamma_type);
 
-    if(jet_type == _tophat)
-    {
-        shockVals_cone(theta, phi, tobs, t, R, u, thj, N, E_iso_core, 0.0,
-                        theta_h_core, &fp);
-    }
-    else if(jet_type == _cone)
-    {
-        shockVals_cone(theta, phi, tobs, t, R, u, thj, N, E_iso_core,
-                        theta_h_core, theta_h_wing, &fp);
-    }
-    else if(jet_type == _Gaussian)
-    {
-        shockVals_struct(theta, phi, tobs, t, R, u, thj, N, E_iso_core,
-                         theta_h_core, theta_h_wing, res_cones, &f_E_Gaussian,
-                         &fp);
-    }
-    else if(jet_type == _powerlaw)
-    {
-        shockVals_struct(theta, phi, tobs, t, R, u, thj, N, E_iso_core,
-                         theta_h_core, theta_h_wing, res_cones, &f_E_powerlaw,
-                         &fp);
-    }
-    else if(jet_type == _Gaussian_core)
-    {
-        shockVals_structCore(theta, phi, tobs, t, R, u, thj, N, E_iso_core,
-                             theta_h_core, theta_h_wing, res_cones,
-                             &f_E_GaussianCore, &fp);
-    }
-    else if(jet_type == _powerlaw_core)
-    {
-        shockVals_structCore(theta, phi, tobs, t, R, u, thj, N, E_iso_core,
-                             theta_h_core, theta_h_wing, res_cones,
-                             &f_E_powerlawCore, &fp);
-    }
+    shockVals_jet(jet_type, theta, phi, tobs, t, R, u, thj, N, latRes, &fp);
+
+    if(diag != NULL)
+        *diag = fp.diag;
     free_fluxParams(&fp);
 
 }
@@ -1752,13 +5493,41 @@ void setup_fluxParams(struct fluxParams *pars,
 
     pars->mask = mask;
     pars->nmask = nmask;
+    memset(&(pars->mask_idx), 0, sizeof(struct maskIndex));
+    mask_index_build(pars);
     pars->spread = spread;
+
+    pars->nu_grid = NULL;
+    pars->n_nu = 0;
+    pars->n_grad = 0;
+    pars->n_mom = 0;
+    pars->res_cones = 0;
+    pars->counter_jet = 0;
+    pars->cj_buf = NULL;
+    work_init(&(pars->work));
+    pars->mu_breaks = NULL;
+    pars->n_mu_breaks = 0;
+    pars->mu_breaks_cap = 0;
+    pars->cone_adapt = 0;
+
+    pars->chi2 = NULL;
+    pars->stats = NULL;
+    pars->cache = NULL;
+    pars->theta_nodes = 0;
+    pars->gauss_tries = 0;
+    pars->gauss_hits = 0;
+    pars->lib = default_dynLibrary;
+    diag_clear(&(pars->diag));
+    select_integrands(pars);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
-void set_jet_params(struct fluxParams *pars, double E_iso, double theta_h)
+void set_jet_cone(struct fluxParams *pars, double E_iso, double theta_h)
 {
+    // Parameters and table time range of the cone (E_iso, theta_h), without
+    // making its tables.
+
     // min/max observer times
     double ta = pars->ta;
     double tb = pars->tb;
@@ -1831,8 +5600,19 @@ void set_jet_params(struct fluxParams *pars, double E_iso, double theta_h)
 
     pars->Rt0 = Rt0;
     pars->Rt1 = Rt1;
+}
+
+void set_jet_params(struct fluxParams *pars, double E_iso, double theta_h)
+{
+    set_jet_cone(pars, E_iso, theta_h);
     
-    make_R_table(pars);
+    if(pars->cache == NULL || !load_R_table(pars, pars->cache))
+    {
+        if(pars->lib == NULL || !load_R_library(pars, pars->lib))
+            make_R_table(pars);
+        if(pars->cache != NULL)
+            store_R_table(pars, pars->cache);
+    }
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -1905,5 +5685,14 @@ void free_fluxParams(struct fluxParams *pars)
         free(pars->mu_table_inner);
         pars->mu_table_inner = NULL;
     }
+    pars->table_entries = 0;
+    pars->table_entries_inner = 0;
+
+    mask_index_free(pars);
+    work_free(&(pars->work));
+    free(pars->mu_breaks);
+    pars->mu_breaks = NULL;
+    pars->n_mu_breaks = 0;
+    pars->mu_breaks_cap = 0;
 }
 
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include "offaxis_struct.h"
 #include "shockEvolution.h"
@@ -91,7 +92,7 @@ void shockInitDecel(double t0, double *R0, double *u0, void *argv)
 
     if(L0 < 0.0 || ts < 0.0)
     {
-        printf("No energy injection! E=%.3le\n", E0);
+        //printf("No energy injection! E=%.3le\n", E0);
         *R0 = R;
         *u0 = u;
         return;
@@ -103,7 +104,7 @@ void shockInitDecel(double t0, double *R0, double *u0, void *argv)
 
     if(Ei <= E0)
     {
-        printf("Energy injection not important! E0=%.3le Ei=%.3le\n", E0, Ei);
+        //printf("Energy injection not important! E0=%.3le Ei=%.3le\n", E0, Ei);
         *R0 = R;
         *u0 = u;
         return;
@@ -348,11 +349,16 @@ void Rudot2D(double t, double *x, void *argv, double *xdot)
     xdot[1] = dudt;
 }
 
-void RuThdot3D(double t, double *x, void *argv, double *xdot, int spread)
+static inline void RuThdot3D_lane(double t, double R, double u, double th,
+                                    double Mej, double th0, double sfac,
+                                    double *args, double *xdot, int spread,
+                                    int inj, int refresh)
 {
-    double *args = (double *)argv;
-
-    double Mej = args[1];
+    // Right hand side of the blast wave equations for one cone, with the
+    // cone's own Mej, th0, and spreadFac() and the rest shared through args.
+    // inj and refresh are set if there is energy injection (L0 > 0) and a
+    // refreshed shock (Einj > 0).  Called with constant spread, inj, and
+    // refresh, all the checks on them compile away.
     double rho0 = args[2];
     double Einj = args[3];
     double k = args[4];
@@ -361,13 +367,8 @@ void RuThdot3D(double t, double *x, void *argv, double *xdot, int spread)
     double q = args[7];
     double ts = args[8];
     double thC = args[9];
-    double th0 = args[10];
     double thCg = args[11];
 
-    double R = x[0];
-    double u = x[1];
-    double th = x[2];
-
     double g = sqrt(1+u*u);
     double be = u/g;
     double bes = 4*u*g/(4*u*u+3);
@@ -497,8 +498,7 @@ void RuThdot3D(double t, double *x, void *argv, double *xdot, int spread)
             {
                 double bew = 0.5*sqrt((2*u*u+3)/(4*u*u+3))*bes/g;
                 double fac = u*thC*Q < 1.0 ? 1.0 : Q*(1-Q0*u*thC) / (Q-Q0);
-                if (th0 < thC)
-                    fac *= tan(0.5*th0)/tan(0.5*thC); //th0/thC;
+                fac *= sfac; //th0/thC;
                 dThdt = fac * bew * v_light / R;
             }
         }
@@ -511,20 +511,19 @@ void RuThdot3D(double t, double *x, void *argv, double *xdot, int spread)
             {
                 double bew = 0.5*sqrt((2*u*u+3)/(4*u*u+3))*bes/g;
                 double fac = u*thCg*Q < 1.0 ? 1.0 : Q*(1-Q0*u*thCg) / (Q-Q0);
-                if (th0 < thCg)
-                    fac *= tan(0.5*th0)/tan(0.5*thCg); //th0/thC;
+                fac *= sfac; //th0/thC;
                 dThdt = fac * bew * v_light / R;
             }
         }
     }
 
     double dEdu = 0.0;
-    if(Einj > 0.0 && u>umin)
+    if(refresh && u>umin)
         dEdu = -k*Einj*pow(u,-k-1);
 
     double dEdt = 0.0;
     double te = t - R/v_light;
-    if(L0 > 0.0 && te < ts)
+    if(inj && te < ts)
     {
         double gs2 = (4*u*u+3)*(4*u*u+3) / (8*u*u+9);
         dEdt = L_inj(te, L0, q, ts) / (gs2*(1+bes)); // Doppler factor (1-bes)
@@ -543,6 +542,88 @@ void RuThdot3D(double t, double *x, void *argv, double *xdot, int spread)
     xdot[2] = dThdt;
 }
 
+double spreadFac(double th0, void *argv, int spread)
+{
+    // The factor spreading modes 7 and 8 apply to cones inside the core,
+    // constant along each cone's evolution.
+    double *args = (double *)argv;
+    double thC = args[9];
+    double thCg = args[11];
+
+    if(spread == 7 && th0 < thC)
+        return tan(0.5*th0)/tan(0.5*thC);
+    if(spread == 8 && th0 < thCg)
+        return tan(0.5*th0)/tan(0.5*thCg);
+    return 1.0;
+}
+
+void RuThdot3D(double t, double *x, void *argv, double *xdot, int spread)
+{
+    double *args = (double *)argv;
+    RuThdot3D_lane(t, x[0], x[1], x[2], args[1], args[10],
+                    spreadFac(args[10], args, spread), args, xdot, spread,
+                    args[6] > 0.0, args[3] > 0.0);
+}
+
+// RuThdot3D() for the first m of n cones at once, specialized for each
+// spreading mode, energy injection, and refreshed shock setting.  x and
+// xdot hold R, u, and th as three blocks of n, cone k has time t[k], mass
+// Mej[k], initial opening angle th0[k], and spreadFac() sfac[k].  The
+// remaining args are shared.
+typedef void (*RuThdot3DKernel)(double *t, double *x, int n, int m,
+                                double *Mej, double *th0, double *sfac,
+                                double *args, double *xdot);
+
+#define RUTHDOT3D_KERNEL(spread, inj, refresh) \
+static void RuThdot3D_##spread##_##inj##_##refresh(double *t, double *x, \
+                                int n, int m, double *Mej, double *th0, \
+                                double *sfac, double *args, double *xdot) \
+{ \
+    double d[3]; \
+    int k; \
+    for(k=0; k<m; k++) \
+    { \
+        RuThdot3D_lane(t[k], x[k], x[n+k], x[2*n+k], Mej[k], th0[k], \
+                        sfac[k], args, d, spread, inj, refresh); \
+        xdot[k] = d[0]; \
+        xdot[n+k] = d[1]; \
+        xdot[2*n+k] = d[2]; \
+    } \
+}
+
+#define RUTHDOT3D_KERNELS(spread) \
+    RUTHDOT3D_KERNEL(spread, 0, 0) \
+    RUTHDOT3D_KERNEL(spread, 0, 1) \
+    RUTHDOT3D_KERNEL(spread, 1, 0) \
+    RUTHDOT3D_KERNEL(spread, 1, 1)
+
+RUTHDOT3D_KERNELS(0)
+RUTHDOT3D_KERNELS(1)
+RUTHDOT3D_KERNELS(2)
+RUTHDOT3D_KERNELS(3)
+RUTHDOT3D_KERNELS(4)
+RUTHDOT3D_KERNELS(5)
+RUTHDOT3D_KERNELS(6)
+RUTHDOT3D_KERNELS(7)
+RUTHDOT3D_KERNELS(8)
+
+#define RUTHDOT3D_ROW(spread) \
+    {{RuThdot3D_##spread##_0_0, RuThdot3D_##spread##_0_1}, \
+     {RuThdot3D_##spread##_1_0, RuThdot3D_##spread##_1_1}}
+
+static const RuThdot3DKernel RuThdot3D_kernels[9][2][2] = {
+    RUTHDOT3D_ROW(0), RUTHDOT3D_ROW(1), RUTHDOT3D_ROW(2),
+    RUTHDOT3D_ROW(3), RUTHDOT3D_ROW(4), RUTHDOT3D_ROW(5),
+    RUTHDOT3D_ROW(6), RUTHDOT3D_ROW(7), RUTHDOT3D_ROW(8)};
+
+static RuThdot3DKernel RuThdot3D_select(double *args, int spread)
+{
+    // Modes other than 1-8 do not spread.
+    if(spread < 0 || spread > 8)
+        spread = 0;
+    return RuThdot3D_kernels[spread][args[6] > 0.0][args[3] > 0.0];
+}
+
 void shockEvolveRK4(double *t, double *R, double *u, int N, double R0, 
                     double u0, void *args)
 {
@@ -583,42 +664,95 @@ void shockEvolveSpreadRK4(double *t, double *R, double *u, double *th, int N,
                             double R0, double u0, double th0, void *args,
                             int spread)
 {
-    int i,j;
-
-    double dt, x[3], x0[3], k1[3], k2[3], k3[3], k4[3];
+    // A single cone is a block of one.
+    double Mej = ((double *)args)[1];
+    shockEvolveSpreadRK4Multi(&t, &R, &u, &th, &N, 1, &R0, &u0, &th0, &Mej,
+                                args, spread);
+}
 
-    R[0] = R0;
-    u[0] = u0;
-    th[0] = th0;
+void shockEvolveSpreadRK4Multi(double **t, double **R, double **u,
+                                double **th, int *N, int n, double *R0,
+                                double *u0, double *th0, double *Mej,
+                                void *args, int spread)
+{
+    // shockEvolveSpreadRK4() for n cones in lock-step.  Cone k has its own
+    // time grid t[k] of N[k] entries and writes R[k], u[k], and th[k].
+    // Cones must be sorted by decreasing N, so those still running are
+    // always the first m.  Each cone takes exactly the steps it would
+    // alone, the state of all cones is kept in blocks so every stage of
+    // the scheme is a loop over cones.
+
+    int i, j, k;
+    int m = n;
+
+    RuThdot3DKernel rhs = RuThdot3D_select(args, spread);
+
+    double *buf = (double *)malloc(21 * n * sizeof(double));
+    double *x0 = buf;
+    double *x = buf + 3*n;
+    double *k1 = buf + 6*n;
+    double *k2 = buf + 9*n;
+    double *k3 = buf + 12*n;
+    double *k4 = buf + 15*n;
+    double *ti = buf + 18*n;
+    double *dt = buf + 19*n;
+    double *sfac = buf + 20*n;
+
+    for(k=0; k<n; k++)
+    {
+        R[k][0] = R0[k];
+        u[k][0] = u0[k];
+        th[k][0] = th0[k];
+        x0[k] = R0[k];
+        x0[n+k] = u0[k];
+        x0[2*n+k] = th0[k];
+        sfac[k] = spreadFac(th0[k], args, spread);
+    }
 
-    for(i=0; i<N-1; i++)
+    for(i=0; m > 0; i++)
     {
-        dt = t[i+1] - t[i];
-        x0[0] = R[i];
-        x0[1] = u[i];
-        x0[2] = th[i];
-        RuThdot3D(t[i], x0, args, k1, spread);
-        
+        while(m > 0 && N[m-1]-1 <= i)
+            m--;
+        if(m == 0)
+            break;
+
+        for(k=0; k<m; k++)
+        {
+            ti[k] = t[k][i];
+            dt[k] = t[k][i+1] - t[k][i];
+        }
+
+        rhs(ti, x0, n, m, Mej, th0, sfac, args, k1);
         for(j=0; j<3; j++)
-            x[j] = x0[j] + 0.5*dt*k1[j];
-        RuThdot3D(t[i], x, args, k2, spread);
-        
+            for(k=0; k<m; k++)
+                x[j*n+k] = x0[j*n+k] + 0.5*dt[k]*k1[j*n+k];
+        rhs(ti, x, n, m, Mej, th0, sfac, args, k2);
         for(j=0; j<3; j++)
-            x[j] = x0[j] + 0.5*dt*k2[j];
-        RuThdot3D(t[i], x, args, k3, spread);
-        
+            for(k=0; k<m; k++)
+                x[j*n+k] = x0[j*n+k] + 0.5*dt[k]*k2[j*n+k];
+        rhs(ti, x, n, m, Mej, th0, sfac, args, k3);
         for(j=0; j<3; j++)
-            x[j] = x0[j] + dt*k3[j];
-        RuThdot3D(t[i], x, args, k4, spread);
-        
+            for(k=0; k<m; k++)
+                x[j*n+k] = x0[j*n+k] + dt[k]*k3[j*n+k];
+        rhs(ti, x, n, m, Mej, th0, sfac, args, k4);
         for(j=0; j<3; j++)
-            x[j] = x0[j] + dt*(k1[j]+2*k2[j]+2*k3[j]+k4[j])/6.0;
+            for(k=0; k<m; k++)
+                x[j*n+k] = x0[j*n+k] + dt[k]*(k1[j*n+k]+2*k2[j*n+k]
+                                                +2*k3[j*n+k]+k4[j*n+k])/6.0;
 
-        R[i+1] = x[0];
-        u[i+1] = x[1];
-        if(x[2] > 0.5*M_PI)
-            th[i+1] = 0.5*M_PI;
-        else
-            th[i+1] = x[2];
+        for(k=0; k<m; k++)
+        {
+            // The next step starts from the clamped table value, as in
+            // shockEvolveSpreadRK4().
+            if(x[2*n+k] > 0.5*M_PI)
+                x[2*n+k] = 0.5*M_PI;
+            R[k][i+1] = x[k];
+            u[k][i+1] = x[n+k];
+            th[k][i+1] = x[2*n+k];
+        }
+        for(j=0; j<3*n; j++)
+            x0[j] = x[j];
     }
+
+    free(buf);
 }
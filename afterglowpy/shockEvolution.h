@@ -10,10 +10,15 @@ void shockInitDecel(double t0, double *R0, double *u0, void *argv);
 void shockInitFind(double t0, double *R0, double *u0, double tRes, void *argv);
 void Rudot2D(double t, double *x, void *argv, double *xdot);
 void RuThdot3D(double t, double *x, void *argv, double *xdot, int spread);
+double spreadFac(double th0, void *argv, int spread);
 void shockEvolveRK4(double *t, double *R, double *u, int N, double R0, 
                     double u0, void *args);
 void shockEvolveSpreadRK4(double *t, double *R, double *u, double *th, int N, 
                             double R0, double u0, double th0, void *args,
                             int spread);
+void shockEvolveSpreadRK4Multi(double **t, double **R, double **u,
+                                double **th, int *N, int n, double *R0,
+                                double *u0, double *th0, double *Mej,
+                                void *args, int spread);
 
 #endif
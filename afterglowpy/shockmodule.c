@@ -1,6 +1,7 @@
 #include <Python.h>
 #define NPY_NO_DEPRECATED_API NPY_1_11_API_VERSION
 #include <numpy/arrayobject.h>
+#include <numpy/ufuncobject.h>
 #include "shockEvolution.h"
 
 static char shock_docstring[] = 
@@ -9,6 +10,9 @@ static char shockEvolRK4_docstring[] =
     "Evolve a spherical shock with RK4";
 static char shockEvolSpreadRK4_docstring[] = 
     "Evolve a conical shock with RK4";
+static char shockVel_docstring[] = 
+    "shockVel(u): 4-velocity of the shock driven by a fluid with\n"
+    "4-velocity u. A ufunc.";
 
 static PyObject *error_out(PyObject *m);
 static PyObject *shock_shockEvolRK4(PyObject *self, PyObject *args);
@@ -25,6 +29,21 @@ struct module_state
 static struct module_state _state;
 #endif
 
+static void shock_shockVel_loop(char **args, npy_intp const *dimensions,
+                                npy_intp const *steps, void *data)
+{
+    npy_intp i;
+    npy_intp n = dimensions[0];
+    for(i=0; i<n; i++)
+        *(double *)(args[1] + i*steps[1])
+                = shockVel(*(double *)(args[0] + i*steps[0]));
+}
+
+static PyUFuncGenericFunction shock_shockVel_funcs[1] = {
+                                                    &shock_shockVel_loop};
+static void *shock_shockVel_data[1] = {NULL};
+static char shock_shockVel_types[2] = {NPY_DOUBLE, NPY_DOUBLE};
+
 static PyMethodDef shockMethods[] = {
     {"shockEvolRK4", shock_shockEvolRK4, METH_VARARGS, shockEvolRK4_docstring},
     {"shockEvolSpreadRK4", shock_shockEvolSpreadRK4, METH_VARARGS,
@@ -83,6 +102,18 @@ void initshock(void)
 
     //Load numpy stuff!
     import_array();
+    import_umath();
+
+    PyObject *shockVel_ufunc = PyUFunc_FromFuncAndData(shock_shockVel_funcs,
+                                    shock_shockVel_data, shock_shockVel_types,
+                                    1, 1, 1, PyUFunc_None, "shockVel",
+                                    shockVel_docstring, 0);
+    if(shockVel_ufunc == NULL)
+    {
+        Py_DECREF(module);
+        INITERROR;
+    }
+    PyModule_AddObject(module, "shockVel", shockVel_ufunc);
 #if PY_MAJOR_VERSION >= 3
     return module;
 #endif
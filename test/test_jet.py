@@ -0,0 +1,677 @@
+import os
+import tempfile
+import unittest
+import warnings
+import numpy as np
+import afterglowpy.jet as jet
+import afterglowpy.shock as shock
+import afterglowpy.emulator as emulator
+
+
+class TestJet(unittest.TestCase):
+
+    Y = (0.3, 1.0e53, 0.1, 0.4, 4.0, 0.0, 0.0, 0.0, 1.0e-2, 2.2, 0.1, 1.0e-3,
+         1.0, 1.0e27)
+
+    def test_Model(self):
+        t = np.geomspace(1.0e4, 1.0e7, 12)
+        nu = np.empty(t.shape)
+        nu[:] = 1.0e14
+
+        for jetType in [-1, 0]:
+            F0 = jet.fluxDensity(t, nu, jetType, 0, *self.Y, spread=7)
+            model = jet.Model(jetType, 0, *self.Y, spread=7)
+
+            # Repeated calls reuse the stored blast wave and must agree
+            # exactly with a one-off evaluation over the same time range.
+            self.assertTrue((model.flux(t, nu) == F0).all())
+            self.assertTrue((model.flux(t, nu) == F0).all())
+            self.assertTrue((model.flux(t[3:7], nu[3:7]) == F0[3:7]).all())
+
+            # Times outside the prepared range trigger a rebuild.
+            F1 = model.flux(10*t, nu)
+            self.assertTrue(np.isfinite(F1).all())
+            self.assertTrue((F1 > 0.0).all())
+
+            theta = np.array([0.05, 0.1])
+            phi = np.array([0.0, 1.0])
+            tobs = np.array([1.0e5, 1.0e5])
+            I = model.intensity(theta, phi, tobs, nu[:2])
+            self.assertEqual(I.shape, theta.shape)
+            self.assertTrue((I >= 0.0).all())
+            res = model.shockVals(theta, phi, tobs)
+            self.assertEqual(len(res), 4)
+
+    def test_fluxDensityStrided(self):
+        z = 0.5
+        t = np.geomspace(1.0e4, 1.0e7, 10)
+        nu = np.empty(t.shape)
+        nu[:] = 1.0e14
+
+        F0 = (1+z) * jet.fluxDensity(t/(1+z), nu*(1+z), -1, 0, *self.Y)
+
+        # Strided views, fused redshift, and an (also strided) output.
+        tt = np.empty((10, 2))
+        tt[:, 0] = t
+        nunu = np.broadcast_to(1.0e14, t.shape)
+        out = np.zeros(20)
+        F = jet.fluxDensity(tt[:, 0], nunu, -1, 0, *self.Y, z=z,
+                            out=out[::2])
+        self.assertTrue(F.base is out)
+        self.assertTrue(np.allclose(out[::2], F0, rtol=1.0e-12, atol=0.0))
+        self.assertTrue((out[1::2] == 0.0).all())
+
+        G = np.empty(10)
+        H = jet.fluxDensity(t, nu, -1, 0, *self.Y, z=z, out=G)
+        self.assertTrue(H is G)
+        self.assertTrue(np.allclose(G, F0, rtol=1.0e-12, atol=0.0))
+
+        self.assertRaises(ValueError, jet.fluxDensity, t, nu, -1, 0,
+                          *self.Y, out=np.empty(3))
+        self.assertRaises(TypeError, jet.fluxDensity, t, nu, -1, 0,
+                          *self.Y, out=np.empty(10, dtype=np.float32))
+
+    def test_fluxDensityGrid(self):
+        t = np.geomspace(1.0e4, 1.0e7, 8)
+        nu = np.array([1.0e9, 1.0e14, 1.0e18])
+
+        for jetType in [-1, 0]:
+            # A single frequency is integrated exactly as fluxDensity() does.
+            G = jet.fluxDensityGrid(t, nu[1:2], jetType, 0, *self.Y)
+            F = jet.fluxDensity(t, np.full(t.shape, nu[1]), jetType, 0,
+                                *self.Y)
+            self.assertEqual(G.shape, (8, 1))
+            self.assertTrue((G[:, 0] == F).all())
+
+        # More frequencies only tighten the integration.
+        T, NU = np.meshgrid(t, nu, indexing='ij')
+        F = jet.fluxDensity(T.ravel(), NU.ravel(), -1, 0, *self.Y)
+        G = np.empty((3, 8)).T
+        H = jet.fluxDensityGrid(t, nu, -1, 0, *self.Y, out=G)
+        self.assertTrue(H is G)
+        self.assertTrue(np.allclose(G, F.reshape(T.shape), rtol=1.0e-2,
+                                    atol=0.0))
+
+        # Unsorted and repeated axes plan the same work as the meshgrid.
+        t = t[[3, 1, 0, 7, 3, 5, 2, 6, 4]]
+        nu = nu[[1, 0, 2, 0]]
+        T, NU = np.meshgrid(t, nu, indexing='ij')
+        for jetType in [-1, -2]:
+            F = jet.fluxDensity(T.ravel(), NU.ravel(), jetType, 0, *self.Y)
+            G = jet.fluxDensityGrid(t, nu, jetType, 0, *self.Y)
+            self.assertTrue((G == F.reshape(T.shape)).all())
+
+    def test_fluxDensityOrder(self):
+        t = np.geomspace(1.0e4, 1.0e7, 6)
+        T = np.concatenate([t, t, t[::-1], t])
+        NU = np.concatenate([np.full(6, 1.0e9), np.full(6, 1.0e14),
+                             np.full(6, 1.0e18), np.full(6, 1.0e14)])
+        perm = np.random.default_rng(3).permutation(T.size)
+
+        for jetType in [-1, 0]:
+            F = jet.fluxDensity(T, NU, jetType, 0, *self.Y)
+            Fp = jet.fluxDensity(T[perm], NU[perm], jetType, 0, *self.Y)
+
+            # Results do not depend on the order of the points, and
+            # duplicated points get identical values.
+            self.assertTrue((Fp == F[perm]).all())
+            self.assertTrue((F[6:12] == F[18:]).all())
+
+        # Points that cannot be ordered are refused.
+        model = jet.Model(-1, 0, *self.Y)
+        for x in [np.nan, np.inf]:
+            Tx = T.copy()
+            Tx[4] = x
+            NUx = NU.copy()
+            NUx[9] = x
+            for a, b in [(Tx, NU), (T, NUx)]:
+                self.assertRaises(ValueError, jet.fluxDensity, a, b, -1, 0,
+                                  *self.Y)
+                self.assertRaises(ValueError, jet.fluxDensityGrid, a, b, -1,
+                                  0, *self.Y)
+                self.assertRaises(ValueError, model.flux, a, b)
+
+    def test_ObservationSet(self):
+        z = 0.5
+        t = np.geomspace(1.0e4, 1.0e7, 6)
+        t = np.concatenate([t, t[::-1]])
+        nu = np.concatenate([np.full(6, 1.0e9), np.full(6, 1.0e14)])
+        Y = np.array(self.Y)
+
+        F0 = (1+z) * jet.fluxDensity(t/(1+z), nu*(1+z), 0, 0, *self.Y)
+        Ferr = 0.1*F0
+
+        obs = jet.ObservationSet(t, nu, 0, 0, Fnu=1.1*F0, Ferr=Ferr, z=z)
+        self.assertEqual(obs.N, 12)
+        self.assertTrue(np.allclose(obs.flux(Y), F0, rtol=1.0e-12, atol=0.0))
+        self.assertAlmostEqual(obs.logLike(Y), -0.5*12, places=8)
+        self.assertEqual(obs.logLike(np.full(14, np.nan)), -np.inf)
+
+        # Parameters flux.checkJetArgs() rejects are refused up front.
+        for k, x in [(1, 0.0), (2, 0.0), (3, -0.1), (8, -1.0e-2), (9, 2.0),
+                     (10, 1.5), (12, 0.0), (13, 0.0)]:
+            Yb = Y.copy()
+            Yb[k] = x
+            self.assertRaises(ValueError, obs.flux, Yb)
+            self.assertRaises(ValueError, obs.fluxGrad, Yb)
+            self.assertEqual(obs.logLike(Yb), -np.inf)
+            self.assertEqual(obs.logLikeGrad(Yb)[0], -np.inf)
+            chi2 = obs.chi2(np.array([Yb, Y]))
+            self.assertEqual(chi2[0], np.inf)
+            self.assertTrue(np.isfinite(chi2[1]))
+        cone = jet.ObservationSet(t, nu, -2, 0, Fnu=F0, Ferr=Ferr, z=z)
+        Yb = Y.copy()
+        Yb[3] = 0.5*Yb[2]
+        self.assertEqual(cone.chi2(Yb), np.inf)
+
+        self.assertRaises(ValueError, obs.flux, Y[:5])
+        self.assertRaises(ValueError, jet.ObservationSet, t, -nu, 0, 0)
+        self.assertRaises(RuntimeError, jet.ObservationSet(t, nu, 0, 0).logLike,
+                          Y)
+
+    def test_ObservationSetChi2(self):
+        t = np.geomspace(1.0e4, 1.0e7, 10)
+        t = np.concatenate([t, t])
+        nu = np.concatenate([np.full(10, 1.0e9), np.full(10, 1.0e14)])
+        Y = np.array(self.Y)
+        F0 = jet.fluxDensity(t, nu, 0, 0, *self.Y)
+        ul = np.zeros(t.shape)
+        ul[-3:] = 1.0
+
+        # Data 10% high, upper limits satisfied by the model.
+        obs = jet.ObservationSet(t, nu, 0, 0, Fnu=1.1*F0, Ferr=0.1*F0,
+                                 ul=ul)
+        self.assertAlmostEqual(obs.chi2(Y), 17.0, places=8)
+
+        # A bad proposal stops early, but is still rejected.
+        Yb = Y.copy()
+        Yb[1] *= 10.0
+        full = obs.chi2(Yb)
+        part = obs.chi2(Yb, chi2Max=100.0)
+        self.assertTrue(100.0 < part <= full)
+        self.assertEqual(obs.chi2(Yb, chi2Max=2*full), full)
+
+        res = obs.chi2(np.array([Y, Yb]), chi2Max=100.0)
+        self.assertEqual(res.shape, (2,))
+        self.assertEqual(res[0], obs.chi2(Y))
+        self.assertEqual(res[1], part)
+        self.assertEqual(obs.logLike(Y), -0.5*obs.chi2(Y))
+
+    def test_ObservationSetGrad(self):
+        z = 0.5
+        t = np.geomspace(1.0e4, 1.0e7, 6)
+        t = np.concatenate([t, t])
+        nu = np.concatenate([np.full(6, 1.0e9), np.full(6, 1.0e17)])
+        Y = np.array(self.Y)
+        # xi_N <= 1, so keep it clear of the bound to difference it.
+        Y[12] = 0.5
+
+        for jetType, specType in [(-1, 0), (0, 0), (0, 1)]:
+            obs = jet.ObservationSet(t, nu, jetType, specType, z=z)
+            F0 = obs.flux(Y)
+            F, dF = obs.fluxGrad(Y, dynamic=False)
+            self.assertTrue((F == F0).all())
+            self.assertEqual(dF.shape, (14, 12))
+            self.assertTrue((dF[:9] == 0.0).all())
+
+            # Radiation parameters against differences of the flux.
+            for k in range(9, 14):
+                h = 1.0e-4 * Y[k]
+                Ya = Y.copy()
+                Yb = Y.copy()
+                Ya[k] += h
+                Yb[k] -= h
+                d = (obs.flux(Ya) - obs.flux(Yb)) / (2*h)
+                self.assertTrue(np.allclose(Y[k]*dF[k], Y[k]*d,
+                                            rtol=0.0, atol=0.05*F.max()))
+
+        # Blast wave parameters, differenced by the engine.  thetaWing is
+        # moved off a multiple of thetaCore so the differences here do not
+        # change the number of cones.
+        Y[3] = 0.43
+        obs = jet.ObservationSet(t, nu, 0, 0, Fnu=1.1*F0, Ferr=0.1*F0, z=z)
+        F, dF = obs.fluxGrad(Y)
+        for k in [0, 1, 2, 3, 8]:
+            h = 1.0e-2 * Y[k]
+            Ya = Y.copy()
+            Yb = Y.copy()
+            Ya[k] += h
+            Yb[k] -= h
+            d = (obs.flux(Ya) - obs.flux(Yb)) / (2*h)
+            self.assertTrue(np.allclose(Y[k]*dF[k], Y[k]*d, rtol=0.0,
+                                        atol=0.3*F.max()))
+        self.assertTrue((dF[4:8] == 0.0).all())
+
+        logL, g = obs.logLikeGrad(Y)
+        r = (F - 1.1*F0) / (0.1*F0)
+        self.assertEqual(logL, obs.logLike(Y))
+        self.assertTrue(np.allclose(g, -(r / (0.1*F0) * dF).sum(axis=1),
+                                    rtol=1.0e-12, atol=0.0))
+
+    def test_Emulator(self):
+        Y = (0.0,) + self.Y[1:]
+        with tempfile.TemporaryDirectory() as d:
+            fname = os.path.join(d, "tophat.emu")
+            maxErr, rmsErr = emulator.buildEmulator(
+                    fname, -1, 0, Y, {1: (1.0e52, 1.0e53), 8: (1.0e-3, 1.0)},
+                    (1.0e5, 1.0e6), (1.0e9, 1.0e10), tol=0.02, nTest=8)
+            self.assertTrue(maxErr <= 0.02)
+
+            emu = jet.Emulator(fname)
+            self.assertEqual(emu.parIndex, (1, 8))
+            self.assertEqual(emu.jetType, -1)
+            self.assertEqual(emu.maxErr, maxErr)
+
+            # Against the full model at new points.
+            err, _ = emulator.verifyEmulator(fname, nTest=8)
+            self.assertTrue(err < 0.04)
+
+            t = np.geomspace(1.0e5, 1.0e6, 5)
+            nu = np.full(5, 1.0e9)
+            F = emu.flux(t, nu, [3.0e52, 0.1])
+            F0 = jet.fluxDensity(t, nu, -1, 0, *(Y[:1] + (3.0e52,) + Y[2:8]
+                                                 + (0.1,) + Y[9:]))
+            self.assertTrue(np.allclose(F, F0, rtol=0.04, atol=0.0))
+            G = emu.flux(t, nu, [[3.0e52, 0.1], [1.0e54, 0.1]])
+            self.assertEqual(G.shape, (2, 5))
+            self.assertTrue((G[0] == F).all())
+            self.assertTrue(np.isnan(G[1]).all())
+            self.assertTrue(np.isnan(emu.flux(20*t, nu, [3.0e52, 0.1])).all())
+            self.assertRaises(ValueError, emu.flux, t, nu, [3.0e52])
+
+            with open(fname, "r+b") as f:
+                f.truncate(100)
+            self.assertRaises(ValueError, jet.Emulator, fname)
+
+    def test_EmulatorSeries(self):
+        # Synthetic series, including a single emulated parameter, against
+        # emulator.chebEval().
+        rng = np.random.default_rng(3)
+        for shape in [(5, 9, 9), (9, 5, 5), (1, 9, 9), (3, 4, 5, 6)]:
+            c = 0.1 * rng.normal(size=shape)
+            npar = len(shape) - 2
+            lo = np.arange(npar + 2, dtype=float)
+            hi = lo + 1.0
+            dims = [(1+d, 1) for d in range(npar)] + [(-1, 1), (-2, 1)]
+            x = rng.uniform(-1.0, 1.0, (6, npar+2))
+            x[:, :npar] = x[0, :npar]
+            v = 10.0**(0.5*(x*(hi-lo) + lo + hi))
+            with tempfile.TemporaryDirectory() as d:
+                fname = os.path.join(d, "series.emu")
+                emulator.writeEmulator(fname, -1, 0, np.zeros(14), dims, lo,
+                                       hi, c, 0.0, 0.0, -12.0)
+                F = jet.Emulator(fname).flux(v[:, -2], v[:, -1],
+                                             v[0, :npar])
+            self.assertTrue(np.allclose(F, 10.0**emulator.chebEval(c, x),
+                                        rtol=1.0e-12, atol=0.0))
+
+    def test_Cocoon(self):
+        Y = np.array((10.0, 1.0, 1.0e51, 5.0, 1.0e-5, 0.0, 0.0, 0.0, 1.0, 2.2,
+                      0.1, 1.0e-2, 1.0, 1.0e26))
+        t = np.geomspace(1.0e3, 1.0e8, 12)
+        nu = np.concatenate([np.full(6, 1.0e9), np.full(6, 1.0e14)])
+
+        F = jet.fluxDensity(t, nu, 3, 0, *Y, rtol=1.0e-3)
+        Fr = jet.fluxDensity(t, nu, 3, 0, *Y, rtol=1.0e-7)
+        self.assertTrue(np.allclose(F, Fr, rtol=1.0e-3, atol=0.0))
+
+        obs = jet.ObservationSet(t, nu, 3, 0, rtol=1.0e-3)
+        self.assertTrue((obs.flux(Y) == F).all())
+
+        # umax, umin, Ei, k, Mej, and n0 (by scaling) against differences.
+        F, dF = obs.fluxGrad(Y)
+        self.assertTrue((dF[5:8] == 0.0).all())
+        for k in [0, 1, 2, 3, 4, 8]:
+            h = 1.0e-3 * Y[k]
+            Ya = Y.copy()
+            Yb = Y.copy()
+            Ya[k] += h
+            Yb[k] -= h
+            d = (obs.flux(Ya) - obs.flux(Yb)) / (2*h)
+            self.assertTrue(np.allclose(Y[k]*dF[k], Y[k]*d, rtol=0.0,
+                                        atol=1.0e-3*F.max()))
+
+        # Against the integral of the original Python cocoon model over
+        # theta (scipy quad, epsrel=1e-10), with and without energy
+        # injection.
+        t = np.geomspace(1.0e3, 1.0e9, 40)
+        nu = np.full(40, 1.0e14)
+        idx = [10, 15, 20, 25, 30, 35]
+        Y = np.array((3.0, 0.1, 1.0e50, 3.0, 1.0e-3, 1.0e47, 1.0, 1.0e5,
+                      1.0e-2, 2.5, 0.1, 1.0e-3, 1.0, 1.0e27))
+        F = jet.fluxDensity(t, nu, 3, 0, *Y)
+        Fq = np.array([7.6064029e-09, 2.0784202e-06, 1.0188881e-04,
+                       4.5137633e-05, 6.6685602e-06, 1.0554518e-06])
+        self.assertTrue(np.allclose(F[idx], Fq, rtol=1.0e-4, atol=0.0))
+        Y[3] = 5.0
+        Y[5] = 0.0
+        F = jet.fluxDensity(t, nu, 3, 0, *Y)
+        Fq = np.array([3.1338161e-09, 6.3160854e-07, 4.9929544e-05,
+                       3.3702071e-05, 5.7878343e-06, 2.3367259e-06])
+        self.assertTrue(np.allclose(F[idx], Fq, rtol=1.0e-4, atol=0.0))
+
+    def test_DynamicsLibrary(self):
+        t = np.geomspace(1.0e4, 1.0e7, 10)
+        nu = np.full(10, 1.0e14)
+        # Different E0 and n0, the solutions are rescaled.
+        Y = np.array(self.Y)
+        rows = np.array([Y, Y])
+        rows[:, 1] = [1.0e51, 1.0e52]
+        rows[:, 8] = [1.0, 1.0]
+
+        with tempfile.TemporaryDirectory() as d:
+            fname = os.path.join(d, "dyn.lib")
+            n = jet.buildDynamicsLibrary(fname, 0, rows, 1.0e2, 1.0e9)
+            self.assertTrue(n > 0)
+
+            for jetType in [-1, 0]:
+                F0 = jet.fluxDensity(t, nu, jetType, 0, *self.Y)
+                try:
+                    jet.useDynamicsLibrary(fname)
+                    F = jet.fluxDensity(t, nu, jetType, 0, *self.Y)
+                finally:
+                    jet.useDynamicsLibrary(None)
+                # Interpolated, so close but not identical.
+                self.assertFalse((F == F0).all())
+                self.assertTrue(np.allclose(F, F0, rtol=1.0e-3, atol=0.0))
+                self.assertTrue(
+                    (jet.fluxDensity(t, nu, jetType, 0, *self.Y) == F0).all())
+
+            with open(fname, "r+b") as f:
+                f.seek(200)
+                f.write(b"x")
+            self.assertRaises(ValueError, jet.useDynamicsLibrary, fname)
+            jet.useDynamicsLibrary(fname, verify=False)
+            jet.useDynamicsLibrary(None)
+
+    def test_CounterJet(self):
+        t = np.geomspace(1.0e5, 1.0e9, 8)
+        nu = np.full(8, 1.0e9)
+        Y = np.array(self.Y)
+        # The counter-jet is the jet seen from pi - thetaObs.
+        Ycj = Y.copy()
+        Ycj[0] = np.pi - Y[0]
+
+        for jetType in [-1, 0]:
+            F1 = jet.fluxDensity(t, nu, jetType, 0, *Y)
+            F2 = jet.fluxDensity(t, nu, jetType, 0, *Ycj)
+            F = jet.fluxDensity(t, nu, jetType, 0, *Y, counterjet=True)
+            self.assertTrue(np.allclose(F, F1+F2, rtol=1.0e-3, atol=0.0))
+
+            obs = jet.ObservationSet(t, nu, jetType, 0, counterjet=True)
+            self.assertTrue((obs.flux(Y) == F).all())
+            model = jet.Model(jetType, 0, *Y, counterjet=True)
+            self.assertTrue((model.flux(t, nu) == F).all())
+
+    def test_AdaptiveCones(self):
+        t = np.geomspace(1.0e5, 1.0e8, 8)
+        nu = np.full(8, 1.0e9)
+        Y = np.array(self.Y)
+        Y[0] = 0.3
+
+        for jetType in [0, 2]:
+            F1 = jet.fluxDensity(t, nu, jetType, 0, *Y, latRes=10)
+            F = jet.fluxDensity(t, nu, jetType, 0, *Y, adaptiveCones=True)
+            self.assertTrue(np.allclose(F, F1, rtol=5.0e-2, atol=0.0))
+
+            obs = jet.ObservationSet(t, nu, jetType, 0, adaptiveCones=True)
+            self.assertTrue((obs.flux(Y) == F).all())
+            model = jet.Model(jetType, 0, *Y, adaptiveCones=True)
+            self.assertTrue((model.flux(t, nu) == F).all())
+
+    def test_PruneStats(self):
+        t = np.geomspace(1.0e3, 1.0e8, 20)
+        nu = np.full(20, 1.0e9)
+        Y = np.array(self.Y)
+        Y[0] = 0.0
+        Y[2] = 0.05
+        Y[3] = 0.6
+
+        F = jet.fluxDensity(t, nu, 0, 0, *Y)
+        obs = jet.ObservationSet(t, nu, 0, 0)
+        self.assertEqual(obs.conesIntegrated, 0)
+        self.assertTrue((obs.flux(Y) == F).all())
+        # Every (cone, time) pair is either integrated or pruned.
+        nCones = int(5 * Y[3] / Y[2])
+        self.assertEqual(obs.conesIntegrated + obs.conesLowOrder
+                         + obs.conesPruned, nCones * 20)
+        self.assertTrue(obs.conesPruned > 0)
+
+        model = jet.Model(0, 0, *Y)
+        self.assertTrue((model.flux(t, nu) == F).all())
+        self.assertEqual(model.conesPruned, obs.conesPruned)
+
+    def test_LowOrderCones(self):
+        t = np.geomspace(1.0e4, 1.0e8, 40)
+        nu = np.full(40, 1.0e14)
+        Y = np.array(self.Y)
+        Y[0] = 1.0
+        Y[2] = 0.05
+        Y[3] = 0.4
+
+        obs = jet.ObservationSet(t, nu, 0, 0)
+        F = obs.flux(Y)
+        nCones = int(5 * Y[3] / Y[2])
+        self.assertEqual(obs.conesIntegrated + obs.conesLowOrder
+                         + obs.conesPruned, nCones * 40)
+        self.assertTrue(obs.conesLowOrder > 0)
+
+        # The low order rules are only accepted within the tolerance.
+        Fref = jet.fluxDensity(t, nu, 0, 0, *Y, rtol=1.0e-7)
+        self.assertTrue(np.allclose(F, Fref, rtol=1.0e-3, atol=0.0))
+
+    def test_Mask(self):
+        t = np.geomspace(1.0e4, 1.0e7, 10)
+        nu = np.full(10, 1.0e14)
+        big = 1.0e300
+        # One mask region covering the whole jet scales the flux.
+        mask = np.array([0.0, big, 0.0, big, -1.0, 4.0, -1.0, 7.0, 0.5])
+        for jetType, specType in [(-1, 0), (0, 1)]:
+            F = jet.fluxDensity(t, nu, jetType, specType, *self.Y)
+            Fm = jet.fluxDensity(t, nu, jetType, specType, *self.Y,
+                                 mask=mask)
+            self.assertTrue(np.allclose(Fm, 0.5*F, rtol=1.0e-3, atol=0.0))
+
+        # Many boxes tiling the jet and counter-jet, under a later box
+        # which overrides them all.
+        # Edges are kept off the integration nodes, which are counted as
+        # outside.
+        th = -1.0 + 0.4173*np.arange(13)
+        ph = -1.0 + 0.8137*np.arange(11)
+        tiles = [[0.0, big, 0.0, big, th[i], th[i+1], ph[j], ph[j+1], 0.3]
+                 for i in range(12) for j in range(10)]
+        mask = np.concatenate([np.ravel(tiles), mask])
+        for counterjet in [False, True]:
+            F = jet.fluxDensity(t, nu, 0, 0, *self.Y, counterjet=counterjet)
+            Fm = jet.fluxDensity(t, nu, 0, 0, *self.Y, counterjet=counterjet,
+                                 mask=mask)
+            self.assertTrue(np.allclose(Fm, 0.5*F, rtol=1.0e-3, atol=0.0))
+            Fm = jet.fluxDensity(t, nu, 0, 0, *self.Y, counterjet=counterjet,
+                                 mask=mask[:-9])
+            self.assertTrue(np.allclose(Fm, 0.3*F, rtol=1.0e-3, atol=0.0))
+
+    def test_Diagnostics(self):
+        t = np.geomspace(1.0e4, 1.0e7, 10)
+        nu = np.full(10, 1.0e14)
+        big = 1.0e300
+        with warnings.catch_warnings():
+            warnings.simplefilter("error")
+            F = jet.fluxDensity(t, nu, -1, 0, *self.Y)
+        self.assertTrue((F > 0.0).all())
+
+        # A negative mask factor is carried on with, but reported once
+        # after the call.
+        mask = np.array([0.0, big, 0.0, big, -1.0, 4.0, -1.0, 7.0, -0.5])
+        with warnings.catch_warnings(record=True) as w:
+            warnings.simplefilter("always")
+            jet.fluxDensity(t, nu, -1, 0, *self.Y, mask=mask)
+        self.assertEqual(len(w), 1)
+        self.assertTrue(issubclass(w[0].category, RuntimeWarning))
+        self.assertIn("bad mask fac", str(w[0].message))
+
+    def test_Image(self):
+        t = 1.0e6
+        nu = 1.0e14
+        e = np.linspace(-1.0e18, 1.0e18, 65)
+        for jetType, counterjet in [(-1, False), (0, False), (0, True)]:
+            model = jet.Model(jetType, 0, *self.Y, counterjet=counterjet)
+            F = model.flux(np.array([t]), np.array([nu]))[0]
+            img = model.image(e, e, t, nu)
+            self.assertEqual(img.shape, (64, 64))
+            self.assertTrue((img >= 0.0).all())
+            # Symmetric about the plane of the jet axis and line of sight.
+            self.assertTrue(np.allclose(img, img[::-1], rtol=1.0e-12,
+                                        atol=0.0))
+            # The grid covers the whole jet, so holds all of its flux.
+            self.assertTrue(np.allclose(img.sum(), F, rtol=1.0e-2, atol=0.0))
+
+            # Pixels are summed consistently over sub-grids.
+            half = model.image(e[32:], e, t, nu)
+            self.assertTrue(np.allclose(half.sum(), img[:, 32:].sum(),
+                                        rtol=1.0e-2, atol=0.0))
+
+        with self.assertRaises(ValueError):
+            model.image(e[::-1], e, t, nu)
+
+    def test_IntensityMap(self):
+        rng = np.random.default_rng(5)
+        theta = rng.uniform(0.0, 1.0, 400)
+        phi = rng.uniform(0.0, 2*np.pi, 400)
+        t = np.full(400, 1.0e6)
+        nu = np.full(400, 1.0e14)
+        perm = rng.permutation(400)
+        for jetType in [0, 2]:
+            model = jet.Model(jetType, 0, *self.Y)
+            I = model.intensity(theta, phi, t, nu)
+            # Points are found by the cone holding them, whatever their
+            # order, and the jet has a finite (spread) extent.
+            Ip = model.intensity(theta[perm], phi[perm], t, nu)
+            self.assertTrue((Ip == I[perm]).all())
+            self.assertTrue((I > 0.0).any())
+            self.assertTrue((I[theta > 0.9] == 0.0).all())
+            res = model.shockVals(theta, phi, t)
+            self.assertTrue(((res[1] > 0.0) == (I > 0.0)).all())
+
+    def test_Moments(self):
+        t = np.array([1.0e5, 1.0e6, 1.0e7])
+        nu = np.full(3, 1.0e14)
+        mom = np.empty((3, 3))
+        for jetType in [-1, 0]:
+            F0 = jet.fluxDensity(t, nu, jetType, 0, *self.Y)
+            F = jet.fluxDensity(t, nu, jetType, 0, *self.Y, moments=mom)
+            # The moments do not change how the flux is integrated.
+            self.assertTrue((F == F0).all())
+            self.assertTrue((mom[0] > 0.0).all())
+            self.assertTrue((mom[1:] > 0.0).all())
+
+        # Written in place above, a strided array is staged instead.
+        big = np.zeros((3, 6))
+        jet.fluxDensity(t, nu, 0, 0, *self.Y, moments=big[:, ::2])
+        self.assertTrue((big[:, ::2] == mom).all())
+        self.assertTrue((big[:, 1::2] == 0.0).all())
+
+        # Against the moments of a rendered image.
+        model = jet.Model(0, 0, *self.Y)
+        L = 4 * (mom[0, 1] + 3*mom[2, 1])
+        e = np.linspace(-L, L, 129)
+        c = 0.5*(e[1:] + e[:-1])
+        img = model.image(e, e, t[1], nu[1])
+        S = img.sum()
+        xc = (img.sum(0)*c).sum() / S
+        sx = np.sqrt((img.sum(0)*c*c).sum() / S - xc*xc)
+        sy = np.sqrt((img.sum(1)*c*c).sum() / S)
+        self.assertTrue(np.allclose(mom[:, 1], [xc, sx, sy], rtol=3.0e-2,
+                                    atol=0.0))
+
+        # A cocoon is centred on the line of sight.
+        Yc = (10.0, 1.0, 1.0e52, 5.0, 1.0e-5, 0.0, 0.0, 0.0, 1.0, 2.2, 0.1,
+              1.0e-3, 1.0, 1.0e28)
+        jet.fluxDensity(t, nu, 3, 0, *Yc, moments=mom)
+        self.assertTrue((mom[0] == 0.0).all())
+        self.assertTrue((mom[1] == mom[2]).all())
+
+    def test_OnAxis(self):
+        t = np.geomspace(1.0e4, 1.0e8, 9)
+        nu = np.full(9, 1.0e14)
+        mom = np.empty((3, 9))
+        Y = np.array(self.Y)
+        Y[0] = 0.0
+        Y1 = Y.copy()
+        Y1[0] = 1.0e-4
+        for jetType in [-1, 0]:
+            # On the axis every cone takes a single phi.
+            model = jet.Model(jetType, 0, *Y)
+            F = model.flux(t, nu)
+            self.assertEqual(model.conesIntegrated, 0)
+            F1 = jet.Model(jetType, 0, *Y1).flux(t, nu)
+            self.assertTrue(np.allclose(F, F1, rtol=1.0e-4, atol=0.0))
+
+            F2 = jet.fluxDensity(t, nu, jetType, 0, *Y, moments=mom)
+            self.assertTrue((F2 == F).all())
+            self.assertTrue((np.abs(mom[0]) < 1.0e-12*mom[1]).all())
+            self.assertTrue(np.allclose(mom[1], mom[2], rtol=1.0e-12,
+                                        atol=0.0))
+
+    def test_ThetaBreaks(self):
+        # The theta integrals are split where nu' crosses nu_m and nu_c,
+        # so the flux is smooth in p and its derivative matches small
+        # differences closely.
+        t = np.geomspace(1.0e4, 1.0e7, 6)
+        t = np.concatenate([t, t])
+        nu = np.concatenate([np.full(6, 1.0e9), np.full(6, 1.0e17)])
+        Y = np.array(self.Y)
+        h = 1.0e-4 * Y[9]
+        Ya = Y.copy()
+        Yb = Y.copy()
+        Ya[9] += h
+        Yb[9] -= h
+
+        for jetType in [-1, 0]:
+            obs = jet.ObservationSet(t, nu, jetType, 0, z=0.5)
+            F, dF = obs.fluxGrad(Y, dynamic=False)
+            d = (obs.flux(Ya) - obs.flux(Yb)) / (2*h)
+            self.assertTrue(np.allclose(d, dF[9], rtol=3.0e-4, atol=0.0))
+
+        # Every frequency's breaks are split at, however many share a time,
+        # so a point's flux barely depends on which others come with it.
+        Y = (0.0, 1.0e52, 0.05, 0.4, 0.0, 0.0, 0.0, 0.0, 1.0e-3, 2.2, 0.1,
+             1.0e-3, 1.0, 1.0e28)
+        t = np.geomspace(1.0e4, 1.0e8, 25)
+        nus = np.geomspace(1.0e8, 1.0e19, 9)
+        F = jet.fluxDensity(np.repeat(t, 9), np.tile(nus, 25), -1, 0,
+                            *Y).reshape(25, 9)
+        for k in range(9):
+            F1 = jet.fluxDensity(t, np.full(25, nus[k]), -1, 0, *Y)
+            self.assertTrue(np.allclose(F1, F[:, k], rtol=1.0e-4, atol=0.0))
+
+    def test_EmissivityUfunc(self):
+        u = np.geomspace(0.01, 100.0, 7)
+        us = shock.shockVel(u)
+        self.assertTrue(np.allclose(us, 4*u*np.sqrt((u*u+1)/(8*u*u+9)),
+                                    rtol=1.0e-14, atol=0.0))
+
+        nu = np.array([1.0e9, 1.0e14, 1.0e18])[:, None]
+        em = jet.emissivity(nu, 1.0e17, 0.5, 0.9, 1.0e5, u, us, 1.0, 2.2,
+                            0.1, 1.0e-3, 1.0, 0)
+        self.assertEqual(em.shape, (3, 7))
+        for i in range(3):
+            for j in range(7):
+                self.assertEqual(em[i, j],
+                                 jet.emissivity(nu[i, 0], 1.0e17, 0.5, 0.9,
+                                                1.0e5, u[j], us[j], 1.0, 2.2,
+                                                0.1, 1.0e-3, 1.0, 0))
+        self.assertTrue((em > 0.0).all())
+
+        # The pre-ufunc 12-argument call still defaults specType to 0.
+        a = (1.0e14, 1.0e17, 0.5, 0.9, 1.0e5, 1.0, 1.2, 1.0, 2.2, 0.1,
+             1.0e-3, 1.0)
+        self.assertEqual(jet.emissivity(*a), jet.emissivity(*a, 0))
+        self.assertEqual(jet.emissivity(*a), jet.emissivity_ufunc(*a, 0))
+        self.assertTrue((jet.emissivity_ufunc(nu, 1.0e17, 0.5, 0.9, 1.0e5,
+                                              u, us, 1.0, 2.2, 0.1, 1.0e-3,
+                                              1.0, 0) == em).all())
+        with self.assertRaises(TypeError):
+            jet.emissivity(*a[:11])
+
+if __name__ == "__main__":
+    unittest.main()